@@ -5,11 +5,16 @@
 #define ARENA_ALLOCATOR_H
 // size_t
 #include <stddef.h>
+// uintptr_t
+#include <stdint.h>
 // memcpy, memset
 #include <string.h>
 #include <assert.h>
 #include "allocator.h"
 #include "mallocator.h"
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
 
 
 #ifdef __clang__
@@ -38,6 +43,9 @@
 // If the allocation is bigger than would fit in an arena, it allocates it
 // independently and maintains a linked list of these big allocations.
 //
+// An ArenaAllocator can also get its arenas from a SharedArena (see below), so
+// several threads can allocate into memory that is freed all at once.
+//
 typedef struct ArenaAllocator ArenaAllocator;
 
 force_inline
@@ -134,10 +142,14 @@ Big_free(const void*_Nullable a, size_t size){
 }
 
 typedef struct Arena Arena;
+typedef struct SharedArena SharedArena;
 
 struct ArenaAllocator {
     Arena*_Nullable arena;
     BigListNode big_allocations;
+    // If set, arenas are claimed from this instead of malloced and are owned
+    // by it.
+    SharedArena*_Nullable shared;
 };
 
 
@@ -169,6 +181,175 @@ struct Arena {
 
 _Static_assert(sizeof(Arena) == ARENA_SIZE, "");
 
+//
+// Arenas shared between threads, for when several threads build parts of
+// one thing (like a document) that should be freed together.
+//
+// Each thread uses its own ArenaAllocator with .shared pointing at the
+// SharedArena. Whenever that needs a new arena, it claims the next one from
+// the current slab with an atomic increment, mallocing a new slab only when
+// that one is used up. Allocating inside the claimed arena is thread-local,
+// so threads only touch shared state once per arena.
+//
+// Big allocations are made by the thread's allocator as usual and handed to
+// the SharedArena by SharedArena_release once the thread is done. Then
+// SharedArena_free_all frees everything, after all threads are finished.
+//
+// Example:
+//
+//   SharedArena shared = {0};
+//   // on each thread
+//   ArenaAllocator aa = {.shared = &shared};
+//   Allocator a = allocator_from_arena(&aa);
+//   ...
+//   SharedArena_release(&aa);
+//   // once all threads are joined
+//   SharedArena_free_all(&shared);
+//
+
+#ifndef SHARED_ARENA_SLAB_ARENAS
+enum {SHARED_ARENA_SLAB_ARENAS=16};
+#endif
+
+typedef struct SharedArenaSlab SharedArenaSlab;
+struct SharedArenaSlab {
+    SharedArenaSlab*_Nullable prev; // The previous, fully claimed slab.
+    // How many arenas have been claimed. Keeps going past
+    // SHARED_ARENA_SLAB_ARENAS when threads race for the last one.
+    size_t claimed;
+    // Padding to keep the counter off the first arena's cache line.
+    uintptr_t pad[6];
+    Arena arenas[SHARED_ARENA_SLAB_ARENAS];
+};
+
+struct SharedArena {
+    SharedArenaSlab*_Nullable slab;
+    // Singly linked list of the big allocations given by SharedArena_release.
+    BigListNode*_Nullable big_allocations;
+};
+
+//
+// The atomics the SharedArena needs: loads, a counter and compare-and-swap
+// for pushing onto lists.
+//
+#if defined(_MSC_VER) && !defined(__clang__)
+static inline
+void*_Nullable
+SharedArena_load_ptr_(void*_Nullable const* p){
+    // Aligned loads are atomic and msvc treats volatile as acquire.
+    return *(void*const volatile*)p;
+}
+
+static inline
+size_t
+SharedArena_increment_(size_t* p){
+#ifdef _WIN64
+    return (size_t)_InterlockedIncrement64((volatile __int64*)p);
+#else
+    return (size_t)_InterlockedIncrement((volatile long*)p);
+#endif
+}
+
+static inline
+int
+SharedArena_cas_ptr_(void*_Nullable* p, void*_Nullable expected, void* desired){
+    return _InterlockedCompareExchangePointer((void*volatile*)p, desired, expected) == expected;
+}
+#else
+static inline
+void*_Nullable
+SharedArena_load_ptr_(void*_Nullable const* p){
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline
+size_t
+SharedArena_increment_(size_t* p){
+    return __atomic_add_fetch(p, 1, __ATOMIC_ACQ_REL);
+}
+
+static inline
+int
+SharedArena_cas_ptr_(void*_Nullable* p, void*_Nullable expected, void* desired){
+    return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+//
+// Claims an unused arena. Safe to call from several threads at once.
+//
+static inline
+Arena*_Nullable
+SharedArena_claim(SharedArena* sa){
+    for(;;){
+        SharedArenaSlab* slab = SharedArena_load_ptr_((void**)&sa->slab);
+        if(slab){
+            size_t i = SharedArena_increment_(&slab->claimed) - 1;
+            if(i < SHARED_ARENA_SLAB_ARENAS)
+                return &slab->arenas[i];
+        }
+        SharedArenaSlab* fresh = Allocator_alloc(MALLOCATOR, sizeof(*fresh));
+        if(!fresh) return NULL;
+        fresh->prev = slab;
+        fresh->claimed = 1;
+        if(SharedArena_cas_ptr_((void**)&sa->slab, slab, fresh))
+            return &fresh->arenas[0];
+        // Another thread replaced the slab first, claim from that one.
+        Allocator_free(MALLOCATOR, fresh, sizeof(*fresh));
+    }
+}
+
+//
+// Hands the big allocations of a thread's allocator over to its SharedArena
+// and resets the allocator. What it allocated stays valid until
+// SharedArena_free_all, but can't be freed or realloced through it anymore.
+// Safe to call from several threads at once.
+//
+static inline
+void
+SharedArena_release(ArenaAllocator* aa){
+    SharedArena* sa = aa->shared;
+    assert(sa);
+    BigListNode* first = aa->big_allocations.next;
+    if(first){
+        BigListNode* last = first;
+        while(last->next)
+            last = last->next;
+        first->prev = NULL;
+        for(;;){
+            BigListNode* head = SharedArena_load_ptr_((void**)&sa->big_allocations);
+            last->next = head;
+            if(SharedArena_cas_ptr_((void**)&sa->big_allocations, head, first))
+                break;
+        }
+    }
+    aa->arena = NULL;
+    aa->big_allocations.next = NULL;
+}
+
+//
+// Frees the slabs and the released big allocations. No thread can be using
+// the SharedArena anymore.
+//
+static inline
+void
+SharedArena_free_all(SharedArena* sa){
+    SharedArenaSlab* slab = sa->slab;
+    while(slab){
+        SharedArenaSlab* to_free = slab;
+        slab = slab->prev;
+        Allocator_free(MALLOCATOR, to_free, sizeof(*to_free));
+    }
+    BigAllocation* ba = (BigAllocation*)sa->big_allocations;
+    while(ba){
+        BigAllocation* to_free = ba;
+        ba = (BigAllocation*)ba->next;
+        Allocator_free(MALLOCATOR, to_free, sizeof(*to_free)+to_free->size);
+    }
+    sa->slab = NULL;
+    sa->big_allocations = NULL;
+}
+
 
 //
 // Rounds up to the nearest power of 8.
@@ -186,7 +367,8 @@ static inline
 warn_unused
 int
 ArenaAllocator_alloc_arena(ArenaAllocator* aa){
-    Arena* arena = Allocator_alloc(MALLOCATOR, sizeof(*arena));
+    Arena* arena = aa->shared? SharedArena_claim(aa->shared)
+                             : Allocator_alloc(MALLOCATOR, sizeof(*arena));
     if(!arena) return 1;
     arena->prev = aa->arena;
     arena->used = 0;
@@ -325,12 +507,13 @@ ArenaAllocator_realloc(ArenaAllocator* aa, void*_Nullable ptr, size_t old_size,
 }
 //
 // Free all allocations from the arenas. Deallocs the arenas themselves and
-// frees the big allocation linked list as well.
+// frees the big allocation linked list as well. Arenas claimed from a
+// SharedArena are just dropped, they are freed along with it.
 //
 static
 void
 ArenaAllocator_free_all(ArenaAllocator*_Nullable aa){
-    Arena* arena = aa->arena;
+    Arena* arena = aa->shared? NULL : aa->arena;
     while(arena){
         Arena* to_free = arena;
         arena = arena->prev;
@@ -349,6 +532,35 @@ ArenaAllocator_free_all(ArenaAllocator*_Nullable aa){
     return;
 }
 
+//
+// Frees all allocations like ArenaAllocator_free_all, but keeps the most
+// recent arena so an allocator that is repeatedly filled and reset doesn't
+// go back to malloc every time.
+//
+static inline
+void
+ArenaAllocator_reset(ArenaAllocator* aa){
+    Arena* keep = aa->arena;
+    if(keep){
+        Arena* arena = aa->shared? NULL : keep->prev;
+        while(arena){
+            Arena* to_free = arena;
+            arena = arena->prev;
+            Allocator_free(MALLOCATOR, to_free, sizeof(*to_free));
+        }
+        keep->prev = NULL;
+        keep->used = 0;
+    }
+    BigAllocation* ba = (BigAllocation*)aa->big_allocations.next;
+    assert(aa->big_allocations.prev == NULL);
+    while(ba){
+        BigAllocation* to_free = ba;
+        ba = (BigAllocation*)ba->next;
+        Allocator_free(MALLOCATOR, to_free, sizeof(*to_free)+to_free->size);
+    }
+    aa->big_allocations.next = NULL;
+}
+
 static
 void
 ArenaAllocator_free(ArenaAllocator*aa, const void*_Nullable ptr, size_t size){
@@ -8,7 +8,13 @@
 #include "allocator.h"
 #include "recording_allocator.h"
 #ifdef TESTING_ALLOCATOR_MULTI_THREADED
-#include "../thread_utils.h"
+#ifndef LOCK_T
+#include "../thread_util.h"
+#define LOCK_T Mutex
+#define LOCK_T_init mutex_init
+#define LOCK_T_lock mutex_lock
+#define LOCK_T_unlock mutex_unlock
+#endif
 #endif
 
 #ifdef __clang__
@@ -227,6 +227,20 @@ msb_write_nchar(MStringBuilder* msb, char c, size_t n){
     msb->cursor += n;
 }
 
+//
+// Writes the decimal representation of the number into the builder.
+static inline
+void
+msb_write_uint(MStringBuilder* msb, size_t value){
+    char buff[20];
+    size_t n = 0;
+    do {
+        buff[sizeof buff - ++n] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+    msb_write_str(msb, buff + sizeof buff - n, n);
+}
+
 //
 // Erases the given number of characters from the end of the builder.
 static inline
@@ -7,23 +7,93 @@
 #endif
 
 #include "drmd.h"
+#include "drmd_cache.h"
 #define PARSE_NUMBER_PARSE_FLOATS 0
 #include "testing.h"
 #include "stringview.h"
 #define REPLACE_MALLOCATOR 1
 #define USE_TESTING_ALLOCATOR 1
+// TestSharedArena allocates from several threads.
+#define TESTING_ALLOCATOR_MULTI_THREADED 1
 #include "Allocators/testing_allocator.h"
 #include "Allocators/mallocator.h"
+#include "Allocators/arena_allocator.h"
+#include "MStringBuilder.h"
+#include "thread_util.h"
+#include "simd_string.h"
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "drmd_shm.h"
+#endif
 
 #ifdef __clang__
 #pragma clang assume_nonnull begin
 #endif
 
 static TestFunc TestMd;
+static TestFunc TestLinks;
+static TestFunc TestCheck;
+static TestFunc TestStats;
+static TestFunc TestTerm;
+static TestFunc TestJson;
+static TestFunc TestTables;
+static TestFunc TestEscape;
+static TestFunc TestFmt;
+static TestFunc TestContext;
+static TestFunc TestRenderHooks;
+static TestFunc TestRenderCursor;
+static TestFunc TestDocument;
+static TestFunc TestCache;
+static TestFunc TestSharedArena;
+static TestFunc TestSimdString;
+static TestFunc TestNdjson;
+static TestFunc TestSite;
+static TestFunc TestTar;
+#ifdef __linux__
+static TestFunc TestShmRing;
+static TestFunc TestShmServe;
+static TestFunc TestBatch;
+static TestFunc TestBook;
+static TestFunc TestReplay;
+#endif
+
+// Defined at the end, once drmd_cache.c is included.
+static size_t cache_bytes(DrMdCache* cache);
+#ifdef __linux__
+static int drmd_shm_serve(int fd, const char*_Nullable metrics_path);
+#endif
 
 int main(int argc, char*_Null_unspecified*_Null_unspecified argv){
     if(!test_funcs_count){ // wasm calls main more than once.
+        testing_allocator_init();
         RegisterTest(TestMd);
+        RegisterTest(TestLinks);
+        RegisterTest(TestCheck);
+        RegisterTest(TestStats);
+        RegisterTest(TestTerm);
+        RegisterTest(TestJson);
+        RegisterTest(TestTables);
+        RegisterTest(TestEscape);
+        RegisterTest(TestFmt);
+        RegisterTest(TestContext);
+        RegisterTest(TestRenderHooks);
+        RegisterTest(TestRenderCursor);
+        RegisterTest(TestDocument);
+        RegisterTest(TestCache);
+        RegisterTest(TestSharedArena);
+        RegisterTest(TestSimdString);
+        RegisterTest(TestNdjson);
+        RegisterTest(TestSite);
+        RegisterTest(TestTar);
+        #ifdef __linux__
+        RegisterTest(TestShmRing);
+        RegisterTest(TestShmServe);
+        RegisterTest(TestBatch);
+        RegisterTest(TestBook);
+        RegisterTest(TestReplay);
+        #endif
     }
     int ret = test_main(argc, argv, NULL);
     return ret;
@@ -101,6 +171,50 @@ TestFunction(TestMd){
                 "<pre>&gt; foo\n&gt; bar\n&gt; baz\n</pre>\n"
             ),
         },
+        {
+            SV(
+            "> foo\n"
+            "> - bar\n"
+            ">   - baz\n"
+            "> > qux\n"
+            "> > > quux\n"
+            ),
+            SV(
+                "<blockquote>\nfoo\n<ul>\n<li>bar <ul>\n<li>baz</ul>\n</ul>\n"
+                "<blockquote>\nqux\n<blockquote>\nquux</blockquote>\n</blockquote>\n</blockquote>\n"
+            ),
+        },
+        {
+            SV(
+            "> ```\n"
+            "> - not a list\n"
+            ">\n"
+            "> ```\n"
+            "> foo\n"
+            "bar\n"
+            "- baz\n"
+            ),
+            SV(
+                "<blockquote>\n<pre>- not a list\n\n</pre>\nfoo\nbar</blockquote>\n<ul>\n<li>baz</ul>\n"
+            ),
+        },
+        {
+            // Blank first lines are kept, and markers past the deepest quote
+            // are text.
+            SV(
+            ">\n"
+            "> a\n"
+            ">>>>>>>>> deep\n"
+            "\n"
+            "hello\n"
+            ),
+            SV(
+                "<blockquote>\n\na\n<blockquote>\n<blockquote>\n<blockquote>\n<blockquote>\n"
+                "<blockquote>\n<blockquote>\n<blockquote>\n&gt; deep</blockquote>\n</blockquote>\n"
+                "</blockquote>\n</blockquote>\n</blockquote>\n</blockquote>\n</blockquote>\n</blockquote>\n"
+                "<p>hello"
+            ),
+        },
         {
             SV(
             "|hello|world\n"
@@ -143,6 +257,20 @@ TestFunction(TestMd){
                 "<ul>\n<li>a <ul>\n<li>b</ul>\n</ul>\n<ul>\n<li>c</ul>\n"
             ),
         },
+        {
+            SV("see [the docs](https://example.com/a?b=1&c=2) -- [](b.html)\n"),
+            SV("<p>see <a href=\"https://example.com/a?b=1&amp;c=2\">the docs</a> &ndash; <a href=\"b.html\">b.html</a>"),
+        },
+        {
+            SV("[x](javascript:alert(1)) [y](a b)\n"),
+            SV("<p>[x](javascript:alert(1)) [y](a b)"),
+        },
+        {
+            SV("```\n"
+               "a[i](x)\n"
+               "```\n"),
+            SV("<pre>a[i](x)\n</pre>\n"),
+        },
     };
     for(size_t i = 0; i < arrlen(test_cases); i++){
         StringView out;
@@ -155,9 +283,1634 @@ TestFunction(TestMd){
     TESTEND();
 }
 
+typedef struct LinkList LinkList;
+struct LinkList {
+    size_t count;
+    StringView targets[8];
+    size_t offsets[8];
+};
+
+static
+int
+collect_link(void* p, StringView target, size_t offset){
+    LinkList* links = p;
+    if(links->count == arrlen(links->targets)) return 1;
+    links->targets[links->count] = target;
+    links->offsets[links->count] = offset;
+    links->count++;
+    return 0;
+}
+
+TestFunction(TestLinks){
+    TESTBEGIN();
+    StringView input = SV(
+        "# [a](a.html)\n"
+        "- [b](b.html)\n"
+        "```\n"
+        "[c](c.html)\n"
+        "```\n"
+        "|[d](https://d.com)|[](mailto:e@e.com)\n"
+    );
+    LinkList links = {0};
+    int e = drmd_links(input, collect_link, &links);
+    TestAssertFalse(e);
+    TestAssertEquals(links.count, 4);
+    TestExpectEquals2(sv_equals, links.targets[0], SV("a.html"));
+    TestExpectEquals(links.offsets[0], 6);
+    TestExpectEquals2(sv_equals, links.targets[1], SV("b.html"));
+    TestExpectEquals(links.offsets[1], 20);
+    TestExpectEquals2(sv_equals, links.targets[2], SV("https://d.com"));
+    TestExpectEquals2(sv_equals, links.targets[3], SV("mailto:e@e.com"));
+    // Brackets that don't start a link don't hide the ones that do.
+    links.count = 0;
+    e = drmd_links(SV("[[x] [a](a.html) [y] ](b) [e](no close [d](d.html)\n"), collect_link, &links);
+    TestAssertFalse(e);
+    TestAssertEquals(links.count, 2);
+    TestExpectEquals2(sv_equals, links.targets[0], SV("a.html"));
+    TestExpectEquals2(sv_equals, links.targets[1], SV("d.html"));
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+static
+int
+collect_diagnostic(void* p, const DrMdDiagnostic* d){
+    int* linenos = p;
+    for(;*linenos;linenos++)
+        ;
+    *linenos = d->lineno;
+    return 0;
+}
+
+TestFunction(TestCheck){
+    TESTBEGIN();
+    StringView input = SV(
+        "|a|b\n"
+        "|c|d\n"
+        "|e\n"
+        "\n"
+        "- 0\n - 1\n  - 2\n   - 3\n    - 4\n     - 5\n      - 6\n       - 7\n        - 8\n"
+        "         - 9\n"
+        "\n"
+        "```\n"
+        "|f\n"
+    );
+    int linenos[8] = {0};
+    size_t n_errors = 0;
+    int e = drmd_check(input, collect_diagnostic, linenos, &n_errors);
+    TestAssertFalse(e);
+    TestAssertEquals(n_errors, 3);
+    TestExpectEquals(linenos[0], 3);
+    TestExpectEquals(linenos[1], 14);
+    TestExpectEquals(linenos[2], 16);
+    testing_assert_all_freed();
+
+    // What the check warned about.
+    StringView out;
+    e = drmd_to_html(input, &out);
+    TestAssert(e);
+    testing_assert_all_freed();
+
+    memset(linenos, 0, sizeof linenos);
+    e = drmd_check(SV("text\n> ```\n> code\nnot code\n"), collect_diagnostic, linenos, &n_errors);
+    TestAssertFalse(e);
+    TestAssertEquals(n_errors, 1);
+    TestExpectEquals(linenos[0], 2);
+    testing_assert_all_freed();
+
+    memset(linenos, 0, sizeof linenos);
+    e = drmd_check(SV("a\n>>>>>>>>> deep\n"), collect_diagnostic, linenos, &n_errors);
+    TestAssertFalse(e);
+    TestAssertEquals(n_errors, 1);
+    TestExpectEquals(linenos[0], 2);
+    testing_assert_all_freed();
+
+    e = drmd_check(SV("# fine\n"), collect_diagnostic, linenos, &n_errors);
+    TestAssertFalse(e);
+    TestExpectEquals(n_errors, 0);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+TestFunction(TestStats){
+    TESTBEGIN();
+    StringView input = SV(
+        "# Some   title\n"
+        "Thïs is\ta paragraph that is long enough to need more than one vector.\n"
+        "- one\n"
+        "  - two three\n"
+        "1. four\n"
+        "|five|six\n"
+        "|seven|\n"
+        "> eight nine\n"
+        "```\n"
+        "not counted\n"
+        "\n"
+        "```\n"
+    );
+    DrMdStats stats;
+    int e = drmd_stats(input, &stats);
+    TestAssertFalse(e);
+    TestExpectEquals(stats.words, 25);
+    TestExpectEquals(stats.characters, 120);
+    TestExpectEquals(stats.code_lines, 2);
+    TestExpectEquals(stats.paragraphs, 1);
+    TestExpectEquals(stats.headings, 1);
+    TestExpectEquals(stats.bullet_lists, 2);
+    TestExpectEquals(stats.ordered_lists, 1);
+    TestExpectEquals(stats.list_items, 3);
+    TestExpectEquals(stats.tables, 1);
+    TestExpectEquals(stats.table_rows, 2);
+    TestExpectEquals(stats.quotes, 1);
+    TestExpectEquals(stats.code_blocks, 1);
+    // Only the text that is displayed counts.
+    e = drmd_stats(SV("<b>one</b>two <br>three [four](https://x.com/a) [](https://five)\n"), &stats);
+    TestAssertFalse(e);
+    TestExpectEquals(stats.words, 4);
+    TestExpectEquals(stats.characters, 31);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+TestFunction(TestTerm){
+    TESTBEGIN();
+    struct {
+        StringView input;
+        StringView expected;
+    } test_cases[] = {
+        {
+            SV("one two three four five six\n"),
+            SV("one two three\nfour five six\n"),
+        },
+        {
+            SV("# Hi <b>there</b>\nx -- y\n"),
+            // Closing the <b> doesn't end the heading's bold.
+            SV("\033[1;4mHi \033[1mthere\033[22m\033[1;4m\033[0m\n\nx \xe2\x80\x93 y\n"),
+        },
+        {
+            SV("- alpha beta gamma\n  1. delta\n"),
+            SV("\xe2\x80\xa2 alpha beta\n  gamma\n  1. delta\n"),
+        },
+        {
+            SV(">quoted text here\n"),
+            SV("\xe2\x94\x82 quoted text\n\xe2\x94\x82 here\n"),
+        },
+        {
+            SV("> quoted\n> - item\n"),
+            SV("\xe2\x94\x82 quoted\n\xe2\x94\x82\n\xe2\x94\x82 \xe2\x80\xa2 item\n"),
+        },
+        {
+            SV("|a|bb\n|ccc|\n"),
+            SV(
+                "\xe2\x94\x8c\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\xac\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x90\n"
+                "\xe2\x94\x82 \033[1ma\033[22m   \xe2\x94\x82 \033[1mbb\033[22m \xe2\x94\x82\n"
+                "\xe2\x94\x9c\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\xbc\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\xa4\n"
+                "\xe2\x94\x82 ccc \xe2\x94\x82    \xe2\x94\x82\n"
+                "\xe2\x94\x94\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\xb4\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x98\n"
+            ),
+        },
+        {
+            // Escapes in the document don't reach the terminal.
+            SV("```\nx\033[2Jy\n```\n[a](http://b\033c)\n"),
+            SV("    x[2Jy\n\n\033[4ma\033[24m (http://bc)\n"),
+        },
+        {
+            SV("ab cd ef gh\x7fij kl\n"),
+            SV("ab cd ef ghij\nkl\n"),
+        },
+        {
+            SV("|<b>a</b>x|\n"),
+            SV(
+                "\xe2\x94\x8c\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x90\n"
+                "\xe2\x94\x82 \033[1m\033[1ma\033[22m\033[1mx\033[22m \xe2\x94\x82\n"
+                "\xe2\x94\x94\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x98\n"
+            ),
+        },
+    };
+    for(size_t i = 0; i < arrlen(test_cases); i++){
+        StringView out;
+        int e = drmd_to_term(test_cases[i].input, 14, &out);
+        TestAssertFalse(e);
+        TestExpectEquals2(sv_equals, out, test_cases[i].expected);
+        Allocator_free(MALLOCATOR, out.text, out.length);
+        testing_assert_all_freed();
+    }
+    TESTEND();
+}
+
+TestFunction(TestJson){
+    TESTBEGIN();
+    StringView input = SV(
+        "## A \"title\"\n"
+        "Text with a \\ backslash, a\ttab and a \x01 control character, long enough to take more than 64 bytes.\n"
+        "|x\n"
+    );
+    StringView expected = SV(
+        "{\"type\":\"MD\",\"children\":["
+            "{\"type\":\"H\",\"level\":2,\"offset\":2,\"text\":\" A \\\"title\\\"\"},"
+            "{\"type\":\"PARA\",\"children\":["
+                "{\"type\":\"STRING\",\"offset\":13,\"text\":\"Text with a \\\\ backslash, a\\ttab and a \\u0001 control character, long enough to take more than 64 bytes.\"}"
+            "]},"
+            "{\"type\":\"TABLE\",\"children\":["
+                "{\"type\":\"TABLE_ROW\",\"children\":["
+                    "{\"type\":\"STRING\",\"offset\":112,\"text\":\"x\"}"
+                "]}"
+            "]}"
+        "]}\n"
+    );
+    StringView out;
+    int e = drmd_to_json(input, &out);
+    TestAssertFalse(e);
+    TestExpectEquals2(sv_equals, out, expected);
+    Allocator_free(MALLOCATOR, out.text, out.length);
+    // Valid utf-8 is copied, anything else is replaced so the json is valid.
+    e = drmd_to_json(SV("\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80 \xff \xc3 \xc0\xaf \xed\xa0\x80 \xe2\x82\n"), &out);
+    TestAssertFalse(e);
+    TestExpectEquals2(sv_equals, out, SV(
+        "{\"type\":\"MD\",\"children\":[{\"type\":\"PARA\",\"children\":["
+        "{\"type\":\"STRING\",\"offset\":0,\"text\":\"\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80 \\ufffd \\ufffd "
+        "\\ufffd\\ufffd \\ufffd\\ufffd\\ufffd \\ufffd\\ufffd\"}"
+        "]}]}\n"));
+    Allocator_free(MALLOCATOR, out.text, out.length);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+typedef struct TableOutput TableOutput;
+struct TableOutput {
+    char text[512];
+    size_t length;
+};
+
+static
+int
+collect_tables(void*_Nullable userdata, StringView output){
+    TableOutput* out = userdata;
+    if(out->length + output.length > sizeof out->text)
+        return 1;
+    memcpy(out->text + out->length, output.text, output.length);
+    out->length += output.length;
+    return 0;
+}
+
+TestFunction(TestTables){
+    TESTBEGIN();
+    StringView input = SV(
+        "# Not a table\n"
+        "|name|note\n"
+        "|a|plain\n"
+        "|b, c|say \"hi\"\n"
+        "|\n"
+        "```\n"
+        "|not|a table\n"
+        "```\n"
+        "> |x|y\ttab\n"
+    );
+    struct {
+        DrMdTableFormat format;
+        StringView expected;
+    } test_cases[] = {
+        {
+            DRMD_TABLES_CSV,
+            SV("name,note\n"
+               "a,plain\n"
+               "\"b, c\",\"say \"\"hi\"\"\"\n"
+               "\"\"\n"
+               "\n"
+               "x,y\ttab\n"),
+        },
+        {
+            DRMD_TABLES_TSV,
+            SV("name\tnote\n"
+               "a\tplain\n"
+               "b, c\tsay \"hi\"\n"
+               " \n"
+               "\n"
+               "x\ty tab\n"),
+        },
+        {
+            DRMD_TABLES_JSON,
+            SV("[[[\"name\",\"note\"],\n"
+               "[\"a\",\"plain\"],\n"
+               "[\"b, c\",\"say \\\"hi\\\"\"],\n"
+               "[\"\"]],\n"
+               "[[\"x\",\"y\\ttab\"]]]\n"),
+        },
+    };
+    for(size_t i = 0; i < arrlen(test_cases); i++){
+        TableOutput out = {0};
+        int e = drmd_tables(input, test_cases[i].format, collect_tables, &out);
+        TestAssertFalse(e);
+        TestExpectEquals2(sv_equals, ((StringView){out.length, out.text}), test_cases[i].expected);
+    }
+    TableOutput out = {0};
+    int e = drmd_tables(SV("no tables\n"), DRMD_TABLES_JSON, collect_tables, &out);
+    TestAssertFalse(e);
+    TestExpectEquals2(sv_equals, ((StringView){out.length, out.text}), SV("[]\n"));
+    out.length = 0;
+    e = drmd_tables(SV("no tables\n"), DRMD_TABLES_CSV, collect_tables, &out);
+    TestAssertFalse(e);
+    TestExpectEquals(out.length, 0);
+    // Stopping early is passed through.
+    out.length = sizeof out.text;
+    e = drmd_tables(input, DRMD_TABLES_CSV, collect_tables, &out);
+    TestExpectEquals(e, 1);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+TestFunction(TestEscape){
+    TESTBEGIN();
+    // Long enough that the specials are found by the vector loops.
+    StringView input = SV(
+        "Tom & Jerry's \"<b>cartoons</b>\" -- [not](a link) &lt; "
+        "are more than 64 bytes long, with a\ttab and a \x01 control character.\n"
+    );
+    struct {
+        DrMdEscapeMode mode;
+        StringView expected;
+    } test_cases[] = {
+        {
+            DRMD_ESCAPE_TEXT,
+            SV("Tom &amp; Jerry's \"&lt;b&gt;cartoons&lt;/b&gt;\" -- [not](a link) &amp;lt; "
+               "are more than 64 bytes long, with a\ttab and a  control character.\n"),
+        },
+        {
+            DRMD_ESCAPE_ATTRIBUTE,
+            SV("Tom &amp; Jerry&#39;s &quot;&lt;b&gt;cartoons&lt;/b&gt;&quot; -- [not](a link) &amp;lt; "
+               "are more than 64 bytes long, with a\ttab and a  control character.\n"),
+        },
+    };
+    for(size_t i = 0; i < arrlen(test_cases); i++){
+        StringView out;
+        int e = drmd_escape_html(input, test_cases[i].mode, &out);
+        TestAssertFalse(e);
+        TestExpectEquals2(sv_equals, out, test_cases[i].expected);
+        Allocator_free(MALLOCATOR, out.text, out.length);
+        testing_assert_all_freed();
+    }
+    StringView out;
+    int e = drmd_escape_html(SV(""), DRMD_ESCAPE_TEXT, &out);
+    TestAssertFalse(e);
+    TestExpectEquals(out.length, 0);
+    TESTEND();
+}
+
+TestFunction(TestFmt){
+    TESTBEGIN();
+    StringView input = SV(
+        "  Some text\n"
+        "   continued\n"
+        "o one\n"
+        "+ two\n"
+        "    * nested\n"
+        "      more\n"
+        "7. a\n"
+        "7. b\n"
+        "  \xe2\x80\xa2 c\n"
+        "|name|size\n"
+        "|caf\xc3\xa9||x\n"
+        ">quote\n"
+        "lazy\n"
+        "\n"
+        "#Title\n"
+        "```c\n"
+        "int x;\n"
+        "\n"
+        "```\n"
+    );
+    StringView expected = SV(
+        "Some text\n"
+        "continued\n"
+        "\n"
+        "- one\n"
+        "- two\n"
+        "  - nested\n"
+        "    more\n"
+        "\n"
+        "1. a\n"
+        "2. b\n"
+        "   - c\n"
+        "\n"
+        "| name | size |\n"
+        "| caf\xc3\xa9 |      | x |\n"
+        "\n"
+        "> quote\n"
+        "> lazy\n"
+        "\n"
+        "#Title\n"
+        "\n"
+        "```c\n"
+        "int x;\n"
+        "\n"
+        "```\n"
+    );
+    StringView out;
+    int e = drmd_to_md(input, &out);
+    TestAssertFalse(e);
+    TestExpectEquals2(sv_equals, out, expected);
+    // Formatting is idempotent and doesn't change the html.
+    StringView again;
+    e = drmd_to_md(out, &again);
+    TestAssertFalse(e);
+    TestExpectEquals2(sv_equals, again, expected);
+    StringView html, formatted_html;
+    e = drmd_to_html(input, &html);
+    TestAssertFalse(e);
+    e = drmd_to_html(out, &formatted_html);
+    TestAssertFalse(e);
+    TestExpectEquals2(sv_equals, html, formatted_html);
+    Allocator_free(MALLOCATOR, out.text, out.length);
+    Allocator_free(MALLOCATOR, again.text, again.length);
+    Allocator_free(MALLOCATOR, html.text, html.length);
+    Allocator_free(MALLOCATOR, formatted_html.text, formatted_html.length);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+TestFunction(TestContext){
+    TESTBEGIN();
+    StringView inputs[] = {
+        SV("# Title\n- a\n- b\n\n|x|y\n"),
+        SV("```\ncode\n```\nsome *text*\n"),
+        SV("# Title\n- a\n- b\n\n|x|y\n"),
+        SV(""),
+    };
+    DrMdContext* ctx = drmd_context_create();
+    TestAssert(ctx);
+    for(size_t i = 0; i < arrlen(inputs); i++){
+        StringView expected;
+        int e = drmd_to_html(inputs[i], &expected);
+        TestAssertFalse(e);
+        StringView out;
+        e = drmd_context_to_html(ctx, inputs[i], &out);
+        TestAssertFalse(e);
+        // Empty output has no text to compare.
+        if(expected.length)
+            TestExpectEquals2(sv_equals, out, expected);
+        else
+            TestExpectEquals(out.length, 0);
+        Allocator_free(MALLOCATOR, expected.text, expected.length);
+    }
+    drmd_context_destroy(ctx);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+static
+int
+table_class_hook(void*_Nullable userdata, const DrMdRenderNode* node, DrMdHtmlWriter* writer){
+    (void)userdata;
+    (void)node;
+    drmd_write_html(writer, SV("<table class=\"data\">"));
+    return 0;
+}
+
+static
+int
+code_open_hook(void*_Nullable userdata, const DrMdRenderNode* node, DrMdHtmlWriter* writer){
+    (void)userdata;
+    drmd_write_html(writer, SV("<div class=\"code\"><pre data-lang=\""));
+    drmd_write_escaped_html(writer, node->text, DRMD_ESCAPE_ATTRIBUTE);
+    drmd_write_html(writer, SV("\">"));
+    return 0;
+}
+
+static
+int
+code_close_hook(void*_Nullable userdata, const DrMdRenderNode* node, DrMdHtmlWriter* writer){
+    (void)userdata;
+    (void)node;
+    drmd_write_html(writer, SV("</pre></div>"));
+    return 0;
+}
+
+static
+int
+heading_open_hook(void*_Nullable userdata, const DrMdRenderNode* node, DrMdHtmlWriter* writer){
+    int* count = userdata;
+    ++*count;
+    char tag[] = "<h0 class=\"title\">";
+    tag[2] += (char)(node->level+1);
+    drmd_write_html(writer, (StringView){sizeof tag - 1, tag});
+    return 0;
+}
+
+static
+int
+heading_close_hook(void*_Nullable userdata, const DrMdRenderNode* node, DrMdHtmlWriter* writer){
+    (void)userdata;
+    char tag[] = "</h0>";
+    tag[3] += (char)(node->level+1);
+    drmd_write_html(writer, (StringView){sizeof tag - 1, tag});
+    return 0;
+}
+
+static
+int
+failing_hook(void*_Nullable userdata, const DrMdRenderNode* node, DrMdHtmlWriter* writer){
+    (void)userdata;
+    (void)node;
+    (void)writer;
+    return 42;
+}
+
+TestFunction(TestRenderHooks){
+    TESTBEGIN();
+    StringView input = SV(
+        "# Title\n"
+        "|a|b\n"
+        "|1|2\n"
+        "```c <x>\n"
+        "int x;\n"
+        "```\n"
+        "- item\n"
+    );
+    int headings = 0;
+    DrMdRenderHooks hooks = {.userdata = &headings};
+    hooks.open[DRMD_NODE_TABLE] = table_class_hook;
+    hooks.open[DRMD_NODE_PRE] = code_open_hook;
+    hooks.close[DRMD_NODE_PRE] = code_close_hook;
+    hooks.open[DRMD_NODE_H] = heading_open_hook;
+    hooks.close[DRMD_NODE_H] = heading_close_hook;
+    DrMdContext* ctx = drmd_context_create();
+    TestAssert(ctx);
+    drmd_context_set_render_hooks(ctx, &hooks);
+    StringView out;
+    int e = drmd_context_to_html(ctx, input, &out);
+    TestAssertFalse(e);
+    TestExpectEquals2(sv_equals, out, SV(
+        "<h2 class=\"title\"> Title</h2>\n"
+        "<table class=\"data\">\n<thead>\n<tr>\n<th>a<th>b\n<tbody>\n<tr><td>1<td>2</table>\n"
+        "<div class=\"code\"><pre data-lang=\"c &lt;x&gt;\">int x;\n</pre></div>\n"
+        "<ul>\n<li>item</ul>\n"
+    ));
+    TestExpectEquals(headings, 1);
+    // Without hooks it is the usual html again.
+    drmd_context_set_render_hooks(ctx, NULL);
+    StringView expected;
+    e = drmd_to_html(input, &expected);
+    TestAssertFalse(e);
+    e = drmd_context_to_html(ctx, input, &out);
+    TestAssertFalse(e);
+    TestExpectEquals2(sv_equals, out, expected);
+    Allocator_free(MALLOCATOR, expected.text, expected.length);
+    DrMdRenderHooks failing = {0};
+    failing.close[DRMD_NODE_LIST_ITEM] = failing_hook;
+    drmd_context_set_render_hooks(ctx, &failing);
+    e = drmd_context_to_html(ctx, input, &out);
+    TestExpectEquals(e, 42);
+    drmd_context_destroy(ctx);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+TestFunction(TestRenderCursor){
+    TESTBEGIN();
+    StringView input = SV(
+        "# Title\n"
+        "Some text [a link](https://example.com) &\n"
+        "more text\n"
+        "- a\n"
+        "  - nested\n"
+        "- b\n"
+        "\n"
+        "1. one\n"
+        "2. two\n"
+        "> quoted\n"
+        "> lines\n"
+        "|x|y\n"
+        "|1|2\n"
+        "```\n"
+        "code <here>\n"
+        "```\n"
+    );
+    StringView expected;
+    int e = drmd_to_html(input, &expected);
+    TestAssertFalse(e);
+    size_t caps[] = {1, 3, 64, 4096};
+    for(size_t i = 0; i < arrlen(caps); i++){
+        DrMdRenderCursor* cursor;
+        e = drmd_render_begin(input, &cursor);
+        TestAssertFalse(e);
+        char out[4096];
+        size_t length = 0;
+        for(;;){
+            size_t n;
+            TestAssert(length + caps[i] <= sizeof out);
+            e = drmd_render_next(cursor, out+length, caps[i], &n);
+            TestAssertFalse(e);
+            length += n;
+            if(n < caps[i]) break;
+        }
+        size_t n;
+        e = drmd_render_next(cursor, out, sizeof out, &n);
+        TestAssertFalse(e);
+        TestAssertEquals(n, 0);
+        drmd_render_end(cursor);
+        TestExpectEquals2(sv_equals, ((StringView){length, out}), expected);
+    }
+    Allocator_free(MALLOCATOR, expected.text, expected.length);
+
+    // Big documents, like the cli streams: steps of several kilobytes go
+    // straight into the buffer while they fit and through the cursor's own
+    // buffer when they don't, with buffer sizes changing between calls.
+    MStringBuilder big = {.allocator = MALLOCATOR};
+    for(int i = 0; i < 400; i++)
+        msb_write_str(&big, input.text, input.length);
+    msb_write_literal(&big, "```\n");
+    for(int i = 0; i < 2000; i++)
+        msb_write_literal(&big, "one long code block <&>\n");
+    msb_write_literal(&big, "```\n");
+    TestAssertFalse(big.errored);
+    e = drmd_to_html(msb_borrow_sv(&big), &expected);
+    TestAssertFalse(e);
+    size_t big_caps[] = {1, 1000, 4096, 5000, 1024*1024};
+    MStringBuilder out = {.allocator = MALLOCATOR};
+    for(size_t i = 0; i < arrlen(big_caps)+1; i++){
+        DrMdRenderCursor* cursor;
+        e = drmd_render_begin(msb_borrow_sv(&big), &cursor);
+        TestAssertFalse(e);
+        msb_reset(&out);
+        for(size_t call = 0;; call++){
+            // The last round cycles through all of the sizes.
+            size_t cap = i < arrlen(big_caps)? big_caps[i] : big_caps[call % arrlen(big_caps)];
+            TestAssertFalse(msb_ensure_additional(&out, cap));
+            size_t n;
+            e = drmd_render_next(cursor, out.data+out.cursor, cap, &n);
+            TestAssertFalse(e);
+            out.cursor += n;
+            if(n < cap) break;
+        }
+        drmd_render_end(cursor);
+        TestExpectEquals2(sv_equals, msb_borrow_sv(&out), expected);
+    }
+    Allocator_free(MALLOCATOR, expected.text, expected.length);
+    msb_destroy(&out);
+    msb_destroy(&big);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+TestFunction(TestDocument){
+    TESTBEGIN();
+    StringView input = SV("# Title\n- a\n- b\n\n|x|y\nsome [link](x.md)\n");
+    StringView expected_html, expected_json;
+    int e = drmd_to_html(input, &expected_html);
+    TestAssertFalse(e);
+    e = drmd_to_json(input, &expected_json);
+    TestAssertFalse(e);
+    DrMdDocument* doc;
+    e = drmd_parse(input, &doc);
+    TestAssertFalse(e);
+    TestAssert(drmd_document_size(doc) > input.length);
+    TestAssert(drmd_document_retain(doc) == doc);
+    drmd_document_release(doc);
+    for(int i = 0; i < 2; i++){
+        StringView out;
+        e = drmd_document_to_html(doc, &out);
+        TestAssertFalse(e);
+        TestExpectEquals2(sv_equals, out, expected_html);
+        Allocator_free(MALLOCATOR, out.text, out.length);
+        e = drmd_document_to_json(doc, &out);
+        TestAssertFalse(e);
+        TestExpectEquals2(sv_equals, out, expected_json);
+        Allocator_free(MALLOCATOR, out.text, out.length);
+    }
+    drmd_document_release(doc);
+    Allocator_free(MALLOCATOR, expected_html.text, expected_html.length);
+    Allocator_free(MALLOCATOR, expected_json.text, expected_json.length);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+TestFunction(TestCache){
+    TESTBEGIN();
+    StringView input = SV("# Title\nsome *text*\n");
+    DrMdDocument* doc;
+    int e = drmd_parse(input, &doc);
+    TestAssertFalse(e);
+    size_t doc_size = drmd_document_size(doc);
+    drmd_document_release(doc);
+    // Room for a few dozen documents.
+    DrMdCache* cache = drmd_cache_create(doc_size * 40);
+    TestAssert(cache);
+    DrMdDocument* first, *again;
+    e = drmd_cache_get(cache, SV("k0"), input, &first);
+    TestAssertFalse(e);
+    e = drmd_cache_get(cache, SV("k0"), input, &again);
+    TestAssertFalse(e);
+    TestAssert(again == first);
+    drmd_document_release(again);
+    // Pushes k0 out, but it stays usable until released.
+    for(int i = 1; i < 200; i++){
+        char key[8];
+        int n = snprintf(key, sizeof key, "k%d", i);
+        e = drmd_cache_get(cache, (StringView){(size_t)n, key}, input, &doc);
+        TestAssertFalse(e);
+        drmd_document_release(doc);
+    }
+    e = drmd_cache_get(cache, SV("k0"), input, &again);
+    TestAssertFalse(e);
+    TestAssert(again != first);
+    StringView expected, out;
+    e = drmd_to_html(input, &expected);
+    TestAssertFalse(e);
+    e = drmd_document_to_html(first, &out);
+    TestAssertFalse(e);
+    TestExpectEquals2(sv_equals, out, expected);
+    Allocator_free(MALLOCATOR, out.text, out.length);
+    Allocator_free(MALLOCATOR, expected.text, expected.length);
+    drmd_document_release(first);
+    drmd_document_release(again);
+    TestAssert(cache_bytes(cache) <= doc_size * 40);
+    drmd_cache_destroy(cache);
+
+    // The budget is for the whole cache, so a document bigger than a
+    // stripe's share of it is still cached.
+    cache = drmd_cache_create(doc_size * 4);
+    TestAssert(cache);
+    e = drmd_cache_get(cache, SV("k0"), input, &first);
+    TestAssertFalse(e);
+    e = drmd_cache_get(cache, SV("k0"), input, &again);
+    TestAssertFalse(e);
+    TestAssert(again == first);
+    drmd_document_release(first);
+    drmd_document_release(again);
+    for(int i = 1; i < 20; i++){
+        char key[8];
+        int n = snprintf(key, sizeof key, "k%d", i);
+        e = drmd_cache_get(cache, (StringView){(size_t)n, key}, input, &doc);
+        TestAssertFalse(e);
+        drmd_document_release(doc);
+        TestAssert(cache_bytes(cache) <= doc_size * 4);
+    }
+    drmd_cache_destroy(cache);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+enum {SHARED_ARENA_THREADS = 4, SHARED_ARENA_ALLOCS = 2 * SHARED_ARENA_SLAB_ARENAS};
+// Too big for two to share an arena.
+enum {SHARED_ARENA_ALLOC_SIZE = ARENA_BUFFER_SIZE/2+8};
+
+typedef struct SharedArenaWorker SharedArenaWorker;
+struct SharedArenaWorker {
+    Thread thread;
+    SharedArena* shared;
+    ArenaAllocator aa;
+    int id;
+    _Bool failed;
+    char*_Nullable allocs[SHARED_ARENA_ALLOCS];
+    char*_Nullable big;
+};
+
+static
+void
+shared_arena_worker(void* arg){
+    SharedArenaWorker* w = arg;
+    w->aa = (ArenaAllocator){.shared = w->shared};
+    for(size_t i = 0; i < SHARED_ARENA_ALLOCS; i++){
+        char* p = ArenaAllocator_alloc(&w->aa, SHARED_ARENA_ALLOC_SIZE);
+        if(!p){
+            w->failed = 1;
+            return;
+        }
+        memset(p, w->id, SHARED_ARENA_ALLOC_SIZE);
+        w->allocs[i] = p;
+    }
+    char* big = ArenaAllocator_alloc(&w->aa, BIG_ALLOC_THRESH+1);
+    if(big){
+        memset(big, w->id, BIG_ALLOC_THRESH+1);
+        big = ArenaAllocator_realloc(&w->aa, big, BIG_ALLOC_THRESH+1, BIG_ALLOC_THRESH*2);
+    }
+    if(!big) w->failed = 1;
+    w->big = big;
+}
+
+static
+int
+compare_ptrs(const void* a, const void* b){
+    uintptr_t x = (uintptr_t)*(char*const*)a;
+    uintptr_t y = (uintptr_t)*(char*const*)b;
+    return x < y? -1 : x > y;
+}
+
+TestFunction(TestSharedArena){
+    TESTBEGIN();
+    SharedArena shared = {0};
+    // Enough threads and allocations that they race for arenas, and for
+    // new slabs when one runs out.
+    static SharedArenaWorker workers[SHARED_ARENA_THREADS];
+    for(int t = 0; t < SHARED_ARENA_THREADS; t++){
+        workers[t] = (SharedArenaWorker){.shared = &shared, .id = 'a' + t};
+        TestAssertFalse(thread_create(&workers[t].thread, shared_arena_worker, &workers[t]));
+    }
+    for(int t = 0; t < SHARED_ARENA_THREADS; t++)
+        thread_join(&workers[t].thread);
+    static char* all[SHARED_ARENA_THREADS * SHARED_ARENA_ALLOCS];
+    size_t n = 0;
+    for(int t = 0; t < SHARED_ARENA_THREADS; t++){
+        SharedArenaWorker* w = &workers[t];
+        TestAssertFalse(w->failed);
+        TestAssertEquals(ArenaAllocator_stats(&w->aa).arena_count, SHARED_ARENA_ALLOCS);
+        // Nothing was overwritten by another thread or freed early.
+        for(size_t i = 0; i < SHARED_ARENA_ALLOCS; i++){
+            char* p = w->allocs[i];
+            TestAssertEquals(p[0], (char)w->id);
+            TestAssertEquals(p[SHARED_ARENA_ALLOC_SIZE-1], (char)w->id);
+            all[n++] = p;
+        }
+        TestAssertEquals(w->big[BIG_ALLOC_THRESH], (char)w->id);
+        SharedArena_release(&w->aa);
+        TestAssertFalse(w->aa.arena);
+    }
+    // Nothing was handed out twice.
+    qsort(all, n, sizeof all[0], compare_ptrs);
+    for(size_t i = 1; i < n; i++)
+        TestAssert((uintptr_t)all[i] - (uintptr_t)all[i-1] >= SHARED_ARENA_ALLOC_SIZE);
+    SharedArena_free_all(&shared);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+static
+int
+sign(int x){
+    return (x > 0) - (x < 0);
+}
+
+TestFunction(TestSimdString){
+    TESTBEGIN();
+    // Aligned, so simd_strlen's aligned loads stay inside it.
+    static _Alignas(16) char buf[128];
+    static _Alignas(16) char other[128];
+    // Every start offset within a vector, every length up to a few vectors
+    // (0, whole vectors and odd tails), and the byte being in every lane,
+    // including the last lane of a vector and the last byte, or nowhere.
+    for(size_t offset = 0; offset < 16; offset++){
+        for(size_t length = 0; length <= 64; length++){
+            for(size_t at = 0; at <= length; at++){
+                memset(buf, 'a', sizeof buf);
+                memset(other, 'a', sizeof other);
+                char* p = buf + offset;
+                char* q = other + offset;
+                // at == length is no match at all.
+                if(at < length){
+                    p[at] = (char)0xe9;
+                    q[at] = 'b';
+                }
+                TestAssertEquals((char*)simd_memchr(p, 0xe9, length), (char*)memchr(p, 0xe9, length));
+                TestAssertEquals(sign(simd_memcmp(p, q, length)), sign(memcmp(p, q, length)));
+                TestAssertEquals(sign(simd_memcmp(q, p, length)), sign(memcmp(q, p, length)));
+                p[at] = 0;
+                TestAssertEquals(simd_strlen(p), at);
+            }
+            TestAssertFalse(simd_memchr(buf + offset, 'z', length));
+            TestAssertEquals(simd_memcmp(buf + offset, buf + offset, length), 0);
+        }
+    }
+    TESTEND();
+}
+
+#ifdef __linux__
+TestFunction(TestShmRing){
+    TESTBEGIN();
+    static _Alignas(4096) char region[3*4096];
+    DrMdShmHeader* shm = (DrMdShmHeader*)region;
+    TestAssertFalse(drmd_shm_init(shm, sizeof region));
+    TestAssertFalse(drmd_shm_validate(shm, sizeof region));
+    TestAssert(drmd_shm_validate(shm, sizeof region - 4096));
+    DrMdShmQueue q, responses;
+    TestAssertFalse(drmd_shm_open(shm, sizeof region, &q, &responses));
+    TestAssertEquals(q.size, 4096);
+    TestAssert(drmd_shm_open(shm, sizeof region - 4096, &q, &responses));
+    TestAssertFalse(drmd_shm_open(shm, sizeof region, &q, &responses));
+    // What the other side writes to the header afterwards isn't used.
+    shm->requests.size = 1ull << 40;
+    shm->requests.offset = 1ull << 40;
+    DrMdShmRecord record;
+    size_t capacity;
+    TestAssertFalse(drmd_shm_next(&q, &record, 0, -1));
+    TestAssertFalse(drmd_shm_reserve(&q, 4096, &capacity, 0, -1));
+    // Odd sizes so records end up everywhere in the ring, including ones
+    // that need to wrap.
+    for(size_t i = 0; i < 200; i++){
+        size_t length = i * 37 % 1500;
+        char* payload = drmd_shm_reserve(&q, length, &capacity, 0, -1);
+        TestAssert(payload);
+        TestAssert(capacity >= length);
+        TestAssert(payload >= region + 4096);
+        TestAssert(payload + capacity <= region + 2*4096);
+        memset(payload, (int)i, length);
+        drmd_shm_commit(&q, DRMD_SHM_CONVERT, i, length);
+        const char* got = drmd_shm_next(&q, &record, 0, -1);
+        TestAssert(got);
+        TestAssertEquals(record.kind, DRMD_SHM_CONVERT);
+        TestAssertEquals(record.id, i);
+        TestAssertEquals(record.length, length);
+        if(length){
+            TestAssertEquals(got[0], (char)i);
+            TestAssertEquals(got[length-1], (char)i);
+        }
+        // The copy is what gets consumed, whatever the record says now.
+        ((DrMdShmRecord*)(q.data + (got - q.data) - sizeof record))->length = 4000;
+        drmd_shm_consume(&q, &record);
+        TestAssertFalse(drmd_shm_next(&q, &record, 0, -1));
+    }
+    // Doesn't wait for a full ring to drain when told not to.
+    size_t n = 0;
+    while(drmd_shm_reserve(&q, 1000, &capacity, 0, -1))
+        drmd_shm_commit(&q, DRMD_SHM_CONVERT, n++, 1000);
+    TestAssert(n >= 2);
+    for(size_t i = 0; i < n; i++){
+        TestAssert(drmd_shm_next(&q, &record, 0, -1));
+        TestAssertEquals(record.id, i);
+        drmd_shm_consume(&q, &record);
+    }
+    TestAssertFalse(drmd_shm_next(&q, &record, 0, -1));
+    // A record longer than what is left of the ring is malformed.
+    TestAssert(drmd_shm_reserve(&q, 0, &capacity, 0, -1));
+    drmd_shm_commit(&q, DRMD_SHM_CONVERT, 0, 0);
+    ((DrMdShmRecord*)(q.data + shm->requests.tail % q.size))->length = 4096;
+    TestAssertFalse(drmd_shm_next(&q, &record, 0, -1));
+    // As is a tail the consumer couldn't have written.
+    shm->requests.tail = shm->requests.head + 16;
+    TestAssertFalse(drmd_shm_reserve(&q, 0, &capacity, 0, -1));
+    TESTEND();
+}
+
+typedef struct ShmServer ShmServer;
+struct ShmServer {
+    Thread thread;
+    int fd;
+    int result;
+};
+
+static
+void
+shm_server_thread(void* arg){
+    ShmServer* server = arg;
+    server->result = drmd_shm_serve(server->fd, NULL);
+}
+
+//
+// Collects the response to the request with this id, which may come in
+// parts. Returns its kind, or 0 if the server went away.
+static
+uint32_t
+shm_collect(const DrMdShmQueue* responses, uint64_t id, int peer, MStringBuilder* sb, size_t* parts){
+    for(;;){
+        DrMdShmRecord response;
+        const char* payload = drmd_shm_next(responses, &response, 1, peer);
+        if(!payload || response.id != id) return 0;
+        msb_write_str(sb, payload, response.length);
+        drmd_shm_consume(responses, &response);
+        if(response.kind != DRMD_SHM_HTML_PART) return response.kind;
+        ++*parts;
+    }
+}
+
+//
+// Some markdown, from a line to almost 3KB depending on i.
+static
+void
+shm_test_input(MStringBuilder* sb, size_t i){
+    sb->cursor = 0;
+    msb_write_literal(sb, "# Document ");
+    msb_write_uint(sb, i);
+    msb_write_literal(sb, "\n\n");
+    for(size_t j = 0; j < i * 7 % 100; j++)
+        msb_write_literal(sb, "Some *text* & <more> text.\n");
+}
+
+TestFunction(TestShmServe){
+    TESTBEGIN();
+    // The smallest rings, so records wrap, most html comes back in parts
+    // and each side keeps running out of room and sleeping until the other
+    // catches up.
+    size_t size = 3*4096;
+    FILE* fp = tmpfile();
+    TestAssert(fp);
+    ShmServer server = {.fd = fileno(fp)};
+    TestAssertFalse(ftruncate(server.fd, (off_t)size));
+    DrMdShmHeader* shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, server.fd, 0);
+    TestAssert(shm != MAP_FAILED);
+    DrMdShmQueue requests, responses;
+    TestAssertFalse(drmd_shm_init(shm, size));
+    TestAssertFalse(drmd_shm_open(shm, size, &requests, &responses));
+    TestAssertFalse(thread_create(&server.thread, shm_server_thread, &server));
+    enum {N = 64};
+    size_t sent = 0, received = 0, parts = 0;
+    MStringBuilder input = {.allocator = MALLOCATOR};
+    MStringBuilder got = {.allocator = MALLOCATOR};
+    while(received < N){
+        while(sent < N){
+            shm_test_input(&input, sent);
+            size_t capacity;
+            // The server frees a request once its html is out, so with
+            // all the html in there may still be no room yet.
+            char* slot = drmd_shm_reserve(&requests, input.cursor, &capacity, sent == received, -1);
+            if(!slot) break;
+            memcpy(slot, input.data, input.cursor);
+            drmd_shm_commit(&requests, DRMD_SHM_CONVERT, sent, input.cursor);
+            sent++;
+        }
+        got.cursor = 0;
+        TestAssertEquals(shm_collect(&responses, received, -1, &got, &parts), DRMD_SHM_HTML);
+        StringView expected;
+        shm_test_input(&input, received);
+        TestAssertFalse(drmd_to_html(msb_borrow_sv(&input), &expected));
+        TestExpectEquals2(sv_equals, msb_borrow_sv(&got), expected);
+        Allocator_free(MALLOCATOR, expected.text, expected.length);
+        received++;
+        if(received == 1){
+            // The server has its own copy of the rings' layout by now and
+            // doesn't look at the header's again.
+            shm->requests.size = shm->responses.size = 1ull << 40;
+            shm->requests.offset = shm->responses.offset = 1ull << 40;
+        }
+    }
+    TestAssert(parts);
+    // The stats don't fit in the ring either.
+    size_t capacity;
+    TestAssert(drmd_shm_reserve(&requests, 0, &capacity, 1, -1));
+    drmd_shm_commit(&requests, DRMD_SHM_STATS, N, 0);
+    got.cursor = 0;
+    TestAssertEquals(shm_collect(&responses, N, -1, &got, &parts), DRMD_SHM_STATS);
+    msb_write_char(&got, '\0');
+    TestAssert(strstr(got.data, "\ndrmd_conversions_total 64\n"));
+    TestAssert(drmd_shm_reserve(&requests, 0, &capacity, 1, -1));
+    drmd_shm_commit(&requests, DRMD_SHM_CLOSE, 0, 0);
+    thread_join(&server.thread);
+    TestAssertEquals(server.result, 0);
+
+    // A client that dies while the server waits for it, and is left a
+    // zombie, as is a server that dies while its client waits.
+    TestAssertFalse(drmd_shm_init(shm, size));
+    pid_t child = fork();
+    TestAssert(child >= 0);
+    if(!child){
+        usleep(100*1000);
+        _exit(0);
+    }
+    shm->client_pid = child;
+    int peer = drmd_shm_peer_open(child);
+    TestAssert(peer >= 0);
+    TestAssertFalse(thread_create(&server.thread, shm_server_thread, &server));
+    DrMdShmRecord response;
+    TestAssertFalse(drmd_shm_next(&responses, &response, 1, peer));
+    TestAssert(drmd_shm_peer_exited(peer));
+    thread_join(&server.thread);
+    TestAssertEquals(server.result, 1);
+    int status;
+    TestAssertEquals(waitpid(child, &status, 0), child);
+    close(peer);
+    munmap(shm, size);
+    fclose(fp);
+    msb_destroy(&input);
+    msb_destroy(&got);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+#endif
 
 #ifdef __clang__
 #pragma clang assume_nonnull end
 #endif
 
 #include "drmd.c"
+#include "drmd_cache.c"
+// The cli's modes, which are tested by their parts rather than all used.
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-function"
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#include "drmd_metrics.c"
+#include "drmd_ndjson.c"
+#include "drmd_site.c"
+#include "drmd_batch.c"
+#include "drmd_tar.c"
+#include "drmd_book.c"
+#include "drmd_replay.c"
+#ifdef __linux__
+#include "drmd_shm.c"
+#endif
+#ifdef __clang__
+#pragma clang diagnostic pop
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+static
+size_t
+cache_bytes(DrMdCache* cache){
+    return atomic_load_size(&cache->bytes);
+}
+
+//
+// The tests of the cli's modes are down here, as they need their sources.
+//
+
+TestFunction(TestNdjson){
+    TESTBEGIN();
+    struct {
+        StringView line;
+        const char*_Nullable error;
+        StringView id;
+        StringView field;
+    } test_cases[] = {
+        {SV(" { \"id\" : 7 , \"md\" : \"a\\nb\" } "), NULL, SV("7"), SV("a\\nb")},
+        {SV("{\"md\":\"x\",\"other\":{\"id\":[1,\"}\"]}}"), NULL, SV("null"), SV("x")},
+        {SV("{\"id\":\"caf\\u00e9\",\"md\":\"\"}"), NULL, SV("\"caf\\u00e9\""), SV("")},
+        {SV("{\"id\":-1.5e+3,\"md\":\"\"}"), NULL, SV("-1.5e+3"), SV("")},
+        {SV("{\"id\":\"x\"}"), "missing field", SV("\"x\""), SV("")},
+        {SV("{\"id\":1,\"md\":3}"), "field is not a string", SV("1"), SV("")},
+        {SV("[1]"), "line is not a json object", SV("null"), SV("")},
+        {SV("{\"id\":1,\"md\":\"x\""), "malformed json", SV("1"), SV("")},
+        // Ids that would make the output invalid json.
+        {SV("{\"id\":01,\"md\":\"x\"}"), "id is not a json string, number or literal", SV("null"), SV("")},
+        {SV("{\"id\":tru,\"md\":\"x\"}"), "id is not a json string, number or literal", SV("null"), SV("")},
+        {SV("{\"id\":[1],\"md\":\"x\"}"), "id is not a json string, number or literal", SV("null"), SV("")},
+        {SV("{\"id\":\"\\q\",\"md\":\"x\"}"), "id is not a json string, number or literal", SV("null"), SV("")},
+        {SV("{\"id\":\"\xff\",\"md\":\"x\"}"), "id is not a json string, number or literal", SV("null"), SV("")},
+        {SV("{\"id\":1.,\"md\":\"x\"}"), "id is not a json string, number or literal", SV("null"), SV("")},
+    };
+    for(size_t i = 0; i < arrlen(test_cases); i++){
+        StringView line = test_cases[i].line;
+        StringView id, field;
+        const char* error = ndjson_parse_line(line.text, line.text + line.length, SV("md"), &id, &field);
+        if(test_cases[i].error){
+            TestAssert(error);
+            TestExpectEquals2(sv_equals, ((StringView){strlen(error), error}), ((StringView){strlen(test_cases[i].error), test_cases[i].error}));
+        }
+        else {
+            TestExpectFalse(error);
+            TestExpectEquals2(sv_equals, field, test_cases[i].field);
+        }
+        TestExpectEquals2(sv_equals, id, test_cases[i].id);
+    }
+    // Surrogate pairs are joined, and anything unpaired or invalid is
+    // replaced.
+    MStringBuilder sb = {.allocator = MALLOCATOR};
+    StringView escaped = SV("a\\u00e9\\ud83d\\ude00 \\ud83d x\\ude00\\q\\\"\\/\\t\\u12");
+    json_unescape(&sb, escaped.text, escaped.length);
+    TestExpectEquals2(sv_equals, msb_borrow_sv(&sb), SV("a\xc3\xa9\xf0\x9f\x98\x80 \xef\xbf\xbd x\xef\xbf\xbd\xef\xbf\xbd\"/\t\xef\xbf\xbd" "12"));
+    msb_destroy(&sb);
+
+    // The whole mode: lines in order, blank lines skipped and errors in
+    // place of bad lines.
+    FILE* in = tmpfile();
+    FILE* out = tmpfile();
+    TestAssert(in);
+    TestAssert(out);
+    fputs("{\"id\":1,\"md\":\"# A\"}\n\n{\"id\":x}\n{\"md\":\"b\\u00e9\"}", in);
+    rewind(in);
+    TestAssertEquals(drmd_ndjson(in, out, SV("md"), 2, NULL, NULL), 1);
+    char text[256];
+    rewind(out);
+    size_t n = fread(text, 1, sizeof text, out);
+    TestExpectEquals2(sv_equals, ((StringView){n, text}), SV(
+        "{\"id\":1,\"html\":\"<h1> A</h1>\\n\"}\n"
+        "{\"id\":null,\"error\":\"id is not a json string, number or literal\"}\n"
+        "{\"id\":null,\"html\":\"<p>b\xc3\xa9\"}\n"));
+    fclose(in);
+    fclose(out);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+TestFunction(TestSite){
+    TESTBEGIN();
+    struct {
+        const char* input;
+        const char* output;
+        StringView text;
+    } pages[] = {
+        {"docs/a.md", "docs/a.html", SV(
+            "# A\n"
+            "## Setup\n"
+            "[b](sub/b.md#usage) [b again](./sub/../sub/b.md?x=1) [html](sub/b.html)\n"
+            "[self](#setup) [self too](a.md#setup)\n"
+            "[gone](c.md) [no heading](sub/b.md#nope) [picture](a.png) [web](https://example.com/x.md)\n")},
+        {"docs/sub/b.md", "docs/sub/b.html", SV(
+            "# B\n"
+            "## Usage\n"
+            "[up](../a.md)\n")},
+    };
+    Site site = {0};
+    TestAssertFalse(site_init(&site, arrlen(pages)));
+    DrMdContext* contexts[arrlen(pages)];
+    NodeHandle roots[arrlen(pages)];
+    ArenaAllocator arena = {0};
+    for(size_t i = 0; i < arrlen(pages); i++){
+        TestAssertFalse(site_add_page(&site, i, pages[i].input, pages[i].output));
+        contexts[i] = drmd_context_create();
+        TestAssert(contexts[i]);
+        TestAssertFalse(context_parse(contexts[i], pages[i].text, &roots[i]));
+        TestAssertFalse(collect_headings(contexts[i], roots[i], SV("")));
+        TestAssertFalse(site_scan_page(&site.pages[i], allocator_from_arena(&arena), contexts[i], roots[i], pages[i].text));
+    }
+    struct {
+        StringView target;
+        enum SiteLinkKind kind;
+        size_t to;
+    } links[] = {
+        {SV("sub/b.md#usage"), SITE_LINK_OK, 1},
+        {SV("./sub/../sub/b.md?x=1"), SITE_LINK_OK, 1},
+        {SV("sub/b.html"), SITE_LINK_OK, 1},
+        {SV("#setup"), SITE_LINK_OK, 0},
+        {SV("a.md#setup"), SITE_LINK_OK, 0},
+        {SV("c.md"), SITE_LINK_NO_PAGE, 0},
+        {SV("sub/b.md#nope"), SITE_LINK_NO_HEADING, 1},
+        {SV("#nope"), SITE_LINK_NO_HEADING, 0},
+        {SV("a.png"), SITE_LINK_UNKNOWN, 0},
+        {SV("https://example.com/x.md"), SITE_LINK_EXTERNAL, 0},
+        {SV("/docs/a.md"), SITE_LINK_EXTERNAL, 0},
+    };
+    MStringBuilder path = {.allocator = MALLOCATOR};
+    for(size_t i = 0; i < arrlen(links); i++){
+        size_t to = 0;
+        enum SiteLinkKind kind = site_resolve_link(&site, 0, links[i].target, &path, &to);
+        TestExpectEquals(kind, links[i].kind);
+        if(kind == SITE_LINK_OK || kind == SITE_LINK_NO_HEADING)
+            TestExpectEquals(to, links[i].to);
+    }
+    msb_destroy(&path);
+
+    FILE* report = tmpfile();
+    TestAssert(report);
+    TestAssertEquals(site_resolve(&site, report), 2);
+    char text[512];
+    rewind(report);
+    size_t n = fread(text, 1, sizeof text, report);
+    fclose(report);
+    TestExpectEquals2(sv_equals, ((StringView){n, text}), SV(
+        "docs/a.md:5: link to missing page 'c.md'\n"
+        "docs/a.md:5: link to missing heading 'sub/b.md#nope'\n"));
+    TestAssertEquals(site.pages[0].backlink_count, 1);
+    TestAssertEquals(site.pages[1].backlink_count, 1);
+
+    // Rendered, links to inputs go to their outputs instead.
+    SiteLinks site_links = {
+        .site = &site,
+        .path = {.allocator = MALLOCATOR},
+        .href = {.allocator = MALLOCATOR},
+    };
+    LinkRewrite rewrite = {site_rewrite_link, &site_links};
+    StringView expected[] = {
+        SV("<h1 id=\"a\"> A</h1>\n"
+           "<h2 id=\"setup\"> Setup</h2>\n"
+           "<p><a href=\"sub/b.html#usage\">b</a> <a href=\"sub/b.html?x=1\">b again</a> <a href=\"sub/b.html\">html</a>\n"
+           "<a href=\"#setup\">self</a> <a href=\"a.html#setup\">self too</a>\n"
+           "<a href=\"c.md\">gone</a> <a href=\"sub/b.html#nope\">no heading</a> <a href=\"a.png\">picture</a> <a href=\"https://example.com/x.md\">web</a>"),
+        SV("<h1 id=\"b\"> B</h1>\n"
+           "<h2 id=\"usage\"> Usage</h2>\n"
+           "<p><a href=\"../a.html\">up</a>"),
+    };
+    MStringBuilder html = {.allocator = MALLOCATOR};
+    for(size_t i = 0; i < arrlen(pages); i++){
+        site_links.from = i;
+        contexts[i]->link_rewrite = &rewrite;
+        msb_reset(&html);
+        TestAssertFalse(render_to_html(contexts[i], roots[i], &html));
+        TestExpectEquals2(sv_equals, msb_borrow_sv(&html), expected[i]);
+        drmd_context_destroy(contexts[i]);
+    }
+    msb_destroy(&html);
+    msb_destroy(&site_links.path);
+    msb_destroy(&site_links.href);
+    ArenaAllocator_free_all(&arena);
+    site_destroy(&site);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+//
+// Appends a tar member with the given type, name, ustar prefix (if any) and
+// contents.
+static
+void
+tar_test_member(MStringBuilder* tar, char type, StringView name, StringView prefix, StringView contents){
+    size_t offset = tar->cursor;
+    msb_write_nchar(tar, '\0', TAR_BLOCK);
+    char* header = tar->data + offset;
+    memcpy(header, name.text, name.length);
+    memcpy(header+100, "0000644", 7);
+    header[156] = type;
+    if(prefix.length){
+        memcpy(header+257, "ustar\0" "00", 8);
+        memcpy(header+345, prefix.text, prefix.length);
+    }
+    tar_finish_header(header, contents.length);
+    msb_write_str(tar, contents.text, contents.length);
+    tar_pad(tar);
+}
+
+TestFunction(TestTar){
+    TESTBEGIN();
+    MStringBuilder tar = {.allocator = MALLOCATOR};
+    tar_test_member(&tar, '0', SV("a.md"), SV("deep/dir"), SV("# a\n"));
+    tar_test_member(&tar, 'L', SV("././@LongLink"), SV(""), SV("long/gnu/name/b.md\0"));
+    tar_test_member(&tar, '0', SV("long/gnu/na"), SV(""), SV("b"));
+    tar_test_member(&tar, 'x', SV("PaxHeaders/c"), SV(""), SV("11 mtime=1\n17 path=pax/c.md\n"));
+    tar_test_member(&tar, '0', SV("c-short.md"), SV(""), SV("c"));
+    tar_test_member(&tar, '5', SV("dir.md/"), SV(""), SV(""));
+    tar_test_member(&tar, '0', SV("image.png"), SV(""), SV("png"));
+    // Old GNU tars put other things where the prefix goes.
+    tar_test_member(&tar, '0', SV("d.md"), SV(""), SV("d"));
+    memcpy(tar.data + tar.cursor - 2*TAR_BLOCK + 345, "junk", 4);
+    tar_finish_header(tar.data + tar.cursor - 2*TAR_BLOCK, 1);
+    size_t members_end = tar.cursor;
+    msb_write_nchar(&tar, '\0', 2*TAR_BLOCK);
+    TestAssertFalse(tar.errored);
+    struct {
+        StringView name;
+        StringView text;
+    } expected[] = {
+        {SV("deep/dir/a.md"), SV("# a\n")},
+        {SV("long/gnu/name/b.md"), SV("b")},
+        {SV("pax/c.md"), SV("c")},
+        {SV("d.md"), SV("d")},
+    };
+    TarReader r = {.cursor = tar.data, .end = tar.data + tar.cursor};
+    for(size_t i = 0; i < arrlen(expected); i++){
+        TarMember member;
+        TestAssertEquals(tar_next(&r, tar.data, &member), 0);
+        TestExpectEquals2(sv_equals, member.name, expected[i].name);
+        TestExpectEquals2(sv_equals, member.text, expected[i].text);
+    }
+    TarMember member;
+    TestAssertEquals(tar_next(&r, tar.data, &member), 1);
+    ArenaAllocator_free_all(&r.names);
+
+    // Without the end blocks or the last member's padding is fine too.
+    r = (TarReader){.cursor = tar.data, .end = tar.data + members_end - TAR_BLOCK + 1};
+    for(size_t i = 0; i < arrlen(expected); i++)
+        TestAssertEquals(tar_next(&r, tar.data, &member), 0);
+    TestAssertEquals(tar_next(&r, tar.data, &member), 1);
+    ArenaAllocator_free_all(&r.names);
+
+    // A truncated header, a truncated member and a bad checksum after a
+    // good member.
+    msb_reset(&tar);
+    tar_test_member(&tar, '0', SV("a.md"), SV(""), SV("a"));
+    tar_test_member(&tar, '0', SV("b.md"), SV(""), SV("b"));
+    char* second = tar.data + 2*TAR_BLOCK;
+    for(int i = 0; i < 3; i++){
+        const char* end = tar.data + tar.cursor;
+        if(i == 0)
+            end = second + 100;
+        if(i == 1)
+            tar_finish_header(second, 2*TAR_BLOCK);
+        if(i == 2){
+            tar_finish_header(second, 1);
+            second[0] ^= 1;
+        }
+        r = (TarReader){.cursor = tar.data, .end = end};
+        TestAssertEquals(tar_next(&r, tar.data, &member), 0);
+        TestAssertEquals(tar_next(&r, tar.data, &member), -1);
+        ArenaAllocator_free_all(&r.names);
+    }
+    msb_destroy(&tar);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+#ifdef __linux__
+static
+int
+write_file(const char* path, StringView text){
+    FILE* fp = fopen(path, "wb");
+    if(!fp)
+        return 1;
+    size_t n = fwrite(text.text, 1, text.length, fp);
+    return fclose(fp) || n != text.length;
+}
+
+static
+int
+read_file(const char* path, MStringBuilder* sb){
+    msb_reset(sb);
+    FILE* fp = fopen(path, "rb");
+    if(!fp)
+        return 1;
+    char buff[4096];
+    size_t n;
+    while((n = fread(buff, 1, sizeof buff, fp)))
+        msb_write_str(sb, buff, n);
+    fclose(fp);
+    return sb->errored;
+}
+
+TestFunction(TestBatch){
+    TESTBEGIN();
+    char dir[] = "/tmp/drmd-batch-XXXXXX";
+    TestAssert(mkdtemp(dir));
+    // Enough files for two workers with full windows, one too big for a
+    // slot's registered read buffer and one that doesn't exist.
+    enum {N = 70, BIG = 5};
+    char path[64];
+    MStringBuilder text = {.allocator = MALLOCATOR};
+    MStringBuilder html = {.allocator = MALLOCATOR};
+    FILE* list = tmpfile();
+    TestAssert(list);
+    for(int i = 0; i < N; i++){
+        msb_reset(&text);
+        msb_write_literal(&text, "# Page ");
+        msb_write_uint(&text, i);
+        msb_write_char(&text, '\n');
+        int lines = i == BIG? 8000 : i;
+        for(int j = 0; j < lines; j++)
+            msb_write_literal(&text, "some *text* here\n");
+        TestAssertFalse(text.errored);
+        snprintf(path, sizeof path, "%s/%d.md", dir, i);
+        TestAssertFalse(write_file(path, msb_borrow_sv(&text)));
+        fprintf(list, "%s%s", path, i == 1? "\r\n" : "\n");
+        if(i == N/2)
+            fprintf(list, "%s/missing.md\n\n", dir);
+    }
+    rewind(list);
+    StringView suffix = SV("<!-- end -->\n");
+    TestAssertEquals(drmd_batch(list, suffix, 2, NULL, 0, NULL, NULL), 1);
+    fclose(list);
+    for(int i = 0; i < N; i++){
+        snprintf(path, sizeof path, "%s/%d.md", dir, i);
+        TestAssertFalse(read_file(path, &text));
+        unlink(path);
+        snprintf(path, sizeof path, "%s/%d.html", dir, i);
+        TestAssertFalse(read_file(path, &html));
+        unlink(path);
+        if(i == BIG)
+            TestAssert(text.cursor > BATCH_READ_SIZE);
+        StringView expected;
+        int e = drmd_to_html(msb_borrow_sv(&text), &expected);
+        TestAssertFalse(e);
+        msb_reset(&text);
+        msb_write_str(&text, expected.text, expected.length);
+        msb_write_str(&text, suffix.text, suffix.length);
+        Allocator_free(MALLOCATOR, expected.text, expected.length);
+        TestExpectEquals2(sv_equals, msb_borrow_sv(&html), msb_borrow_sv(&text));
+    }
+    snprintf(path, sizeof path, "%s/missing.html", dir);
+    TestExpectFalse(unlink(path) == 0);
+    TestExpectFalse(rmdir(dir));
+    msb_destroy(&text);
+    msb_destroy(&html);
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+TestFunction(TestBook){
+    TESTBEGIN();
+    char dir[] = "/tmp/drmd-book-XXXXXX";
+    TestAssert(mkdtemp(dir));
+    StringView chapters[] = {
+        SV("# One\n"
+           "#### Deep\n"
+           "## Two\n"
+           "[to two](#two) [nowhere](#nowhere) [elsewhere](https://example.com/#two)\n"),
+        SV("## One\n"
+           "[back](#one) [first](#c1-one)\n"),
+    };
+    char paths[arrlen(chapters)][64];
+    StringView path_svs[arrlen(chapters)];
+    for(size_t i = 0; i < arrlen(chapters); i++){
+        int n = snprintf(paths[i], sizeof paths[i], "%s/%zu.md", dir, i);
+        path_svs[i] = (StringView){(size_t)n, paths[i]};
+        TestAssertFalse(write_file(paths[i], chapters[i]));
+    }
+    FILE* out = tmpfile();
+    TestAssert(out);
+    TestAssertFalse(drmd_book(path_svs, arrlen(path_svs), out, SV("<!-- end -->\n"), 2));
+    char text[2048];
+    rewind(out);
+    size_t n = fread(text, 1, sizeof text, out);
+    fclose(out);
+    // The toc goes back up from level 4 to 2 within the same list, and each
+    // chapter's #links go to its own headings.
+    TestExpectEquals2(sv_equals, ((StringView){n, text}), SV(
+        "<nav class=\"toc\">\n"
+        "<ul>\n"
+        "<li><a href=\"#c1-one\">One</a><ul>\n"
+        "<li><ul>\n"
+        "<li><ul>\n"
+        "<li><a href=\"#c1-deep\">Deep</a></li>\n"
+        "</ul>\n"
+        "</li>\n"
+        "</ul>\n"
+        "</li>\n"
+        "<li><a href=\"#c1-two\">Two</a></li>\n"
+        "<li><a href=\"#c2-one\">One</a></li>\n"
+        "</ul>\n"
+        "</li>\n"
+        "</ul>\n"
+        "</nav>\n"
+        "<section id=\"c1\">\n"
+        "<h1 id=\"c1-one\"> One</h1>\n"
+        "<h4 id=\"c1-deep\"> Deep</h4>\n"
+        "<h2 id=\"c1-two\"> Two</h2>\n"
+        "<p><a href=\"#c1-two\">to two</a> <a href=\"#nowhere\">nowhere</a> <a href=\"https://example.com/#two\">elsewhere</a></section>\n"
+        "<section id=\"c2\">\n"
+        "<h2 id=\"c2-one\"> One</h2>\n"
+        "<p><a href=\"#c2-one\">back</a> <a href=\"#c1-one\">first</a></section>\n"
+        "<!-- end -->\n"));
+    for(size_t i = 0; i < arrlen(chapters); i++)
+        unlink(paths[i]);
+    TestExpectFalse(rmdir(dir));
+    testing_assert_all_freed();
+    TESTEND();
+}
+
+
+TestFunction(TestReplay){
+    TESTBEGIN();
+    char dir[] = "/tmp/drmd-replay-XXXXXX";
+    TestAssert(mkdtemp(dir));
+    DrMdContext* ctx = drmd_context_create();
+    TestAssert(ctx);
+    MStringBuilder html = {.allocator = MALLOCATOR};
+    // Only documents of at least 4 nodes are captured, each once.
+    const Capture* capture = capture_options(dir, 0, 4);
+    TestAssert(capture);
+    StringView inputs[] = {
+        SV("# A\n- b\n- c\n"),
+        SV("x\n"),
+        SV("# A\n- b\n- c\n"),
+        SV("> q\n> r\n\n1. s\n"),
+    };
+    for(size_t i = 0; i < arrlen(inputs); i++){
+        msb_reset(&html);
+        TestAssertFalse(metrics_convert(NULL, capture, ctx, SV("test"), inputs[i], &html));
+    }
+    drmd_context_destroy(ctx);
+    msb_destroy(&html);
+    MStringBuilder names = {.allocator = MALLOCATOR};
+    size_t count;
+    TestAssertFalse(replay_list(dir, &names, &count));
+    TestAssertEquals(count, 2);
+    msb_destroy(&names);
+    char path[64];
+    for(size_t i = 0; i < arrlen(inputs); i += 3){
+        snprintf(path, sizeof path, "%s/%08x-%zu.txt", dir, (unsigned)hash_bytes(inputs[i].text, inputs[i].length), inputs[i].length);
+        FILE* fp = fopen(path, "rb");
+        TestAssert(fp);
+        char text[256];
+        size_t n = fread(text, 1, sizeof text, fp);
+        fclose(fp);
+        StringView expected = SV("source: test\nbytes: ");
+        TestAssert(n > expected.length);
+        TestExpectEquals2(sv_equals, ((StringView){expected.length, text}), expected);
+    }
+
+    FILE* out = tmpfile();
+    TestAssert(out);
+    TestAssertFalse(drmd_replay(dir, out));
+    char text[1024];
+    rewind(out);
+    size_t n = fread(text, 1, sizeof text - 1, out);
+    fclose(out);
+    text[n] = 0;
+    // A header, a line per document sorted by name, then the total.
+    int lines = 0;
+    for(char* line = text; *line; lines++){
+        char* nl = strchr(line, '\n');
+        TestAssert(nl);
+        *nl = 0;
+        if(lines == 1 || lines == 2){
+            TestAssert(strstr(line, ".md"));
+            TestAssert(strlen(line) > 60);
+        }
+        line = nl+1;
+    }
+    TestAssertEquals(lines, 4);
+    TestAssert(strstr(text + n - 9, " 2 files"));
+    MStringBuilder listed = {.allocator = MALLOCATOR};
+    TestAssertFalse(replay_list(dir, &listed, &count));
+    const char* name = listed.data;
+    for(size_t i = 0; i < count; i++){
+        int length = (int)strlen(name) - 3;
+        snprintf(path, sizeof path, "%s/%.*s.md", dir, length, name);
+        TestExpectFalse(unlink(path));
+        snprintf(path, sizeof path, "%s/%.*s.txt", dir, length, name);
+        TestExpectFalse(unlink(path));
+        name += strlen(name) + 1;
+    }
+    msb_destroy(&listed);
+    TestExpectFalse(rmdir(dir));
+    testing_assert_all_freed();
+    TESTEND();
+}
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
@@ -55,23 +55,17 @@ _Static_assert(sizeof(uint64_t)==8, "");
 
 #define NULL ((void*)0)
 
+// Vectorized with simd128 when it is enabled, and tested natively.
+#include "../simd_string.h"
+
 static inline
 void* _Nullable
 memchr(const void*_Nonnull pointer, int c, size_t nbytes){
-    unsigned char*p  = (unsigned char*)pointer;
-    while(nbytes--){
-        if(*p == c)
-            return p;
-        p++;
-    }
-    return NULL;
+    return simd_memchr(pointer, c, nbytes);
 }
 
 size_t strlen(const char* p){
-    for(size_t i = 0; ; i++){
-        if(p[i] == 0)
-            return i;
-    }
+    return simd_strlen(p);
 }
 
 static
@@ -221,16 +215,7 @@ abort(void);
 
 int
 memcmp(const void* s1, const void* s2, size_t n){
-    const unsigned char* pa = s1;
-    const unsigned char* pb = s2;
-    while(n--){
-        unsigned char a = *pa++;
-        unsigned char b = *pb++;
-        int diff = a - b;
-        if(diff)
-            return diff;
-    }
-    return 0;
+    return simd_memcmp(s1, s2, n);
 }
 
 int
@@ -251,6 +236,10 @@ strcmp(const char* s1, const char* s2){
 
 void*
 memmove(void* dst, const void* src, size_t len){
+#ifdef __wasm_bulk_memory__
+    // memory.copy is defined for overlapping ranges.
+    return __builtin_memmove(dst, src, len);
+#else
     if(src == dst)
         return dst;
     if(src < dst){
@@ -262,6 +251,7 @@ memmove(void* dst, const void* src, size_t len){
     }
     else
         return memcpy(dst, src, len);
+#endif
 }
 
 int abs(int i){
@@ -0,0 +1,70 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+#ifndef ATOMIC_UTIL_H
+#define ATOMIC_UTIL_H
+#include <stddef.h>
+
+//
+// Just enough atomics for reference counts and shared counters, without
+// needing <stdatomic.h> (which msvc doesn't have for C).
+//
+
+//
+// Adds n and returns the new value.
+static inline size_t atomic_add_size(size_t* p, size_t n);
+
+//
+// Subtracts n and returns the new value.
+static inline size_t atomic_sub_size(size_t* p, size_t n);
+
+static inline size_t atomic_load_size(const size_t* p);
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+
+static inline
+size_t
+atomic_add_size(size_t* p, size_t n){
+#ifdef _WIN64
+    return (size_t)_InterlockedExchangeAdd64((volatile __int64*)p, (__int64)n) + n;
+#else
+    return (size_t)_InterlockedExchangeAdd((volatile long*)p, (long)n) + n;
+#endif
+}
+
+static inline
+size_t
+atomic_sub_size(size_t* p, size_t n){
+    return atomic_add_size(p, (size_t)0 - n);
+}
+
+static inline
+size_t
+atomic_load_size(const size_t* p){
+    // Aligned loads are atomic and msvc treats volatile as acquire.
+    return *(const volatile size_t*)p;
+}
+
+#else
+
+static inline
+size_t
+atomic_add_size(size_t* p, size_t n){
+    return __atomic_add_fetch(p, n, __ATOMIC_ACQ_REL);
+}
+
+static inline
+size_t
+atomic_sub_size(size_t* p, size_t n){
+    return __atomic_sub_fetch(p, n, __ATOMIC_ACQ_REL);
+}
+
+static inline
+size_t
+atomic_load_size(const size_t* p){
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+#endif
+
+#endif
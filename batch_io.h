@@ -0,0 +1,453 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+#ifdef _WIN32
+#ifndef _CRT_NONSTDC_NO_DEPRECATE
+#define _CRT_NONSTDC_NO_DEPRECATE
+#endif
+#endif
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+//
+// Asynchronous whole-file io for converting many small files, where the
+// open/read/write/close syscalls cost more than the conversion.
+//
+// On linux this uses io_uring: operations are queued and only submitted in
+// a batch when waiting for a completion, so many files are in flight per
+// syscall. Reads into the buffers given to batch_io_init use them as
+// registered (fixed) buffers.
+// Elsewhere, or if io_uring is unavailable (old kernel, disabled by sysctl
+// or seccomp) or NO_IO_URING is defined, each operation is done with a plain
+// syscall when it is queued and just completes immediately.
+//
+// Every queued operation completes exactly once, with the `user` value it was
+// queued with. Callers must not have more than `depth` operations in flight.
+// Reads and writes are sequential: `offset` must be where the previous
+// operation on that fd left off.
+//
+
+typedef struct BatchCompletion BatchCompletion;
+struct BatchCompletion {
+    uint64_t user;
+    // Like the syscall: the fd or bytes transferred, or -errno.
+    long long result;
+};
+
+enum {BATCH_IO_MAX_DEPTH = 256};
+
+#if defined(__linux__) && !defined(NO_IO_URING)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+typedef struct Uring Uring;
+struct Uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void*_Nullable cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    // Queued but not yet submitted.
+    unsigned unsubmitted;
+};
+#else
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#define BATCH_O_BINARY O_BINARY
+#else
+#define BATCH_O_BINARY 0
+#endif
+
+typedef struct BatchIO BatchIO;
+struct BatchIO {
+#ifdef HAVE_IO_URING
+    _Bool uring_ok;
+    _Bool registered;
+    Uring uring;
+#endif
+    // Completions of the syscall fallback, waiting to be returned.
+    BatchCompletion done[BATCH_IO_MAX_DEPTH];
+    unsigned done_head, done_count;
+    char*_Nullable buffers;
+    size_t buffer_size;
+    unsigned buffer_count;
+};
+
+//
+// `buffers` is `count` buffers of `size` bytes, which are registered with
+// the kernel if possible. Always succeeds, as it can fall back to syscalls.
+static inline void batch_io_init(BatchIO* io, unsigned depth, char*_Nullable buffers, size_t size, unsigned count);
+static inline void batch_io_destroy(BatchIO* io);
+
+// Opens for reading, or for writing if `create`, truncating and creating it.
+static inline void batch_io_open(BatchIO* io, const char* path, _Bool create, uint64_t user);
+// If `buf` is within one of the registered buffers, reads into it as such.
+static inline void batch_io_read(BatchIO* io, int fd, char* buf, size_t length, uint64_t offset, uint64_t user);
+static inline void batch_io_write(BatchIO* io, int fd, const char* buf, size_t length, uint64_t offset, uint64_t user);
+static inline void batch_io_close(BatchIO* io, int fd, uint64_t user);
+
+//
+// Waits for the next completion. Only call with operations in flight.
+static inline void batch_io_wait(BatchIO* io, BatchCompletion* completion);
+
+//
+// Whether io_uring is being used, for diagnostics.
+static inline _Bool batch_io_is_async(const BatchIO* io);
+
+//
+// Syscall fallback.
+//
+static inline
+void
+batch_io_complete_(BatchIO* io, uint64_t user, long long result){
+    assert(io->done_count < BATCH_IO_MAX_DEPTH);
+    unsigned index = (io->done_head + io->done_count++) % BATCH_IO_MAX_DEPTH;
+    io->done[index] = (BatchCompletion){user, result};
+}
+
+static inline
+long long
+batch_io_result_(long long result){
+    return result < 0? -(long long)errno : result;
+}
+
+static inline
+void
+batch_io_sync_op_(BatchIO* io, int op, int fd, const char*_Nullable path, uint64_t user){
+    long long result = 0;
+    switch(op){
+        case 0: // open for reading
+            result = batch_io_result_(open(path, O_RDONLY|BATCH_O_BINARY));
+            break;
+        case 1: // open for writing
+            result = batch_io_result_(open(path, O_WRONLY|O_CREAT|O_TRUNC|BATCH_O_BINARY, 0666));
+            break;
+        case 2:
+            result = batch_io_result_(close(fd));
+            break;
+    }
+    batch_io_complete_(io, user, result);
+}
+
+#ifdef HAVE_IO_URING
+//
+// io_uring without liburing: the raw syscalls and the shared rings.
+//
+static inline
+int
+uring_setup_(Uring* u, unsigned entries){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if(fd < 0) return 1;
+    memset(u, 0, sizeof *u);
+    u->fd = fd;
+    u->sq_entries = p.sq_entries;
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    _Bool single = !!(p.features & IORING_FEAT_SINGLE_MMAP);
+    if(single && u->cq_ring_size > u->sq_ring_size)
+        u->sq_ring_size = u->cq_ring_size;
+    void* sq = mmap(NULL, u->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED) goto fail;
+    u->sq_ring = sq;
+    void* cq = sq;
+    if(!single){
+        cq = mmap(NULL, u->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(cq == MAP_FAILED) goto fail;
+        u->cq_ring = cq;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) goto fail;
+    u->sqes = sqes;
+    char* s = sq;
+    u->sq_head  = (unsigned*)(s + p.sq_off.head);
+    u->sq_tail  = (unsigned*)(s + p.sq_off.tail);
+    u->sq_mask  = (unsigned*)(s + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(s + p.sq_off.array);
+    char* c = cq;
+    u->cq_head  = (unsigned*)(c + p.cq_off.head);
+    u->cq_tail  = (unsigned*)(c + p.cq_off.tail);
+    u->cq_mask  = (unsigned*)(c + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe*)(c + p.cq_off.cqes);
+    return 0;
+
+    fail:
+    if(u->sq_ring) munmap(u->sq_ring, u->sq_ring_size);
+    if(u->cq_ring) munmap(u->cq_ring, u->cq_ring_size);
+    close(fd);
+    return 1;
+}
+
+static inline
+void
+uring_destroy_(Uring* u){
+    munmap(u->sqes, u->sqes_size);
+    if(u->cq_ring) munmap(u->cq_ring, u->cq_ring_size);
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+}
+
+//
+// Whether the kernel knows all of the operations we use (openat and close
+// need 5.6).
+static inline
+_Bool
+uring_supports_ops_(Uring* u){
+    enum {NOPS = 64};
+    struct {
+        struct io_uring_probe probe;
+        struct io_uring_probe_op ops[NOPS];
+    } p;
+    memset(&p, 0, sizeof p);
+    if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, &p, NOPS) < 0)
+        return 0;
+    const int needed[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_WRITE, IORING_OP_CLOSE};
+    for(size_t i = 0; i < sizeof needed / sizeof needed[0]; i++){
+        int op = needed[i];
+        if(op > p.probe.last_op || !(p.ops[op].flags & IO_URING_OP_SUPPORTED))
+            return 0;
+    }
+    return 1;
+}
+
+static inline
+int
+uring_enter_(Uring* u, unsigned min_complete){
+    for(;;){
+        long r = syscall(__NR_io_uring_enter, u->fd, u->unsubmitted, min_complete, min_complete? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(r >= 0){
+            u->unsubmitted -= (unsigned)r;
+            return 0;
+        }
+        if(errno != EINTR)
+            return 1;
+    }
+}
+
+static inline
+struct io_uring_sqe*
+uring_get_sqe_(Uring* u){
+    unsigned tail = *u->sq_tail;
+    if(tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries)
+        uring_enter_(u, 0);
+    struct io_uring_sqe* sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+static inline
+void
+uring_queue_(Uring* u, struct io_uring_sqe* sqe){
+    unsigned tail = *u->sq_tail;
+    unsigned index = (unsigned)(sqe - u->sqes);
+    u->sq_array[tail & *u->sq_mask] = index;
+    __atomic_store_n(u->sq_tail, tail+1, __ATOMIC_RELEASE);
+    u->unsubmitted++;
+}
+#endif
+
+static inline
+void
+batch_io_init(BatchIO* io, unsigned depth, char*_Nullable buffers, size_t size, unsigned count){
+    memset(io, 0, sizeof *io);
+    io->buffers = buffers;
+    io->buffer_size = size;
+    io->buffer_count = count;
+#ifdef HAVE_IO_URING
+    if(uring_setup_(&io->uring, depth))
+        return;
+    if(!uring_supports_ops_(&io->uring)){
+        uring_destroy_(&io->uring);
+        return;
+    }
+    io->uring_ok = 1;
+    if(buffers && count){
+        struct iovec iovs[BATCH_IO_MAX_DEPTH];
+        if(count > BATCH_IO_MAX_DEPTH) count = BATCH_IO_MAX_DEPTH;
+        for(unsigned i = 0; i < count; i++)
+            iovs[i] = (struct iovec){buffers + i*size, size};
+        // Can fail from memlock limits on older kernels; reads just won't
+        // be fixed then.
+        io->registered = syscall(__NR_io_uring_register, io->uring.fd, IORING_REGISTER_BUFFERS, iovs, count) == 0;
+        io->buffer_count = count;
+    }
+#else
+    (void)depth;
+#endif
+}
+
+static inline
+void
+batch_io_destroy(BatchIO* io){
+#ifdef HAVE_IO_URING
+    if(io->uring_ok)
+        uring_destroy_(&io->uring);
+#else
+    (void)io;
+#endif
+}
+
+static inline
+_Bool
+batch_io_is_async(const BatchIO* io){
+#ifdef HAVE_IO_URING
+    return io->uring_ok;
+#else
+    (void)io;
+    return 0;
+#endif
+}
+
+static inline
+void
+batch_io_open(BatchIO* io, const char* path, _Bool create, uint64_t user){
+#ifdef HAVE_IO_URING
+    if(io->uring_ok){
+        struct io_uring_sqe* sqe = uring_get_sqe_(&io->uring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)path;
+        sqe->open_flags = create? O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC : O_RDONLY|O_CLOEXEC;
+        sqe->len = create? 0666 : 0;
+        sqe->user_data = user;
+        uring_queue_(&io->uring, sqe);
+        return;
+    }
+#endif
+    batch_io_sync_op_(io, create? 1 : 0, -1, path, user);
+}
+
+static inline
+void
+batch_io_read(BatchIO* io, int fd, char* buf, size_t length, uint64_t offset, uint64_t user){
+#ifdef HAVE_IO_URING
+    if(io->uring_ok){
+        struct io_uring_sqe* sqe = uring_get_sqe_(&io->uring);
+        sqe->opcode = IORING_OP_READ;
+        if(io->registered && buf >= io->buffers && buf < io->buffers + io->buffer_size*io->buffer_count){
+            size_t index = (size_t)(buf - io->buffers) / io->buffer_size;
+            // A fixed read must be entirely within its buffer.
+            if(buf + length <= io->buffers + (index+1)*io->buffer_size){
+                sqe->opcode = IORING_OP_READ_FIXED;
+                sqe->buf_index = (uint16_t)index;
+            }
+        }
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = length > 0x7ffff000? 0x7ffff000 : (unsigned)length;
+        sqe->off = offset;
+        sqe->user_data = user;
+        uring_queue_(&io->uring, sqe);
+        return;
+    }
+#endif
+    (void)offset;
+    batch_io_complete_(io, user, batch_io_result_(read(fd, buf, length)));
+}
+
+static inline
+void
+batch_io_write(BatchIO* io, int fd, const char* buf, size_t length, uint64_t offset, uint64_t user){
+#ifdef HAVE_IO_URING
+    if(io->uring_ok){
+        struct io_uring_sqe* sqe = uring_get_sqe_(&io->uring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = length > 0x7ffff000? 0x7ffff000 : (unsigned)length;
+        sqe->off = offset;
+        sqe->user_data = user;
+        uring_queue_(&io->uring, sqe);
+        return;
+    }
+#endif
+    (void)offset;
+    batch_io_complete_(io, user, batch_io_result_(write(fd, buf, length)));
+}
+
+static inline
+void
+batch_io_close(BatchIO* io, int fd, uint64_t user){
+#ifdef HAVE_IO_URING
+    if(io->uring_ok){
+        struct io_uring_sqe* sqe = uring_get_sqe_(&io->uring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fd;
+        sqe->user_data = user;
+        uring_queue_(&io->uring, sqe);
+        return;
+    }
+#endif
+    batch_io_sync_op_(io, 2, fd, NULL, user);
+}
+
+static inline
+void
+batch_io_wait(BatchIO* io, BatchCompletion* completion){
+#ifdef HAVE_IO_URING
+    if(io->uring_ok){
+        Uring* u = &io->uring;
+        for(;;){
+            unsigned head = *u->cq_head;
+            if(head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)){
+                struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+                *completion = (BatchCompletion){cqe->user_data, cqe->res};
+                __atomic_store_n(u->cq_head, head+1, __ATOMIC_RELEASE);
+                return;
+            }
+            // Submits everything queued so far in the same syscall.
+            if(uring_enter_(u, 1)){
+                // Nothing sensible to do if the ring itself is broken.
+                perror("io_uring_enter");
+                abort();
+            }
+        }
+    }
+#endif
+    assert(io->done_count);
+    *completion = io->done[io->done_head];
+    io->done_head = (io->done_head + 1) % BATCH_IO_MAX_DEPTH;
+    io->done_count--;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
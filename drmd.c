@@ -6,22 +6,27 @@
 #include "stringview.h"
 #include "Allocators/arena_allocator.h"
 #include "Allocators/mallocator.h"
+#include "Allocators/nullacator.h"
 #include "MStringBuilder.h"
 
-// simd includes
-#ifndef NO_SIMD
-#ifdef __x86_64__
-#include <immintrin.h>
-#endif
-
-#ifdef __ARM_NEON
-#include <arm_neon.h>
-#endif
-
-#ifdef __wasm_simd128__
-#include <wasm_simd128.h>
-#endif
+#include "simd_util.h"
+#include "atomic_util.h"
 
+//
+// Compile-time feature selection. Define DRMD_FEATURES to some combination of
+// these to leave the other constructs out of the parser and renderer
+// entirely. Their syntax is then treated as plain text.
+//
+#define DRMD_FEATURE_TABLES      0x01 // |a|b rows
+#define DRMD_FEATURE_FENCES      0x02 // ``` and ~~~ code blocks
+#define DRMD_FEATURE_QUOTES      0x04 // > quotes
+#define DRMD_FEATURE_INLINE_TAGS 0x08 // <b>, <code>, <br>, etc. pass through
+#define DRMD_FEATURE_TYPOGRAPHY  0x10 // -- and --- become dashes
+#define DRMD_FEATURE_LINKS       0x20 // [text](target)
+#define DRMD_FEATURE_ALL         0x3f
+
+#ifndef DRMD_FEATURES
+#define DRMD_FEATURES DRMD_FEATURE_ALL
 #endif
 
 #ifdef __clang__
@@ -61,10 +66,13 @@
 
 #if defined(__GNUC__) || defined(__clang__)
 #define warn_unused __attribute__((warn_unused_result))
+#define maybe_unused __attribute__((__unused__))
 #elif defined(_MSC_VER)
 #define warn_unused
+#define maybe_unused
 #else
 #define warn_unused
+#define maybe_unused
 #endif
 
 #ifndef arrlen
@@ -76,7 +84,14 @@
     case '6': case '7': case '8': case '9'
 #endif
 
-enum { ERROR_OOM = 1, };
+enum {
+    ERROR_OOM = 1,
+    // Lists nested deeper than the parser or renderer can handle.
+    ERROR_TOO_DEEP = 2,
+};
+
+// Deepest node nesting the renderer (and other tree walks) will recurse into.
+enum {MAX_NODE_DEPTH=20};
 
 static inline
 StringView
@@ -148,6 +163,14 @@ enum NodeType{
 
 typedef enum NodeType NodeType;
 
+// The public node types are the same (see drmd.h), other than INVALID.
+#define DRMD_NODE_INVALID 0
+#define X(a, b) _Static_assert(NODE_##a == (int)DRMD_NODE_##a, "");
+NODETYPES(X)
+#undef X
+#undef DRMD_NODE_INVALID
+_Static_assert(NODE_H+1 == (int)DRMD_NODE_TYPE_COUNT, "");
+
 typedef struct Node Node;
 struct Node{
     // The type of the node
@@ -157,7 +180,8 @@ struct Node{
     // has no parent.
     // NodeHandle parent;            // 4 bytes
     // The header text for a node.
-    // For NODE_STRING, this is instead the contents of that node
+    // For NODE_STRING, this is instead the contents of that node and for
+    // NODE_PRE the line with the opening fence.
     StringView header;            // 16 bytes
     // Handles to child nodes.
     union {
@@ -200,6 +224,8 @@ struct ParseLocation {
     const char*_Null_unspecified line_start;
     const char*_Null_unspecified line_end;
     int nspaces;
+    // 1-based line number of the line at cursor.
+    int lineno;
 };
 
 
@@ -214,16 +240,82 @@ advance_row(ParseLocation* loc){
         loc->cursor = loc->line_end;
     else
         loc->cursor = loc->line_end+1;
-    // ctx->lineno++;
+    loc->lineno++;
+}
+
+//
+// Counts the whitespace at the start of the rest of a line, as analyze_line
+// does for the whole line.
+static inline
+int
+count_indentation(const char* p, const char* end){
+    int n = 0;
+    for(;p != end && (*p == ' ' || *p == '\r' || *p == '\t');p++)
+        n++;
+    return n;
 }
 
-typedef struct DrMdContext DrMdContext;
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#define MARRAY_T DrMdDiagnostic
+#include "Marray.h"
+
+typedef struct HeadingAnchor HeadingAnchor;
+struct HeadingAnchor {
+    NodeHandle handle;
+    int level;
+    // The heading's text with surrounding whitespace stripped.
+    StringView text;
+    // Unique within the document; safe to write in an attribute as is.
+    StringView id;
+};
+
+#define MARRAY_T HeadingAnchor
+#include "Marray.h"
+
+//
+// Changes the targets of inline links as they are rendered, for the cli's
+// modes that render several documents linking to each other.
+typedef struct LinkRewrite LinkRewrite;
+struct LinkRewrite {
+    // Sets *out to the target to write instead of `target` (or to `target`
+    // to keep it), which must stay valid until the next call. Returns
+    // non-zero on error.
+    int (*func)(void* userdata, StringView target, StringView* out);
+    void* userdata;
+};
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
 struct DrMdContext {
     // The actual storage for all the nodes.
     Marray(Node) nodes;
 
     // General purpose allocator.
     ArenaAllocator main_arena;
+
+    // Whether the parser should record diagnostics (see drmd_check).
+    _Bool check;
+    // Allocated from main_arena.
+    Marray(DrMdDiagnostic) diagnostics;
+
+    // Allocated from main_arena. If any, headings are rendered with an id
+    // attribute. Sorted by handle (see collect_headings).
+    Marray(HeadingAnchor) anchors;
+
+    // Set by drmd_context_set_render_hooks, owned by the caller.
+    const DrMdRenderHooks*_Nullable hooks;
+
+    // Set by the cli's modes, owned by them.
+    const LinkRewrite*_Nullable link_rewrite;
+
+    // Output buffer kept between calls to drmd_context_to_html.
+    char*_Nullable output;
+    size_t output_capacity;
 };
 
 force_inline
@@ -232,6 +324,15 @@ main_allocator(DrMdContext* ctx){
     return allocator_from_arena(&ctx->main_arena);
 }
 
+static
+void
+add_diagnostic(DrMdContext* ctx, int lineno, StringView message){
+    // If we can't allocate we just lose the diagnostic, which is not worth
+    // failing the parse over.
+    int err = Marray_push(DrMdDiagnostic)(&ctx->diagnostics, main_allocator(ctx), (DrMdDiagnostic){.lineno=lineno, .message=message});
+    (void)err;
+}
+
 force_inline
 NodeHandle
 alloc_handle_(DrMdContext* ctx, NodeType type){
@@ -297,25 +398,62 @@ append_string(DrMdContext* ctx, NodeHandle parent, StringView sv){
 
 static
 int
-parse_md_node(DrMdContext* ctx, ParseLocation* loc, NodeHandle parent_handle);
+parse_md_node(DrMdContext* ctx, ParseLocation* loc, NodeHandle root);
 
 static
 int
 render_to_html(DrMdContext* ctx, NodeHandle root, MStringBuilder* msb);
 
 
-DRMD_API
+static
 int
-drmd_to_html(StringView input, StringView* output){
-    DrMdContext ctx = {0};
+render_to_term(DrMdContext* ctx, NodeHandle root, int width, MStringBuilder* msb);
+
+static
+int
+render_to_json(DrMdContext* ctx, NodeHandle root, const char* base, MStringBuilder* msb);
+
+static
+int
+render_to_md(DrMdContext* ctx, NodeHandle root, MStringBuilder* msb);
+
+static
+int
+extract_tables(DrMdContext* ctx, NodeHandle root, DrMdTableFormat format, DrMdOutputFunc* func, void*_Nullable userdata);
+
+static
+int
+find_links(DrMdContext* ctx, NodeHandle handle, const char* base, DrMdLinkFunc* func, void*_Nullable userdata, int node_depth);
+
+static
+int
+gather_stats(DrMdContext* ctx, NodeHandle handle, DrMdStats* stats, MStringBuilder* scratch, int node_depth);
+
+// Only the cli's book and batch modes give headings ids.
+static maybe_unused
+int
+collect_headings(DrMdContext* ctx, NodeHandle root, StringView id_prefix);
+
+static
+int
+parse_input(DrMdContext* ctx, StringView input, NodeHandle* root){
     ParseLocation loc = {
         .cursor = input.text,
         .end = input.text + input.length,
+        .lineno = 1,
     };
-    NodeHandle root = alloc_handle_(&ctx, NODE_MD);
-    if(NodeHandle_eq(root, INVALID_NODE_HANDLE))
+    *root = alloc_handle_(ctx, NODE_MD);
+    if(NodeHandle_eq(*root, INVALID_NODE_HANDLE))
         return ERROR_OOM;
-    int err = parse_md_node(&ctx, &loc, root);
+    return parse_md_node(ctx, &loc, *root);
+}
+
+DRMD_API
+int
+drmd_to_html(StringView input, StringView* output){
+    DrMdContext ctx = {0};
+    NodeHandle root;
+    int err = parse_input(&ctx, input, &root);
     if(err) goto cleanup;
     MStringBuilder msb = {.allocator = MALLOCATOR};
     err = render_to_html(&ctx, root, &msb);
@@ -335,9 +473,288 @@ drmd_to_html(StringView input, StringView* output){
     return err;
 }
 
+DRMD_API
+int
+drmd_to_term(StringView input, int width, StringView* output){
+    DrMdContext ctx = {0};
+    NodeHandle root;
+    int err = parse_input(&ctx, input, &root);
+    if(err) goto cleanup;
+    MStringBuilder msb = {.allocator = MALLOCATOR};
+    err = render_to_term(&ctx, root, width, &msb);
+    if(!err && msb.cursor)
+        *output = msb_detach_sv(&msb);
+    else {
+        msb_destroy(&msb);
+        *output = (StringView){0};
+    }
+    cleanup:
+    ArenaAllocator_free_all(&ctx.main_arena);
+    return err;
+}
+
+DRMD_API
+int
+drmd_to_json(StringView input, StringView* output){
+    DrMdContext ctx = {0};
+    NodeHandle root;
+    int err = parse_input(&ctx, input, &root);
+    if(err) goto cleanup;
+    MStringBuilder msb = {.allocator = MALLOCATOR};
+    err = render_to_json(&ctx, root, input.text, &msb);
+    if(!err)
+        *output = msb_detach_sv(&msb);
+    else
+        msb_destroy(&msb);
+    cleanup:
+    ArenaAllocator_free_all(&ctx.main_arena);
+    return err;
+}
+
+DRMD_API
+int
+drmd_to_md(StringView input, StringView* output){
+    DrMdContext ctx = {0};
+    NodeHandle root;
+    int err = parse_input(&ctx, input, &root);
+    if(err) goto cleanup;
+    MStringBuilder msb = {.allocator = MALLOCATOR};
+    err = render_to_md(&ctx, root, &msb);
+    if(!err && msb.cursor)
+        *output = msb_detach_sv(&msb);
+    else {
+        msb_destroy(&msb);
+        *output = (StringView){0};
+    }
+    cleanup:
+    ArenaAllocator_free_all(&ctx.main_arena);
+    return err;
+}
+
+DRMD_API
+DrMdContext*_Nullable
+drmd_context_create(void){
+    return Allocator_zalloc(MALLOCATOR, sizeof(DrMdContext));
+}
+
+DRMD_API
+void
+drmd_context_destroy(DrMdContext* ctx){
+    ArenaAllocator_free_all(&ctx->main_arena);
+    Allocator_free(MALLOCATOR, ctx->output, ctx->output_capacity);
+    Allocator_free(MALLOCATOR, ctx, sizeof *ctx);
+}
+
+//
+// Parses the input with everything from the previous document in the
+// context thrown away.
+static
+int
+context_parse(DrMdContext* ctx, StringView input, NodeHandle* root){
+    // Everything from the previous document lived in the arena.
+    ArenaAllocator_reset(&ctx->main_arena);
+    ctx->nodes = (Marray(Node)){0};
+    ctx->diagnostics = (Marray(DrMdDiagnostic)){0};
+    ctx->anchors = (Marray(HeadingAnchor)){0};
+    return parse_input(ctx, input, root);
+}
+
+//
+// Like context_parse, then renders the html into msb.
+static
+int
+context_render_html(DrMdContext* ctx, StringView input, MStringBuilder* msb){
+    NodeHandle root;
+    int err = context_parse(ctx, input, &root);
+    if(err) return err;
+    err = render_to_html(ctx, root, msb);
+    if(!err && msb->errored)
+        err = ERROR_OOM;
+    return err;
+}
+
+DRMD_API maybe_unused
+void
+drmd_context_set_render_hooks(DrMdContext* ctx, const DrMdRenderHooks*_Nullable hooks){
+    ctx->hooks = hooks;
+}
+
+DRMD_API maybe_unused
+int
+drmd_context_to_html(DrMdContext* ctx, StringView input, StringView* output){
+    MStringBuilder msb = {
+        .data = ctx->output,
+        .capacity = ctx->output_capacity,
+        .allocator = MALLOCATOR,
+    };
+    int err = context_render_html(ctx, input, &msb);
+    ctx->output = msb.data;
+    ctx->output_capacity = msb.capacity;
+    if(err) return err;
+    *output = (StringView){msb.cursor, msb.data};
+    return 0;
+}
+
+struct DrMdDocument {
+    DrMdContext ctx;
+    NodeHandle root;
+    // The copy of the input, in the arena.
+    StringView text;
+    size_t refcount;
+    // Doesn't change once parsed.
+    size_t size;
+};
+
+DRMD_API
+int
+drmd_parse(StringView input, DrMdDocument*_Nullable* document){
+    DrMdDocument* doc = Allocator_zalloc(MALLOCATOR, sizeof *doc);
+    if(!doc) return ERROR_OOM;
+    // The nodes point into the text.
+    char* text = Allocator_alloc(main_allocator(&doc->ctx), input.length+1);
+    int err = ERROR_OOM;
+    if(text){
+        if(input.length)
+            memcpy(text, input.text, input.length);
+        text[input.length] = '\0';
+        doc->text = (StringView){input.length, text};
+        err = parse_input(&doc->ctx, doc->text, &doc->root);
+    }
+    if(err){
+        ArenaAllocator_free_all(&doc->ctx.main_arena);
+        Allocator_free(MALLOCATOR, doc, sizeof *doc);
+        return err;
+    }
+    ArenaAllocatorStats stats = ArenaAllocator_stats(&doc->ctx.main_arena);
+    doc->size = sizeof *doc + stats.capacity + stats.big_used;
+    doc->refcount = 1;
+    *document = doc;
+    return 0;
+}
+
+DRMD_API
+DrMdDocument*
+drmd_document_retain(DrMdDocument* document){
+    atomic_add_size(&document->refcount, 1);
+    return document;
+}
+
+DRMD_API
+void
+drmd_document_release(DrMdDocument* document){
+    if(atomic_sub_size(&document->refcount, 1))
+        return;
+    ArenaAllocator_free_all(&document->ctx.main_arena);
+    Allocator_free(MALLOCATOR, document, sizeof *document);
+}
+
+DRMD_API
+size_t
+drmd_document_size(const DrMdDocument* document){
+    return document->size;
+}
+
+// The renderers only read the context.
+DRMD_API maybe_unused
+int
+drmd_document_to_html(DrMdDocument* document, StringView* output){
+    DrMdContext* ctx = &document->ctx;
+    MStringBuilder msb = {.allocator = MALLOCATOR};
+    int err = render_to_html(ctx, document->root, &msb);
+    if(!err && msb.errored)
+        err = ERROR_OOM;
+    if(err){
+        msb_destroy(&msb);
+        return err;
+    }
+    if(!msb.cursor){
+        msb_destroy(&msb);
+        *output = (StringView){0};
+    }
+    else
+        *output = msb_detach_sv(&msb);
+    return 0;
+}
+
+DRMD_API maybe_unused
+int
+drmd_document_to_json(DrMdDocument* document, StringView* output){
+    DrMdContext* ctx = &document->ctx;
+    MStringBuilder msb = {.allocator = MALLOCATOR};
+    int err = render_to_json(ctx, document->root, document->text.text, &msb);
+    if(err){
+        msb_destroy(&msb);
+        return err;
+    }
+    *output = msb_detach_sv(&msb);
+    return 0;
+}
+
+DRMD_API
+int
+drmd_links(StringView input, DrMdLinkFunc* func, void*_Nullable userdata){
+    DrMdContext ctx = {0};
+    NodeHandle root;
+    int err = parse_input(&ctx, input, &root);
+    if(!err)
+        err = find_links(&ctx, root, input.text, func, userdata, 0);
+    ArenaAllocator_free_all(&ctx.main_arena);
+    return err;
+}
+
+DRMD_API
+int
+drmd_tables(StringView input, DrMdTableFormat format, DrMdOutputFunc* func, void*_Nullable userdata){
+    DrMdContext ctx = {0};
+    NodeHandle root;
+    int err = parse_input(&ctx, input, &root);
+    if(!err)
+        err = extract_tables(&ctx, root, format, func, userdata);
+    ArenaAllocator_free_all(&ctx.main_arena);
+    return err;
+}
+
+DRMD_API
+int
+drmd_check(StringView input, DrMdDiagnosticFunc* func, void*_Nullable userdata, size_t* error_count){
+    DrMdContext ctx = {.check = 1};
+    NodeHandle root;
+    int err = parse_input(&ctx, input, &root);
+    // Lists nested too deeply stop the parse, but have been reported as a
+    // diagnostic.
+    if(err == ERROR_TOO_DEEP)
+        err = 0;
+    *error_count = ctx.diagnostics.count;
+    if(!err){
+        MARRAY_FOR_EACH(DrMdDiagnostic, d, ctx.diagnostics){
+            err = func(userdata, d);
+            if(err) break;
+        }
+    }
+    ArenaAllocator_free_all(&ctx.main_arena);
+    return err;
+}
+
+DRMD_API
+int
+drmd_stats(StringView input, DrMdStats* stats){
+    DrMdContext ctx = {0};
+    *stats = (DrMdStats){0};
+    NodeHandle root;
+    int err = parse_input(&ctx, input, &root);
+    MStringBuilder scratch = {.allocator = MALLOCATOR};
+    if(!err)
+        err = gather_stats(&ctx, root, stats, &scratch, 0);
+    if(!err && scratch.errored)
+        err = ERROR_OOM;
+    msb_destroy(&scratch);
+    ArenaAllocator_free_all(&ctx.main_arena);
+    return err;
+}
+
 static
 int
-parse_md_node(DrMdContext* ctx, ParseLocation* loc, NodeHandle parent_handle){
+parse_md_node(DrMdContext* ctx, ParseLocation* loc, NodeHandle root){
     enum MDSTATE {
         NONE = 0,
         PARA = 1,
@@ -345,36 +762,106 @@ parse_md_node(DrMdContext* ctx, ParseLocation* loc, NodeHandle parent_handle){
         LIST = 3,
         TABLE = 4,
         QUOTE = 5,
+        FENCE = 6,
+        HEADING = 7,
     };
-    enum MDSTATE state = NONE;
-    struct StackItem {
-        NodeHandle list;
-        NodeHandle item;
+    enum {MAX_QUOTE_DEPTH = 8, MAX_LIST_DEPTH = 16};
+    // The open containers, outermost first: the document, the quotes inside
+    // of it, then the levels of the list in the innermost of those. Each line
+    // is matched against them once from its start: a '>' for each quote,
+    // then its indentation against the list levels.
+    struct Container {
+        // The md or quote node, or the list.
+        NodeHandle node;
+        // For the document and quotes, the paragraph, table or code block
+        // lines are being added to. For lists, the current item.
+        NodeHandle child;
+        // For the document and quotes, the indentation of the first line,
+        // which starts a paragraph instead of continuing a list item. For
+        // lists, the indentation of the items.
         int indentation;
+        // For the document and quotes, what the previous line was part of.
+        // For lists, BULLET or LIST.
         enum MDSTATE state;
-    } stack[16];
-    int si = -1; // stack index
-    NodeHandle container_handle = INVALID_NODE_HANDLE;
-    int normal_indent = -1;
+        // The code block's fence character and the line it started on.
+        char fence;
+        int fence_lineno;
+#if DRMD_FEATURES & DRMD_FEATURE_TABLES
+        size_t header_cells;
+#endif
+    } stack[1+MAX_QUOTE_DEPTH+MAX_LIST_DEPTH];
+    // Index of the innermost document or quote.
+    int qi = 0;
+    // List level index, past qi. -1 if no list is open.
+    int si = -1;
+    stack[0] = (struct Container){.node = root, .child = INVALID_NODE_HANDLE, .indentation = -1};
     for(;loc->cursor != loc->end;){
         analyze_line(loc);
+        const char* line_start = loc->line_start;
+        const char* line_end = loc->line_end;
+        int nspaces = loc->nspaces;
+        int matched = 0;
+#if DRMD_FEATURES & DRMD_FEATURE_QUOTES
+        // Strip the markers of the open quotes.
+        for(;matched < qi;matched++){
+            const char* marker = line_start + nspaces;
+            if(marker == line_end || *marker != '>')
+                break;
+            line_start = marker+1;
+            if(line_start != line_end && *line_start == ' ')
+                line_start++;
+            nspaces = count_indentation(line_start, line_end);
+        }
+#endif
+        struct Container* c = &stack[qi];
+#if DRMD_FEATURES & DRMD_FEATURE_FENCES
+        // Code takes the rest of the line as is.
+        if(c->state == FENCE && matched == qi){
+            const char* firstchar = line_start + nspaces;
+            if(line_end - firstchar >= 3 && firstchar[1] == c->fence && firstchar[2] == c->fence)
+                c->state = NONE;
+            else {
+                NodeHandle string = append_string(ctx, c->child, (StringView){line_end-line_start, line_start});
+                if(NodeHandle_eq(string, INVALID_NODE_HANDLE))
+                    return ERROR_OOM;
+            }
+            advance_row(loc);
+            continue;
+        }
+#endif
         // skip_blanks
-        if(loc->line_start+loc->nspaces == loc->line_end){
-            state = NONE;
+        if(line_start+nspaces == line_end){
+            // Ends the quotes without a marker and any list.
+            for(;qi > matched;qi--){
+                if(unlikely(ctx->check) && stack[qi].state == FENCE)
+                    add_diagnostic(ctx, stack[qi].fence_lineno, SV("code fence is not closed before the end of its quote"));
+            }
+            c = &stack[qi];
+            // Keep the blank lines between a quote's lines of text.
+            if(qi && c->state == PARA){
+                NodeHandle string = append_string(ctx, c->node, (StringView){0, line_end});
+                if(NodeHandle_eq(string, INVALID_NODE_HANDLE))
+                    return ERROR_OOM;
+            }
+            else
+                c->state = NONE;
             si = -1;
             advance_row(loc);
             continue;
         }
-        if(normal_indent < 0){
-            normal_indent = loc->nspaces;
-        }
-        enum MDSTATE newstate = NONE;
-        const char* firstchar = loc->line_start + loc->nspaces;
-        int prefix_length = 0;
+        enum MDSTATE newstate;
+        const char* firstchar;
+        int prefix_length;
+#if DRMD_FEATURES & DRMD_FEATURE_QUOTES
+        classify:
+#endif
+        newstate = NONE;
+        firstchar = line_start + nspaces;
+        prefix_length = 0;
         switch(*firstchar){
             // "•"
             case '\xe2':
-                if(firstchar+3 < loc->end && firstchar[1] == '\x80' && firstchar[2] == '\xa2' && firstchar[3] == ' '){
+                if(firstchar+3 < line_end && firstchar[1] == '\x80' && firstchar[2] == '\xa2' && firstchar[3] == ' '){
                     prefix_length = 4;
                     newstate = BULLET;
                 }
@@ -385,34 +872,21 @@ parse_md_node(DrMdContext* ctx, ParseLocation* loc, NodeHandle parent_handle){
             case '-':
             case '*':
             case 'o':
-                if(firstchar+1 != loc->end && firstchar[1] == ' '){
+                if(firstchar+1 != line_end && firstchar[1] == ' '){
                     prefix_length = 1;
                     newstate = BULLET;
                 }
                 else
                     newstate = PARA;
                 goto after;
-            case '#':{
-                int h = 1;
-                firstchar++;
-                for(;firstchar != loc->end && *firstchar=='#';firstchar++)
-                    h++;
-                NodeHandle heading = append_node(ctx, parent_handle, NODE_H);
-                if(NodeHandle_eq(heading, INVALID_NODE_HANDLE))
-                    return ERROR_OOM;
-                Node* n = get_node(ctx, heading);
-                n->heading_level = h;
-                n->header = (StringView){loc->line_end-firstchar, firstchar};
-                advance_row(loc);
-                state = NONE;
-                si = -1;
-                continue;
-            }
+            case '#':
+                newstate = HEADING;
+                goto after;
             case CASE_0_9:{
                 prefix_length = 1;
                 newstate = PARA;
-                for(const char* c = firstchar+1;c != loc->end;c++){
-                    switch(*c){
+                for(const char* ch = firstchar+1;ch != line_end;ch++){
+                    switch(*ch){
                         case CASE_0_9:
                             prefix_length++;
                             continue;
@@ -425,114 +899,162 @@ parse_md_node(DrMdContext* ctx, ParseLocation* loc, NodeHandle parent_handle){
                     }
                 }
             }break;
-            case '~':{
-                if(loc->line_end - firstchar >= 3){
-                    if(firstchar[1] == '~' && firstchar[2] == '~'){
-                        NodeHandle pre = append_node(ctx, parent_handle, NODE_PRE);
-                        if(NodeHandle_eq(pre, INVALID_NODE_HANDLE))
-                            return ERROR_OOM;
-                        advance_row(loc);
-                        for(;loc->cursor != loc->end;){
-                            analyze_line(loc);
-                            firstchar = loc->line_start + loc->nspaces;
-                            if(loc->line_end - firstchar >= 3){
-                                if(firstchar[1] == '~' && firstchar[2] == '~'){
-                                    advance_row(loc);
-                                    state = NONE;
-                                    si = -1;
-                                    break;
-                                }
-                            }
-                            NodeHandle string = append_string(ctx, pre, (StringView){ loc->line_end-loc->line_start, loc->line_start});
-                            if(NodeHandle_eq(string, INVALID_NODE_HANDLE))
-                                return ERROR_OOM;
-                            advance_row(loc);
-                        }
-                        continue;
-                    }
-                }
-                goto lDefault;
-            }
-            case '`':{
-                if(loc->line_end - firstchar >= 3){
-                    if(firstchar[1] == '`' && firstchar[2] == '`'){
-                        NodeHandle pre = append_node(ctx, parent_handle, NODE_PRE);
-                        if(NodeHandle_eq(pre, INVALID_NODE_HANDLE))
-                            return ERROR_OOM;
-                        advance_row(loc);
-                        for(;loc->cursor != loc->end;){
-                            analyze_line(loc);
-                            firstchar = loc->line_start + loc->nspaces;
-                            if(loc->line_end - firstchar >= 3){
-                                if(firstchar[1] == '`' && firstchar[2] == '`'){
-                                    advance_row(loc);
-                                    state = NONE;
-                                    si = -1;
-                                    break;
-                                }
-                            }
-                            NodeHandle string = append_string(ctx, pre, (StringView){ loc->line_end-loc->line_start, loc->line_start});
-                            if(NodeHandle_eq(string, INVALID_NODE_HANDLE))
-                                return ERROR_OOM;
-                            advance_row(loc);
-                        }
-                        continue;
-                    }
+#if DRMD_FEATURES & DRMD_FEATURE_FENCES
+            case '~':
+            case '`':
+                if(line_end - firstchar >= 3 && firstchar[1] == *firstchar && firstchar[2] == *firstchar){
+                    newstate = FENCE;
+                    goto after;
                 }
                 goto lDefault;
-            }
+#endif
             default:
+#if DRMD_FEATURES & DRMD_FEATURE_FENCES
                 lDefault:;
+#endif
                 newstate = PARA;
                 goto after;
+#if DRMD_FEATURES & DRMD_FEATURE_TABLES
             case '|':
                 newstate = TABLE;
                 goto after;
+#endif
+#if DRMD_FEATURES & DRMD_FEATURE_QUOTES
             case '>':
-                newstate = QUOTE;
+                // Past the deepest quote, the markers are text.
+                if(qi == MAX_QUOTE_DEPTH){
+                    if(unlikely(ctx->check))
+                        add_diagnostic(ctx, loc->lineno, SV("quote is nested more than 8 levels deep"));
+                    newstate = PARA;
+                }
+                else
+                    newstate = QUOTE;
                 goto after;
+#endif
 
         }
         after:;
         assert(newstate != NONE);
-        if(newstate == BULLET || newstate == LIST){
-            if(si == -1){
-                si = 0;
-                struct StackItem* s = &stack[si];
-                s->list = append_node(ctx, parent_handle, newstate==BULLET?NODE_BULLETS:NODE_LIST);
-                if(unlikely(NodeHandle_eq(s->list, INVALID_NODE_HANDLE)))
-                    return ERROR_OOM;
-                s->item = INVALID_NODE_HANDLE;
-                s->indentation = loc->nspaces;
-                s->state = newstate;
+        if(matched < qi){
+            // Text without the markers lazily continues the innermost quote,
+            // anything else ends the quotes it doesn't have markers for.
+            if(newstate != PARA || c->state == FENCE){
+                for(;qi > matched;qi--){
+                    if(unlikely(ctx->check) && stack[qi].state == FENCE)
+                        add_diagnostic(ctx, stack[qi].fence_lineno, SV("code fence is not closed before the end of its quote"));
+                }
+                c = &stack[qi];
+                si = -1;
+            }
+        }
+        if(c->indentation < 0){
+            c->indentation = nspaces;
+        }
+        NodeHandle parent_handle = c->node;
+        struct Container* lists = c+1;
+        if(newstate == HEADING){
+            int h = 1;
+            firstchar++;
+            for(;firstchar != line_end && *firstchar=='#';firstchar++)
+                h++;
+            NodeHandle heading = append_node(ctx, parent_handle, NODE_H);
+            if(NodeHandle_eq(heading, INVALID_NODE_HANDLE))
+                return ERROR_OOM;
+            Node* n = get_node(ctx, heading);
+            n->heading_level = h;
+            n->header = (StringView){line_end-firstchar, firstchar};
+            advance_row(loc);
+            c->state = NONE;
+            si = -1;
+            continue;
+        }
+#if DRMD_FEATURES & DRMD_FEATURE_FENCES
+        if(newstate == FENCE){
+            c->child = append_node(ctx, parent_handle, NODE_PRE);
+            if(NodeHandle_eq(c->child, INVALID_NODE_HANDLE))
+                return ERROR_OOM;
+            // The opening fence, with its info string, for the markdown
+            // renderer.
+            get_node(ctx, c->child)->header = stripped_view(firstchar, line_end - firstchar);
+            c->fence = *firstchar;
+            c->fence_lineno = loc->lineno;
+            advance_row(loc);
+            c->state = FENCE;
+            si = -1;
+            continue;
+        }
+#endif
+#if DRMD_FEATURES & DRMD_FEATURE_QUOTES
+        if(newstate == QUOTE){
+            NodeHandle quote = append_node(ctx, parent_handle, NODE_QUOTE);
+            if(NodeHandle_eq(quote, INVALID_NODE_HANDLE))
+                return ERROR_OOM;
+            c->state = QUOTE;
+            si = -1;
+            c = &stack[++qi];
+            *c = (struct Container){.node = quote, .child = INVALID_NODE_HANDLE, .indentation = -1};
+            matched = qi;
+            line_start = firstchar+1;
+            if(line_start != line_end && *line_start == ' ')
+                line_start++;
+            nspaces = count_indentation(line_start, line_end);
+            // The rest of the line is the quote's first line.
+            if(line_start+nspaces != line_end)
+                goto classify;
+            // A blank first line is kept, like the blank lines after text.
+            NodeHandle string = append_string(ctx, quote, (StringView){0, line_end});
+            if(NodeHandle_eq(string, INVALID_NODE_HANDLE))
+                return ERROR_OOM;
+            c->child = quote;
+            c->state = PARA;
+            advance_row(loc);
+            continue;
+        }
+#endif
+        if(newstate == BULLET || newstate == LIST){
+            if(si == -1){
+                si = 0;
+                struct Container* s = &lists[si];
+                s->node = append_node(ctx, parent_handle, newstate==BULLET?NODE_BULLETS:NODE_LIST);
+                if(unlikely(NodeHandle_eq(s->node, INVALID_NODE_HANDLE)))
+                    return ERROR_OOM;
+                s->child = INVALID_NODE_HANDLE;
+                s->indentation = nspaces;
+                s->state = newstate;
             }
             else {
                 // new level of list
-                if(loc->nspaces > stack[si].indentation){
+                if(nspaces > lists[si].indentation){
                     si++;
-                    if(si == arrlen(stack)){
-                        return ERROR_OOM;
+                    // The text of a list item is at depth 3+qi+2*si: md, the
+                    // quotes, then a list and list item per level.
+                    if(unlikely(ctx->check) && 3+qi+2*si > MAX_NODE_DEPTH && 1+qi+2*si <= MAX_NODE_DEPTH)
+                        add_diagnostic(ctx, loc->lineno, SV("list is nested too deeply to render"));
+                    if(si == MAX_LIST_DEPTH){
+                        if(unlikely(ctx->check))
+                            add_diagnostic(ctx, loc->lineno, SV("list is nested more than 16 levels deep"));
+                        return ERROR_TOO_DEEP;
                     }
-                    struct StackItem* s = &stack[si];
+                    struct Container* s = &lists[si];
                     assert(si > 0);
-                    s->list = append_node(ctx, stack[si-1].item, newstate==BULLET?NODE_BULLETS:NODE_LIST);
-                    if(unlikely(NodeHandle_eq(s->list, INVALID_NODE_HANDLE)))
+                    s->node = append_node(ctx, lists[si-1].child, newstate==BULLET?NODE_BULLETS:NODE_LIST);
+                    if(unlikely(NodeHandle_eq(s->node, INVALID_NODE_HANDLE)))
                         return ERROR_OOM;
-                    s->item = INVALID_NODE_HANDLE;
-                    s->indentation = loc->nspaces;
+                    s->child = INVALID_NODE_HANDLE;
+                    s->indentation = nspaces;
                     s->state = newstate;
                 }
                 // neighbors
-                else if(loc->nspaces == stack[si].indentation){
-                    struct StackItem* s = &stack[si];
+                else if(nspaces == lists[si].indentation){
+                    struct Container* s = &lists[si];
                     if(s->state != newstate){
                         // neighbor of different type
-                        NodeHandle prev = si>0? stack[si-1].item : parent_handle;
-                        s->list = append_node(ctx, prev, newstate==BULLET?NODE_BULLETS:NODE_LIST);
-                        if(unlikely(NodeHandle_eq(s->list, INVALID_NODE_HANDLE)))
+                        NodeHandle prev = si>0? lists[si-1].child : parent_handle;
+                        s->node = append_node(ctx, prev, newstate==BULLET?NODE_BULLETS:NODE_LIST);
+                        if(unlikely(NodeHandle_eq(s->node, INVALID_NODE_HANDLE)))
                             return ERROR_OOM;
-                        s->item = INVALID_NODE_HANDLE;
-                        s->indentation = loc->nspaces;
+                        s->child = INVALID_NODE_HANDLE;
+                        s->indentation = nspaces;
                         s->state = newstate;
                     }
                     else {
@@ -545,72 +1067,73 @@ parse_md_node(DrMdContext* ctx, ParseLocation* loc, NodeHandle parent_handle){
                         si--;
                         if(si < 0){
                             si = 0;
-                            struct StackItem* s = &stack[si];
-                            s->list = append_node(ctx, parent_handle, newstate==BULLET?NODE_BULLETS:NODE_LIST);
-                            if(unlikely(NodeHandle_eq(s->list, INVALID_NODE_HANDLE)))
+                            struct Container* s = &lists[si];
+                            s->node = append_node(ctx, parent_handle, newstate==BULLET?NODE_BULLETS:NODE_LIST);
+                            if(unlikely(NodeHandle_eq(s->node, INVALID_NODE_HANDLE)))
                                 return ERROR_OOM;
-                            s->item = INVALID_NODE_HANDLE;
-                            s->indentation = loc->nspaces;
+                            s->child = INVALID_NODE_HANDLE;
+                            s->indentation = nspaces;
                             s->state = newstate;
                             goto after_go_up;
                         }
                         assert(si >= 0);
-                        int indent = stack[si].indentation;
-                        if(indent > loc->nspaces)
+                        int indent = lists[si].indentation;
+                        if(indent > nspaces)
                             continue;
-                        if(indent == loc->nspaces)
+                        if(indent == nspaces)
                             break;
-                        if(indent < loc->nspaces){
+                        if(indent < nspaces){
                             si = 0;
-                            struct StackItem* s = &stack[si];
-                            s->list = append_node(ctx, parent_handle, newstate==BULLET?NODE_BULLETS:NODE_LIST);
-                            if(unlikely(NodeHandle_eq(s->list, INVALID_NODE_HANDLE)))
+                            struct Container* s = &lists[si];
+                            s->node = append_node(ctx, parent_handle, newstate==BULLET?NODE_BULLETS:NODE_LIST);
+                            if(unlikely(NodeHandle_eq(s->node, INVALID_NODE_HANDLE)))
                                 return ERROR_OOM;
-                            s->item = INVALID_NODE_HANDLE;
-                            s->indentation = loc->nspaces;
+                            s->child = INVALID_NODE_HANDLE;
+                            s->indentation = nspaces;
                             s->state = newstate;
                             goto after_go_up;
                         }
                     }
-                    struct StackItem* s = &stack[si];
+                    struct Container* s = &lists[si];
                     if(s->state != newstate){
-                        s->list = append_node(ctx, si?stack[si-1].item:parent_handle, newstate==BULLET?NODE_BULLETS:NODE_LIST);
-                        if(unlikely(NodeHandle_eq(s->list, INVALID_NODE_HANDLE)))
+                        s->node = append_node(ctx, si?lists[si-1].child:parent_handle, newstate==BULLET?NODE_BULLETS:NODE_LIST);
+                        if(unlikely(NodeHandle_eq(s->node, INVALID_NODE_HANDLE)))
                             return ERROR_OOM;
-                        s->item = INVALID_NODE_HANDLE;
-                        s->indentation = loc->nspaces;
+                        s->child = INVALID_NODE_HANDLE;
+                        s->indentation = nspaces;
                         s->state = newstate;
                     }
                 }
             }
             after_go_up:;
-            struct StackItem* s = &stack[si];
-            s->item = append_node(ctx, s->list, NODE_LIST_ITEM);
-            if(unlikely(NodeHandle_eq(s->item, INVALID_NODE_HANDLE)))
+            struct Container* s = &lists[si];
+            s->child = append_node(ctx, s->node, NODE_LIST_ITEM);
+            if(unlikely(NodeHandle_eq(s->child, INVALID_NODE_HANDLE)))
                 return ERROR_OOM;
-            StringView content = stripped_view(loc->line_start + loc->nspaces+prefix_length, (loc->line_end - loc->line_start)-loc->nspaces-prefix_length);
-            NodeHandle new_node_handle = append_string(ctx, s->item, content);
+            StringView content = stripped_view(line_start + nspaces+prefix_length, (line_end - line_start)-nspaces-prefix_length);
+            NodeHandle new_node_handle = append_string(ctx, s->child, content);
             if(unlikely(NodeHandle_eq(new_node_handle, INVALID_NODE_HANDLE)))
                 return ERROR_OOM;
             advance_row(loc);
-            state = newstate;
+            c->state = newstate;
             continue;
         }
+#if DRMD_FEATURES & DRMD_FEATURE_TABLES
         if(newstate == TABLE){
-            if(state != TABLE){
-                container_handle = append_node(ctx, parent_handle, NODE_TABLE);
-                if(unlikely(NodeHandle_eq(container_handle, INVALID_NODE_HANDLE)))
+            if(c->state != TABLE){
+                c->child = append_node(ctx, parent_handle, NODE_TABLE);
+                if(unlikely(NodeHandle_eq(c->child, INVALID_NODE_HANDLE)))
                     return ERROR_OOM;
             }
-            NodeHandle table_row_handle = append_node(ctx, container_handle, NODE_TABLE_ROW);
+            NodeHandle table_row_handle = append_node(ctx, c->child, NODE_TABLE_ROW);
             if(unlikely(NodeHandle_eq(table_row_handle, INVALID_NODE_HANDLE)))
                 return ERROR_OOM;
             int n_tds = 0;
             const char* p = firstchar+1;
             for(;;n_tds++){
-                const char* pi = memchr(p, '|', loc->line_end - p);
+                const char* pi = memchr(p, '|', line_end - p);
                 if(!pi){
-                    ptrdiff_t diff = loc->line_end - p;
+                    ptrdiff_t diff = line_end - p;
                     // elide the final empty cell, unless we don't have any cells.
                     if(!diff && n_tds != 0)
                         break;
@@ -625,56 +1148,47 @@ parse_md_node(DrMdContext* ctx, ParseLocation* loc, NodeHandle parent_handle){
                     return ERROR_OOM;
                 p = pi+1;
             }
-            advance_row(loc);
-            state = newstate;
-            si = -1;
-            continue;
-        }
-        if(newstate == QUOTE){
-            if(state != QUOTE){
-                container_handle = append_node(ctx, parent_handle, NODE_QUOTE);
-                if(NodeHandle_eq(container_handle, INVALID_NODE_HANDLE))
-                    return ERROR_OOM;
-                si = -1;
+            if(unlikely(ctx->check)){
+                size_t n_cells = node_children_count(get_node(ctx, table_row_handle));
+                if(c->state != TABLE)
+                    c->header_cells = n_cells;
+                else if(n_cells != c->header_cells)
+                    add_diagnostic(ctx, loc->lineno, SV("table row has a different number of cells than the header"));
             }
-            NodeHandle string = append_string(ctx, container_handle, stripped_view(loc->line_start+1, loc->line_end-loc->line_start-1));
-            if(NodeHandle_eq(string, INVALID_NODE_HANDLE))
-                return ERROR_OOM;
             advance_row(loc);
-            state = newstate;
+            c->state = newstate;
+            si = -1;
             continue;
         }
+#endif
         assert(newstate == PARA);
-        if(state == QUOTE){
-            StringView content = stripped_view( loc->line_start + loc->nspaces, (loc->line_end - loc->line_start)-loc->nspaces);
-            NodeHandle new_node_handle = append_string(ctx, container_handle, content);
-            if(unlikely(NodeHandle_eq(new_node_handle, INVALID_NODE_HANDLE)))
-                return ERROR_OOM;
-            advance_row(loc);
-            continue;
-        }
-        if(state == PARA || state == NONE || loc->nspaces == normal_indent || state == TABLE){
-            if(state != PARA){
-                container_handle = append_node(ctx, parent_handle, NODE_PARA);
-                if(unlikely(NodeHandle_eq(container_handle, INVALID_NODE_HANDLE)))
+        if(c->state == PARA || c->state == NONE || nspaces == c->indentation || c->state == TABLE || c->state == QUOTE){
+            if(c->state != PARA){
+                // A quote's text goes straight in the quote.
+                c->child = qi? parent_handle : append_node(ctx, parent_handle, NODE_PARA);
+                if(unlikely(NodeHandle_eq(c->child, INVALID_NODE_HANDLE)))
                     return ERROR_OOM;
             }
-            StringView content = stripped_view( loc->line_start + loc->nspaces, (loc->line_end - loc->line_start)-loc->nspaces);
-            NodeHandle new_node_handle = append_string(ctx, container_handle, content);
+            StringView content = stripped_view(line_start + nspaces, (line_end - line_start)-nspaces);
+            NodeHandle new_node_handle = append_string(ctx, c->child, content);
             if(unlikely(NodeHandle_eq(new_node_handle, INVALID_NODE_HANDLE)))
                 return ERROR_OOM;
             advance_row(loc);
             si = -1;
-            state = newstate;
+            c->state = newstate;
             continue;
         }
-        StringView content = stripped_view(loc->line_start + loc->nspaces, (loc->line_end - loc->line_start)-loc->nspaces);
-        NodeHandle new_node_handle = append_string(ctx, stack[si].item, content);
+        StringView content = stripped_view(line_start + nspaces, (line_end - line_start)-nspaces);
+        NodeHandle new_node_handle = append_string(ctx, lists[si].child, content);
         if(unlikely(NodeHandle_eq(new_node_handle, INVALID_NODE_HANDLE)))
             return ERROR_OOM;
         advance_row(loc);
         continue;
     }
+#if DRMD_FEATURES & DRMD_FEATURE_FENCES
+    if(unlikely(ctx->check) && stack[qi].state == FENCE)
+        add_diagnostic(ctx, stack[qi].fence_lineno, SV("unterminated code fence, the rest of the file is code"));
+#endif
     return 0;
 }
 
@@ -687,6 +1201,18 @@ parse_md_node(DrMdContext* ctx, ParseLocation* loc, NodeHandle parent_handle){
 #define RENDERFUNCNAME(nt) render_##nt
 #define RENDERFUNC(nt) static warn_unused int RENDERFUNCNAME(nt)(DrMdContext* ctx, MStringBuilder* sb, NodeHandle handle, int unused_param node_depth)
 
+// Nodes of disabled features are never created, so leave out their renderers.
+#if !(DRMD_FEATURES & DRMD_FEATURE_TABLES)
+#define render_TABLE render_INVALID
+#define render_TABLE_ROW render_INVALID
+#endif
+#if !(DRMD_FEATURES & DRMD_FEATURE_FENCES)
+#define render_PRE render_INVALID
+#endif
+#if !(DRMD_FEATURES & DRMD_FEATURE_QUOTES)
+#define render_QUOTE render_INVALID
+#endif
+
 #define X(a, b) RENDERFUNC(a);
 NODETYPES(X)
 #undef X
@@ -704,8 +1230,7 @@ force_inline
 warn_unused
 int
 render_node(DrMdContext* ctx, MStringBuilder* restrict sb, NodeHandle handle, int node_depth){
-    enum {MAX_NODE_DEPTH=20};
-    if(node_depth > MAX_NODE_DEPTH) return 1;
+    if(node_depth > MAX_NODE_DEPTH) return ERROR_TOO_DEEP;
     Node* node = get_node(ctx, handle);
     return RENDERFUNCS[node->type](ctx, sb, handle, node_depth+1);
 }
@@ -721,16 +1246,313 @@ render_to_html(DrMdContext* ctx, NodeHandle root, MStringBuilder* msb){
     return e;
 }
 
+enum EscapeFlags {
+    // Recognize [text](target) inline links and emit them as anchors.
+    ESCAPE_LINKS = 0x1,
+    // The text isn't markdown: only escape the html special characters, with
+    // no inline tags, entities or typography.
+    ESCAPE_PLAIN = 0x2,
+    // Also escape quotes, for attribute values. Only with ESCAPE_PLAIN.
+    ESCAPE_QUOTES = 0x4,
+};
+
 static inline
 int
-write_link_escaped_str(MStringBuilder* sb, const char* text, size_t length);
+write_link_escaped_str(MStringBuilder* sb, const char* text, size_t length, unsigned flags);
+
+static inline
+int
+write_md_text(DrMdContext* ctx, MStringBuilder* sb, const char* text, size_t length);
+
+//
+// Headings are allocated as they are parsed, so the anchors collected in
+// document order are also sorted by handle.
+static
+const HeadingAnchor*_Nullable
+find_anchor(DrMdContext* ctx, NodeHandle handle){
+    size_t lo = 0, hi = ctx->anchors.count;
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        const HeadingAnchor* a = &ctx->anchors.data[mid];
+        if(a->handle.index == handle.index) return a;
+        if(a->handle.index < handle.index) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+//
+// Render hooks (see drmd_context_set_render_hooks). Renderers write their
+// tags with write_open_tag and write_close_tag, which only look further
+// than ctx->hooks if there are any.
+//
+struct DrMdHtmlWriter {
+    MStringBuilder msb;
+};
+
+static
+warn_unused
+int
+call_render_hook(DrMdContext* ctx, MStringBuilder* sb, NodeHandle handle, DrMdRenderHook* hook){
+    Node* node = get_node(ctx, handle);
+    DrMdRenderNode info = {.type = (DrMdNodeType)node->type};
+    switch(node->type){
+        case NODE_STRING:
+            info.text = node->header;
+            break;
+        case NODE_H:{
+            info.level = node->heading_level;
+            info.text = node->header;
+            const HeadingAnchor* anchor = ctx->anchors.count? find_anchor(ctx, handle) : NULL;
+            if(anchor) info.id = anchor->id;
+        }break;
+        case NODE_PRE:{
+            // The header is the opening fence line, skip the fence.
+            StringView fence = node->header;
+            size_t i = 0;
+            while(i < fence.length && fence.text[i] == fence.text[0])
+                i++;
+            info.text = stripped_view(fence.text+i, fence.length-i);
+        }break;
+        default:
+            break;
+    }
+    return hook(ctx->hooks->userdata, &info, (DrMdHtmlWriter*)sb);
+}
+
+//
+// Writes the node's start tag, or calls the open hook for its type instead.
+force_inline
+warn_unused
+int
+write_open_tag(DrMdContext* ctx, MStringBuilder* sb, NodeHandle handle, NodeType type, StringView tag){
+    if(likely(!ctx->hooks) || !ctx->hooks->open[type]){
+        msb_write_str(sb, tag.text, tag.length);
+        return 0;
+    }
+    return call_render_hook(ctx, sb, handle, ctx->hooks->open[type]);
+}
+
+//
+// Writes the node's end tag (empty if it is left out), or calls the close
+// hook for its type instead.
+force_inline
+warn_unused
+int
+write_close_tag(DrMdContext* ctx, MStringBuilder* sb, NodeHandle handle, NodeType type, StringView tag){
+    if(likely(!ctx->hooks) || !ctx->hooks->close[type]){
+        msb_write_str(sb, tag.text, tag.length);
+        return 0;
+    }
+    return call_render_hook(ctx, sb, handle, ctx->hooks->close[type]);
+}
+
+DRMD_API maybe_unused
+void
+drmd_write_html(DrMdHtmlWriter* writer, StringView html){
+    msb_write_str(&writer->msb, html.text, html.length);
+}
+
+DRMD_API maybe_unused
+void
+drmd_write_escaped_html(DrMdHtmlWriter* writer, StringView text, DrMdEscapeMode mode){
+    unsigned flags = mode == DRMD_ESCAPE_ATTRIBUTE? ESCAPE_PLAIN|ESCAPE_QUOTES : ESCAPE_PLAIN;
+    // Can only fail by running out of memory, which the builder remembers.
+    int e = write_link_escaped_str(&writer->msb, text.text, text.length, flags);
+    (void)e;
+}
+
+//
+// Containers are rendered by the same helpers whether recursively, by
+// render_container, or a step at a time, by the render cursor below.
+//
+typedef struct RenderFrame RenderFrame;
+struct RenderFrame {
+    NodeHandle handle;
+    int node_depth;
+    // Index of the next child to render.
+    size_t next_child;
+};
+
+force_inline
+_Bool
+html_is_container(NodeType type){
+    switch(type){
+        case NODE_MD:
+        case NODE_PARA:
+        case NODE_BULLETS:
+        case NODE_LIST:
+        case NODE_LIST_ITEM:
+        #if DRMD_FEATURES & DRMD_FEATURE_TABLES
+        case NODE_TABLE:
+        #endif
+        #if DRMD_FEATURES & DRMD_FEATURE_QUOTES
+        case NODE_QUOTE:
+        #endif
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+//
+// Writes what comes before the children of a container. Tables render their
+// head row here and skip past it.
+static
+warn_unused
+int
+html_open_container(DrMdContext* ctx, MStringBuilder* sb, RenderFrame* frame){
+    NodeHandle handle = frame->handle;
+    Node* node = get_node(ctx, handle);
+    int e = 0;
+    switch(node->type){
+        case NODE_MD:
+            return write_open_tag(ctx, sb, handle, NODE_MD, SV(""));
+        case NODE_PARA:
+            return write_open_tag(ctx, sb, handle, NODE_PARA, SV("<p>"));
+        case NODE_BULLETS:
+            e = write_open_tag(ctx, sb, handle, NODE_BULLETS, SV("<ul>"));
+            msb_write_char(sb, '\n');
+            return e;
+        case NODE_LIST:
+            e = write_open_tag(ctx, sb, handle, NODE_LIST, SV("<ol>"));
+            msb_write_char(sb, '\n');
+            return e;
+        case NODE_LIST_ITEM:
+            return write_open_tag(ctx, sb, handle, NODE_LIST_ITEM, SV("<li>"));
+        #if DRMD_FEATURES & DRMD_FEATURE_QUOTES
+        case NODE_QUOTE:
+            e = write_open_tag(ctx, sb, handle, NODE_QUOTE, SV("<blockquote>"));
+            msb_write_char(sb, '\n');
+            return e;
+        #endif
+        #if DRMD_FEATURES & DRMD_FEATURE_TABLES
+        case NODE_TABLE:{
+            e = write_open_tag(ctx, sb, handle, NODE_TABLE, SV("<table>"));
+            if(e) return e;
+            msb_write_literal(sb, "\n<thead>\n");
+            if(node_children_count(node)){
+                NodeHandle head = node_children(node)[0];
+                Node* child = get_node(ctx, head);
+                assert(child->type == NODE_TABLE_ROW);
+                // inline rendering table row here so we can do heads
+                e = write_open_tag(ctx, sb, head, NODE_TABLE_ROW, SV("<tr>"));
+                if(e) return e;
+                msb_write_char(sb, '\n');
+                NODE_CHILDREN_FOR_EACH(it, child){
+                    msb_write_literal(sb, "<th>");
+                    e = render_node(ctx, sb, *it, frame->node_depth+1);
+                    if(e) return e;
+                    // closing </th> is not needed
+                    // msb_write_literal(sb, "</th>\n");
+                }
+                // closing </tr> is not needed
+                // msb_write_literal(sb, "</tr>\n");
+                e = write_close_tag(ctx, sb, head, NODE_TABLE_ROW, SV(""));
+                if(e) return e;
+                frame->next_child = 1;
+            }
+            // <tbody> is not required
+            msb_write_literal(sb, "\n<tbody>\n");
+            return 0;
+        }
+        #endif
+        default:
+            return 0;
+    }
+}
+
+//
+// Writes what goes between two children of a container, given the type of
+// the first.
+force_inline
+void
+html_separate_children(MStringBuilder* sb, NodeType type, NodeType unused_param prev){
+    switch(type){
+        case NODE_PARA:
+            msb_write_char(sb, '\n');
+            break;
+        #if DRMD_FEATURES & DRMD_FEATURE_QUOTES
+        case NODE_QUOTE:
+            // Lines of text are separated by newlines, other blocks end
+            // with one.
+            if(prev == NODE_STRING)
+                msb_write_char(sb, '\n');
+            break;
+        #endif
+        case NODE_LIST_ITEM:
+            msb_write_char(sb, ' ');
+            break;
+        default:
+            break;
+    }
+}
+
+//
+// Writes what comes after the children of a container.
+static
+warn_unused
+int
+html_close_container(DrMdContext* ctx, MStringBuilder* sb, NodeHandle handle, NodeType type){
+    int e = 0;
+    switch(type){
+        // closing </p> and </li> are not needed
+        case NODE_MD:
+        case NODE_PARA:
+        case NODE_LIST_ITEM:
+            return write_close_tag(ctx, sb, handle, type, SV(""));
+        case NODE_BULLETS:
+            e = write_close_tag(ctx, sb, handle, NODE_BULLETS, SV("</ul>"));
+            break;
+        case NODE_LIST:
+            e = write_close_tag(ctx, sb, handle, NODE_LIST, SV("</ol>"));
+            break;
+        #if DRMD_FEATURES & DRMD_FEATURE_QUOTES
+        case NODE_QUOTE:
+            e = write_close_tag(ctx, sb, handle, NODE_QUOTE, SV("</blockquote>"));
+            break;
+        #endif
+        #if DRMD_FEATURES & DRMD_FEATURE_TABLES
+        case NODE_TABLE:
+            e = write_close_tag(ctx, sb, handle, NODE_TABLE, SV("</table>"));
+            break;
+        #endif
+        default:
+            return 0;
+    }
+    if(e) return e;
+    msb_write_char(sb, '\n');
+    return 0;
+}
+
+static
+warn_unused
+int
+render_container(DrMdContext* ctx, MStringBuilder* sb, NodeHandle handle, int node_depth){
+    // node_depth is already one deeper than the container's.
+    RenderFrame frame = {.handle = handle, .node_depth = node_depth-1};
+    int e = html_open_container(ctx, sb, &frame);
+    if(e) return e;
+    Node* node = get_node(ctx, handle);
+    size_t count = node_children_count(node);
+    NodeHandle* children = node_children(node);
+    for(size_t i = frame.next_child; i < count; i++){
+        if(i != 0)
+            html_separate_children(sb, node->type, get_node(ctx, children[i-1])->type);
+        e = render_node(ctx, sb, children[i], node_depth);
+        if(e) return e;
+    }
+    return html_close_container(ctx, sb, handle, node->type);
+}
 
 RENDERFUNC(STRING){
     Node* node = get_node(ctx, handle);
-    int e = write_link_escaped_str(sb, node->header.text, node->header.length);
+    int e = write_open_tag(ctx, sb, handle, NODE_STRING, SV(""));
+    if(e) return e;
+    e = write_md_text(ctx, sb, node->header.text, node->header.length);
     if(e) return e;
     // msb_write_char(sb, '\n');
-    return 0;
+    return write_close_tag(ctx, sb, handle, NODE_STRING, SV(""));
 }
 RENDERFUNC(INVALID){
     (void)ctx;
@@ -739,98 +1561,32 @@ RENDERFUNC(INVALID){
     return -1;
 }
 RENDERFUNC(PARA){
-    Node* node = get_node(ctx, handle);
-    msb_write_literal(sb, "<p>");
-    _Bool first = 1;
-    NODE_CHILDREN_FOR_EACH(it, node){
-        if(!first) msb_write_char(sb, '\n');
-        first = 0;
-        int e = render_node(ctx, sb, *it, node_depth);
-        if(e) return e;
-    }
-    // closing </p> is not needed
-    // msb_write_literal(sb, "</p>\n");
-    return 0;
+    return render_container(ctx, sb, handle, node_depth);
 }
 RENDERFUNC(BULLETS){
-    Node* node = get_node(ctx, handle);
-    msb_write_literal(sb, "<ul>\n");
-    NODE_CHILDREN_FOR_EACH(it, node){
-        int e = render_node(ctx, sb, *it, node_depth);
-        if(e) return e;
-    }
-    msb_write_literal(sb, "</ul>\n");
-    return 0;
+    return render_container(ctx, sb, handle, node_depth);
 }
 RENDERFUNC(LIST){
-    Node* node = get_node(ctx, handle);
-    msb_write_literal(sb, "<ol>\n");
-    NODE_CHILDREN_FOR_EACH(it, node){
-        int e = render_node(ctx, sb, *it, node_depth);
-        if(e) return e;
-    }
-    msb_write_literal(sb, "</ol>\n");
-    return 0;
+    return render_container(ctx, sb, handle, node_depth);
 }
 RENDERFUNC(LIST_ITEM){
-    Node* node = get_node(ctx, handle);
-    msb_write_literal(sb, "<li>");
-    size_t count = node_children_count(node);
-    NodeHandle* children = node_children(node);
-    for(size_t i = 0; i < count; i++){
-        if(i != 0)
-            msb_write_char(sb, ' ');
-        int e = render_node(ctx, sb, children[i], node_depth);
-        if(e) return e;
-    }
-    // closing </li> is not needed
-    // msb_write_literal(sb, "</li>\n");
-    return 0;
+    return render_container(ctx, sb, handle, node_depth);
 }
 RENDERFUNC(MD){
-    Node* node = get_node(ctx, handle);
-    NODE_CHILDREN_FOR_EACH(it, node){
-        int e = render_node(ctx, sb, *it, node_depth);
-        if(e) return e;
-    }
-    return 0;
+    return render_container(ctx, sb, handle, node_depth);
 }
 
+#if DRMD_FEATURES & DRMD_FEATURE_TABLES
 RENDERFUNC(TABLE){
-    Node* node = get_node(ctx, handle);
-    msb_write_literal(sb, "<table>\n<thead>\n");
-    size_t count = node_children_count(node);
-    NodeHandle* children = node_children(node);
-    if(count){
-        Node* child = get_node(ctx, children[0]);
-        assert(child->type == NODE_TABLE_ROW);
-        // inline rendering table row here so we can do heads
-        msb_write_literal(sb, "<tr>\n");
-        NODE_CHILDREN_FOR_EACH(it, child){
-            msb_write_literal(sb, "<th>");
-            int e = render_node(ctx, sb, *it, node_depth);
-            if(e) return e;
-            // closing </th> is not needed
-            // msb_write_literal(sb, "</th>\n");
-        }
-        // closing </tr> is not needed
-        // msb_write_literal(sb, "</tr>\n");
-    }
-    msb_write_literal(sb, "\n<tbody>\n");
-    // <tbody> is not required
-    for(size_t i = 1; i < count; i++){
-        int e = render_node(ctx, sb, children[i], node_depth);
-        if(e) return e;
-    }
-    msb_write_literal(sb, "</table>\n");
-    return 0;
+    return render_container(ctx, sb, handle, node_depth);
 }
 RENDERFUNC(TABLE_ROW){
     Node* node = get_node(ctx, handle);
-    msb_write_literal(sb, "<tr>");
+    int e = write_open_tag(ctx, sb, handle, NODE_TABLE_ROW, SV("<tr>"));
+    if(e) return e;
     NODE_CHILDREN_FOR_EACH(it, node){
         msb_write_literal(sb, "<td>");
-        int e = render_node(ctx, sb, *it, node_depth);
+        e = render_node(ctx, sb, *it, node_depth);
         if(e) return e;
         // closing </td> is not needed
         // msb_write_literal(sb, "</td>");
@@ -838,189 +1594,731 @@ RENDERFUNC(TABLE_ROW){
     // msb_write_char(sb, '\n');
     // closing </tr> is not needed
     // msb_write_literal(sb, "</tr>\n");
-    return 0;
+    return write_close_tag(ctx, sb, handle, NODE_TABLE_ROW, SV(""));
 }
+#endif
+#if DRMD_FEATURES & DRMD_FEATURE_QUOTES
 RENDERFUNC(QUOTE){
-    Node* node = get_node(ctx, handle);
-    msb_write_literal(sb, "<blockquote>\n");
-    _Bool first = 1;
-    NODE_CHILDREN_FOR_EACH(it, node){
-        if(!first) msb_write_char(sb, '\n');
-        first = 0;
-        int e = render_node(ctx, sb, *it, node_depth);
-        if(e) return e;
-    }
-    msb_write_literal(sb, "</blockquote>\n");
-    return 0;
+    return render_container(ctx, sb, handle, node_depth);
 }
+#endif
+#if DRMD_FEATURES & DRMD_FEATURE_FENCES
 RENDERFUNC(PRE){
     Node* node = get_node(ctx, handle);
-    msb_write_literal(sb, "<pre>");
+    int e = write_open_tag(ctx, sb, handle, NODE_PRE, SV("<pre>"));
+    if(e) return e;
     NODE_CHILDREN_FOR_EACH(it, node){
-        int e = render_node(ctx, sb, *it, node_depth);
+        // Code is not scanned for links, so `a[i](x)` stays as written.
+        Node* child = get_node(ctx, *it);
+        e = write_link_escaped_str(sb, child->header.text, child->header.length, 0);
         if(e) return e;
         msb_write_char(sb, '\n');
     }
-    msb_write_literal(sb, "</pre>\n");
+    e = write_close_tag(ctx, sb, handle, NODE_PRE, SV("</pre>"));
+    if(e) return e;
+    msb_write_char(sb, '\n');
     return 0;
 }
+#endif
 
 RENDERFUNC(H){
     Node* node = get_node(ctx, handle);
-    msb_write_literal(sb, "<h");
-    msb_write_char(sb, '0'+node->heading_level);
-    msb_write_char(sb, '>');
-    int e = write_link_escaped_str(sb, node->header.text, node->header.length);
+    int e;
+    if(unlikely(ctx->hooks) && ctx->hooks->open[NODE_H]){
+        e = call_render_hook(ctx, sb, handle, ctx->hooks->open[NODE_H]);
+        if(e) return e;
+    }
+    else {
+        msb_write_literal(sb, "<h");
+        msb_write_char(sb, '0'+node->heading_level);
+        const HeadingAnchor* anchor = ctx->anchors.count? find_anchor(ctx, handle) : NULL;
+        if(anchor){
+            msb_write_literal(sb, " id=\"");
+            msb_write_str(sb, anchor->id.text, anchor->id.length);
+            msb_write_char(sb, '"');
+        }
+        msb_write_char(sb, '>');
+    }
+    e = write_md_text(ctx, sb, node->header.text, node->header.length);
+    if(e) return e;
+    char end_tag[] = "</h0>";
+    end_tag[3] += (char)node->heading_level;
+    e = write_close_tag(ctx, sb, handle, NODE_H, (StringView){sizeof end_tag - 1, end_tag});
     if(e) return e;
-    msb_write_literal(sb, "</h");
-    msb_write_char(sb, '0'+node->heading_level);
-    msb_write_char(sb, '>');
     msb_write_char(sb, '\n');
     return 0;
 }
 
-static inline
+//
+// Resumable html rendering.
+//
+// Walks the same tree as render_node, but containers are opened and closed
+// with an explicit stack instead of recursion, so rendering can stop after
+// any node and pick up again later. Leaves (text, headings, code blocks,
+// table rows) are still rendered whole by their RENDERFUNC.
+//
+struct DrMdRenderCursor {
+    // The output buffer of the context holds rendered html not yet returned.
+    DrMdContext ctx;
+    size_t pending_length;
+    size_t pending_offset;
+    RenderFrame stack[MAX_NODE_DEPTH+1];
+    int stack_count;
+    // Sticky, so calling again after a failure fails again.
+    int error;
+};
+
+//
+// Renders the next leaf, or opens or closes the next container.
+static
+warn_unused
 int
-write_link_escaped_str_slow(MStringBuilder* sb, const char* text, size_t length){
-    for(size_t i = 0; i < length; i++){
-        char c = text[i];
-        switch(c){
-            case '-':{
-                if(i < length - 1){
-                    char peek1 = text[i+1];
-                    if(peek1 == '-'){
-                        if(i < length - 2){
-                            char peek2 = text[i+2];
-                            if(peek2 == '-'){
-                                msb_write_literal(sb, "&mdash;");
-                                i += 2;
-                                continue;
-                            }
-                        }
-                        msb_write_literal(sb, "&ndash;");
-                        i += 1;
-                        continue;
-                    }
-                }
-                msb_write_char(sb, c);
-            }break;
-            case '&':{ // allow &lt;, &gt;
-                if(length - i >= 4){
-                    if(memcmp(text+i, "&lt;", 4) == 0){
-                        msb_write_literal(sb, "&lt;");
-                        i += 3;
-                        continue;
-                    }
-                    if(memcmp(text+i, "&gt;", 4) == 0){
-                        msb_write_literal(sb, "&gt;");
-                        i += 3;
-                        continue;
+html_cursor_advance(DrMdRenderCursor* cursor, MStringBuilder* sb){
+    DrMdContext* ctx = &cursor->ctx;
+    RenderFrame* frame = &cursor->stack[cursor->stack_count-1];
+    Node* node = get_node(ctx, frame->handle);
+    size_t count = node_children_count(node);
+    if(frame->next_child == count){
+        cursor->stack_count--;
+        return html_close_container(ctx, sb, frame->handle, node->type);
+    }
+    // Tables start at 1 as their head row was rendered when opened, but
+    // nothing separates their rows anyway.
+    if(frame->next_child != 0)
+        html_separate_children(sb, node->type, get_node(ctx, node_children(node)[frame->next_child-1])->type);
+    NodeHandle child = node_children(node)[frame->next_child++];
+    int node_depth = frame->node_depth+1;
+    if(!html_is_container(get_node(ctx, child)->type))
+        return render_node(ctx, sb, child, node_depth);
+    if(node_depth > MAX_NODE_DEPTH)
+        return ERROR_TOO_DEEP;
+    RenderFrame* child_frame = &cursor->stack[cursor->stack_count++];
+    *child_frame = (RenderFrame){.handle = child, .node_depth = node_depth};
+    return html_open_container(ctx, sb, child_frame);
+}
+
+//
+// Advances until at least a few kilobytes were rendered, or the end, so the
+// per-step overhead is spread over more output.
+static
+warn_unused
+int
+html_cursor_step(DrMdRenderCursor* cursor, MStringBuilder* sb){
+    size_t start = sb->cursor;
+    do {
+        int e = html_cursor_advance(cursor, sb);
+        if(e) return e;
+        if(sb->errored) return 0;
+    }while(cursor->stack_count && sb->cursor - start < 4096);
+    return 0;
+}
+
+DRMD_API maybe_unused
+int
+drmd_render_begin(StringView input, DrMdRenderCursor*_Nullable* out){
+    *out = NULL;
+    DrMdRenderCursor* cursor = Allocator_zalloc(MALLOCATOR, sizeof *cursor);
+    if(!cursor) return ERROR_OOM;
+    NodeHandle root;
+    int err = parse_input(&cursor->ctx, input, &root);
+    if(err){
+        drmd_render_end(cursor);
+        return err;
+    }
+    // The root is always a container, so it is never empty of frames
+    // until it is done.
+    cursor->stack[0] = (RenderFrame){.handle = root};
+    cursor->stack_count = 1;
+    *out = cursor;
+    return 0;
+}
+
+DRMD_API maybe_unused
+int
+drmd_render_next(DrMdRenderCursor* cursor, char* buf, size_t cap, size_t* written){
+    *written = 0;
+    if(cursor->error)
+        return cursor->error;
+    size_t n = 0;
+    while(n < cap){
+        if(cursor->pending_offset == cursor->pending_length){
+            if(!cursor->stack_count)
+                break;
+            // Each step is rendered once, into the pending buffer, and
+            // copied out from there.
+            MStringBuilder msb = {
+                .data = cursor->ctx.output,
+                .capacity = cursor->ctx.output_capacity,
+                .allocator = MALLOCATOR,
+            };
+            int err = html_cursor_step(cursor, &msb);
+            cursor->ctx.output = msb.data;
+            cursor->ctx.output_capacity = msb.capacity;
+            if(!err && msb.errored)
+                err = ERROR_OOM;
+            if(err){
+                cursor->error = err;
+                return err;
+            }
+            cursor->pending_length = msb.cursor;
+            cursor->pending_offset = 0;
+            continue;
+        }
+        size_t avail = cursor->pending_length - cursor->pending_offset;
+        size_t to_copy = avail < cap - n? avail : cap - n;
+        memcpy(buf+n, cursor->ctx.output+cursor->pending_offset, to_copy);
+        cursor->pending_offset += to_copy;
+        n += to_copy;
+    }
+    *written = n;
+    return 0;
+}
+
+DRMD_API maybe_unused
+void
+drmd_render_end(DrMdRenderCursor* cursor){
+    ArenaAllocator_free_all(&cursor->ctx.main_arena);
+    Allocator_free(MALLOCATOR, cursor->ctx.output, cursor->ctx.output_capacity);
+    Allocator_free(MALLOCATOR, cursor, sizeof *cursor);
+}
+
+//
+// The last searches for the ']' and ')' of an inline link: where each
+// started and what it found (NULL for nothing). The first ']' after a
+// later '[' is the same one until the scan moves past it, so a run of '['
+// without a ']' doesn't search the rest of the text again for every one.
+// Zero it before scanning a text, and only scan forwards.
+typedef struct LinkScan LinkScan;
+struct LinkScan {
+    const char*_Nullable rsquare_from;
+    const char*_Nullable rsquare;
+    const char*_Nullable rparen_from;
+    const char*_Nullable rparen;
+};
+
+static inline
+const char*_Nullable
+link_scan_find(const char*_Nullable* from, const char*_Nullable* found, const char* p, const char* end, char c){
+    if(*from && p >= *from && (!*found || p <= *found))
+        return *found;
+    *from = p;
+    *found = memchr(p, c, end - p);
+    return *found;
+}
+
+//
+// Matches an inline link of the form [text](target) at the start of `text`.
+// Returns the number of bytes the link spans, or 0 if it is not a link.
+//
+// Targets can't contain whitespace and the only schemes allowed are http,
+// https and mailto, so user content can't smuggle in javascript: urls.
+static inline
+size_t
+match_inline_link(LinkScan* scan, const char* text, size_t length, StringView* link_text, StringView* target){
+    if(length < 4 || text[0] != '[')
+        return 0;
+    const char* end = text + length;
+    const char* rsquare = link_scan_find(&scan->rsquare_from, &scan->rsquare, text+1, end, ']');
+    if(!rsquare || end - rsquare < 3 || rsquare[1] != '(')
+        return 0;
+    const char* t = rsquare+2;
+    const char* rparen = link_scan_find(&scan->rparen_from, &scan->rparen, t, end, ')');
+    if(!rparen || rparen == t)
+        return 0;
+    size_t scheme_length = 0;
+    for(const char* c = t; c != rparen; c++){
+        switch(*c){
+            case ' ': case '\t': case '\r': case '\n': case '\f': case '\v':
+            case '<': case '>': case '"': case '\'':
+                return 0;
+            case ':':
+                if(!scheme_length)
+                    scheme_length = c - t;
+                break;
+            case '/': case '?': case '#':
+                // A ':' after any of these is not the scheme separator.
+                if(!scheme_length)
+                    scheme_length = (size_t)-1;
+                break;
+            default:
+                break;
+        }
+    }
+    if(scheme_length && scheme_length != (size_t)-1){
+        StringView scheme = {scheme_length, t};
+        if(!sv_iequals(scheme, SV("http"))
+        && !sv_iequals(scheme, SV("https"))
+        && !sv_iequals(scheme, SV("mailto")))
+            return 0;
+    }
+    *link_text = (StringView){rsquare - (text+1), text+1};
+    *target = (StringView){rparen - t, t};
+    return rparen+1 - text;
+}
+
+static inline
+void
+write_attr_escaped_str(MStringBuilder* sb, const char* text, size_t length){
+    // Running out of memory leaves the builder errored.
+    (void)write_link_escaped_str(sb, text, length, ESCAPE_PLAIN|ESCAPE_QUOTES);
+}
+
+static inline
+int
+write_inline_link(MStringBuilder* sb, StringView link_text, StringView target, const LinkRewrite*_Nullable rewrite){
+    StringView href = target;
+    if(rewrite){
+        int e = rewrite->func(rewrite->userdata, target, &href);
+        if(e) return e;
+    }
+    msb_write_literal(sb, "<a href=\"");
+    write_attr_escaped_str(sb, href.text, href.length);
+    msb_write_literal(sb, "\">");
+    // [](target) uses the target as the text.
+    StringView txt = link_text.length? link_text : target;
+    // Links don't nest.
+    int e = write_link_escaped_str(sb, txt.text, txt.length, 0);
+    if(e) return e;
+    msb_write_literal(sb, "</a>");
+    return 0;
+}
+
+//
+// Reports the links in the same places the renderer would produce anchors:
+// everything except code blocks.
+static
+int
+find_links(DrMdContext* ctx, NodeHandle handle, const char* base, DrMdLinkFunc* func, void*_Nullable userdata, int node_depth){
+    if(node_depth > MAX_NODE_DEPTH) return ERROR_TOO_DEEP;
+    Node* node = get_node(ctx, handle);
+    switch(node->type){
+        case NODE_PRE:
+            return 0;
+        case NODE_STRING:
+        case NODE_H:{
+            if(!(DRMD_FEATURES & DRMD_FEATURE_LINKS))
+                return 0;
+            const char* p = node->header.text;
+            const char* end = p + node->header.length;
+            LinkScan scan = {0};
+            for(;;){
+                const char* lsquare = memchr(p, '[', end - p);
+                if(!lsquare) return 0;
+                StringView link_text, target;
+                size_t n = match_inline_link(&scan, lsquare, end - lsquare, &link_text, &target);
+                if(!n){
+                    p = lsquare+1;
+                    continue;
+                }
+                int e = func(userdata, target, target.text - base);
+                if(e) return e;
+                p = lsquare + n;
+            }
+        }
+        default:
+            NODE_CHILDREN_FOR_EACH(it, node){
+                int e = find_links(ctx, *it, base, func, userdata, node_depth+1);
+                if(e) return e;
+            }
+            return 0;
+    }
+}
+
+#if DRMD_FEATURES & DRMD_FEATURE_INLINE_TAGS
+//
+// The html tags allowed inline in text. The html renderer passes them
+// through and the other renderers translate or skip them.
+enum InlineTag {
+    INLINE_B, INLINE_B_END,
+    INLINE_I, INLINE_I_END,
+    INLINE_U, INLINE_U_END,
+    INLINE_S, INLINE_S_END,
+    INLINE_CODE, INLINE_CODE_END,
+    INLINE_TT, INLINE_TT_END,
+    INLINE_BR,
+    INLINE_HR,
+    INLINE_TAG_COUNT,
+};
+
+static const StringView INLINE_TAGS[INLINE_TAG_COUNT] = {
+    [INLINE_B]        = SV("<b>"),
+    [INLINE_B_END]    = SV("</b>"),
+    [INLINE_I]        = SV("<i>"),
+    [INLINE_I_END]    = SV("</i>"),
+    [INLINE_U]        = SV("<u>"),
+    [INLINE_U_END]    = SV("</u>"),
+    [INLINE_S]        = SV("<s>"),
+    [INLINE_S_END]    = SV("</s>"),
+    [INLINE_CODE]     = SV("<code>"),
+    [INLINE_CODE_END] = SV("</code>"),
+    [INLINE_TT]       = SV("<tt>"),
+    [INLINE_TT_END]   = SV("</tt>"),
+    [INLINE_BR]       = SV("<br>"),
+    [INLINE_HR]       = SV("<hr>"),
+};
+
+//
+// Returns which of the INLINE_TAGS the text (starting with a '<') starts
+// with, or -1 for none.
+static inline
+int
+match_inline_tag(const char* text, size_t length){
+    for(int t = 0; t < INLINE_TAG_COUNT; t++){
+        StringView tag = INLINE_TAGS[t];
+        if(length >= tag.length && memcmp(text, tag.text, tag.length) == 0)
+            return t;
+    }
+    return -1;
+}
+#endif
+
+//
+// Counts the words (runs of bytes above ' ') and utf-8 characters (bytes
+// that aren't continuation bytes) in the text.
+static inline
+void
+count_words(const char* text, size_t length, size_t* words, size_t* characters);
+
+//
+// Writes the text as it is displayed: without inline tags (<br> and <hr>
+// separate words) and with only the text of links.
+static
+void
+write_displayed_text(MStringBuilder* sb, const char* text, size_t length){
+#if DRMD_FEATURES & DRMD_FEATURE_LINKS
+    LinkScan scan = {0};
+#endif
+    size_t run = 0;
+    for(size_t i = 0; i < length; i++){
+        switch(text[i]){
+#if DRMD_FEATURES & DRMD_FEATURE_INLINE_TAGS
+            case '<':{
+                int t = match_inline_tag(text+i, length-i);
+                if(t < 0) break;
+                msb_write_str(sb, text+run, i-run);
+                if(t == INLINE_BR || t == INLINE_HR)
+                    msb_write_char(sb, ' ');
+                i += INLINE_TAGS[t].length - 1;
+                run = i + 1;
+            }break;
+#endif
+#if DRMD_FEATURES & DRMD_FEATURE_LINKS
+            case '[':{
+                StringView link_text, target;
+                size_t n = match_inline_link(&scan, text+i, length-i, &link_text, &target);
+                if(!n) break;
+                msb_write_str(sb, text+run, i-run);
+                // [](target) displays the target.
+                if(link_text.length)
+                    write_displayed_text(sb, link_text.text, link_text.length);
+                else
+                    msb_write_str(sb, target.text, target.length);
+                i += n - 1;
+                run = i + 1;
+            }break;
+#endif
+            default:
+                break;
+        }
+    }
+    msb_write_str(sb, text+run, length-run);
+}
+
+static
+int
+gather_stats(DrMdContext* ctx, NodeHandle handle, DrMdStats* stats, MStringBuilder* scratch, int node_depth){
+    if(node_depth > MAX_NODE_DEPTH) return ERROR_TOO_DEEP;
+    Node* node = get_node(ctx, handle);
+    switch(node->type){
+        case NODE_INVALID:
+            return 0;
+        case NODE_PRE:
+            stats->code_blocks++;
+            stats->code_lines += node_children_count(node);
+            return 0;
+        case NODE_H:
+            stats->headings++;
+            // fall-through
+        case NODE_STRING:{
+            StringView text = node->header;
+            // Most text has no tags or links to leave out.
+            if(memchr(text.text, '<', text.length) || memchr(text.text, '[', text.length)){
+                msb_reset(scratch);
+                write_displayed_text(scratch, text.text, text.length);
+                if(scratch->errored) return ERROR_OOM;
+                text = msb_borrow_sv(scratch);
+            }
+            count_words(text.text, text.length, &stats->words, &stats->characters);
+            return 0;
+        }
+        case NODE_MD:         break;
+        case NODE_PARA:       stats->paragraphs++;    break;
+        case NODE_TABLE:      stats->tables++;        break;
+        case NODE_TABLE_ROW:  stats->table_rows++;    break;
+        case NODE_BULLETS:    stats->bullet_lists++;  break;
+        case NODE_LIST:       stats->ordered_lists++; break;
+        case NODE_LIST_ITEM:  stats->list_items++;    break;
+        case NODE_QUOTE:      stats->quotes++;        break;
+    }
+    NODE_CHILDREN_FOR_EACH(it, node){
+        int e = gather_stats(ctx, *it, stats, scratch, node_depth+1);
+        if(e) return e;
+    }
+    return 0;
+}
+
+//
+// Appends the slug of a heading's text to sb: ascii letters and digits
+// lowercased, utf-8 kept as is, anything between < and > dropped and every
+// other run of bytes turned into a single '-'.
+static
+void
+write_slug(MStringBuilder* sb, const char* text, size_t length){
+    _Bool dash = 0, wrote = 0, in_tag = 0;
+    for(size_t i = 0; i < length; i++){
+        unsigned char c = (unsigned char)text[i];
+        if(in_tag){
+            if(c == '>') in_tag = 0;
+            continue;
+        }
+        if(c == '<'){
+            in_tag = 1;
+            dash = 1;
+            continue;
+        }
+        _Bool keep = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c >= 0x80;
+        if(c >= 'A' && c <= 'Z'){
+            c |= 0x20;
+            keep = 1;
+        }
+        if(!keep){
+            dash = 1;
+            continue;
+        }
+        if(dash && wrote)
+            msb_write_char(sb, '-');
+        msb_write_char(sb, (char)c);
+        dash = 0;
+        wrote = 1;
+    }
+    if(!wrote)
+        msb_write_literal(sb, "section");
+}
+
+typedef struct HeadingIdSlot HeadingIdSlot;
+struct HeadingIdSlot {
+    StringView id;
+    // The next n to try for id-n when id repeats.
+    size_t next_suffix;
+};
+
+//
+// The ids given out so far, for keeping them unique: an open addressing hash
+// set from the main arena.
+typedef struct HeadingIds HeadingIds;
+struct HeadingIds {
+    StringView id_prefix;
+    HeadingIdSlot*_Nullable slots;
+    // Power of 2.
+    size_t capacity;
+    size_t count;
+};
+
+static inline
+uint32_t
+hash_bytes(const char* text, size_t length){
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < length; i++){
+        h ^= (unsigned char)text[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+//
+// Returns the slot with the id, or the empty slot it would go in.
+static
+HeadingIdSlot*
+heading_ids_find(HeadingIds* ids, const char* text, size_t length){
+    size_t mask = ids->capacity - 1;
+    for(size_t i = hash_bytes(text, length) & mask;; i = (i + 1) & mask){
+        HeadingIdSlot* slot = &ids->slots[i];
+        if(!slot->id.length) return slot;
+        if(slot->id.length == length && memcmp(slot->id.text, text, length) == 0)
+            return slot;
+    }
+}
+
+static
+int
+heading_ids_grow(DrMdContext* ctx, HeadingIds* ids){
+    size_t capacity = ids->capacity? ids->capacity*2 : 64;
+    HeadingIdSlot* old = ids->slots;
+    size_t old_capacity = ids->capacity;
+    ids->slots = Allocator_zalloc(main_allocator(ctx), capacity * sizeof *ids->slots);
+    if(!ids->slots) return ERROR_OOM;
+    ids->capacity = capacity;
+    for(size_t i = 0; i < old_capacity; i++)
+        if(old[i].id.length)
+            *heading_ids_find(ids, old[i].id.text, old[i].id.length) = old[i];
+    return 0;
+}
+
+static
+int
+collect_headings_(DrMdContext* ctx, NodeHandle handle, HeadingIds* ids, int node_depth){
+    if(node_depth > MAX_NODE_DEPTH) return ERROR_TOO_DEEP;
+    Node* node = get_node(ctx, handle);
+    switch(node->type){
+        case NODE_INVALID:
+            return -1;
+        case NODE_H:
+            break;
+        case NODE_STRING:
+        case NODE_PRE:
+            return 0;
+        case NODE_MD:
+        case NODE_PARA:
+        case NODE_TABLE:
+        case NODE_TABLE_ROW:
+        case NODE_BULLETS:
+        case NODE_LIST:
+        case NODE_LIST_ITEM:
+        case NODE_QUOTE:
+            NODE_CHILDREN_FOR_EACH(it, node){
+                int e = collect_headings_(ctx, *it, ids, node_depth+1);
+                if(e) return e;
+            }
+            return 0;
+    }
+    // Room for the id and a repeat's id-n.
+    if((ids->count + 2) * 2 > ids->capacity){
+        int e = heading_ids_grow(ctx, ids);
+        if(e) return e;
+    }
+    StringView text = stripped_view(node->header.text, node->header.length);
+    MStringBuilder msb = {.allocator = main_allocator(ctx)};
+    msb_write_str(&msb, ids->id_prefix.text, ids->id_prefix.length);
+    write_slug(&msb, text.text, text.length);
+    if(msb.errored){
+        msb_destroy(&msb);
+        return ERROR_OOM;
+    }
+    HeadingIdSlot* slot = heading_ids_find(ids, msb.data, msb.cursor);
+    if(slot->id.length){
+        HeadingIdSlot* first = slot;
+        size_t base_length = msb.cursor;
+        for(size_t n = first->next_suffix;; n++){
+            msb.cursor = base_length;
+            msb_write_char(&msb, '-');
+            msb_write_uint(&msb, n);
+            if(msb.errored){
+                msb_destroy(&msb);
+                return ERROR_OOM;
+            }
+            slot = heading_ids_find(ids, msb.data, msb.cursor);
+            if(!slot->id.length){
+                first->next_suffix = n+1;
+                break;
+            }
+        }
+    }
+    StringView id = msb_detach_sv(&msb);
+    *slot = (HeadingIdSlot){.id = id, .next_suffix = 2};
+    ids->count++;
+    int err = Marray_push(HeadingAnchor)(&ctx->anchors, main_allocator(ctx), (HeadingAnchor){
+        .handle = handle,
+        .level = node->heading_level,
+        .text = text,
+        .id = id,
+    });
+    if(err) return ERROR_OOM;
+    return 0;
+}
+
+//
+// Appends every heading in the document to ctx->anchors in document order,
+// with an id of id_prefix followed by the slug of its text. Repeated ids get
+// -2, -3, ... appended to keep them unique.
+static
+int
+collect_headings(DrMdContext* ctx, NodeHandle root, StringView id_prefix){
+    HeadingIds ids = {.id_prefix = id_prefix};
+    return collect_headings_(ctx, root, &ids, 0);
+}
+
+static inline
+int
+write_link_escaped_str_slow(MStringBuilder* sb, const char* text, size_t length, unsigned flags, const LinkRewrite*_Nullable rewrite){
+    (void)flags; // unused if links are disabled
+    (void)rewrite;
+#if DRMD_FEATURES & DRMD_FEATURE_LINKS
+    LinkScan scan = {0};
+#endif
+    for(size_t i = 0; i < length; i++){
+        char c = text[i];
+        switch(c){
+#if DRMD_FEATURES & DRMD_FEATURE_LINKS
+            case '[':{
+                if(flags & ESCAPE_LINKS){
+                    StringView link_text, target;
+                    size_t n = match_inline_link(&scan, text+i, length-i, &link_text, &target);
+                    if(n){
+                        int e = write_inline_link(sb, link_text, target, rewrite);
+                        if(e) return e;
+                        i += n-1;
+                        continue;
                     }
                 }
-                msb_write_literal(sb, "&amp;");
+                msb_write_char(sb, c);
             }break;
-            case '<':{
-                // we allow inline <b>, <s>, <i>, </b>, </s>, </i>, <br>, <code>, </code>, <hr>, <tt>, </tt>, <u>, </u>
-                // This is a big mess and should be done in an easier to do way.
-                if(length - i >= 2){
+#endif
+#if DRMD_FEATURES & DRMD_FEATURE_TYPOGRAPHY
+            case '-':{
+                if(i < length - 1){
                     char peek1 = text[i+1];
-                    if(peek1 == 'c'){ // could be <code> tag
-                        if(length - i >= sizeof("<code>")-1){
-                            if(memcmp(text+i, "<code>", sizeof("<code>")-1) == 0){
-                                msb_write_literal(sb, "<code>");
-                                i += sizeof("<code>")-2;
-                                continue;
-                            }
-                        }
-                    }
-                    if(peek1 == 'h'){
-                        if(length - i >= sizeof("<hr>")-1){
-                            if(memcmp(text+i, "<hr>", sizeof("<hr>")-1) == 0){
-                                msb_write_literal(sb, "<hr>");
-                                i += sizeof("<hr>")-2;
-                                continue;
-                            }
-                        }
-                    }
-                    if(peek1 == '/'){
-                        if(length - i >= sizeof("</code>")-1){
-                            if(memcmp(text+i, "</code>", sizeof("</code>")-1) == 0){
-                                msb_write_literal(sb, "</code>");
-                                i += sizeof("</code>")-2;
-                                continue;
-                            }
-                        }
-                        if(length - i >= sizeof("</tt>")-1){
-                            if(memcmp(text+i, "</tt>", sizeof("</tt>")-1) == 0){
-                                msb_write_literal(sb, "</tt>");
-                                i += sizeof("</tt>")-2;
-                                continue;
-                            }
-                        }
-                    }
-                    if(peek1 == 't'){
-                        if(length - i >= sizeof("<tt>")-1){
-                            if(memcmp(text+i, "<tt>", sizeof("<tt>")-1) == 0){
-                                msb_write_literal(sb, "<tt>");
-                                i += sizeof("<tt>")-2;
+                    if(peek1 == '-'){
+                        if(i < length - 2){
+                            char peek2 = text[i+2];
+                            if(peek2 == '-'){
+                                msb_write_literal(sb, "&mdash;");
+                                i += 2;
                                 continue;
                             }
                         }
+                        msb_write_literal(sb, "&ndash;");
+                        i += 1;
+                        continue;
                     }
-                    switch(peek1){
-                        case 'b':
-                        case 's':
-                        case 'i':
-                        case 'u':
-                        case '/':
-                            break;
-                        default:
-                            msb_write_literal(sb, "&lt;");
-                            continue;
+                }
+                msb_write_char(sb, c);
+            }break;
+#endif
+            case '&':{ // allow &lt;, &gt;
+                if(length - i >= 4){
+                    if(memcmp(text+i, "&lt;", 4) == 0){
+                        msb_write_literal(sb, "&lt;");
+                        i += 3;
+                        continue;
                     }
-                    if(length - i >= 3){
-                        char peek2 = text[i+2];
-                        if(peek1 == 'b' && peek2 == 'r'){
-                            if(length - i >= 4 && text[i+3] == '>'){
-                                msb_write_literal(sb, "<br>");
-                                i += sizeof("<br>")-2;
-                                continue;
-                            }
-                        }
-                        if(peek1 != '/'){
-                            if(peek2 == '>'){
-                                msb_write_char(sb, c);
-                                msb_write_char(sb, peek1);
-                                msb_write_char(sb, peek2);
-                                i += 2;
-                                continue;
-                            }
-                            msb_write_literal(sb, "&lt;");
-                            continue;
-                        }
-                        switch(peek2){
-                            case 'b':
-                            case 's':
-                            case 'i':
-                            case 'u':
-                                break;
-                            default:
-                                msb_write_literal(sb, "&lt;");
-                                continue;
-                        }
-                        if(length -i >= 4){
-                            char peek3 = text[i+3];
-                            if(peek3 == '>'){
-                                msb_write_char(sb, c);
-                                msb_write_char(sb, peek1);
-                                msb_write_char(sb, peek2);
-                                msb_write_char(sb, peek3);
-                                i += 3;
-                                continue;
-                            }
-                        }
+                    if(memcmp(text+i, "&gt;", 4) == 0){
+                        msb_write_literal(sb, "&gt;");
+                        i += 3;
+                        continue;
                     }
                 }
+                msb_write_literal(sb, "&amp;");
+            }break;
+            case '<':{
+#if DRMD_FEATURES & DRMD_FEATURE_INLINE_TAGS
+                int t = match_inline_tag(text+i, length-i);
+                if(t >= 0){
+                    msb_write_str(sb, INLINE_TAGS[t].text, INLINE_TAGS[t].length);
+                    i += INLINE_TAGS[t].length-1;
+                    continue;
+                }
+#endif
                 msb_write_literal(sb, "&lt;");
             }break;
             case '>':{
@@ -1040,348 +2338,1611 @@ write_link_escaped_str_slow(MStringBuilder* sb, const char* text, size_t length)
             case 28: case 29: case 30: case 31:
                 break;
             default:
-                msb_write_char(sb, c);
+                msb_write_char(sb, c);
+                break;
+        }
+    }
+    return 0;
+}
+
+static inline
+void
+write_plain_escaped_str_slow(MStringBuilder* sb, const char* text, size_t length, unsigned flags){
+    for(size_t i = 0; i < length; i++){
+        char c = text[i];
+        switch(c){
+            case '&': msb_write_literal(sb, "&amp;"); break;
+            case '<': msb_write_literal(sb, "&lt;"); break;
+            case '>': msb_write_literal(sb, "&gt;"); break;
+            case '"':
+                if(flags & ESCAPE_QUOTES)
+                    msb_write_literal(sb, "&quot;");
+                else
+                    msb_write_char(sb, c);
+                break;
+            case '\'':
+                if(flags & ESCAPE_QUOTES)
+                    msb_write_literal(sb, "&#39;");
+                else
+                    msb_write_char(sb, c);
+                break;
+            // Control characters html doesn't allow. Whitespace is kept.
+            case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 8:
+            case 11:
+            case 14: case 15: case 16: case 17: case 18: case 19: case 20:
+            case 21: case 22: case 23: case 24: case 25: case 26: case 27:
+            case 28: case 29: case 30: case 31:
+                break;
+            default:
+                msb_write_char(sb, c);
+                break;
+        }
+    }
+}
+
+#ifdef HAVE_VEC
+// Lanes the slow path has to look at: the html special characters, control
+// characters (ascii < 32, which are not valid in html, with the exception of
+// whitespace) and, for markdown, anything that could start a link or a dash
+// or, for attributes, a quote.
+force_inline
+Vec
+escape_special(Vec data, unsigned flags){
+    Vec special = vec_or(vec_eq(data, vec_splat('<')), vec_eq(data, vec_splat('>')));
+    special = vec_or(special, vec_eq(data, vec_splat('&')));
+    special = vec_or(special, vec_le(data, vec_splat(31)));
+    if(flags & ESCAPE_PLAIN){
+        if(flags & ESCAPE_QUOTES){
+            special = vec_or(special, vec_eq(data, vec_splat('"')));
+            special = vec_or(special, vec_eq(data, vec_splat('\'')));
+        }
+        return special;
+    }
+#if DRMD_FEATURES & DRMD_FEATURE_LINKS
+    special = vec_or(special, vec_eq(data, vec_splat('[')));
+#endif
+#if DRMD_FEATURES & DRMD_FEATURE_TYPOGRAPHY
+    special = vec_or(special, vec_eq(data, vec_splat('-')));
+#endif
+    return special;
+}
+#endif
+
+static inline
+int
+write_link_escaped_str(MStringBuilder* sb, const char* text, size_t length, unsigned flags){
+    int err = msb_ensure_additional(sb, length);
+    if(unlikely(err))
+        return ERROR_OOM;
+#ifdef HAVE_VEC
+    size_t cursor = sb->cursor;
+    char* sbdata = sb->data + cursor;
+    // This code is straightforward. Check each 64 byte block for the
+    // presence of one of the special characters and copy it through if there
+    // are none. Once a block has one, go 16 bytes at a time up to it.
+    //
+    // For the common case of no special character this is much faster
+    // than the byte at a time processing we'd otherwise have to do.
+    //
+    // Storing is safe as we did the ensure additional above and we only
+    // write 1 byte of output per byte of input in these loops.
+    while(length >= 64){
+        Vec d0 = vec_load(text);
+        Vec d1 = vec_load(text+16);
+        Vec d2 = vec_load(text+32);
+        Vec d3 = vec_load(text+48);
+        Vec special = vec_or(vec_or(escape_special(d0, flags), escape_special(d1, flags)),
+                             vec_or(escape_special(d2, flags), escape_special(d3, flags)));
+        if(vec_any(special))
+            break;
+        vec_store(sbdata,    d0);
+        vec_store(sbdata+16, d1);
+        vec_store(sbdata+32, d2);
+        vec_store(sbdata+48, d3);
+        cursor += 64;
+        sbdata += 64;
+        length -= 64;
+        text += 64;
+    }
+    while(length >= 16){
+        Vec data = vec_load(text);
+        if(vec_any(escape_special(data, flags)))
+            break;
+        vec_store(sbdata, data);
+        cursor += 16;
+        sbdata += 16;
+        length -= 16;
+        text += 16;
+    }
+    sb->cursor = cursor;
+#endif
+    if(flags & ESCAPE_PLAIN){
+        write_plain_escaped_str_slow(sb, text, length, flags);
+        return 0;
+    }
+    return write_link_escaped_str_slow(sb, text, length, flags, NULL);
+}
+
+//
+// Writes the text of a paragraph or heading, with its links.
+static inline
+int
+write_md_text(DrMdContext* ctx, MStringBuilder* sb, const char* text, size_t length){
+    if(likely(!ctx->link_rewrite))
+        return write_link_escaped_str(sb, text, length, ESCAPE_LINKS);
+    // Only the cli's modes rewrite links, so they do without the fast path.
+    if(msb_ensure_additional(sb, length))
+        return ERROR_OOM;
+    return write_link_escaped_str_slow(sb, text, length, ESCAPE_LINKS, ctx->link_rewrite);
+}
+
+DRMD_API maybe_unused
+int
+drmd_escape_html(StringView input, DrMdEscapeMode mode, StringView* output){
+    MStringBuilder msb = {.allocator = MALLOCATOR};
+    unsigned flags = ESCAPE_PLAIN;
+    if(mode == DRMD_ESCAPE_ATTRIBUTE)
+        flags |= ESCAPE_QUOTES;
+    int err = write_link_escaped_str(&msb, input.text, input.length, flags);
+    if(!err && msb.errored)
+        err = ERROR_OOM;
+    if(err || !msb.cursor){
+        msb_destroy(&msb);
+        if(!err)
+            *output = (StringView){0};
+        return err;
+    }
+    *output = msb_detach_sv(&msb);
+    return 0;
+}
+
+#ifdef HAVE_VEC
+force_inline
+Vec
+word_space(Vec data){
+    return vec_le(data, vec_splat(' '));
+}
+
+// utf-8 continuation bytes are 0b10xxxxxx
+force_inline
+Vec
+utf8_continuation(Vec data){
+    return vec_eq(vec_and(data, vec_splat(0xc0)), vec_splat(0x80));
+}
+#endif
+
+static inline
+void
+count_words(const char* text, size_t length, size_t* words, size_t* characters){
+    size_t nwords = 0;
+    size_t nchars = 0;
+    // Whether the byte before the current one was whitespace. The start of
+    // the text counts as whitespace.
+    unsigned prev_space = 1;
+#ifdef HAVE_VEC
+    while(length >= 64){
+        // A word starts at every non-space byte preceded by a space byte, so
+        // shift the space mask up by one lane and count the transitions.
+        Vec d0 = vec_load(text);
+        Vec d1 = vec_load(text+16);
+        Vec d2 = vec_load(text+32);
+        Vec d3 = vec_load(text+48);
+        uint64_t spaces = vec_mask64(word_space(d0), word_space(d1),
+                                     word_space(d2), word_space(d3));
+        uint64_t conts  = vec_mask64(utf8_continuation(d0), utf8_continuation(d1),
+                                     utf8_continuation(d2), utf8_continuation(d3));
+        uint64_t starts = ~spaces & ((spaces << 1) | prev_space);
+        nwords += popcount_64(starts);
+        nchars += 64 - popcount_64(conts);
+        prev_space = spaces >> 63;
+        text += 64;
+        length -= 64;
+    }
+    while(length >= 16){
+        // Same as above, but vec_mask has VEC_MASK_BITS bits per byte.
+        Vec data = vec_load(text);
+        uint64_t spaces = vec_mask(word_space(data));
+        uint64_t conts  = vec_mask(utf8_continuation(data));
+        uint64_t starts = ~spaces & ((spaces << VEC_MASK_BITS) | (prev_space?VEC_MASK_LANE:0)) & VEC_MASK_ALL;
+        nwords += popcount_64(starts)/VEC_MASK_BITS;
+        nchars += 16 - popcount_64(conts)/VEC_MASK_BITS;
+        prev_space = (spaces >> (16*VEC_MASK_BITS-1)) & 1;
+        text += 16;
+        length -= 16;
+    }
+#endif
+    for(;length;length--,text++){
+        unsigned char c = (unsigned char)*text;
+        unsigned is_space = c <= ' ';
+        nwords += (!is_space) & prev_space;
+        nchars += (c & 0xc0) != 0x80;
+        prev_space = is_space;
+    }
+    *words += nwords;
+    *characters += nchars;
+}
+
+#ifdef HAVE_VEC
+force_inline
+Vec
+line_space(Vec data){
+    Vec space = vec_or(vec_eq(data, vec_splat(' ')), vec_eq(data, vec_splat('\r')));
+    return vec_or(space, vec_eq(data, vec_splat('\t')));
+}
+
+force_inline
+Vec
+line_end(Vec data){
+    return vec_or(vec_eq(data, vec_splat('\n')), vec_eq(data, vec_splat(0)));
+}
+#endif
+
+static inline
+void
+analyze_line(ParseLocation* loc){
+    if(loc->cursor == loc->line_start)
+        return;
+    const char* endline = NULL;
+    const char* cursor = loc->cursor;
+    int nspace = 0;
+    size_t length = loc->end - loc->cursor;
+#ifdef HAVE_VEC
+    // Leading whitespace is short, so this stays 16 bytes at a time.
+    while(length >= 16){
+        uint64_t mask = vec_mask(line_space(vec_load(cursor)));
+        if(mask != VEC_MASK_ALL){
+            int n = ctz_64(~mask)/VEC_MASK_BITS;
+            nspace += n;
+            cursor += n;
+            length -= n;
+            goto Lafterwhitespace;
+        }
+        nspace += 16;
+        cursor += 16;
+        length -= 16;
+    }
+#endif
+    for(;length;length--,cursor++){
+        char ch = *cursor;
+        switch(ch){
+            case ' ': case '\r': case '\t':
+                nspace++;
+                continue;
+            default:
+                goto Lafterwhitespace;
+        }
+    }
+    Lafterwhitespace:;
+    length = loc->end - cursor;
+#ifdef HAVE_VEC
+    while(length >= 64){
+        uint64_t end = vec_mask64(line_end(vec_load(cursor)),    line_end(vec_load(cursor+16)),
+                                  line_end(vec_load(cursor+32)), line_end(vec_load(cursor+48)));
+        if(end){
+            endline = cursor + ctz_64(end);
+            goto Lfinish;
+        }
+        cursor += 64;
+        length -= 64;
+    }
+    while(length >= 16){
+        uint64_t end = vec_mask(line_end(vec_load(cursor)));
+        if(end){
+            endline = cursor + ctz_64(end)/VEC_MASK_BITS;
+            goto Lfinish;
+        }
+        cursor += 16;
+        length -= 16;
+    }
+#endif
+    for(;length;length--,cursor++){
+        switch(*cursor){
+            case '\n': case '\0':
+                endline = cursor;
+                goto Lfinish;
+            default:
+                continue;
+        }
+    }
+    endline = cursor;
+
+    Lfinish:;
+    loc->line_end = endline;
+    loc->line_start = loc->cursor;
+    loc->nspaces = nspace;
+}
+
+//
+// Terminal rendering.
+//
+// Walks the same node tree as the html renderer, but writes utf-8 text with
+// ANSI escapes. Inline text of a block is first written into a scratch
+// builder, then word-wrapped into the output.
+//
+
+typedef struct TermRenderer TermRenderer;
+struct TermRenderer {
+    DrMdContext* ctx;
+    MStringBuilder* sb;
+    // Inline text of the current block, before wrapping.
+    MStringBuilder scratch;
+    int width;
+    // Written at the start of every line: list indentation and quote bars.
+    char prefix[128];
+    int prefix_length;
+    int prefix_columns;
+    // Columns used on the current line, including the prefix.
+    int column;
+    _Bool line_started;
+    // Whether there is a word on the current line after the prefix.
+    _Bool line_has_words;
+    // Whether a block has been written, so the next one needs a blank line.
+    _Bool wrote_block;
+    int list_depth;
+    // Attributes of the text being written (headings, table headers), put
+    // back after an inline tag or link turns some of them off.
+    StringView style;
+};
+
+#if DRMD_FEATURES & DRMD_FEATURE_INLINE_TAGS
+// What the INLINE_TAGS turn into, except <br> and <hr>.
+static const StringView TERM_INLINE_TAGS[INLINE_TAG_COUNT] = {
+    [INLINE_B]        = SV("\033[1m"),
+    [INLINE_B_END]    = SV("\033[22m"),
+    [INLINE_I]        = SV("\033[3m"),
+    [INLINE_I_END]    = SV("\033[23m"),
+    [INLINE_U]        = SV("\033[4m"),
+    [INLINE_U_END]    = SV("\033[24m"),
+    [INLINE_S]        = SV("\033[9m"),
+    [INLINE_S_END]    = SV("\033[29m"),
+    [INLINE_CODE]     = SV("\033[36m"),
+    [INLINE_CODE_END] = SV("\033[39m"),
+    [INLINE_TT]       = SV("\033[36m"),
+    [INLINE_TT_END]   = SV("\033[39m"),
+};
+#endif
+
+enum TermFlags {
+    // Render [text](target) links.
+    TERM_LINKS    = 0x1,
+    // <br> and <hr> become spaces, for table cells.
+    TERM_ONE_LINE = 0x2,
+};
+
+typedef struct TermPrefix TermPrefix;
+struct TermPrefix {
+    int length, columns;
+};
+
+static inline
+TermPrefix
+term_push_prefix(TermRenderer* tr, const char* text, int length, int columns){
+    TermPrefix saved = {tr->prefix_length, tr->prefix_columns};
+    // Nesting is limited by MAX_NODE_DEPTH, but if it still doesn't fit
+    // just stop indenting.
+    if(tr->prefix_length + length <= (int)sizeof tr->prefix){
+        memcpy(tr->prefix+tr->prefix_length, text, length);
+        tr->prefix_length += length;
+        tr->prefix_columns += columns;
+    }
+    return saved;
+}
+
+static inline
+void
+term_pop_prefix(TermRenderer* tr, TermPrefix saved){
+    tr->prefix_length = saved.length;
+    tr->prefix_columns = saved.columns;
+}
+
+static inline
+void
+term_start_line(TermRenderer* tr){
+    if(tr->line_started)
+        return;
+    msb_write_str(tr->sb, tr->prefix, tr->prefix_length);
+    tr->column = tr->prefix_columns;
+    tr->line_started = 1;
+    tr->line_has_words = 0;
+}
+
+static inline
+void
+term_end_line(TermRenderer* tr){
+    if(!tr->line_started)
+        return;
+    msb_write_char(tr->sb, '\n');
+    tr->line_started = 0;
+}
+
+static inline
+void
+term_begin_block(TermRenderer* tr){
+    term_end_line(tr);
+    if(tr->wrote_block){
+        // Keep the quote bars, but not trailing indentation.
+        int n = tr->prefix_length;
+        while(n && tr->prefix[n-1] == ' ')
+            n--;
+        msb_write_str(tr->sb, tr->prefix, n);
+        msb_write_char(tr->sb, '\n');
+    }
+    tr->wrote_block = 1;
+}
+
+//
+// Columns the text takes up: utf-8 characters that aren't part of an ANSI
+// escape sequence.
+static inline
+int
+term_columns(const char* text, size_t length){
+    // Words are short, so this isn't worth vectorizing.
+    int columns = 0;
+    for(size_t i = 0; i < length; i++){
+        unsigned char c = (unsigned char)text[i];
+        if(c == '\033'){
+            // Escapes we write are ESC [ params letter
+            for(i++; i < length; i++){
+                c = (unsigned char)text[i];
+                if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+                    break;
+            }
+            continue;
+        }
+        columns += (c & 0xc0) != 0x80;
+    }
+    return columns;
+}
+
+//
+// Finds word boundaries (' ' and '\n') a 64 byte block at a time, so
+// wrapping walks the bits of a mask instead of testing every byte.
+typedef struct BoundaryScan BoundaryScan;
+struct BoundaryScan {
+    const char* block;
+    const char* end;
+    // Bit i is set if block[i] is a boundary.
+    uint64_t mask;
+};
+
+#ifdef HAVE_VEC
+force_inline
+Vec
+word_boundary(Vec data){
+    return vec_or(vec_eq(data, vec_splat(' ')), vec_eq(data, vec_splat('\n')));
+}
+#endif
+
+static inline
+void
+boundary_load(BoundaryScan* scan){
+    const char* b = scan->block;
+    size_t remaining = scan->end - b;
+#ifdef HAVE_VEC
+    if(remaining >= 64){
+        scan->mask = vec_mask64(word_boundary(vec_load(b)),    word_boundary(vec_load(b+16)),
+                                word_boundary(vec_load(b+32)), word_boundary(vec_load(b+48)));
+        return;
+    }
+#endif
+    uint64_t mask = 0;
+    size_t n = remaining < 64? remaining : 64;
+    for(size_t i = 0; i < n; i++)
+        if(b[i] == ' ' || b[i] == '\n')
+            mask |= (uint64_t)1 << i;
+    scan->mask = mask;
+}
+
+//
+// Returns the first boundary at or after p, or the end if there isn't one.
+// p must not go backwards between calls.
+static inline
+const char*
+boundary_next(BoundaryScan* scan, const char* p){
+    if(p - scan->block >= 64){
+        scan->block += (p - scan->block) & ~(ptrdiff_t)63;
+        boundary_load(scan);
+    }
+    uint64_t mask = scan->mask & (~(uint64_t)0 << (p - scan->block));
+    for(;;){
+        if(mask)
+            return scan->block + ctz_64(mask);
+        if(scan->end - scan->block <= 64)
+            return scan->end;
+        scan->block += 64;
+        boundary_load(scan);
+        mask = scan->mask;
+    }
+}
+
+//
+// Greedily fills lines with the words of the text. Words wider than the
+// terminal get a line to themselves.
+static
+void
+term_wrap(TermRenderer* tr, const char* text, size_t length){
+    const char* end = text + length;
+    BoundaryScan scan = {.block = text, .end = end};
+    boundary_load(&scan);
+    for(const char* p = text; p != end;){
+        if(*p == ' '){
+            p++;
+            continue;
+        }
+        if(*p == '\n'){
+            term_start_line(tr);
+            term_end_line(tr);
+            p++;
+            continue;
+        }
+        const char* word_end = boundary_next(&scan, p);
+        int w = term_columns(p, word_end - p);
+        // Words that are only escapes take no room, so don't break or
+        // space around them.
+        if(w){
+            if(tr->line_has_words && tr->column + 1 + w > tr->width)
+                term_end_line(tr);
+            term_start_line(tr);
+            if(tr->line_has_words){
+                msb_write_char(tr->sb, ' ');
+                tr->column++;
+            }
+            tr->line_has_words = 1;
+            tr->column += w;
+        }
+        else
+            term_start_line(tr);
+        msb_write_str(tr->sb, p, word_end - p);
+        p = word_end;
+    }
+}
+
+static inline
+void
+term_flush(TermRenderer* tr){
+    if(tr->scratch.cursor)
+        term_wrap(tr, tr->scratch.data, tr->scratch.cursor);
+    msb_reset(&tr->scratch);
+}
+
+//
+// Writes the text without control characters, so documents can't send
+// their own escapes to the terminal.
+static inline
+void
+term_write_plain(MStringBuilder* sb, const char* text, size_t length){
+    for(size_t i = 0; i < length; i++){
+        unsigned char c = (unsigned char)text[i];
+        if(c == '\t' || (c >= ' ' && c != 127))
+            msb_write_char(sb, (char)c);
+    }
+}
+
+static
+void
+term_write_inline(TermRenderer* tr, const char* text, size_t length, unsigned flags){
+    (void)flags; // unused if links are disabled
+    MStringBuilder* sb = &tr->scratch;
+#if DRMD_FEATURES & DRMD_FEATURE_LINKS
+    LinkScan scan = {0};
+#endif
+    for(size_t i = 0; i < length; i++){
+#ifdef HAVE_VEC
+        // Copy through runs of plain text.
+        size_t run = i;
+        // escape_special doesn't flag DEL, which html lets through.
+        while(length - i >= 16){
+            Vec data = vec_load(text+i);
+            if(vec_any(vec_or(escape_special(data, 0), vec_eq(data, vec_splat(127)))))
+                break;
+            i += 16;
+        }
+        if(i != run)
+            msb_write_str(sb, text+run, i-run);
+        if(i == length)
+            break;
+#endif
+        char c = text[i];
+        switch(c){
+#if DRMD_FEATURES & DRMD_FEATURE_LINKS
+            case '[':{
+                if(flags & TERM_LINKS){
+                    StringView link_text, target;
+                    size_t n = match_inline_link(&scan, text+i, length-i, &link_text, &target);
+                    if(n){
+                        msb_write_literal(sb, "\033[4m");
+                        if(link_text.length)
+                            term_write_inline(tr, link_text.text, link_text.length, flags & ~TERM_LINKS);
+                        else
+                            term_write_plain(sb, target.text, target.length);
+                        msb_write_literal(sb, "\033[24m");
+                        msb_write_str(sb, tr->style.text, tr->style.length);
+                        if(link_text.length){
+                            msb_write_literal(sb, " (");
+                            term_write_plain(sb, target.text, target.length);
+                            msb_write_char(sb, ')');
+                        }
+                        i += n-1;
+                        continue;
+                    }
+                }
+                msb_write_char(sb, c);
+            }break;
+#endif
+#if DRMD_FEATURES & DRMD_FEATURE_TYPOGRAPHY
+            case '-':{
+                if(length - i >= 3 && text[i+1] == '-' && text[i+2] == '-'){
+                    msb_write_literal(sb, "\xe2\x80\x94"); // mdash
+                    i += 2;
+                    continue;
+                }
+                if(length - i >= 2 && text[i+1] == '-'){
+                    msb_write_literal(sb, "\xe2\x80\x93"); // ndash
+                    i += 1;
+                    continue;
+                }
+                msb_write_char(sb, c);
+            }break;
+#endif
+            case '&':{
+                if(length - i >= 4){
+                    if(memcmp(text+i, "&lt;", 4) == 0){
+                        msb_write_char(sb, '<');
+                        i += 3;
+                        continue;
+                    }
+                    if(memcmp(text+i, "&gt;", 4) == 0){
+                        msb_write_char(sb, '>');
+                        i += 3;
+                        continue;
+                    }
+                }
+                msb_write_char(sb, c);
+            }break;
+            case '<':{
+#if DRMD_FEATURES & DRMD_FEATURE_INLINE_TAGS
+                int t = match_inline_tag(text+i, length-i);
+                if(t >= 0){
+                    i += INLINE_TAGS[t].length-1;
+                    if(t == INLINE_BR)
+                        msb_write_char(sb, (flags & TERM_ONE_LINE)? ' ' : '\n');
+                    else if(t == INLINE_HR){
+                        if(flags & TERM_ONE_LINE)
+                            msb_write_char(sb, ' ');
+                        else {
+                            msb_write_char(sb, '\n');
+                            int n = tr->width - tr->prefix_columns;
+                            for(int r = 0; r < n; r++)
+                                msb_write_literal(sb, "\xe2\x94\x80"); // ─
+                            msb_write_char(sb, '\n');
+                        }
+                    }
+                    else {
+                        msb_write_str(sb, TERM_INLINE_TAGS[t].text, TERM_INLINE_TAGS[t].length);
+                        // Closing a tag can turn off the block's own bold
+                        // or underline.
+                        if(INLINE_TAGS[t].text[1] == '/')
+                            msb_write_str(sb, tr->style.text, tr->style.length);
+                    }
+                    continue;
+                }
+#endif
+                msb_write_char(sb, c);
+            }break;
+            case '\t': case '\r': case '\f': case '\n':
+                msb_write_char(sb, ' ');
+                break;
+            // Don't print control characters, especially not escapes.
+            case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 8:
+            case 11:
+            case 14: case 15: case 16: case 17: case 18: case 19: case 20:
+            case 21: case 22: case 23: case 24: case 25: case 26: case 27:
+            case 28: case 29: case 30: case 31: case 127:
+                break;
+            default:
+                msb_write_char(sb, c);
+                break;
+        }
+    }
+}
+
+static
+int
+render_term_node(TermRenderer* tr, NodeHandle handle, int node_depth);
+
+static
+int
+render_term_list(TermRenderer* tr, Node* list, int node_depth){
+    if(!tr->list_depth)
+        term_begin_block(tr);
+    tr->list_depth++;
+    unsigned number = 1;
+    NODE_CHILDREN_FOR_EACH(it, list){
+        Node* item = get_node(tr->ctx, *it);
+        char marker[16];
+        int marker_length;
+        int marker_columns;
+        if(list->type == NODE_BULLETS){
+            memcpy(marker, "\xe2\x80\xa2 ", 4); // •
+            marker_length = 4;
+            marker_columns = 2;
+        }
+        else {
+            char digits[10];
+            int n = 0;
+            for(unsigned x = number++; n == 0 || x; x /= 10)
+                digits[n++] = '0' + x % 10;
+            for(marker_length = 0; marker_length < n; marker_length++)
+                marker[marker_length] = digits[n-1-marker_length];
+            marker[marker_length++] = '.';
+            marker[marker_length++] = ' ';
+            marker_columns = marker_length;
+        }
+        term_end_line(tr);
+        term_start_line(tr);
+        msb_write_str(tr->sb, marker, marker_length);
+        tr->column += marker_columns;
+        // Continuation lines and nested lists line up after the marker.
+        TermPrefix saved = term_push_prefix(tr, "            ", marker_columns, marker_columns);
+        NODE_CHILDREN_FOR_EACH(c, item){
+            Node* child = get_node(tr->ctx, *c);
+            if(child->type == NODE_STRING){
+                if(tr->scratch.cursor)
+                    msb_write_char(&tr->scratch, ' ');
+                term_write_inline(tr, child->header.text, child->header.length, TERM_LINKS);
+                continue;
+            }
+            term_flush(tr);
+            int e = render_term_node(tr, *c, node_depth+1);
+            if(e) return e;
+        }
+        term_flush(tr);
+        term_pop_prefix(tr, saved);
+    }
+    term_end_line(tr);
+    tr->list_depth--;
+    return 0;
+}
+
+static
+void
+term_table_rule(TermRenderer* tr, const int* widths, size_t ncols, const char* left, const char* middle, const char* right){
+    term_start_line(tr);
+    msb_write_str(tr->sb, left, strlen(left));
+    for(size_t j = 0; j < ncols; j++){
+        for(int k = 0; k < widths[j]+2; k++)
+            msb_write_literal(tr->sb, "\xe2\x94\x80"); // ─
+        const char* s = j == ncols-1? right : middle;
+        msb_write_str(tr->sb, s, strlen(s));
+    }
+    term_end_line(tr);
+}
+
+static
+int
+render_term_table(TermRenderer* tr, Node* table){
+    DrMdContext* ctx = tr->ctx;
+    size_t ncols = 0;
+    NODE_CHILDREN_FOR_EACH(it, table){
+        size_t n = node_children_count(get_node(ctx, *it));
+        if(n > ncols) ncols = n;
+    }
+    if(!ncols)
+        return 0;
+    int* widths = Allocator_zalloc(main_allocator(ctx), ncols * sizeof *widths);
+    if(!widths)
+        return ERROR_OOM;
+    // Tables are short, so render each cell twice instead of keeping them
+    // around: once to measure the columns and once to draw.
+    NODE_CHILDREN_FOR_EACH(it, table){
+        Node* row = get_node(ctx, *it);
+        size_t j = 0;
+        NODE_CHILDREN_FOR_EACH(c, row){
+            Node* cell = get_node(ctx, *c);
+            msb_reset(&tr->scratch);
+            term_write_inline(tr, cell->header.text, cell->header.length, TERM_LINKS|TERM_ONE_LINE);
+            int w = term_columns(tr->scratch.data, tr->scratch.cursor);
+            if(w > widths[j]) widths[j] = w;
+            j++;
+        }
+    }
+    msb_reset(&tr->scratch);
+    term_table_rule(tr, widths, ncols, "\xe2\x94\x8c", "\xe2\x94\xac", "\xe2\x94\x90"); // ┌ ┬ ┐
+    size_t count = node_children_count(table);
+    NodeHandle* rows = node_children(table);
+    for(size_t i = 0; i < count; i++){
+        Node* row = get_node(ctx, rows[i]);
+        size_t ncells = node_children_count(row);
+        NodeHandle* cells = node_children(row);
+        term_start_line(tr);
+        msb_write_literal(tr->sb, "\xe2\x94\x82"); // │
+        for(size_t j = 0; j < ncols; j++){
+            int w = 0;
+            msb_write_char(tr->sb, ' ');
+            if(j < ncells){
+                Node* cell = get_node(ctx, cells[j]);
+                // The first row is the header.
+                if(i == 0) tr->style = SV("\033[1m");
+                term_write_inline(tr, cell->header.text, cell->header.length, TERM_LINKS|TERM_ONE_LINE);
+                tr->style = (StringView){0};
+                w = term_columns(tr->scratch.data, tr->scratch.cursor);
+                if(i == 0) msb_write_literal(tr->sb, "\033[1m");
+                msb_write_str(tr->sb, tr->scratch.data, tr->scratch.cursor);
+                if(i == 0) msb_write_literal(tr->sb, "\033[22m");
+                msb_reset(&tr->scratch);
+            }
+            msb_write_nchar(tr->sb, ' ', widths[j] - w + 1);
+            msb_write_literal(tr->sb, "\xe2\x94\x82"); // │
+        }
+        term_end_line(tr);
+        if(i == 0 && count > 1)
+            term_table_rule(tr, widths, ncols, "\xe2\x94\x9c", "\xe2\x94\xbc", "\xe2\x94\xa4"); // ├ ┼ ┤
+    }
+    term_table_rule(tr, widths, ncols, "\xe2\x94\x94", "\xe2\x94\xb4", "\xe2\x94\x98"); // └ ┴ ┘
+    return 0;
+}
+
+static
+int
+render_term_node(TermRenderer* tr, NodeHandle handle, int node_depth){
+    if(node_depth > MAX_NODE_DEPTH) return ERROR_TOO_DEEP;
+    Node* node = get_node(tr->ctx, handle);
+    switch(node->type){
+        case NODE_INVALID:
+        case NODE_TABLE_ROW:
+        case NODE_LIST_ITEM:
+            return -1;
+        case NODE_MD:
+            NODE_CHILDREN_FOR_EACH(it, node){
+                int e = render_term_node(tr, *it, node_depth+1);
+                if(e) return e;
+            }
+            return 0;
+        case NODE_STRING:
+            term_write_inline(tr, node->header.text, node->header.length, TERM_LINKS);
+            term_flush(tr);
+            return 0;
+        case NODE_PARA:{
+            term_begin_block(tr);
+            NODE_CHILDREN_FOR_EACH(it, node){
+                if(tr->scratch.cursor)
+                    msb_write_char(&tr->scratch, ' ');
+                Node* child = get_node(tr->ctx, *it);
+                term_write_inline(tr, child->header.text, child->header.length, TERM_LINKS);
+            }
+            term_flush(tr);
+            term_end_line(tr);
+            return 0;
+        }
+        case NODE_QUOTE:{
+            term_begin_block(tr);
+            TermPrefix saved = term_push_prefix(tr, "\xe2\x94\x82 ", 4, 2); // │
+            // Runs of text are wrapped as a paragraph, other blocks render
+            // themselves, all separated by blank lines behind the bar.
+            tr->wrote_block = 0;
+            _Bool in_text = 0;
+            NODE_CHILDREN_FOR_EACH(it, node){
+                Node* child = get_node(tr->ctx, *it);
+                if(child->type == NODE_STRING){
+                    if(!in_text)
+                        term_begin_block(tr);
+                    else if(tr->scratch.cursor)
+                        msb_write_char(&tr->scratch, ' ');
+                    in_text = 1;
+                    term_write_inline(tr, child->header.text, child->header.length, TERM_LINKS);
+                    continue;
+                }
+                if(in_text){
+                    term_flush(tr);
+                    term_end_line(tr);
+                    in_text = 0;
+                }
+                int e = render_term_node(tr, *it, node_depth+1);
+                if(e) return e;
+            }
+            term_flush(tr);
+            term_end_line(tr);
+            term_pop_prefix(tr, saved);
+            tr->wrote_block = 1;
+            return 0;
+        }
+        case NODE_H:{
+            term_begin_block(tr);
+            StringView text = stripped_view(node->header.text, node->header.length);
+            tr->style = node->heading_level == 1? SV("\033[1;4m") : SV("\033[1m");
+            msb_write_str(&tr->scratch, tr->style.text, tr->style.length);
+            term_write_inline(tr, text.text, text.length, TERM_LINKS);
+            tr->style = (StringView){0};
+            msb_write_literal(&tr->scratch, "\033[0m");
+            term_flush(tr);
+            term_end_line(tr);
+            return 0;
+        }
+        case NODE_BULLETS:
+        case NODE_LIST:
+            return render_term_list(tr, node, node_depth);
+        case NODE_TABLE:
+            term_begin_block(tr);
+            return render_term_table(tr, node);
+        case NODE_PRE:{
+            term_begin_block(tr);
+            // Code isn't wrapped, just indented.
+            TermPrefix saved = term_push_prefix(tr, "    ", 4, 4);
+            NODE_CHILDREN_FOR_EACH(it, node){
+                Node* child = get_node(tr->ctx, *it);
+                term_start_line(tr);
+                term_write_plain(tr->sb, child->header.text, child->header.length);
+                term_end_line(tr);
+            }
+            term_pop_prefix(tr, saved);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static
+int
+render_to_term(DrMdContext* ctx, NodeHandle root, int width, MStringBuilder* msb){
+    TermRenderer tr = {
+        .ctx = ctx,
+        .sb = msb,
+        .scratch = {.allocator = MALLOCATOR},
+        .width = width,
+    };
+    int e = render_term_node(&tr, root, 0);
+    term_end_line(&tr);
+    if(!e && (msb->errored || tr.scratch.errored))
+        e = ERROR_OOM;
+    msb_destroy(&tr.scratch);
+    return e;
+}
+
+
+//
+// JSON rendering.
+//
+// Writes the tree straight into the builder as it is walked: every node is
+// {"type": ..., "children": [...]}, except strings and headings which have
+// the byte offset of their text in the input and the text itself instead of
+// children.
+//
+
+#ifdef HAVE_VEC
+// Lanes that need escaping in a json string, or checking that they are
+// valid utf-8.
+force_inline
+Vec
+json_special(Vec data){
+    Vec special = vec_or(vec_eq(data, vec_splat('"')), vec_eq(data, vec_splat('\\')));
+    special = vec_or(special, vec_le(data, vec_splat(31)));
+    return vec_or(special, vec_le(vec_splat(0x80), data));
+}
+#endif
+
+//
+// Returns how many bytes at the start of the text can be copied into a json
+// string as is.
+static inline
+size_t
+json_plain_length(const char* text, size_t length){
+    size_t i = 0;
+#ifdef HAVE_VEC
+    for(; length - i >= 64; i += 64){
+        const char* t = text+i;
+        uint64_t mask = vec_mask64(json_special(vec_load(t)),    json_special(vec_load(t+16)),
+                                   json_special(vec_load(t+32)), json_special(vec_load(t+48)));
+        if(mask)
+            return i + ctz_64(mask);
+    }
+    for(; length - i >= 16; i += 16){
+        uint64_t mask = vec_mask(json_special(vec_load(text+i)));
+        if(mask)
+            return i + ctz_64(mask)/VEC_MASK_BITS;
+    }
+#endif
+    for(; i < length; i++){
+        unsigned char c = (unsigned char)text[i];
+        if(c == '"' || c == '\\' || c < 32 || c >= 0x80)
+            break;
+    }
+    return i;
+}
+
+//
+// Returns the length of the utf-8 sequence at the start of the text, or 0
+// if it isn't valid: truncated, overlong, a surrogate or above U+10FFFF.
+static inline
+size_t
+utf8_sequence_length(const char* text, size_t length){
+    const unsigned char* p = (const unsigned char*)text;
+    if(p[0] < 0x80) return 1;
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xbf;
+    if(p[0] >= 0xc2 && p[0] <= 0xdf) n = 2;
+    else if(p[0] >= 0xe0 && p[0] <= 0xef){
+        n = 3;
+        if(p[0] == 0xe0) lo = 0xa0;
+        if(p[0] == 0xed) hi = 0x9f;
+    }
+    else if(p[0] >= 0xf0 && p[0] <= 0xf4){
+        n = 4;
+        if(p[0] == 0xf0) lo = 0x90;
+        if(p[0] == 0xf4) hi = 0x8f;
+    }
+    else return 0;
+    if(length < n) return 0;
+    if(p[1] < lo || p[1] > hi) return 0;
+    for(size_t i = 2; i < n; i++)
+        if((p[i] & 0xc0) != 0x80) return 0;
+    return n;
+}
+
+static inline
+void
+write_json_escaped_str(MStringBuilder* sb, const char* text, size_t length){
+    const char* end = text + length;
+    for(;;){
+        size_t n = json_plain_length(text, end - text);
+        msb_write_str(sb, text, n);
+        text += n;
+        if(text == end)
+            return;
+        // Copy through valid utf-8, replacing anything else so the output
+        // is valid json.
+        while(text != end && (unsigned char)*text >= 0x80){
+            const char* run = text;
+            for(size_t u; text != end && (u = utf8_sequence_length(text, end - text)) > 1;)
+                text += u;
+            msb_write_str(sb, run, text - run);
+            if(text != end && (unsigned char)*text >= 0x80){
+                msb_write_literal(sb, "\\ufffd");
+                text++;
+            }
+        }
+        if(text == end)
+            return;
+        unsigned char c = (unsigned char)*text++;
+        if(c >= 32 && c != '"' && c != '\\'){
+            msb_write_char(sb, (char)c);
+            continue;
+        }
+        switch(c){
+            case '"':  msb_write_literal(sb, "\\\""); break;
+            case '\\': msb_write_literal(sb, "\\\\"); break;
+            case '\n': msb_write_literal(sb, "\\n");  break;
+            case '\r': msb_write_literal(sb, "\\r");  break;
+            case '\t': msb_write_literal(sb, "\\t");  break;
+            case '\b': msb_write_literal(sb, "\\b");  break;
+            case '\f': msb_write_literal(sb, "\\f");  break;
+            default:
+                msb_write_literal(sb, "\\u00");
+                msb_write_char(sb, "0123456789abcdef"[c >> 4]);
+                msb_write_char(sb, "0123456789abcdef"[c & 0xf]);
                 break;
         }
     }
-    return 0;
 }
 
-static inline
+static
+const StringView NODE_TYPE_NAMES[] = {
+    #define X(a, b) [NODE_##a] = SV(#a),
+    NODETYPES(X)
+    #undef X
+};
+
+static
 int
-write_link_escaped_str(MStringBuilder* sb, const char* text, size_t length){
-    int err = msb_ensure_additional(sb, length);
-    if(unlikely(err))
-        return ERROR_OOM;
-#if 1 && !defined(NO_SIMD) && defined(__x86_64__)
-    size_t cursor = sb->cursor;
-    char* sbdata = sb->data + cursor;
-    __m128i lsquare = _mm_set1_epi8('[');
-    __m128i hyphen  = _mm_set1_epi8('-');
-    __m128i langle  = _mm_set1_epi8('<');
-    __m128i rangle  = _mm_set1_epi8('>');
-    __m128i amp     = _mm_set1_epi8('&');
-    __m128i control = _mm_set1_epi8(32);
-    while(length >= 16){
-        // This code is straightforward. Check each 16byte chunk for the
-        // presence of one of the special characters.  Also check for control
-        // characters (ascii < 32), as those are not valid in html, with the
-        // exception of newline.
-        //
-        // For the common case of no special character this is much faster
-        // than the byte at a time processing we'd otherwise have to do.
-        __m128i data         = _mm_loadu_si128((const __m128i*)text);
-        __m128i test_lsquare = _mm_cmpeq_epi8(data, lsquare);
-        __m128i test_hyphen  = _mm_cmpeq_epi8(data, hyphen);
-        __m128i test_langle  = _mm_cmpeq_epi8(data, langle);
-        __m128i test_rangle  = _mm_cmpeq_epi8(data, rangle);
-        __m128i test_amp     = _mm_cmpeq_epi8(data, amp);
-        __m128i test_control = _mm_cmplt_epi8(data, control);
-        // Combine the results together so we can do a single check
-        __m128i Ored  = _mm_or_si128(test_lsquare, test_hyphen);
-        __m128i Ored2 = _mm_or_si128(test_langle, test_rangle);
-        __m128i Ored3 = _mm_or_si128(test_amp, test_control);
-        __m128i Ored4 = _mm_or_si128(Ored, Ored2);
-        __m128i Ored5 = _mm_or_si128(Ored3, Ored4);
-        int had_it = _mm_movemask_epi8(Ored5);
-        if(had_it)
-            break;
-        // Safe to store as we did the ensure additional above and we only
-        // write 1 byte of output per byte of input in this loop.
-        _mm_storeu_si128((__m128i_u*)sbdata, data);
-        cursor += 16;
-        sbdata += 16;
-        length -= 16;
-        text += 16;
-    }
-    sb->cursor = cursor;
-#endif
-#if 1 && !defined(NO_SIMD) && defined(__wasm_simd128__)
-    size_t cursor = sb->cursor;
-    char* sbdata = sb->data + cursor;
-    v128_t lsquare = wasm_i8x16_splat('[');
-    v128_t hyphen  = wasm_i8x16_splat('-');
-    v128_t langle  = wasm_i8x16_splat('<');
-    v128_t rangle  = wasm_i8x16_splat('>');
-    v128_t amp     = wasm_i8x16_splat('&');
-    v128_t control = wasm_i8x16_splat(32);
-    while(length >= 16){
-        // This code is straightforward. Check each 16byte chunk for the
-        // presence of one of the special characters.  Also check for control
-        // characters (ascii < 32), as those are not valid in html, with the
-        // exception of newline.
-        //
-        // For the common case of no special character this is much faster
-        // than the byte at a time processing we'd otherwise have to do.
-        v128_t data         = wasm_v128_load(text);
-        v128_t test_lsquare = wasm_i8x16_eq(data, lsquare);
-        v128_t test_hyphen  = wasm_i8x16_eq(data, hyphen);
-        v128_t test_langle  = wasm_i8x16_eq(data, langle);
-        v128_t test_rangle  = wasm_i8x16_eq(data, rangle);
-        v128_t test_amp     = wasm_i8x16_eq(data, amp);
-        v128_t test_control = wasm_i8x16_eq(data, control);
-        // Combine the results together so we can do a single check
-        v128_t Ored  = test_lsquare | test_hyphen;
-        v128_t Ored2 = test_langle | test_rangle;
-        v128_t Ored3 = test_amp | test_control;
-        v128_t Ored4 = Ored | Ored2;
-        v128_t Ored5 = Ored3 | Ored4;
-        int had_it = wasm_i8x16_bitmask(Ored5);
-        if(had_it)
+render_json_node(DrMdContext* ctx, MStringBuilder* sb, NodeHandle handle, const char* base, int node_depth){
+    if(node_depth > MAX_NODE_DEPTH) return ERROR_TOO_DEEP;
+    Node* node = get_node(ctx, handle);
+    if(node->type == NODE_INVALID)
+        return -1;
+    msb_write_literal(sb, "{\"type\":\"");
+    StringView name = NODE_TYPE_NAMES[node->type];
+    msb_write_str(sb, name.text, name.length);
+    msb_write_char(sb, '"');
+    switch(node->type){
+        case NODE_H:
+            msb_write_literal(sb, ",\"level\":");
+            msb_write_uint(sb, node->heading_level);
+            // fall-through
+        case NODE_STRING:
+            msb_write_literal(sb, ",\"offset\":");
+            msb_write_uint(sb, node->header.text - base);
+            msb_write_literal(sb, ",\"text\":\"");
+            write_json_escaped_str(sb, node->header.text, node->header.length);
+            msb_write_literal(sb, "\"}");
+            return 0;
+        default:
             break;
-        // Safe to store as we did the ensure additional above and we only
-        // write 1 byte of output per byte of input in this loop.
-        wasm_v128_store(sbdata, data);
-        cursor += 16;
-        sbdata += 16;
-        length -= 16;
-        text += 16;
     }
-    sb->cursor = cursor;
-#endif
-#if 1 && !defined(NO_SIMD) && defined(__ARM_NEON)
-    size_t cursor = sb->cursor;
-    unsigned char* sbdata = (unsigned char*)sb->data + cursor;
-    uint8x16_t lsquare = vdupq_n_u8('[');
-    uint8x16_t hyphen  = vdupq_n_u8('-');
-    uint8x16_t langle  = vdupq_n_u8('<');
-    uint8x16_t rangle  = vdupq_n_u8('>');
-    uint8x16_t amp     = vdupq_n_u8('&');
-    uint8x16_t control = vdupq_n_u8(32);
-    while(length >= 16){
-        uint8x16_t data         = vld1q_u8((const unsigned char*)text);
-        uint8x16_t test_lsquare = vceqq_u8(data, lsquare);
-        uint8x16_t test_hyphen  = vceqq_u8(data, hyphen);
-        uint8x16_t test_langle  = vceqq_u8(data, langle);
-        uint8x16_t test_rangle  = vceqq_u8(data, rangle);
-        uint8x16_t test_amp     = vceqq_u8(data, amp);
-        uint8x16_t test_control = vcltq_u8(data, control);
-        // Combine the results together so we can do a single
-        // check
-        uint8x16_t Ored  = vorrq_u8(test_lsquare, test_hyphen);
-        uint8x16_t Ored2 = vorrq_u8(test_langle, test_rangle);
-        uint8x16_t Ored3 = vorrq_u8(test_amp, test_control);
-        uint8x16_t Ored4 = vorrq_u8(Ored, Ored2);
-        uint8x16_t Ored5 = vorrq_u8(Ored3, Ored4);
-        uint8x8_t shifted = vshrn_n_u16(vreinterpretq_u16_u8(Ored5), 4);
-        uint64x1_t had_it = vreinterpret_u64_u8(shifted);
-
-        if(vget_lane_u64(had_it, 0)){
-            break;
-        }
-        // Safe to store as we did the ensure additional above and
-        // we only write 1 byte of output per byte of input in
-        // this loop.
-        vst1q_u8(sbdata, data);
-        cursor += 16;
-        sbdata += 16;
-        length -= 16;
-        text += 16;
+    msb_write_literal(sb, ",\"children\":[");
+    _Bool first = 1;
+    NODE_CHILDREN_FOR_EACH(it, node){
+        if(!first) msb_write_char(sb, ',');
+        first = 0;
+        int e = render_json_node(ctx, sb, *it, base, node_depth+1);
+        if(e) return e;
     }
-    sb->cursor = cursor;
-#endif
-    return write_link_escaped_str_slow(sb, text, length);
+    msb_write_literal(sb, "]}");
+    return 0;
 }
 
-#if 1 &&!defined(NO_SIMD) && defined(__ARM_NEON)
+static
+int
+render_to_json(DrMdContext* ctx, NodeHandle root, const char* base, MStringBuilder* msb){
+    int e = render_json_node(ctx, msb, root, base, 0);
+    if(e) return e;
+    msb_write_char(msb, '\n');
+    if(msb->errored) return ERROR_OOM;
+    return 0;
+}
 
-// leaving this as reference, it is inefficient compared to the shrn trick
-#if 0
-// Copied from https://stackoverflow.com/a/68694558
-static inline
-uint32_t
-_mm_movemask_aarch64(uint8x16_t input){
-    _Alignas(16) const uint8_t ucShift[] = {-7,-6,-5,-4,-3,-2,-1,0,-7,-6,-5,-4,-3,-2,-1,0};
-    uint8x16_t vshift = vld1q_u8(ucShift);
-    // Mask to only the msb of each lane.
-    uint8x16_t vmask = vandq_u8(input, vdupq_n_u8(0x80));
+//
+// Table extraction.
+//
+// Walks the blocks down to the tables and writes only their cells, a row at
+// a time, as csv, tsv or json. Whenever a buffer's worth of rows is ready it
+// is handed to the caller, so big tables don't need all of their output in
+// memory.
+//
 
-    // Shift the mask into place.
-    vmask = vshlq_u8(vmask, vshift);
-    uint32_t out = vaddv_u8(vget_low_u8(vmask));
-    // combine
-    out += vaddv_u8(vget_high_u8(vmask)) << 8;
+enum {TABLES_FLUSH_SIZE = 64*1024};
 
-    return out;
-}
-#endif
+typedef struct TableWriter TableWriter;
+struct TableWriter {
+    DrMdContext* ctx;
+    DrMdTableFormat format;
+    MStringBuilder sb;
+    DrMdOutputFunc* func;
+    void*_Nullable userdata;
+    size_t n_tables;
+};
 
-//  shrn trick from
-//  https://community.arm.com/arm-community-blogs/b/infrastructure-solutions-blog/posts/porting-x86-vector-bitmask-optimizations-to-arm-neon
-// Allows you to achieve a similar effect to _mm_movemask, but you get 4 bits set instead of 1 per 8 bit lane (thus it's a fat mask).
-// Usually need to divide by 4 when you count bits or whatever.
+#ifdef HAVE_VEC
+// Lanes that make a cell need quoting in csv (or replacing in tsv).
 force_inline
-uint64_t
-vector128_to_fatmask(uint8x16_t input){
-    uint8x8_t shifted = vshrn_n_u16(vreinterpretq_u16_u8(input), 4);
-    uint64_t fatmask = vget_lane_u64(vreinterpret_u64_u8(shifted), 0);
-    return fatmask;
+Vec
+csv_special(Vec data, char sep){
+    Vec special = vec_or(vec_eq(data, vec_splat(sep)), vec_eq(data, vec_splat('"')));
+    return vec_or(special, vec_or(vec_eq(data, vec_splat('\n')), vec_eq(data, vec_splat('\r'))));
 }
 #endif
 
+//
+// Returns how many bytes at the start of the cell can be written as is.
 static inline
+size_t
+csv_plain_length(const char* text, size_t length, char sep){
+    size_t i = 0;
+#ifdef HAVE_VEC
+    for(; length - i >= 64; i += 64){
+        const char* t = text+i;
+        uint64_t mask = vec_mask64(csv_special(vec_load(t), sep),    csv_special(vec_load(t+16), sep),
+                                   csv_special(vec_load(t+32), sep), csv_special(vec_load(t+48), sep));
+        if(mask)
+            return i + ctz_64(mask);
+    }
+    for(; length - i >= 16; i += 16){
+        uint64_t mask = vec_mask(csv_special(vec_load(text+i), sep));
+        if(mask)
+            return i + ctz_64(mask)/VEC_MASK_BITS;
+    }
+#endif
+    for(; i < length; i++){
+        char c = text[i];
+        if(c == sep || c == '"' || c == '\n' || c == '\r')
+            break;
+    }
+    return i;
+}
+
+static
 void
-analyze_line(ParseLocation* loc){
-    if(loc->cursor == loc->line_start)
+write_csv_cell(MStringBuilder* sb, StringView cell, char sep){
+    size_t n = csv_plain_length(cell.text, cell.length, sep);
+    if(n == cell.length){
+        msb_write_str(sb, cell.text, cell.length);
         return;
-    const char* endline = NULL;
-    const char* cursor = loc->cursor;
-    int nspace = 0;
-    size_t length = loc->end - loc->cursor;
-#if 1 && !defined(NO_SIMD) && defined(__x86_64__)
-    __m128i spaces  = _mm_set1_epi8(' ');
-    __m128i cr      = _mm_set1_epi8('\r');
-    __m128i tabs    = _mm_set1_epi8('\t');
-    while(length >= 16){
-        __m128i data         = _mm_loadu_si128((const __m128i*)cursor);
-        __m128i test_space = _mm_cmpeq_epi8(data, spaces);
-        __m128i test_cr    = _mm_cmpeq_epi8(data, cr);
-        __m128i test_tabs  = _mm_cmpeq_epi8(data, tabs);
-        __m128i spacecr    = _mm_or_si128(test_space, test_cr);
-        __m128i whitespace = _mm_or_si128(spacecr, test_tabs);
-        unsigned mask = _mm_movemask_epi8(whitespace);
-        int n = ctz_32(~mask);
-        nspace += n;
-        if(n != 16){
-            cursor += n;
-            length -= n;
-            goto Lafterwhitespace;
+    }
+    if(sep == '\t'){
+        // Quotes are fine in tsv, but there's no escaping tabs or newlines.
+        msb_write_str(sb, cell.text, n);
+        for(size_t i = n; i < cell.length; i++){
+            char c = cell.text[i];
+            msb_write_char(sb, c == '\t' || c == '\n' || c == '\r'? ' ' : c);
         }
-        cursor += 16;
-        length -= 16;
+        return;
     }
-#endif
-
-#if 1 && !defined(NO_SIMD) && defined(__wasm_simd128__)
-    v128_t spaces = wasm_i8x16_splat(' ');
-    v128_t cr     = wasm_i8x16_splat('\r');
-    v128_t tabs   = wasm_i8x16_splat('\t');
-    while(length >= 16){
-        v128_t data       = wasm_v128_load(cursor);
-        v128_t test_space = wasm_i8x16_eq(data, spaces);
-        v128_t test_cr    = wasm_i8x16_eq(data, cr);
-        v128_t test_tabs  = wasm_i8x16_eq(data, tabs);
-        v128_t whitespace = test_space | test_cr | test_tabs;
-        unsigned mask = wasm_i8x16_bitmask(whitespace);
-        int n = ctz_32(~mask);
-        nspace += n;
-        if(n != 16){
-            cursor += n;
-            length -= n;
-            goto Lafterwhitespace;
+    msb_write_char(sb, '"');
+    const char* text = cell.text;
+    const char* end = cell.text + cell.length;
+    for(;;){
+        const char* quote = memchr(text, '"', end - text);
+        if(!quote){
+            msb_write_str(sb, text, end - text);
+            break;
         }
-        cursor += 16;
-        length -= 16;
+        msb_write_str(sb, text, quote + 1 - text);
+        msb_write_char(sb, '"');
+        text = quote + 1;
     }
-#endif
+    msb_write_char(sb, '"');
+}
 
-#if 1 && !defined(NO_SIMD) && defined(__ARM_NEON)
-    uint8x16_t spaces = vdupq_n_u8(' ');
-    uint8x16_t cr     = vdupq_n_u8('\r');
-    uint8x16_t tabs   = vdupq_n_u8('\t');
-    while(length >= 16){
-        uint8x16_t data       = vld1q_u8((const unsigned char*)cursor);
-        uint8x16_t test_space = vceqq_u8(data, spaces);
-        uint8x16_t test_cr    = vceqq_u8(data, cr);
-        uint8x16_t test_tabs  = vceqq_u8(data, tabs);
-        uint8x16_t spacecr    = vorrq_u8(test_space, test_cr);
-        uint8x16_t whitespace = vorrq_u8(spacecr, test_tabs);
-        uint64_t fatmask = vector128_to_fatmask(whitespace);
-        int n = ctz_64(~fatmask)/4;
-
-        nspace += n;
-        if(n != 16){
-            cursor += n;
-            length -= n;
-            goto Lafterwhitespace;
-        }
-        cursor += 16;
-        length -= 16;
+//
+// Gives the rows written so far to the caller once there are enough.
+static
+int
+flush_tables(TableWriter* w, _Bool force){
+    if(w->sb.errored) return ERROR_OOM;
+    if(!w->sb.cursor || (!force && w->sb.cursor < TABLES_FLUSH_SIZE))
+        return 0;
+    int e = w->func(w->userdata, (StringView){w->sb.cursor, w->sb.data});
+    w->sb.cursor = 0;
+    return e;
+}
+
+static
+int
+write_table(TableWriter* w, Node* table){
+    MStringBuilder* sb = &w->sb;
+    if(w->format == DRMD_TABLES_JSON){
+        if(w->n_tables)
+            msb_write_literal(sb, ",\n");
+        msb_write_char(sb, '[');
     }
-#endif
-    for(;length;length--,cursor++){
-        char ch = *cursor;
-        switch(ch){
-            case ' ': case '\r': case '\t':
-                nspace++;
-                continue;
-            default:
-                goto Lafterwhitespace;
+    else if(w->n_tables)
+        msb_write_char(sb, '\n');
+    w->n_tables++;
+    char sep = w->format == DRMD_TABLES_TSV? '\t' : ',';
+    _Bool first_row = 1;
+    NODE_CHILDREN_FOR_EACH(row, table){
+        Node* row_node = get_node(w->ctx, *row);
+        _Bool first = 1;
+        if(w->format == DRMD_TABLES_JSON){
+            if(!first_row)
+                msb_write_literal(sb, ",\n");
+            msb_write_char(sb, '[');
+            NODE_CHILDREN_FOR_EACH(it, row_node){
+                Node* cell = get_node(w->ctx, *it);
+                if(!first) msb_write_char(sb, ',');
+                msb_write_char(sb, '"');
+                write_json_escaped_str(sb, cell->header.text, cell->header.length);
+                msb_write_char(sb, '"');
+                first = 0;
+            }
+            msb_write_char(sb, ']');
+        }
+        else {
+            NODE_CHILDREN_FOR_EACH(it, row_node){
+                if(!first) msb_write_char(sb, sep);
+                first = 0;
+                write_csv_cell(sb, get_node(w->ctx, *it)->header, sep);
+            }
+            // A blank line would be a row without cells (or the end of
+            // the table), so quote a single empty cell. Tsv has no quoting,
+            // but cells are stripped, so a lone space can't be anything else.
+            if(node_children_count(row_node) == 1 && !get_node(w->ctx, node_children(row_node)[0])->header.length){
+                if(sep == ',')
+                    msb_write_literal(sb, "\"\"");
+                else
+                    msb_write_char(sb, ' ');
+            }
+            msb_write_char(sb, '\n');
         }
+        first_row = 0;
+        int e = flush_tables(w, 0);
+        if(e) return e;
     }
-    Lafterwhitespace:;
-    length = loc->end - cursor;
-#if 1 && !defined(NO_SIMD) && defined(__x86_64__)
-    __m128i newline = _mm_set1_epi8('\n');
-    __m128i zed     = _mm_set1_epi8(0);
-    while(length >= 16){
-        __m128i data    = _mm_loadu_si128((const __m128i*)(cursor));
-        __m128i testnl  = _mm_cmpeq_epi8(data, newline);
-        __m128i testzed = _mm_cmpeq_epi8(data, zed);
-        __m128i testend = _mm_or_si128(testnl, testzed);
-        unsigned end = _mm_movemask_epi8(testend);
-        if(end){
-            unsigned endoff = ctz_32(end);
-            endline = cursor + endoff;
-            goto Lfinish;
+    if(w->format == DRMD_TABLES_JSON)
+        msb_write_char(sb, ']');
+    return 0;
+}
+
+static
+int
+extract_tables_(TableWriter* w, NodeHandle handle, int node_depth){
+    if(node_depth > MAX_NODE_DEPTH) return ERROR_TOO_DEEP;
+    Node* node = get_node(w->ctx, handle);
+    switch(node->type){
+        case NODE_TABLE:
+            return write_table(w, node);
+        // Tables can only be in containers of blocks.
+        case NODE_MD:
+        case NODE_BULLETS:
+        case NODE_LIST:
+        case NODE_LIST_ITEM:
+        case NODE_QUOTE:
+            NODE_CHILDREN_FOR_EACH(it, node){
+                int e = extract_tables_(w, *it, node_depth+1);
+                if(e) return e;
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+static
+int
+extract_tables(DrMdContext* ctx, NodeHandle root, DrMdTableFormat format, DrMdOutputFunc* func, void*_Nullable userdata){
+    TableWriter w = {
+        .ctx = ctx,
+        .format = format,
+        .sb = {.allocator = MALLOCATOR},
+        .func = func,
+        .userdata = userdata,
+    };
+    if(format == DRMD_TABLES_JSON)
+        msb_write_char(&w.sb, '[');
+    int e = extract_tables_(&w, root, 0);
+    if(!e && format == DRMD_TABLES_JSON)
+        msb_write_literal(&w.sb, "]\n");
+    if(!e)
+        e = flush_tables(&w, 1);
+    msb_destroy(&w.sb);
+    return e;
+}
+
+//
+// Markdown rendering.
+//
+// Writes the tree back out as markdown in one canonical form: "-" bullets,
+// lists numbered from 1 with nested lists indented to the text of their
+// item, "> " before every line of a quote, table cells padded to the width
+// of their column and a blank line between blocks. The text itself is
+// copied from the input as is, so the output renders to the same html as
+// the input did.
+//
+
+typedef struct MdRenderer MdRenderer;
+struct MdRenderer {
+    DrMdContext* ctx;
+    MStringBuilder* sb;
+    // Written at the start of every line: the markers of the enclosing
+    // quotes and the indentation of the enclosing list items.
+    char prefix[256];
+    int prefix_length;
+};
+
+static inline
+int
+md_push_prefix(MdRenderer* r, const char* text, int length){
+    if(r->prefix_length + length > (int)sizeof r->prefix)
+        return ERROR_TOO_DEEP;
+    memcpy(r->prefix + r->prefix_length, text, length);
+    r->prefix_length += length;
+    return 0;
+}
+
+static inline
+void
+md_write_line(MdRenderer* r, StringView text){
+    int n = r->prefix_length;
+    // Blank lines don't get trailing spaces.
+    if(!text.length)
+        while(n && r->prefix[n-1] == ' ')
+            n--;
+    msb_write_str(r->sb, r->prefix, n);
+    msb_write_str(r->sb, text.text, text.length);
+    msb_write_char(r->sb, '\n');
+}
+
+//
+// Writes each of the node's strings as a line. Without a prefix to put
+// between them, lines that are next to each other in the input (like most
+// of a code block) are copied as one span.
+static
+void
+md_write_lines(MdRenderer* r, Node* node){
+    size_t count = node_children_count(node);
+    NodeHandle* children = node_children(node);
+    for(size_t i = 0; i < count;){
+        StringView line = get_node(r->ctx, children[i++])->header;
+        if(!r->prefix_length){
+            for(; i < count; i++){
+                StringView next = get_node(r->ctx, children[i])->header;
+                // Only the newline is between them.
+                if(next.text != line.text + line.length + 1)
+                    break;
+                line.length += 1 + next.length;
+            }
         }
-        cursor += 16;
-        length -= 16;
+        md_write_line(r, line);
     }
-#endif
-#if 1 && !defined(NO_SIMD) && defined(__wasm_simd128__)
-    v128_t newline = wasm_i8x16_splat('\n');
-    v128_t zed     = wasm_i8x16_splat(0);
-    while(length >= 16){
-        v128_t data    = wasm_v128_load(cursor);
-        v128_t testnl  = wasm_i8x16_eq(data, newline);
-        v128_t testzed = wasm_i8x16_eq(data, zed);
-        v128_t testend = testnl | testzed;
-        unsigned end = wasm_i8x16_bitmask(testend);
-        if(end){
-            unsigned endoff = ctz_32(end);
-            endline = cursor + endoff;
-            goto Lfinish;
+}
+
+//
+// utf-8 characters in the text.
+static inline
+size_t
+md_columns(StringView text){
+    size_t columns = 0;
+    for(size_t i = 0; i < text.length; i++)
+        columns += ((unsigned char)text.text[i] & 0xc0) != 0x80;
+    return columns;
+}
+
+static
+int
+render_md_table(MdRenderer* r, Node* table){
+    DrMdContext* ctx = r->ctx;
+    size_t ncols = 0;
+    NODE_CHILDREN_FOR_EACH(it, table){
+        size_t n = node_children_count(get_node(ctx, *it));
+        if(n > ncols) ncols = n;
+    }
+    if(!ncols)
+        return 0;
+    size_t* widths = Allocator_zalloc(main_allocator(ctx), ncols * sizeof *widths);
+    if(!widths)
+        return ERROR_OOM;
+    NODE_CHILDREN_FOR_EACH(it, table){
+        size_t j = 0;
+        NODE_CHILDREN_FOR_EACH(c, get_node(ctx, *it)){
+            size_t w = md_columns(get_node(ctx, *c)->header);
+            if(w > widths[j]) widths[j] = w;
+            j++;
         }
-        cursor += 16;
-        length -= 16;
     }
-#endif
-#if 1 && !defined(NO_SIMD) && defined(__ARM_NEON)
-    uint8x16_t newline = vdupq_n_u8('\n');
-    uint8x16_t zed     = vdupq_n_u8(0);
-    while(length >= 16){
-        uint8x16_t data    = vld1q_u8((const unsigned char*)cursor);
-        uint8x16_t testnl  = vceqq_u8(data, newline);
-        uint8x16_t testzed = vceqq_u8(data, zed);
-        uint8x16_t testend = vorrq_u8(testnl, testzed);
-        uint64_t end       = vector128_to_fatmask(testend);
-        if(end){
-            unsigned endoff = ctz_64(end)/4;
-            endline = cursor + endoff;
-            goto Lfinish;
+    NODE_CHILDREN_FOR_EACH(it, table){
+        msb_write_str(r->sb, r->prefix, r->prefix_length);
+        msb_write_char(r->sb, '|');
+        size_t j = 0;
+        NODE_CHILDREN_FOR_EACH(c, get_node(ctx, *it)){
+            StringView text = get_node(ctx, *c)->header;
+            msb_write_char(r->sb, ' ');
+            msb_write_str(r->sb, text.text, text.length);
+            msb_write_nchar(r->sb, ' ', widths[j] - md_columns(text) + 1);
+            msb_write_char(r->sb, '|');
+            j++;
         }
-        cursor += 16;
-        length -= 16;
+        msb_write_char(r->sb, '\n');
     }
-#endif
-    for(;length;length--,cursor++){
-        switch(*cursor){
-            case '\n': case '\0':
-                endline = cursor;
-                goto Lfinish;
-            default:
-                continue;
+    return 0;
+}
+
+static
+int
+render_md_node(MdRenderer* r, NodeHandle handle, int node_depth);
+
+static
+int
+render_md_list(MdRenderer* r, Node* list, int node_depth){
+    DrMdContext* ctx = r->ctx;
+    size_t number = 0;
+    NODE_CHILDREN_FOR_EACH(it, list){
+        Node* item = get_node(ctx, *it);
+        msb_write_str(r->sb, r->prefix, r->prefix_length);
+        int marker_length = 2;
+        if(list->type == NODE_BULLETS)
+            msb_write_literal(r->sb, "- ");
+        else {
+            number++;
+            msb_write_uint(r->sb, number);
+            msb_write_literal(r->sb, ". ");
+            for(size_t n = number; n >= 10; n /= 10)
+                marker_length++;
+            marker_length++;
+        }
+        size_t count = node_children_count(item);
+        NodeHandle* children = node_children(item);
+        size_t i = 0;
+        // The item's first line goes after the marker.
+        if(count && get_node(ctx, children[0])->type == NODE_STRING){
+            StringView text = get_node(ctx, children[0])->header;
+            msb_write_str(r->sb, text.text, text.length);
+            i++;
+        }
+        msb_write_char(r->sb, '\n');
+        int saved = r->prefix_length;
+        int e = md_push_prefix(r, "                        ", marker_length);
+        if(e) return e;
+        for(; i < count; i++){
+            Node* child = get_node(ctx, children[i]);
+            if(child->type == NODE_STRING)
+                md_write_line(r, child->header);
+            else {
+                e = render_md_node(r, children[i], node_depth+1);
+                if(e) return e;
+            }
         }
+        r->prefix_length = saved;
     }
-    endline = cursor;
+    return 0;
+}
 
-    Lfinish:;
-    loc->line_end = endline;
-    loc->line_start = loc->cursor;
-    loc->nspaces = nspace;
+static
+int
+render_md_node(MdRenderer* r, NodeHandle handle, int node_depth){
+    if(node_depth > MAX_NODE_DEPTH) return ERROR_TOO_DEEP;
+    DrMdContext* ctx = r->ctx;
+    Node* node = get_node(ctx, handle);
+    switch(node->type){
+        case NODE_INVALID:
+        case NODE_TABLE_ROW:
+        case NODE_LIST_ITEM:
+            return -1;
+        case NODE_MD:{
+            _Bool first = 1;
+            NODE_CHILDREN_FOR_EACH(it, node){
+                if(!first) md_write_line(r, (StringView){0});
+                first = 0;
+                int e = render_md_node(r, *it, node_depth+1);
+                if(e) return e;
+            }
+            return 0;
+        }
+        case NODE_QUOTE:{
+            int saved = r->prefix_length;
+            int e = md_push_prefix(r, "> ", 2);
+            if(e) return e;
+            // A blank line after a line of text would be kept as part of
+            // the text, but is needed after a block to end it.
+            _Bool after_block = 0;
+            if(!node_children_count(node))
+                md_write_line(r, (StringView){0});
+            NODE_CHILDREN_FOR_EACH(it, node){
+                if(after_block) md_write_line(r, (StringView){0});
+                Node* child = get_node(ctx, *it);
+                after_block = child->type != NODE_STRING;
+                if(!after_block)
+                    md_write_line(r, child->header);
+                else {
+                    e = render_md_node(r, *it, node_depth+1);
+                    if(e) return e;
+                }
+            }
+            r->prefix_length = saved;
+            return 0;
+        }
+        case NODE_STRING:
+            md_write_line(r, node->header);
+            return 0;
+        case NODE_PARA:
+            md_write_lines(r, node);
+            return 0;
+        case NODE_H:{
+            msb_write_str(r->sb, r->prefix, r->prefix_length);
+            msb_write_nchar(r->sb, '#', node->heading_level);
+            // The leading space is part of the heading's text, but
+            // trailing space (like a '\r') is left out.
+            StringView text = node->header;
+            while(text.length && (unsigned char)text.text[text.length-1] <= ' ')
+                text.length--;
+            msb_write_str(r->sb, text.text, text.length);
+            msb_write_char(r->sb, '\n');
+            return 0;
+        }
+        case NODE_PRE:{
+            StringView fence = node->header;
+            md_write_line(r, fence);
+            md_write_lines(r, node);
+            msb_write_str(r->sb, r->prefix, r->prefix_length);
+            msb_write_nchar(r->sb, fence.text[0], 3);
+            msb_write_char(r->sb, '\n');
+            return 0;
+        }
+        case NODE_TABLE:
+            return render_md_table(r, node);
+        case NODE_BULLETS:
+        case NODE_LIST:
+            return render_md_list(r, node, node_depth);
+    }
+    return -1;
 }
 
+static
+int
+render_to_md(DrMdContext* ctx, NodeHandle root, MStringBuilder* msb){
+    MdRenderer r = {.ctx = ctx, .sb = msb};
+    int e = render_md_node(&r, root, 0);
+    if(e) return e;
+    if(msb->errored) return ERROR_OOM;
+    return 0;
+}
 
 #ifdef __clang__
 #pragma clang assume_nonnull end
@@ -3,6 +3,10 @@
 #include "stringview.h"
 #ifdef __clang__
 #pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
 #endif
 
 #ifndef DRMD_API
@@ -12,6 +16,267 @@
 DRMD_API
 int drmd_to_html(StringView input, StringView* output);
 
+//
+// A parser and renderer that keeps its memory between documents, for
+// converting many documents in a row. Not thread-safe; use one per thread.
+typedef struct DrMdContext DrMdContext;
+
+DRMD_API
+DrMdContext*_Nullable drmd_context_create(void);
+
+DRMD_API
+void drmd_context_destroy(DrMdContext* ctx);
+
+//
+// Like `drmd_to_html`, but the output is owned by the context and only valid
+// until the next call with that context or it is destroyed.
+DRMD_API
+int drmd_context_to_html(DrMdContext* ctx, StringView input, StringView* output);
+
+//
+// A parsed document, for rendering the same input many times without parsing
+// it again. Documents are immutable once parsed, so any number of threads can
+// render one at the same time. They are reference counted: `drmd_parse`
+// returns one reference and the document is freed when the last is
+// released.
+typedef struct DrMdDocument DrMdDocument;
+
+//
+// The input is copied, so it doesn't need to outlive the document.
+DRMD_API
+int drmd_parse(StringView input, DrMdDocument*_Nullable* document);
+
+DRMD_API
+DrMdDocument* drmd_document_retain(DrMdDocument* document);
+
+DRMD_API
+void drmd_document_release(DrMdDocument* document);
+
+//
+// How many bytes of memory the document holds.
+DRMD_API
+size_t drmd_document_size(const DrMdDocument* document);
+
+//
+// Like `drmd_to_html` and `drmd_to_json` without the parsing. They don't
+// change the document, so many threads can call them on the same one.
+DRMD_API
+int drmd_document_to_html(DrMdDocument* document, StringView* output);
+
+DRMD_API
+int drmd_document_to_json(DrMdDocument* document, StringView* output);
+
+//
+// Pull-based html rendering, for sending output as it is produced at the
+// caller's pace (e.g. chunked http responses). `drmd_render_begin` parses
+// the input, which must outlive the cursor. Each `drmd_render_next` fills up
+// to `cap` bytes of `buf` with the next part of the html and sets `written`;
+// it is only less than `cap` once the end is reached, after which it is 0.
+// Concatenating all of the output is the same as `drmd_to_html`.
+typedef struct DrMdRenderCursor DrMdRenderCursor;
+
+DRMD_API
+int drmd_render_begin(StringView input, DrMdRenderCursor*_Nullable* cursor);
+
+DRMD_API
+int drmd_render_next(DrMdRenderCursor* cursor, char* buf, size_t cap, size_t* written);
+
+DRMD_API
+void drmd_render_end(DrMdRenderCursor* cursor);
+
+//
+// Renders the input for reading in a terminal: utf-8 text with ANSI bold and
+// underline for headings and inline tags, indented lists, box-drawn tables
+// and paragraphs word-wrapped to `width` columns.
+DRMD_API
+int drmd_to_term(StringView input, int width, StringView* output);
+
+//
+// Renders the parsed document as a json tree instead of html. Every node is
+// {"type": ..., "children": [...]}, except STRING and H nodes, which have the
+// byte "offset" of their text in the input and the "text" instead (and H a
+// "level").
+DRMD_API
+int drmd_to_json(StringView input, StringView* output);
+
+//
+// Parses the input and writes it back out as markdown in a canonical form:
+// "-" bullets, lists numbered from 1 with nested lists indented to the text
+// of their item, "> " before every line of a quote, table columns padded to
+// the same width and a blank line between blocks. The text is copied as is,
+// so the output renders to the same html.
+DRMD_API
+int drmd_to_md(StringView input, StringView* output);
+
+//
+// Called for each link target found by `drmd_links`. `offset` is the byte
+// offset of the target within the input. Return non-zero to stop early.
+typedef int (DrMdLinkFunc)(void*_Nullable userdata, StringView target, size_t offset);
+
+//
+// Parses the input and reports every [text](target) link without rendering.
+// Returns 0 on success, otherwise an error or whatever `func` stopped with.
+DRMD_API
+int drmd_links(StringView input, DrMdLinkFunc* func, void*_Nullable userdata);
+
+typedef enum DrMdTableFormat DrMdTableFormat;
+enum DrMdTableFormat {
+    // Cells with a comma, quote or newline are quoted, with quotes doubled.
+    DRMD_TABLES_CSV,
+    // Tabs and newlines in cells become spaces, as tsv can't escape them.
+    // A row of one empty cell is written as a single space, so it isn't
+    // mistaken for the blank line between tables.
+    DRMD_TABLES_TSV,
+    // An array of tables, each an array of rows of cell strings.
+    DRMD_TABLES_JSON,
+};
+
+//
+// Called with the next part of some output. Return non-zero to stop early.
+typedef int (DrMdOutputFunc)(void*_Nullable userdata, StringView output);
+
+//
+// Parses the input and outputs the cells of its tables, header row first,
+// without rendering anything else. In csv and tsv each row is a line and
+// tables are separated by a blank line. Cells are the text as written, with
+// surrounding whitespace stripped. The output is given to `func` in whole
+// rows, a buffer at a time, so it doesn't all have to fit in memory.
+// Returns 0 on success, otherwise an error or whatever `func` stopped with.
+DRMD_API
+int drmd_tables(StringView input, DrMdTableFormat format, DrMdOutputFunc* func, void*_Nullable userdata);
+
+typedef struct DrMdDiagnostic DrMdDiagnostic;
+struct DrMdDiagnostic {
+    // 1-based line the problem was found on.
+    int lineno;
+    StringView message;
+};
+
+//
+// Called for each problem found by `drmd_check`. Return non-zero to stop
+// early.
+typedef int (DrMdDiagnosticFunc)(void*_Nullable userdata, const DrMdDiagnostic* diagnostic);
+
+//
+// Parses the input without rendering, looking for authoring mistakes:
+// unterminated code fences, lists nested too deeply and table rows with a
+// different number of cells than the header.
+// Sets `error_count` to the number of problems found and reports each to
+// `func`. Returns 0 on success, otherwise an error or whatever `func`
+// stopped with.
+DRMD_API
+int drmd_check(StringView input, DrMdDiagnosticFunc* func, void*_Nullable userdata, size_t* error_count);
+
+typedef struct DrMdStats DrMdStats;
+struct DrMdStats {
+    // Words and utf-8 characters of the text as displayed: not counting
+    // code blocks, inline tags or the targets of links.
+    size_t words;
+    size_t characters;
+    // Lines inside of code blocks.
+    size_t code_lines;
+    // How many of each kind of node the document has.
+    size_t paragraphs;
+    size_t headings;
+    size_t bullet_lists;
+    size_t ordered_lists;
+    size_t list_items;
+    size_t tables;
+    size_t table_rows;
+    size_t quotes;
+    size_t code_blocks;
+};
+
+//
+// Parses the input and counts words, characters, code lines and blocks
+// without rendering.
+DRMD_API
+int drmd_stats(StringView input, DrMdStats* stats);
+
+//
+// Escapes text that isn't markdown (titles, names, ...) for html, without
+// any of the markdown handling: only &, < and > are replaced, or with
+// DRMD_ESCAPE_ATTRIBUTE also " and ' for use in a quoted attribute value.
+// Control characters html doesn't allow are dropped. The output is allocated
+// the same way as `drmd_to_html`'s.
+typedef enum DrMdEscapeMode DrMdEscapeMode;
+enum DrMdEscapeMode {
+    DRMD_ESCAPE_TEXT,
+    DRMD_ESCAPE_ATTRIBUTE,
+};
+
+DRMD_API
+int drmd_escape_html(StringView input, DrMdEscapeMode mode, StringView* output);
+
+//
+// The kinds of nodes in a parsed document, named as in `drmd_to_json`.
+typedef enum DrMdNodeType DrMdNodeType;
+enum DrMdNodeType {
+    DRMD_NODE_MD = 1,    // The whole document.
+    DRMD_NODE_STRING,    // A line of text.
+    DRMD_NODE_PARA,
+    DRMD_NODE_TABLE,
+    DRMD_NODE_TABLE_ROW,
+    DRMD_NODE_BULLETS,
+    DRMD_NODE_LIST,
+    DRMD_NODE_LIST_ITEM,
+    DRMD_NODE_QUOTE,
+    DRMD_NODE_PRE,
+    DRMD_NODE_H,
+    DRMD_NODE_TYPE_COUNT,
+};
+
+typedef struct DrMdRenderNode DrMdRenderNode;
+struct DrMdRenderNode {
+    DrMdNodeType type;
+    // 1 to 6 for headings, otherwise 0.
+    int level;
+    // The text of a STRING or heading and the info string of a code block
+    // (what follows the opening fence, like "c"), as written in the input.
+    StringView text;
+    // The id of a heading, if headings get ids (like in --batch).
+    StringView id;
+};
+
+//
+// Where a render hook writes its html.
+typedef struct DrMdHtmlWriter DrMdHtmlWriter;
+
+//
+// Writes html as is.
+DRMD_API
+void drmd_write_html(DrMdHtmlWriter* writer, StringView html);
+
+//
+// Writes text escaped like `drmd_escape_html` does.
+DRMD_API
+void drmd_write_escaped_html(DrMdHtmlWriter* writer, StringView text, DrMdEscapeMode mode);
+
+//
+// Called while rendering a node. Return non-zero to stop rendering, which
+// then fails with that.
+typedef int (DrMdRenderHook)(void*_Nullable userdata, const DrMdRenderNode* node, DrMdHtmlWriter* writer);
+
+//
+// Hooks by node type, for customizing the html without parsing it again.
+// An `open` hook is written instead of the node's start tag (like
+// `<table>` or `<h2 id="...">`) and a `close` hook instead of its end tag,
+// or where the end tag would be for nodes that leave it out (paragraphs,
+// list items, table rows) and for documents and text, which have no tags.
+// Children and the newlines between tags are rendered as usual.
+typedef struct DrMdRenderHooks DrMdRenderHooks;
+struct DrMdRenderHooks {
+    DrMdRenderHook*_Nullable open[DRMD_NODE_TYPE_COUNT];
+    DrMdRenderHook*_Nullable close[DRMD_NODE_TYPE_COUNT];
+    void*_Nullable userdata;
+};
+
+//
+// Uses the hooks for the html of following `drmd_context_to_html` calls,
+// until set to NULL. The hooks must outlive their use.
+DRMD_API
+void drmd_context_set_render_hooks(DrMdContext* ctx, const DrMdRenderHooks*_Nullable hooks);
+
 #ifdef __clang__
 #pragma clang assume_nonnull end
 #endif
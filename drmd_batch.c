@@ -0,0 +1,520 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+// Batch conversion of many markdown files, each foo.md to foo.html.
+//
+// Each worker thread keeps a window of files in flight through batch_io.h,
+// so reads of the next files and writes of the previous ones overlap with
+// converting the current one, and on linux all of that io is submitted
+// with a single io_uring syscall per completion waited on.
+//
+// Included after drmd.c by drmd_cli.c.
+//
+#include <stdio.h>
+#include "thread_util.h"
+#include "batch_io.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+typedef struct BatchFile BatchFile;
+struct BatchFile {
+    const char* input;
+    const char* output;
+    // Only when building the link graph.
+    SitePage*_Nullable page;
+};
+
+enum {
+    BATCH_MAX_WORKERS = 64,
+    // Files in flight per worker.
+    BATCH_WINDOW = 32,
+    // Each slot's registered read buffer. Bigger files move to a heap buffer.
+    BATCH_READ_SIZE = 64*1024,
+    // Room for each slot's operation plus the closes nobody waits for.
+    BATCH_DEPTH = 4*BATCH_WINDOW,
+};
+
+enum BatchSlotState {
+    BATCH_SLOT_FREE,
+    BATCH_SLOT_OPENING,
+    BATCH_SLOT_READING,
+    BATCH_SLOT_CREATING,
+    BATCH_SLOT_WRITING,
+};
+
+typedef struct BatchSlot BatchSlot;
+struct BatchSlot {
+    enum BatchSlotState state;
+    const BatchFile* file;
+    int fd;
+    // Either this slot's registered buffer or `big`.
+    char* data;
+    size_t length;
+    size_t capacity;
+    // Kept between files for the ones that don't fit in the registered
+    // buffer.
+    char*_Nullable big;
+    size_t big_capacity;
+    // The html, also kept between files.
+    char*_Nullable out;
+    size_t out_capacity;
+    size_t out_length;
+    size_t written;
+};
+
+typedef struct BatchWorker BatchWorker;
+struct BatchWorker {
+    Thread thread;
+    DrMdContext*_Nullable ctx;
+    const BatchFile* begin;
+    const BatchFile* end;
+    // Appended to every document (the stylesheet).
+    StringView suffix;
+    // The link graph, if one is being built.
+    const Site*_Nullable site;
+    // Whether to scan the pages into the link graph, and to only do that
+    // without writing any html.
+    _Bool scan, scan_only;
+    // Whether to add the backlinks to each page, once the graph is done.
+    _Bool backlinks;
+    // What the scanned pages' data is allocated from.
+    ArenaAllocator site_arena;
+    // Set while the worker runs, if building the link graph.
+    SiteLinks*_Nullable links;
+    Metrics*_Nullable metrics;
+    const Capture*_Nullable capture;
+    size_t errors;
+    // Operations in flight, including closes.
+    unsigned pending;
+    BatchIO io;
+    BatchSlot slots[BATCH_WINDOW];
+};
+
+// Completions for closes have no slot.
+enum {BATCH_NO_SLOT = 0};
+
+static
+void
+batch_close(BatchWorker* w, int fd){
+    batch_io_close(&w->io, fd, BATCH_NO_SLOT);
+    w->pending++;
+}
+
+static
+void
+batch_fail(BatchWorker* w, BatchSlot* slot, const char* path, const char* what, int err){
+    fprintf(stderr, "%s '%s': %s\n", what, path, strerror(err));
+    w->errors++;
+    if(w->metrics)
+        w->metrics->errors[METRICS_ERROR_IO]++;
+    if(slot->fd >= 0)
+        batch_close(w, slot->fd);
+    slot->fd = -1;
+    slot->state = BATCH_SLOT_FREE;
+}
+
+static
+void
+batch_read_more(BatchWorker* w, BatchSlot* slot, uint64_t user){
+    if(slot->length == slot->capacity){
+        size_t capacity = slot->capacity * 2;
+        // Growing big moves what was already read into it.
+        _Bool in_big = slot->data == slot->big;
+        if(slot->big_capacity < capacity){
+            char* big = Allocator_realloc(MALLOCATOR, slot->big, slot->big_capacity, capacity);
+            if(!big){
+                batch_fail(w, slot, slot->file->input, "Unable to read", ENOMEM);
+                return;
+            }
+            slot->big = big;
+            slot->big_capacity = capacity;
+        }
+        if(!in_big)
+            memcpy(slot->big, slot->data, slot->length);
+        slot->data = slot->big;
+        slot->capacity = slot->big_capacity;
+    }
+    batch_io_read(&w->io, slot->fd, slot->data + slot->length, slot->capacity - slot->length, slot->length, user);
+    w->pending++;
+}
+
+static
+void
+batch_convert(BatchWorker* w, BatchSlot* slot, uint64_t user){
+    batch_close(w, slot->fd);
+    slot->fd = -1;
+    const BatchFile* file = slot->file;
+    StringView text = {slot->length, slot->data};
+    // Only conversions that write html are recorded, so scanning for the
+    // backlinks doesn't count every file twice.
+    _Bool timed = !w->scan_only && w->ctx && (w->metrics || w->capture);
+    uint64_t start = timed? metrics_now() : 0;
+    NodeHandle root;
+    int err = w->ctx? context_parse(w->ctx, text, &root) : ERROR_OOM;
+    // Headings get ids so the links to them checked by the graph work.
+    if(!err && file->page)
+        err = collect_headings(w->ctx, root, SV(""));
+    if(!err && w->scan)
+        err = site_scan_page(file->page, allocator_from_arena(&w->site_arena), w->ctx, root, text);
+    MStringBuilder msb = {
+        .data = slot->out,
+        .capacity = slot->out_capacity,
+        .allocator = MALLOCATOR,
+    };
+    if(w->links)
+        w->links->from = file->page - w->site->pages;
+    uint64_t parsed = timed? metrics_now() : 0;
+    if(!err && !w->scan_only){
+        err = render_to_html(w->ctx, root, &msb);
+        if(!err && w->backlinks)
+            err = site_write_backlinks(w->site, file->page, &msb);
+        if(!err && w->suffix.length)
+            msb_write_str(&msb, w->suffix.text, w->suffix.length);
+        if(!err && msb.errored)
+            err = ERROR_OOM;
+    }
+    slot->out = msb.data;
+    slot->out_capacity = msb.capacity;
+    if(timed){
+        uint64_t rendered = metrics_now();
+        if(w->metrics)
+            metrics_record(w->metrics, w->ctx, text.length, msb.cursor, start, parsed, rendered, err);
+        if(w->capture)
+            capture_conversion(w->capture, w->ctx, (StringView){strlen(file->input), file->input}, text, parsed - start, rendered - parsed);
+    }
+    if(err){
+        fprintf(stderr, "Unable to convert '%s'\n", file->input);
+        w->errors++;
+        slot->state = BATCH_SLOT_FREE;
+        return;
+    }
+    if(w->scan_only){
+        slot->state = BATCH_SLOT_FREE;
+        return;
+    }
+    slot->out_length = msb.cursor;
+    slot->written = 0;
+    slot->state = BATCH_SLOT_CREATING;
+    batch_io_open(&w->io, file->output, 1, user);
+    w->pending++;
+}
+
+//
+// Moves a slot along once its operation completes.
+static
+void
+batch_advance(BatchWorker* w, BatchSlot* slot, uint64_t user, long long result){
+    const BatchFile* file = slot->file;
+    switch(slot->state){
+        case BATCH_SLOT_FREE:
+            assert(0);
+            break;
+        case BATCH_SLOT_OPENING:
+            if(result < 0){
+                batch_fail(w, slot, file->input, "Unable to open", (int)-result);
+                return;
+            }
+            slot->fd = (int)result;
+            slot->state = BATCH_SLOT_READING;
+            batch_read_more(w, slot, user);
+            return;
+        case BATCH_SLOT_READING:{
+            if(result < 0){
+                batch_fail(w, slot, file->input, "Error reading", (int)-result);
+                return;
+            }
+            size_t asked = slot->capacity - slot->length;
+            slot->length += (size_t)result;
+            // Inputs are regular files, so a short read is the end.
+            if((size_t)result < asked)
+                batch_convert(w, slot, user);
+            else
+                batch_read_more(w, slot, user);
+            return;
+        }
+        case BATCH_SLOT_CREATING:
+            if(result < 0){
+                batch_fail(w, slot, file->output, "Unable to open", (int)-result);
+                return;
+            }
+            slot->fd = (int)result;
+            slot->state = BATCH_SLOT_WRITING;
+            break;
+        case BATCH_SLOT_WRITING:
+            if(result <= 0 && slot->written != slot->out_length){
+                batch_fail(w, slot, file->output, "Error writing", result? (int)-result : EIO);
+                return;
+            }
+            slot->written += (size_t)result;
+            break;
+    }
+    if(slot->written == slot->out_length){
+        batch_close(w, slot->fd);
+        slot->fd = -1;
+        slot->state = BATCH_SLOT_FREE;
+        return;
+    }
+    batch_io_write(&w->io, slot->fd, slot->out + slot->written, slot->out_length - slot->written, slot->written, user);
+    w->pending++;
+}
+
+static
+void
+batch_worker(void* p){
+    BatchWorker* w = p;
+    w->ctx = drmd_context_create();
+    // Links to other inputs go to their outputs in the html.
+    SiteLinks links = {
+        .site = w->site,
+        .path = {.allocator = MALLOCATOR},
+        .href = {.allocator = MALLOCATOR},
+    };
+    LinkRewrite rewrite = {site_rewrite_link, &links};
+    if(w->ctx && (w->scan || w->backlinks)){
+        w->links = &links;
+        w->ctx->link_rewrite = &rewrite;
+    }
+    // The read buffers are registered once and reused for every file.
+    char* buffers = Allocator_alloc(MALLOCATOR, (size_t)BATCH_WINDOW*BATCH_READ_SIZE);
+    batch_io_init(&w->io, BATCH_DEPTH, buffers, BATCH_READ_SIZE, buffers? BATCH_WINDOW : 0);
+    char small[BATCH_WINDOW];
+    const BatchFile* next = w->begin;
+    size_t busy = 0;
+    for(;;){
+        for(size_t i = 0; i < BATCH_WINDOW; i++){
+            // These already failed and were reported when scanning.
+            while(w->backlinks && next != w->end && !next->page->scanned)
+                next++;
+            if(next == w->end)
+                break;
+            BatchSlot* slot = &w->slots[i];
+            if(slot->state != BATCH_SLOT_FREE)
+                continue;
+            // Leave room for the closes the slots can still queue.
+            if(w->pending + 3 > BATCH_DEPTH)
+                break;
+            slot->file = next++;
+            slot->fd = -1;
+            slot->data = buffers? buffers + i*BATCH_READ_SIZE : &small[i];
+            slot->capacity = buffers? BATCH_READ_SIZE : 1;
+            slot->length = 0;
+            slot->state = BATCH_SLOT_OPENING;
+            batch_io_open(&w->io, slot->file->input, 0, i+1);
+            w->pending++;
+            busy++;
+        }
+        if(!w->pending)
+            break;
+        BatchCompletion c;
+        batch_io_wait(&w->io, &c);
+        w->pending--;
+        if(c.user == BATCH_NO_SLOT)
+            continue;
+        BatchSlot* slot = &w->slots[c.user-1];
+        batch_advance(w, slot, c.user, c.result);
+        if(slot->state == BATCH_SLOT_FREE)
+            busy--;
+    }
+    assert(!busy);
+    batch_io_destroy(&w->io);
+    Allocator_free(MALLOCATOR, buffers, (size_t)BATCH_WINDOW*BATCH_READ_SIZE);
+    for(size_t i = 0; i < BATCH_WINDOW; i++){
+        BatchSlot* slot = &w->slots[i];
+        Allocator_free(MALLOCATOR, slot->big, slot->big_capacity);
+        Allocator_free(MALLOCATOR, slot->out, slot->out_capacity);
+    }
+    // The worker is run again for the second pass with backlinks.
+    memset(w->slots, 0, sizeof w->slots);
+    if(w->ctx)
+        drmd_context_destroy(w->ctx);
+    w->ctx = NULL;
+    w->links = NULL;
+    msb_destroy(&links.path);
+    msb_destroy(&links.href);
+}
+
+//
+// foo.md becomes foo.html, anything else gets .html added.
+static
+void
+batch_output_path(MStringBuilder* sb, StringView input){
+    if(input.length > 3 && memcmp(input.text + input.length - 3, ".md", 3) == 0)
+        input.length -= 3;
+    msb_write_str(sb, input.text, input.length);
+    msb_write_literal(sb, ".html");
+    msb_write_char(sb, '\0');
+}
+
+//
+// Runs every worker over its files, returning how many failed.
+static
+long long
+batch_run(BatchWorker* workers, int nworkers){
+    _Bool started[BATCH_MAX_WORKERS] = {0};
+    for(int i = 1; i < nworkers; i++)
+        started[i] = !thread_create(&workers[i].thread, batch_worker, &workers[i]);
+    batch_worker(&workers[0]);
+    long long errors = 0;
+    for(int i = 0; i < nworkers; i++){
+        if(started[i])
+            thread_join(&workers[i].thread);
+        else if(i)
+            batch_worker(&workers[i]);
+        errors += workers[i].errors;
+        workers[i].errors = 0;
+    }
+    return errors;
+}
+
+//
+// Reads a list of markdown files, one path per line, from `list` and writes
+// each one's html, with `suffix` appended, next to it.
+// With a `link_report` or `backlinks`, also builds the link graph of the
+// files and their headings (which then get ids): the links to inputs or
+// headings that don't exist are written to the report, and with backlinks
+// every page gets a list of the pages linking to it before the suffix. As
+// that needs the whole graph before writing anything, the inputs are then
+// read twice. Links to other inputs are also rewritten to go to their html.
+// If `metrics_path` is given, the metrics of the conversions are written
+// there at the end. With a `capture`, the conversions over its thresholds
+// are saved to its directory.
+// Returns the number of files that failed, or -1 if the list couldn't be
+// read.
+static
+long long
+drmd_batch(FILE* list, StringView suffix, int jobs, FILE*_Nullable link_report, _Bool backlinks, const char*_Nullable metrics_path, const Capture*_Nullable capture){
+    if(jobs < 1) jobs = 1;
+    if(jobs > BATCH_MAX_WORKERS) jobs = BATCH_MAX_WORKERS;
+    long long result = -1;
+    MStringBuilder paths = {.allocator = MALLOCATOR};
+    MStringBuilder outputs = {.allocator = MALLOCATOR};
+    BatchFile* files = NULL;
+    size_t count = 0;
+    BatchWorker* workers = NULL;
+    int nworkers = jobs;
+    Site site = {0};
+    for(;;){
+        if(msb_ensure_additional(&paths, 4096))
+            goto oom;
+        size_t nread = fread(paths.data + paths.cursor, 1, 4096, list);
+        paths.cursor += nread;
+        if(nread != 4096){
+            if(ferror(list)){
+                fprintf(stderr, "Error reading: %s\n", strerror(errno));
+                goto cleanup;
+            }
+            break;
+        }
+    }
+    msb_write_char(&paths, '\n');
+    if(paths.errored)
+        goto oom;
+    // Split into nul-terminated lines, build the output paths and count.
+    for(char *p = paths.data, *end = paths.data + paths.cursor; p != end;){
+        char* nl = memchr(p, '\n', end - p);
+        StringView line = {nl - p, p};
+        *nl = '\0';
+        if(line.length && line.text[line.length-1] == '\r')
+            nl[-1] = '\0', line.length--;
+        if(line.length){
+            batch_output_path(&outputs, line);
+            count++;
+        }
+        p = nl+1;
+    }
+    if(outputs.errored)
+        goto oom;
+    files = Allocator_alloc(MALLOCATOR, count * sizeof *files);
+    if(count && !files)
+        goto oom;
+    {
+        const char* out = outputs.data;
+        size_t i = 0;
+        for(const char *p = paths.data, *end = paths.data + paths.cursor; p != end; p += strlen(p)+1){
+            if(!*p) continue;
+            files[i++] = (BatchFile){p, out, NULL};
+            out += strlen(out)+1;
+        }
+    }
+    // Each worker should at least fill its window.
+    if((size_t)nworkers > count / BATCH_WINDOW)
+        nworkers = (int)(count / BATCH_WINDOW);
+    if(nworkers < 1) nworkers = 1;
+    workers = Allocator_zalloc(MALLOCATOR, nworkers * sizeof *workers);
+    if(!workers)
+        goto oom;
+    for(int i = 0; i < nworkers; i++){
+        workers[i].begin = files + count * i / nworkers;
+        workers[i].end = files + count * (i+1) / nworkers;
+        workers[i].suffix = suffix;
+        workers[i].capture = capture;
+        if(metrics_path){
+            workers[i].metrics = Allocator_zalloc(MALLOCATOR, sizeof(Metrics));
+            if(!workers[i].metrics)
+                goto oom;
+        }
+    }
+    _Bool linking = link_report || backlinks;
+    if(linking){
+        if(site_init(&site, count))
+            goto oom;
+        for(size_t i = 0; i < count; i++){
+            if(site_add_page(&site, i, files[i].input, files[i].output))
+                goto oom;
+            files[i].page = &site.pages[i];
+        }
+    }
+    for(int i = 0; i < nworkers; i++){
+        workers[i].site = &site;
+        workers[i].scan = linking;
+        workers[i].scan_only = backlinks;
+    }
+    result = batch_run(workers, nworkers);
+    if(linking){
+        long long broken = site_resolve(&site, link_report);
+        if(broken < 0)
+            goto oom;
+        if(broken)
+            fprintf(stderr, "%lld broken links\n", broken);
+    }
+    if(backlinks){
+        for(int i = 0; i < nworkers; i++){
+            workers[i].scan = 0;
+            workers[i].scan_only = 0;
+            workers[i].backlinks = 1;
+        }
+        result += batch_run(workers, nworkers);
+    }
+    if(metrics_path){
+        const Metrics* metrics[BATCH_MAX_WORKERS];
+        for(int i = 0; i < nworkers; i++)
+            metrics[i] = workers[i].metrics;
+        if(metrics_save(metrics_path, metrics, nworkers))
+            result = -1;
+    }
+    goto cleanup;
+
+    oom:
+    fprintf(stderr, "Out of memory\n");
+    cleanup:
+    if(workers){
+        for(int i = 0; i < nworkers; i++){
+            ArenaAllocator_free_all(&workers[i].site_arena);
+            if(workers[i].metrics)
+                Allocator_free(MALLOCATOR, workers[i].metrics, sizeof(Metrics));
+        }
+        Allocator_free(MALLOCATOR, workers, nworkers * sizeof *workers);
+    }
+    site_destroy(&site);
+    if(files)
+        Allocator_free(MALLOCATOR, files, count * sizeof *files);
+    msb_destroy(&paths);
+    msb_destroy(&outputs);
+    return result;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
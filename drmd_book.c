@@ -0,0 +1,384 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+// Book mode: many chapter files rendered into one html document, with a
+// table of contents of every chapter's headings at the top.
+//
+// Chapters are parsed in parallel first, as the table of contents needs all
+// of their headings before anything else can be written. Then they are
+// rendered in parallel and each is written out, in order, as soon as it and
+// every chapter before it is done.
+//
+// The chapters' nodes all come from one SharedArena, so the parse workers
+// claim arenas for them with an atomic increment instead of a malloc each,
+// and they are freed together once the book is written.
+//
+// Chapter n (from 1) is wrapped in <section id="cn"> and its headings get
+// ids of "cn-" followed by the slug of their text, so the same heading in
+// two chapters links to the right one. A chapter's links to its own
+// headings (#slug) are rewritten to match.
+//
+// Included after drmd.c and drmd_site.c by drmd_cli.c.
+//
+#include <stdio.h>
+#include "thread_util.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+typedef struct BookChapter BookChapter;
+struct BookChapter {
+    const char* path;
+    // The markdown, which the parsed nodes point into.
+    MStringBuilder text;
+    // Owns the parsed nodes and the heading anchors.
+    DrMdContext*_Nullable ctx;
+    NodeHandle root;
+    MStringBuilder html;
+    _Bool failed;
+    // Set with Book.lock held.
+    _Bool rendered;
+};
+
+typedef struct Book Book;
+struct Book {
+    BookChapter* chapters;
+    size_t count;
+    Mutex lock;
+    // Broadcast whenever a chapter is rendered.
+    CondVar chapter_rendered;
+    // The next chapter for a worker to take.
+    size_t next;
+    // Where the chapters' contexts get their arenas.
+    SharedArena arena;
+};
+
+enum {BOOK_MAX_WORKERS = 64};
+
+typedef struct BookWorker BookWorker;
+struct BookWorker {
+    Thread thread;
+    Book* book;
+};
+
+static
+void
+book_parse_chapter(BookChapter* chapter, size_t index, SharedArena* arena){
+    FILE* fp = fopen(chapter->path, "rb");
+    if(!fp){
+        fprintf(stderr, "Unable to open '%s': %s\n", chapter->path, strerror(errno));
+        chapter->failed = 1;
+        return;
+    }
+    MStringBuilder* text = &chapter->text;
+    for(;;){
+        if(msb_ensure_additional(text, 64*1024)){
+            fclose(fp);
+            fprintf(stderr, "Out of memory\n");
+            chapter->failed = 1;
+            return;
+        }
+        size_t nread = fread(text->data + text->cursor, 1, 64*1024, fp);
+        text->cursor += nread;
+        if(nread != 64*1024){
+            if(ferror(fp)){
+                fprintf(stderr, "Error reading '%s': %s\n", chapter->path, strerror(errno));
+                fclose(fp);
+                chapter->failed = 1;
+                return;
+            }
+            break;
+        }
+    }
+    fclose(fp);
+    chapter->ctx = drmd_context_create();
+    int err = 1;
+    if(chapter->ctx){
+        chapter->ctx->main_arena.shared = arena;
+        char prefix[32];
+        int n = snprintf(prefix, sizeof prefix, "c%zu-", index+1);
+        err = context_parse(chapter->ctx, (StringView){text->cursor, text->data? text->data : ""}, &chapter->root);
+        if(!err)
+            err = collect_headings(chapter->ctx, chapter->root, (StringView){.length=(size_t)n, .text=prefix});
+    }
+    if(err){
+        fprintf(stderr, "Unable to convert '%s'\n", chapter->path);
+        chapter->failed = 1;
+    }
+}
+
+typedef struct BookLinks BookLinks;
+struct BookLinks {
+    // The chapter's heading ids, sorted.
+    StringView* ids;
+    size_t count;
+    // "#cn-" of the chapter, followed by the last rewritten link's slug.
+    MStringBuilder target;
+    size_t prefix_length;
+};
+
+//
+// Rewrites #slug to #cn-slug if the chapter has a heading with that id.
+static
+int
+book_rewrite_link(void* p, StringView target, StringView* out){
+    BookLinks* links = p;
+    *out = target;
+    if(target.length < 2 || target.text[0] != '#')
+        return 0;
+    links->target.cursor = links->prefix_length;
+    msb_write_str(&links->target, target.text+1, target.length-1);
+    if(links->target.errored)
+        return ERROR_OOM;
+    StringView id = {links->target.cursor-1, links->target.data+1};
+    if(bsearch(&id, links->ids, links->count, sizeof *links->ids, site_compare_ids))
+        *out = msb_borrow_sv(&links->target);
+    return 0;
+}
+
+static
+void
+book_render_chapter(BookChapter* chapter, size_t index){
+    MStringBuilder* html = &chapter->html;
+    msb_write_literal(html, "<section id=\"c");
+    msb_write_uint(html, index+1);
+    msb_write_literal(html, "\">\n");
+    DrMdContext* ctx = chapter->ctx;
+    BookLinks links = {
+        .count = ctx->anchors.count,
+        .target = {.allocator = MALLOCATOR},
+    };
+    LinkRewrite rewrite = {book_rewrite_link, &links};
+    int err = 0;
+    if(links.count){
+        links.ids = Allocator_alloc(MALLOCATOR, links.count * sizeof *links.ids);
+        if(!links.ids)
+            err = ERROR_OOM;
+        else {
+            for(size_t i = 0; i < links.count; i++)
+                links.ids[i] = ctx->anchors.data[i].id;
+            qsort(links.ids, links.count, sizeof *links.ids, site_compare_ids);
+            msb_write_literal(&links.target, "#c");
+            msb_write_uint(&links.target, index+1);
+            msb_write_char(&links.target, '-');
+            links.prefix_length = links.target.cursor;
+            ctx->link_rewrite = &rewrite;
+        }
+    }
+    if(!err)
+        err = render_to_html(ctx, chapter->root, html);
+    ctx->link_rewrite = NULL;
+    if(links.ids)
+        Allocator_free(MALLOCATOR, links.ids, links.count * sizeof *links.ids);
+    msb_destroy(&links.target);
+    msb_write_literal(html, "</section>\n");
+    if(err || html->errored){
+        fprintf(stderr, "Unable to convert '%s'\n", chapter->path);
+        chapter->failed = 1;
+    }
+}
+
+//
+// Takes the next chapter to work on, or returns 0 if there are none left.
+// Call with book->lock held.
+static inline
+_Bool
+book_take_chapter(Book* book, size_t* index){
+    if(book->next == book->count) return 0;
+    *index = book->next++;
+    return 1;
+}
+
+static
+void
+book_parse_worker(void* p){
+    Book* book = ((BookWorker*)p)->book;
+    for(;;){
+        size_t i;
+        mutex_lock(&book->lock);
+        _Bool took = book_take_chapter(book, &i);
+        mutex_unlock(&book->lock);
+        if(!took) break;
+        book_parse_chapter(&book->chapters[i], i, &book->arena);
+    }
+}
+
+static
+void
+book_render_worker(void* p){
+    Book* book = ((BookWorker*)p)->book;
+    mutex_lock(&book->lock);
+    size_t i;
+    while(book_take_chapter(book, &i)){
+        mutex_unlock(&book->lock);
+        book_render_chapter(&book->chapters[i], i);
+        mutex_lock(&book->lock);
+        book->chapters[i].rendered = 1;
+        cond_broadcast(&book->chapter_rendered);
+    }
+    mutex_unlock(&book->lock);
+}
+
+//
+// Writes the headings of every chapter as nested lists of links, a list per
+// heading level from the book's highest. A heading more than one level below
+// the previous one gets lists with empty items for the levels in between.
+static
+int
+book_write_toc(const Book* book, MStringBuilder* sb){
+    msb_write_literal(sb, "<nav class=\"toc\">\n");
+    int top = 6;
+    for(size_t c = 0; c < book->count; c++)
+        MARRAY_FOR_EACH(HeadingAnchor, a, book->chapters[c].ctx->anchors)
+            if(a->level < top) top = a->level;
+    // The number of open lists, each with an open item.
+    int depth = 0;
+    for(size_t c = 0; c < book->count; c++){
+        MARRAY_FOR_EACH(HeadingAnchor, a, book->chapters[c].ctx->anchors){
+            int target = a->level - top + 1;
+            for(; depth > target; depth--)
+                msb_write_literal(sb, "</li>\n</ul>\n");
+            if(depth == target)
+                msb_write_literal(sb, "</li>\n");
+            while(depth < target){
+                msb_write_literal(sb, "<ul>\n");
+                if(++depth < target)
+                    msb_write_literal(sb, "<li>");
+            }
+            msb_write_literal(sb, "<li><a href=\"#");
+            msb_write_str(sb, a->id.text, a->id.length);
+            msb_write_literal(sb, "\">");
+            int err = write_link_escaped_str(sb, a->text.text, a->text.length, 0);
+            if(err) return err;
+            msb_write_literal(sb, "</a>");
+        }
+    }
+    for(; depth; depth--)
+        msb_write_literal(sb, "</li>\n</ul>\n");
+    msb_write_literal(sb, "</nav>\n");
+    return sb->errored;
+}
+
+static
+int
+book_write(FILE* out, const char* data, size_t length){
+    if(length && fwrite(data, length, 1, out) != 1){
+        fprintf(stderr, "Error writing: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static
+void
+book_free_chapter(BookChapter* chapter){
+    if(chapter->ctx)
+        drmd_context_destroy(chapter->ctx);
+    chapter->ctx = NULL;
+    msb_destroy(&chapter->text);
+    msb_destroy(&chapter->html);
+}
+
+//
+// Converts the chapter files into a single html document written to `out`:
+// the table of contents, each chapter in order, then `suffix` (the
+// stylesheet). Uses `jobs` threads, counting the calling one.
+// Returns 0 on success, or 1 if any chapter failed to convert or on an io
+// error.
+static
+int
+drmd_book(const StringView* paths, size_t count, FILE* out, StringView suffix, int jobs){
+    if(jobs < 1) jobs = 1;
+    if(jobs > BOOK_MAX_WORKERS) jobs = BOOK_MAX_WORKERS;
+    if((size_t)jobs > count) jobs = count? (int)count : 1;
+    BookChapter* chapters = Allocator_zalloc(MALLOCATOR, count * sizeof *chapters);
+    if(count && !chapters){
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for(size_t i = 0; i < count; i++){
+        memcpy(&chapters[i], &(BookChapter){
+            .path = paths[i].text,
+            .text = {.allocator = MALLOCATOR},
+            .html = {.allocator = MALLOCATOR},
+        }, sizeof chapters[i]);
+    }
+    Book book = {.chapters = chapters, .count = count};
+    mutex_init(&book.lock);
+    cond_init(&book.chapter_rendered);
+    BookWorker workers[BOOK_MAX_WORKERS];
+    _Bool started[BOOK_MAX_WORKERS] = {0};
+    for(int i = 0; i < jobs; i++)
+        workers[i] = (BookWorker){.book = &book};
+    int result = 0;
+    MStringBuilder toc = {.allocator = MALLOCATOR};
+
+    for(int i = 1; i < jobs; i++)
+        started[i] = !thread_create(&workers[i].thread, book_parse_worker, &workers[i]);
+    book_parse_worker(&workers[0]);
+    for(int i = 1; i < jobs; i++)
+        if(started[i])
+            thread_join(&workers[i].thread);
+    for(size_t i = 0; i < count; i++)
+        if(chapters[i].failed)
+            result = 1;
+    if(result) goto cleanup;
+
+    if(book_write_toc(&book, &toc)){
+        fprintf(stderr, "Out of memory\n");
+        result = 1;
+        goto cleanup;
+    }
+    if(book_write(out, toc.data, toc.cursor)){
+        result = 1;
+        goto cleanup;
+    }
+
+    book.next = 0;
+    for(int i = 1; i < jobs; i++)
+        started[i] = !thread_create(&workers[i].thread, book_render_worker, &workers[i]);
+    // Write the chapters in order, rendering one whenever the next to write
+    // isn't done yet and there are still chapters to take.
+    for(size_t i = 0; i < count; i++){
+        BookChapter* chapter = &chapters[i];
+        mutex_lock(&book.lock);
+        while(!chapter->rendered){
+            size_t c;
+            if(book_take_chapter(&book, &c)){
+                mutex_unlock(&book.lock);
+                book_render_chapter(&chapters[c], c);
+                mutex_lock(&book.lock);
+                chapters[c].rendered = 1;
+            }
+            else
+                cond_wait(&book.chapter_rendered, &book.lock);
+        }
+        mutex_unlock(&book.lock);
+        if(!result && chapter->failed)
+            result = 1;
+        if(!result && book_write(out, chapter->html.data, chapter->html.cursor))
+            result = 1;
+        book_free_chapter(chapter);
+    }
+    for(int i = 1; i < jobs; i++)
+        if(started[i])
+            thread_join(&workers[i].thread);
+    if(!result && book_write(out, suffix.text, suffix.length))
+        result = 1;
+
+    cleanup:
+    msb_destroy(&toc);
+    for(size_t i = 0; i < count; i++)
+        book_free_chapter(&chapters[i]);
+    // Only once every context using it is gone.
+    SharedArena_free_all(&book.arena);
+    Allocator_free(MALLOCATOR, chapters, count * sizeof *chapters);
+    cond_destroy(&book.chapter_rendered);
+    mutex_destroy(&book.lock);
+    return result;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
@@ -0,0 +1,300 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+// A thread-safe LRU cache of parsed documents (see drmd_cache.h).
+//
+// The cache is split into stripes by the hash of the key, each with its own
+// lock, table and LRU list, so threads looking up different documents rarely
+// wait on each other. Locks are only held to look up, insert and evict:
+// parsing a miss happens outside of them, and rendering a document needs no
+// locks at all as documents never change. A hit still takes its stripe's
+// lock for a moment, as it moves the entry to the end of the LRU list.
+//
+// The byte budget is shared by all the stripes. An insert that goes over it
+// evicts the least recently used documents of its own stripe first, then
+// those of the others in turn, so the order is only strictly least recently
+// used within a stripe.
+//
+// Compile along with drmd.c, or include after it.
+//
+#include <stdint.h>
+#include "drmd_cache.h"
+#include "stringview.h"
+#include "thread_util.h"
+#include "atomic_util.h"
+#include "Allocators/mallocator.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+enum {CACHE_STRIPES = 16};
+
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+    CacheEntry*_Nullable next_in_bucket;
+    // From least to most recently used.
+    CacheEntry*_Nullable lru_prev;
+    CacheEntry*_Nullable lru_next;
+    uint64_t hash;
+    // Holds one reference.
+    DrMdDocument* document;
+    // What this entry counts against the budget.
+    size_t size;
+    size_t key_length;
+    char key[];
+};
+
+typedef struct CacheStripe CacheStripe;
+struct CacheStripe {
+    Mutex lock;
+    CacheEntry*_Nullable*_Nullable buckets;
+    // Power of 2.
+    size_t bucket_count;
+    size_t count;
+    CacheEntry*_Nullable lru_first;
+    CacheEntry*_Nullable lru_last;
+};
+
+struct DrMdCache {
+    CacheStripe stripes[CACHE_STRIPES];
+    size_t max_bytes;
+    // Of all the stripes, only changed atomically.
+    size_t bytes;
+};
+
+static inline
+uint64_t
+cache_hash(StringView key){
+    // FNV-1a
+    uint64_t h = 14695981039346656037u;
+    for(size_t i = 0; i < key.length; i++){
+        h ^= (unsigned char)key.text[i];
+        h *= 1099511628211u;
+    }
+    return h;
+}
+
+static inline
+size_t
+cache_stripe_index(uint64_t hash){
+    // The top bits pick the stripe, as the low ones pick the bucket.
+    return (size_t)(hash >> 60);
+}
+
+static
+CacheEntry*_Nullable
+cache_find(CacheStripe* stripe, uint64_t hash, StringView key){
+    if(!stripe->bucket_count) return NULL;
+    CacheEntry* e = stripe->buckets[hash & (stripe->bucket_count-1)];
+    for(; e; e = e->next_in_bucket)
+        if(e->hash == hash && e->key_length == key.length && memcmp(e->key, key.text, key.length) == 0)
+            return e;
+    return NULL;
+}
+
+static
+void
+cache_lru_unlink(CacheStripe* stripe, CacheEntry* e){
+    if(e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else stripe->lru_first = e->lru_next;
+    if(e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else stripe->lru_last = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static
+void
+cache_lru_append(CacheStripe* stripe, CacheEntry* e){
+    e->lru_prev = stripe->lru_last;
+    e->lru_next = NULL;
+    if(stripe->lru_last) stripe->lru_last->lru_next = e;
+    else stripe->lru_first = e;
+    stripe->lru_last = e;
+}
+
+//
+// Marks the entry as the most recently used and returns a new reference to
+// its document.
+static
+DrMdDocument*
+cache_use(CacheStripe* stripe, CacheEntry* e){
+    if(stripe->lru_last != e){
+        cache_lru_unlink(stripe, e);
+        cache_lru_append(stripe, e);
+    }
+    return drmd_document_retain(e->document);
+}
+
+static
+int
+cache_grow(CacheStripe* stripe){
+    size_t count = stripe->bucket_count? stripe->bucket_count*2 : 64;
+    CacheEntry** buckets = Allocator_zalloc(MALLOCATOR, count * sizeof *buckets);
+    if(!buckets) return 1;
+    for(size_t i = 0; i < stripe->bucket_count; i++){
+        for(CacheEntry* e = stripe->buckets[i], *next; e; e = next){
+            next = e->next_in_bucket;
+            CacheEntry** b = &buckets[e->hash & (count-1)];
+            e->next_in_bucket = *b;
+            *b = e;
+        }
+    }
+    Allocator_free(MALLOCATOR, stripe->buckets, stripe->bucket_count * sizeof *stripe->buckets);
+    stripe->buckets = buckets;
+    stripe->bucket_count = count;
+    return 0;
+}
+
+//
+// Takes the entry out of the table and the LRU list.
+static
+void
+cache_remove(DrMdCache* cache, CacheStripe* stripe, CacheEntry* e){
+    CacheEntry** b = &stripe->buckets[e->hash & (stripe->bucket_count-1)];
+    while(*b != e)
+        b = &(*b)->next_in_bucket;
+    *b = e->next_in_bucket;
+    cache_lru_unlink(stripe, e);
+    stripe->count--;
+    atomic_sub_size(&cache->bytes, e->size);
+}
+
+static
+void
+cache_free_entry(CacheEntry* e){
+    drmd_document_release(e->document);
+    Allocator_free(MALLOCATOR, e, sizeof *e + e->key_length);
+}
+
+//
+// Evicts from the stripe, which must be locked, until the cache is within
+// its budget or only `keep` is left. The evicted entries are chained
+// through next_in_bucket onto `evicted`, to be freed once unlocked.
+static
+void
+cache_evict(DrMdCache* cache, CacheStripe* stripe, const CacheEntry*_Nullable keep, CacheEntry*_Nullable* evicted){
+    while(stripe->lru_first && stripe->lru_first != keep && atomic_load_size(&cache->bytes) > cache->max_bytes){
+        CacheEntry* victim = stripe->lru_first;
+        cache_remove(cache, stripe, victim);
+        victim->next_in_bucket = *evicted;
+        *evicted = victim;
+    }
+}
+
+static
+void
+cache_free_evicted(CacheEntry*_Nullable evicted){
+    for(CacheEntry* next; evicted; evicted = next){
+        next = evicted->next_in_bucket;
+        cache_free_entry(evicted);
+    }
+}
+
+DRMD_API maybe_unused
+DrMdCache*_Nullable
+drmd_cache_create(size_t max_bytes){
+    DrMdCache* cache = Allocator_zalloc(MALLOCATOR, sizeof *cache);
+    if(!cache) return NULL;
+    for(size_t i = 0; i < CACHE_STRIPES; i++)
+        mutex_init(&cache->stripes[i].lock);
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+DRMD_API maybe_unused
+void
+drmd_cache_destroy(DrMdCache* cache){
+    for(size_t i = 0; i < CACHE_STRIPES; i++){
+        CacheStripe* stripe = &cache->stripes[i];
+        for(CacheEntry* e = stripe->lru_first, *next; e; e = next){
+            next = e->lru_next;
+            cache_free_entry(e);
+        }
+        Allocator_free(MALLOCATOR, stripe->buckets, stripe->bucket_count * sizeof *stripe->buckets);
+        mutex_destroy(&stripe->lock);
+    }
+    Allocator_free(MALLOCATOR, cache, sizeof *cache);
+}
+
+DRMD_API maybe_unused
+int
+drmd_cache_get(DrMdCache* cache, StringView key, StringView input, DrMdDocument*_Nullable* document){
+    uint64_t hash = cache_hash(key);
+    size_t index = cache_stripe_index(hash);
+    CacheStripe* stripe = &cache->stripes[index];
+    mutex_lock(&stripe->lock);
+    CacheEntry* e = cache_find(stripe, hash, key);
+    if(e){
+        *document = cache_use(stripe, e);
+        mutex_unlock(&stripe->lock);
+        return 0;
+    }
+    mutex_unlock(&stripe->lock);
+
+    DrMdDocument* doc;
+    int err = drmd_parse(input, &doc);
+    if(err) return err;
+    size_t size = drmd_document_size(doc) + sizeof *e + key.length;
+    // Too big to ever fit, so don't push everything else out for it.
+    if(size > cache->max_bytes){
+        *document = doc;
+        return 0;
+    }
+    e = Allocator_alloc(MALLOCATOR, sizeof *e + key.length);
+    if(!e){
+        *document = doc;
+        return 0;
+    }
+    *e = (CacheEntry){
+        .hash = hash,
+        .document = doc,
+        .size = size,
+        .key_length = key.length,
+    };
+    if(key.length)
+        memcpy(e->key, key.text, key.length);
+    CacheEntry* evicted = NULL;
+    mutex_lock(&stripe->lock);
+    // Another thread could have parsed the same document meanwhile.
+    CacheEntry* other = cache_find(stripe, hash, key);
+    if(other){
+        *document = cache_use(stripe, other);
+        mutex_unlock(&stripe->lock);
+        cache_free_entry(e);
+        return 0;
+    }
+    if(stripe->count >= stripe->bucket_count && cache_grow(stripe)){
+        mutex_unlock(&stripe->lock);
+        Allocator_free(MALLOCATOR, e, sizeof *e + key.length);
+        *document = doc;
+        return 0;
+    }
+    CacheEntry** b = &stripe->buckets[hash & (stripe->bucket_count-1)];
+    e->next_in_bucket = *b;
+    *b = e;
+    cache_lru_append(stripe, e);
+    stripe->count++;
+    atomic_add_size(&cache->bytes, size);
+    cache_evict(cache, stripe, e, &evicted);
+    *document = drmd_document_retain(doc);
+    mutex_unlock(&stripe->lock);
+    cache_free_evicted(evicted);
+    // Only one stripe is locked at a time, so inserts into different
+    // stripes can't deadlock evicting from each other.
+    for(size_t i = 1; i < CACHE_STRIPES && atomic_load_size(&cache->bytes) > cache->max_bytes; i++){
+        CacheStripe* other_stripe = &cache->stripes[(index + i) % CACHE_STRIPES];
+        evicted = NULL;
+        mutex_lock(&other_stripe->lock);
+        cache_evict(cache, other_stripe, NULL, &evicted);
+        mutex_unlock(&other_stripe->lock);
+        cache_free_evicted(evicted);
+    }
+    return 0;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#include "Allocators/allocator.c"
@@ -0,0 +1,37 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+#ifndef DRMD_CACHE_H
+#define DRMD_CACHE_H
+#include "drmd.h"
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+//
+// A cache of parsed documents by key (a path, a database id with a
+// revision, ...), holding at most `max_bytes` of documents (see
+// `drmd_document_size`) and evicting the least recently used ones first.
+// Safe to use from many threads. Defined in drmd_cache.c, which needs to be
+// built along with drmd.c.
+typedef struct DrMdCache DrMdCache;
+
+DRMD_API
+DrMdCache*_Nullable drmd_cache_create(size_t max_bytes);
+
+//
+// Releases the cache's references; documents still in use stay alive until
+// they are released.
+DRMD_API
+void drmd_cache_destroy(DrMdCache* cache);
+
+//
+// Sets `document` to the one cached for `key`, or parses `input` and caches
+// it if there is none. Either way the caller gets a reference to release.
+DRMD_API
+int drmd_cache_get(DrMdCache* cache, StringView key, StringView input, DrMdDocument*_Nullable* document);
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+#endif
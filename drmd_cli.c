@@ -9,6 +9,7 @@
 #include "MStringBuilder.h"
 #include "Allocators/mallocator.h"
 #include "term_util.h"
+#include "thread_util.h"
 
 #define DRMD_API static
 #include "drmd.h"
@@ -32,6 +33,124 @@ asm(
 #else
 #endif
 
+static
+FILE*_Nullable
+open_output(StringView dst){
+    if(!dst.length)
+        return stdout;
+    FILE* output = fopen(dst.text, "wb");
+    if(!output)
+        fprintf(stderr, "Unable to open '%s': %s\n", dst.text, strerror(errno));
+    return output;
+}
+
+static
+int
+print_link(void* fp, StringView target, size_t offset){
+    fprintf(fp, "%zu\t%.*s\n", offset, (int)target.length, target.text);
+    return 0;
+}
+
+static
+int
+write_tables(void* fp, StringView output){
+    if(fwrite(output.text, output.length, 1, fp) != 1){
+        fprintf(stderr, "Error writing: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static
+int
+print_diagnostic(void* pfilename, const DrMdDiagnostic* d){
+    const char* filename = *(const char**)pfilename;
+    fprintf(stderr, "%s:%d: %.*s\n", filename, d->lineno, (int)d->message.length, d->message.text);
+    return 0;
+}
+
+typedef struct Capture Capture;
+static const Capture*_Nullable capture_options(const char*_Nullable dir, int ms, int nodes);
+static long long drmd_ndjson(FILE* in, FILE* out, StringView field_name, int jobs, const char*_Nullable metrics_path, const Capture*_Nullable capture);
+static long long drmd_batch(FILE* list, StringView suffix, int jobs, FILE*_Nullable link_report, _Bool backlinks, const char*_Nullable metrics_path, const Capture*_Nullable capture);
+static long long drmd_batch_tar(const char* path, FILE* out, StringView suffix, int jobs, const char*_Nullable metrics_path, const Capture*_Nullable capture);
+static int drmd_book(const StringView* paths, size_t count, FILE* out, StringView suffix, int jobs);
+static int drmd_replay(const char* dir, FILE* out);
+static int drmd_shm_serve(int fd, const char*_Nullable metrics_path);
+
+//
+// What goes after the html: the stylesheet, unless there isn't one.
+static
+int
+read_stylesheet(StringView stylesheet, _Bool no_stylesheet, MStringBuilder* sb){
+    if(no_stylesheet)
+        return 0;
+    if(stylesheet.length){
+        FILE* s = fopen(stylesheet.text, "rb");
+        if(!s){
+            fprintf(stderr, "Unable to read stylesheet '%s': %s\n", stylesheet.text, strerror(errno));
+            return 1;
+        }
+        for(;;){
+            if(msb_ensure_additional(sb, 4000)){
+                fclose(s);
+                return 1;
+            }
+            size_t nread = fread(sb->data + sb->cursor, 1, 4000, s);
+            sb->cursor += nread;
+            if(nread != 4000){
+                int err = ferror(s);
+                if(err)
+                    fprintf(stderr, "Error reading '%s': %s\n", stylesheet.text, strerror(errno));
+                fclose(s);
+                return err;
+            }
+        }
+    }
+    #ifdef EMBEDDED_STYLESHEET
+    msb_write_char(sb, '\n');
+    msb_write_str(sb, _readme_stylesheet, strlen(_readme_stylesheet));
+    msb_write_char(sb, '\n');
+    #endif
+    return sb->errored;
+}
+
+// Below this, the whole output is rendered and then written at once.
+enum {STREAMED_OUTPUT_MIN = 1024*1024};
+
+//
+// Renders the html a buffer at a time and writes each as it is filled,
+// instead of holding the whole output in memory before writing it.
+static
+int
+render_streamed(FILE* output, StringView txt, StringView dst){
+    DrMdRenderCursor* cursor;
+    int err = drmd_render_begin(txt, &cursor);
+    if(err) return err;
+    enum {BUFF_SIZE = 1024*1024};
+    char* buff = Allocator_alloc(MALLOCATOR, BUFF_SIZE);
+    if(!buff){
+        drmd_render_end(cursor);
+        return 1;
+    }
+    for(;;){
+        size_t n;
+        err = drmd_render_next(cursor, buff, BUFF_SIZE, &n);
+        if(err) break;
+        if(n && fwrite(buff, n, 1, output) != 1){
+            if(dst.length)
+                fprintf(stderr, "Error writing to '%s': %s\n", dst.text, strerror(errno));
+            else
+                fprintf(stderr, "Error writing: %s\n", strerror(errno));
+            err = 1;
+            break;
+        }
+        if(n < BUFF_SIZE) break;
+    }
+    Allocator_free(MALLOCATOR, buff, BUFF_SIZE);
+    drmd_render_end(cursor);
+    return err;
+}
 
 int 
 main(int argc, const char** argv){
@@ -39,6 +158,40 @@ main(int argc, const char** argv){
     StringView dst = {0};
     StringView stylesheet = {0};
     _Bool no_stylesheet = 0;
+    _Bool links = 0;
+    _Bool check = 0;
+    _Bool wordcount = 0;
+    _Bool term = 0;
+    _Bool json = 0;
+    _Bool fmt = 0;
+    int tables = -1;
+    StringView table_formats[] = {
+        [DRMD_TABLES_CSV] = SV("csv"),
+        [DRMD_TABLES_TSV] = SV("tsv"),
+        [DRMD_TABLES_JSON] = SV("json"),
+    };
+    ArgParseEnumType table_format_enum = {
+        .enum_size = sizeof tables,
+        .enum_count = arrlen(table_formats),
+        .enum_names = table_formats,
+    };
+    StringView ndjson = {0};
+    int jobs = 0;
+    _Bool batch = 0;
+    StringView link_report = {0};
+    _Bool backlinks = 0;
+    StringView batch_tar = {0};
+    StringView out_tar = {0};
+    StringView metrics = {0};
+    StringView capture_dir = {0};
+    int capture_ms = 100;
+    int capture_nodes = 0;
+    StringView replay = {0};
+    int shm_fd = -1;
+    // Can't have more chapters than arguments.
+    StringView* chapters = Allocator_zalloc(MALLOCATOR, (argc? argc : 1) * sizeof *chapters);
+    if(!chapters) return 1;
+    size_t n_chapters = 0;
     ArgToParse pos_args[] = {
         {
             .name = SV("src"),
@@ -62,6 +215,152 @@ main(int argc, const char** argv){
             .min_num = 0, .max_num = 1,
             .help = "stylesheet to append to the output",
         },
+        {
+            .name = SV("--links"),
+            .dest = ARGDEST(&links),
+            .help = "Instead of html, output the byte offset and target of each link, one per line.",
+        },
+        {
+            .name = SV("--check"),
+            .dest = ARGDEST(&check),
+            .help = "Don't output html, only report problems like unterminated code fences. "
+                    "Exits with 1 if there were any.",
+        },
+        {
+            .name = SV("--wordcount"),
+            .dest = ARGDEST(&wordcount),
+            .help = "Instead of html, output the number of words, characters, "
+                    "an estimated reading time and how many of each kind of block there are.",
+        },
+        {
+            .name = SV("--term"),
+            .dest = ARGDEST(&term),
+            .help = "Instead of html, output text with ANSI styling, "
+                    "word-wrapped to the width of the terminal.",
+        },
+        {
+            .name = SV("--json"),
+            .dest = ARGDEST(&json),
+            .help = "Instead of html, output the parsed document as a json tree.",
+        },
+        {
+            .name = SV("--fmt"),
+            .dest = ARGDEST(&fmt),
+            .help = "Instead of html, output the document as markdown in a canonical "
+                    "form: \"-\" bullets, renumbered lists, aligned tables and "
+                    "consistent indentation.",
+        },
+        {
+            .name = SV("--tables"),
+            .dest = ArgEnumDest(&tables, &table_format_enum),
+            .min_num = 0, .max_num = 1,
+            .help = "Instead of html, output only the cells of the tables, "
+                    "as csv, tsv or json.",
+        },
+        {
+            .name = SV("--ndjson"),
+            .dest = ARGDEST(&ndjson),
+            .min_num = 0, .max_num = 1,
+            .help = "Read json lines and convert the markdown in the given string "
+                    "field of each. Outputs a json line with the \"id\" and \"html\" "
+                    "for each, in the same order.",
+        },
+        {
+            .name = SV("--batch"),
+            .dest = ARGDEST(&batch),
+            .help = "Read a list of markdown files, one path per line, from src "
+                    "(or stdin) and convert each foo.md to foo.html next to it.",
+        },
+        {
+            .name = SV("--link-report"),
+            .dest = ARGDEST(&link_report),
+            .min_num = 0, .max_num = 1,
+            .help = "With --batch, write the links to other inputs or to headings "
+                    "that don't exist to this file. Headings get ids to link to "
+                    "and links to other inputs go to their html.",
+        },
+        {
+            .name = SV("--backlinks"),
+            .dest = ARGDEST(&backlinks),
+            .help = "With --batch, add a list of the pages linking to each page "
+                    "to the end of it. Headings get ids to link to "
+                    "and links to other inputs go to their html.",
+        },
+        {
+            .name = SV("--batch-tar"),
+            .dest = ARGDEST(&batch_tar),
+            .min_num = 0, .max_num = 1,
+            .help = "Convert each foo.md in this tar archive (- for stdin) to foo.html "
+                    "in a tar archive written to --out-tar (or stdout), without "
+                    "extracting anything.",
+        },
+        {
+            .name = SV("--out-tar"),
+            .dest = ARGDEST(&out_tar),
+            .min_num = 0, .max_num = 1,
+            .help = "Where --batch-tar writes its archive.",
+        },
+        {
+            .name = SV("--book"),
+            .dest = ARGDEST(chapters),
+            .min_num = 0, .max_num = argc,
+            .pnum_parsed = &n_chapters,
+            .help = "Convert the given chapter files into one html document, "
+                    "with a table of contents of their headings at the top.",
+        },
+        {
+            .name = SV("-j"),
+            .altname1 = SV("--jobs"),
+            .dest = ARGDEST(&jobs),
+            .min_num = 0, .max_num = 1,
+            .help = "How many threads to convert --ndjson, --batch, --batch-tar or --book input with. "
+                    "Defaults to the number of processors.",
+        },
+        {
+            .name = SV("--metrics"),
+            .dest = ARGDEST(&metrics),
+            .min_num = 0, .max_num = 1,
+            .help = "With --ndjson, --batch, --batch-tar or --shm, write counters and latency histograms "
+                    "of the conversions to this file in the Prometheus text format. "
+                    "With --ndjson or --batch-tar it is rewritten as the input is converted.",
+        },
+        {
+            .name = SV("--capture"),
+            .dest = ARGDEST(&capture_dir),
+            .min_num = 0, .max_num = 1,
+            .help = "With --ndjson, --batch or --batch-tar, save the input of each conversion "
+                    "slower than --capture-ms or bigger than --capture-nodes to this "
+                    "directory, with its timings, for --replay.",
+        },
+        {
+            .name = SV("--capture-ms"),
+            .dest = ARGDEST(&capture_ms),
+            .min_num = 0, .max_num = 1,
+            .help = "Capture conversions taking at least this many milliseconds "
+                    "(default 100, 0 for none).",
+        },
+        {
+            .name = SV("--capture-nodes"),
+            .dest = ARGDEST(&capture_nodes),
+            .min_num = 0, .max_num = 1,
+            .help = "Capture conversions parsing to at least this many nodes "
+                    "(default 0, for none).",
+        },
+        {
+            .name = SV("--replay"),
+            .dest = ARGDEST(&replay),
+            .min_num = 0, .max_num = 1,
+            .help = "Convert each document captured in this directory several times "
+                    "and output the fastest parse, render and total time of each.",
+        },
+        {
+            .name = SV("--shm"),
+            .dest = ARGDEST(&shm_fd),
+            .min_num = 0, .max_num = 1,
+            .help = "Serve conversions to a co-process through the shared memory "
+                    "rings in this inherited file descriptor (see drmd_shm.h). "
+                    "Linux only.",
+        },
         #ifdef EMBEDDED_STYLESHEET
         {
             .name = SV("--no-stylesheet"),
@@ -129,6 +428,49 @@ main(int argc, const char** argv){
         print_argparse_error(&parser, error);
         return error;
     }
+    if(replay.length){
+        FILE* output = open_output(dst);
+        if(!output) return 1;
+        int err = drmd_replay(replay.text, output);
+        fflush(output);
+        fclose(output);
+        return err;
+    }
+    if(shm_fd >= 0)
+        return drmd_shm_serve(shm_fd, metrics.text);
+    const Capture* capture = capture_options(capture_dir.text, capture_ms, capture_nodes);
+    if(n_chapters){
+        MStringBuilder suffix = {.allocator=MALLOCATOR};
+        if(read_stylesheet(stylesheet, no_stylesheet, &suffix)) return 1;
+        FILE* output = open_output(dst);
+        if(!output) return 1;
+        if(!jobs) jobs = processor_count();
+        int err = drmd_book(chapters, n_chapters, output, msb_borrow_sv(&suffix), jobs);
+        msb_destroy(&suffix);
+        fflush(output);
+        fclose(output);
+        return err;
+    }
+    if(batch_tar.length){
+        MStringBuilder suffix = {.allocator=MALLOCATOR};
+        if(read_stylesheet(stylesheet, no_stylesheet, &suffix)) return 1;
+        FILE* output = open_output(out_tar);
+        if(!output) return 1;
+        if(!jobs) jobs = processor_count();
+        long long n_errors = drmd_batch_tar(batch_tar.text, output, msb_borrow_sv(&suffix), jobs, metrics.text, capture);
+        msb_destroy(&suffix);
+        if(n_errors < 0) return 1;
+        if(fflush(output) != 0){
+            fprintf(stderr, "Error writing: %s\n", strerror(errno));
+            return 1;
+        }
+        fclose(output);
+        if(n_errors){
+            fprintf(stderr, "%lld files failed to convert\n", n_errors);
+            return 1;
+        }
+        return 0;
+    }
     FILE* inp = stdin;
     if(src.text){
         inp = fopen(src.text, "rb");
@@ -137,6 +479,43 @@ main(int argc, const char** argv){
             return 1;
         }
     }
+    if(ndjson.length){
+        FILE* output = open_output(dst);
+        if(!output) return 1;
+        if(!jobs) jobs = processor_count();
+        long long n_errors = drmd_ndjson(inp, output, ndjson, jobs, metrics.text, capture);
+        if(n_errors < 0) return 1;
+        fflush(output);
+        fclose(output);
+        if(n_errors){
+            fprintf(stderr, "%lld lines failed to convert\n", n_errors);
+            return 1;
+        }
+        return 0;
+    }
+    if(batch){
+        MStringBuilder suffix = {.allocator=MALLOCATOR};
+        if(read_stylesheet(stylesheet, no_stylesheet, &suffix)) return 1;
+        if(!jobs) jobs = processor_count();
+        FILE* report = NULL;
+        if(link_report.length){
+            report = fopen(link_report.text, "wb");
+            if(!report){
+                fprintf(stderr, "Unable to open '%s': %s\n", link_report.text, strerror(errno));
+                return 1;
+            }
+        }
+        long long n_errors = drmd_batch(inp, msb_borrow_sv(&suffix), jobs, report, backlinks, metrics.text, capture);
+        msb_destroy(&suffix);
+        if(report)
+            fclose(report);
+        if(n_errors < 0) return 1;
+        if(n_errors){
+            fprintf(stderr, "%lld files failed to convert\n", n_errors);
+            return 1;
+        }
+        return 0;
+    }
     MStringBuilder sb = {.allocator=MALLOCATOR};
     for(;;){
         int e = msb_ensure_additional(&sb, 1024);
@@ -154,18 +533,98 @@ main(int argc, const char** argv){
         }
     }
     StringView txt = msb_detach_sv(&sb);
-    StringView md;
-    int err = drmd_to_html(txt, &md);
-    if(err) return err;
-    FILE* output = stdout;
-    if(dst.length){
-        output = fopen(dst.text, "wb");
-        if(!output){
-            fprintf(stderr, "Unable to open '%s': %s\n", dst.text, strerror(errno));
+    if(check){
+        size_t n_errors = 0;
+        const char* filename = src.text?src.text:"<stdin>";
+        int err = drmd_check(txt, print_diagnostic, &filename, &n_errors);
+        if(err) return err;
+        return n_errors?1:0;
+    }
+    if(wordcount){
+        DrMdStats stats;
+        int err = drmd_stats(txt, &stats);
+        if(err) return err;
+        FILE* output = open_output(dst);
+        if(!output) return 1;
+        // Assume a reading speed of 200 words per minute.
+        size_t minutes = (stats.words + 199) / 200;
+        fprintf(output,
+            "words: %zu\n"
+            "characters: %zu\n"
+            "reading time: %zu min\n"
+            "code lines: %zu\n"
+            "paragraphs: %zu\n"
+            "headings: %zu\n"
+            "bullet lists: %zu\n"
+            "ordered lists: %zu\n"
+            "list items: %zu\n"
+            "tables: %zu\n"
+            "table rows: %zu\n"
+            "quotes: %zu\n"
+            "code blocks: %zu\n",
+            stats.words, stats.characters, minutes, stats.code_lines,
+            stats.paragraphs, stats.headings, stats.bullet_lists,
+            stats.ordered_lists, stats.list_items, stats.tables,
+            stats.table_rows, stats.quotes, stats.code_blocks);
+        fflush(output);
+        fclose(output);
+        return 0;
+    }
+    if(links){
+        FILE* output = open_output(dst);
+        if(!output) return 1;
+        int err = drmd_links(txt, print_link, output);
+        if(err) return err;
+        fflush(output);
+        fclose(output);
+        return 0;
+    }
+    if(tables >= 0){
+        FILE* output = open_output(dst);
+        if(!output) return 1;
+        int err = drmd_tables(txt, (DrMdTableFormat)tables, write_tables, output);
+        if(err) return err;
+        fflush(output);
+        fclose(output);
+        return 0;
+    }
+    if(term || json || fmt){
+        StringView text;
+        int err;
+        if(json)
+            err = drmd_to_json(txt, &text);
+        else if(fmt)
+            err = drmd_to_md(txt, &text);
+        else {
+            int columns = get_terminal_size().columns;
+            // Leave room for the list markers and quote bars.
+            if(columns < 20) columns = 20;
+            err = drmd_to_term(txt, columns, &text);
+        }
+        if(err) return err;
+        FILE* output = open_output(dst);
+        if(!output) return 1;
+        if(text.length && fwrite(text.text, text.length, 1, output) != 1){
+            fprintf(stderr, "Error writing: %s\n", strerror(errno));
             return 1;
         }
+        fflush(output);
+        fclose(output);
+        return 0;
+    }
+    FILE* output;
+    if(txt.length >= STREAMED_OUTPUT_MIN){
+        output = open_output(dst);
+        if(!output) return 1;
+        int err = render_streamed(output, txt, dst);
+        if(err) return err;
     }
-    {
+    else {
+        StringView md;
+        int err = drmd_to_html(txt, &md);
+        if(err) return err;
+        output = open_output(dst);
+        if(!output) return 1;
         size_t nwrit = fwrite(md.text, md.length, 1, output);
         if(nwrit != 1){
             if(dst.length)
@@ -174,44 +633,26 @@ main(int argc, const char** argv){
                 fprintf(stderr, "Error writing: %s\n", strerror(errno));
         }
     }
-    if(no_stylesheet){
-        // do nothing
-    }
-    else if(stylesheet.length){
-        FILE* s = fopen(stylesheet.text, "rb");
-        if(!s){
-            fprintf(stderr, "Unable to read stylesheet '%s': %s\n", stylesheet.text, strerror(errno));
-        }
-        else {
-            char buff[4000];
-            _Bool loop = 1;
-            for(;loop;){
-                size_t nread = fread(buff, 1, sizeof buff, s);
-                if(nread != sizeof buff){
-                    if(ferror(s)){
-                        fprintf(stderr, "Error reading '%s': %s\n", stylesheet.text, strerror(errno));
-                        return 1;
-                    }
-                    loop = 0;
-                }
-                size_t nwrit = fwrite(buff, nread, 1, output);
-                if(nwrit != 1){
-                    fprintf(stderr, "Error writing to output: %s\n", strerror(errno));
-                    return 1;
-                }
-            }
-            fclose(s);
-        }
-    }
-    else {
-        #ifdef EMBEDDED_STYLESHEET
-        fprintf(output, "\n%s\n", _readme_stylesheet);
-        #endif
+    MStringBuilder suffix = {.allocator=MALLOCATOR};
+    int err = read_stylesheet(stylesheet, no_stylesheet, &suffix);
+    if(!err && suffix.cursor && fwrite(suffix.data, suffix.cursor, 1, output) != 1){
+        fprintf(stderr, "Error writing to output: %s\n", strerror(errno));
+        err = 1;
     }
+    msb_destroy(&suffix);
     fflush(output);
     fclose(output);
-    return 0;
+    return err;
 }
 
 #include "drmd.c"
+#include "drmd_metrics.c"
+#include "drmd_ndjson.c"
+#include "drmd_site.c"
+#include "drmd_batch.c"
+#include "drmd_tar.c"
+#include "drmd_book.c"
+#include "drmd_replay.c"
+#include "drmd_cache.c"
+#include "drmd_shm.c"
 #include "Allocators/allocator.c"
@@ -0,0 +1,476 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+// Metrics for the long-running modes: how many documents were converted, how
+// long parsing and rendering took (as latency histograms by input size), how
+// big the arenas got and how many conversions failed and why.
+//
+// Every worker thread records into its own Metrics with plain stores, so
+// recording takes no locks or atomics; they are only added up when written
+// out, once the workers are done with a chunk of input. They are written in
+// the Prometheus text format, to a file that is replaced each time (e.g. for
+// node_exporter's textfile collector).
+//
+// Conversions that are slow or big enough can also have their input saved to
+// a directory, to find out what was slow and replay it later (drmd_replay.c).
+//
+// Included after drmd.c by drmd_cli.c.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include "bit_util.h"
+#include "thread_util.h"
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+static inline
+uint64_t
+metrics_now(void){
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    if(!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return (uint64_t)((double)t.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+enum MetricsPhase {
+    METRICS_PARSE,
+    METRICS_RENDER,
+    METRICS_TOTAL,
+    METRICS_PHASES,
+};
+
+static const char*const metrics_phase_names[METRICS_PHASES] = {"parse", "render", "total"};
+
+// By input size: under 1KB, 16KB, 256KB and the rest.
+enum {METRICS_SIZE_CLASSES = 4};
+
+static const char*const metrics_size_names[METRICS_SIZE_CLASSES] = {"1k", "16k", "256k", "inf"};
+
+static inline
+int
+metrics_size_class(size_t length){
+    if(length < 1024) return 0;
+    if(length < 16*1024) return 1;
+    if(length < 256*1024) return 2;
+    return 3;
+}
+
+enum MetricsError {
+    METRICS_ERROR_OOM,
+    METRICS_ERROR_TOO_DEEP,
+    // The input wasn't usable, e.g. a json line without the markdown field.
+    METRICS_ERROR_INPUT,
+    // Reading the input or writing the output failed.
+    METRICS_ERROR_IO,
+    METRICS_ERROR_OTHER,
+    METRICS_ERRORS,
+};
+
+static const char*const metrics_error_names[METRICS_ERRORS] = {"oom", "too_deep", "input", "io", "other"};
+
+//
+// HDR-style log-linear buckets of nanoseconds: each power of 2 is split into
+// HIST_SUB buckets, so every bucket is within 1/HIST_SUB of its values.
+enum {
+    HIST_SUB_BITS = 3,
+    HIST_SUB = 1 << HIST_SUB_BITS,
+    HIST_BUCKETS = (64 - HIST_SUB_BITS + 1) * HIST_SUB,
+};
+
+typedef struct Histogram Histogram;
+struct Histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline
+size_t
+histogram_bucket(uint64_t value){
+    if(value < HIST_SUB) return (size_t)value;
+    int shift = 63 - clz_64(value) - HIST_SUB_BITS;
+    return (size_t)(shift + 1) * HIST_SUB + (size_t)((value >> shift) & (HIST_SUB - 1));
+}
+
+//
+// The smallest value that goes in the bucket.
+static inline
+uint64_t
+histogram_bucket_min(size_t bucket){
+    if(bucket < HIST_SUB) return bucket;
+    int shift = (int)(bucket / HIST_SUB) - 1;
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << shift;
+}
+
+static inline
+void
+histogram_record(Histogram* h, uint64_t value){
+    h->count++;
+    h->sum += value;
+    h->buckets[histogram_bucket(value)]++;
+}
+
+//
+// The value below which `q` of the recorded values are, to within a bucket.
+static
+uint64_t
+histogram_quantile(const Histogram* h, double q){
+    uint64_t rank = (uint64_t)(q * (double)h->count);
+    if(rank >= h->count) rank = h->count? h->count - 1 : 0;
+    uint64_t seen = 0;
+    for(size_t i = 0; i < HIST_BUCKETS; i++){
+        seen += h->buckets[i];
+        if(seen > rank)
+            return i + 1 < HIST_BUCKETS? histogram_bucket_min(i+1) : UINT64_MAX;
+    }
+    return 0;
+}
+
+typedef struct Metrics Metrics;
+struct Metrics {
+    uint64_t conversions;
+    uint64_t input_bytes;
+    uint64_t output_bytes;
+    uint64_t errors[METRICS_ERRORS];
+    // The most memory a context's arena has held after a conversion.
+    size_t arena_high_water;
+    Histogram latency[METRICS_PHASES][METRICS_SIZE_CLASSES];
+};
+
+static inline
+enum MetricsError
+metrics_error(int err){
+    switch(err){
+        case ERROR_OOM: return METRICS_ERROR_OOM;
+        case ERROR_TOO_DEEP: return METRICS_ERROR_TOO_DEEP;
+        default: return METRICS_ERROR_OTHER;
+    }
+}
+
+//
+// Records one conversion from its start, the end of parsing and the end of
+// rendering (metrics_now), and the error it failed with if any.
+static inline
+void
+metrics_record(Metrics* m, DrMdContext* ctx, size_t input_length, size_t output_length, uint64_t start, uint64_t parsed, uint64_t rendered, int err){
+    int size = metrics_size_class(input_length);
+    histogram_record(&m->latency[METRICS_PARSE][size], parsed - start);
+    histogram_record(&m->latency[METRICS_RENDER][size], rendered - parsed);
+    histogram_record(&m->latency[METRICS_TOTAL][size], rendered - start);
+    m->conversions++;
+    m->input_bytes += input_length;
+    m->output_bytes += output_length;
+    if(err)
+        m->errors[metrics_error(err)]++;
+    // Usually a single arena, so this is cheap.
+    ArenaAllocatorStats stats = ArenaAllocator_stats(&ctx->main_arena);
+    size_t arena = stats.capacity + stats.big_used;
+    if(arena > m->arena_high_water)
+        m->arena_high_water = arena;
+}
+
+//
+// Where to save the inputs of conversions worth looking at later.
+typedef struct Capture Capture;
+struct Capture {
+    const char* dir;
+    // Conversions taking at least this long, or parsing to at least this many
+    // nodes, are captured. 0 to not capture by that.
+    uint64_t min_ns;
+    size_t min_nodes;
+};
+
+//
+// The capture settings from the command line, or NULL without a directory.
+static
+const Capture*_Nullable
+capture_options(const char*_Nullable dir, int ms, int nodes){
+    static Capture capture;
+    if(!dir) return NULL;
+    capture = (Capture){
+        .dir = dir,
+        .min_ns = ms > 0? (uint64_t)ms * 1000000u : 0,
+        .min_nodes = nodes > 0? (size_t)nodes : 0,
+    };
+    return &capture;
+}
+
+//
+// Saves the input as dir/HASH-LENGTH.md, with its source (the json id or the
+// path), size and timings in dir/HASH-LENGTH.txt, if the conversion went over
+// either threshold. Inputs are named by their content, so a document is only
+// captured once however many times it is slow.
+static
+void
+capture_conversion(const Capture* capture, const DrMdContext* ctx, StringView source, StringView input, uint64_t parse_ns, uint64_t render_ns){
+    size_t nodes = ctx->nodes.count;
+    _Bool slow = capture->min_ns && parse_ns + render_ns >= capture->min_ns;
+    _Bool big = capture->min_nodes && nodes >= capture->min_nodes;
+    if(!slow && !big) return;
+    MStringBuilder path = {.allocator = MALLOCATOR};
+    msb_write_str(&path, capture->dir, strlen(capture->dir));
+    char name[48];
+    int n = snprintf(name, sizeof name, "/%08x-%zu.md", (unsigned)hash_bytes(input.text, input.length), input.length);
+    msb_write_str(&path, name, (size_t)n);
+    msb_write_char(&path, '\0');
+    if(path.errored){
+        msb_destroy(&path);
+        return;
+    }
+    // Exclusive, so threads capturing the same document don't both write it.
+    FILE* fp = fopen(path.data, "wbx");
+    if(!fp){
+        if(errno != EEXIST)
+            fprintf(stderr, "Unable to capture to '%s': %s\n", path.data, strerror(errno));
+        msb_destroy(&path);
+        return;
+    }
+    _Bool ok = !input.length || fwrite(input.text, input.length, 1, fp) == 1;
+    ok = !fclose(fp) && ok;
+    if(ok){
+        memcpy(path.data + path.cursor - 3, "txt", 3);
+        msb_write_char(&path, '\0');
+        fp = path.errored? NULL : fopen(path.data, "wb");
+        if(fp){
+            fprintf(fp, "source: %.*s\nbytes: %zu\nnodes: %zu\nparse_ms: %.3f\nrender_ms: %.3f\ntotal_ms: %.3f\n",
+                (int)source.length, source.text, input.length, nodes,
+                (double)parse_ns / 1e6, (double)render_ns / 1e6, (double)(parse_ns + render_ns) / 1e6);
+            ok = !fclose(fp);
+        }
+        else
+            ok = 0;
+    }
+    if(!ok)
+        fprintf(stderr, "Unable to capture to '%s': %s\n", path.data, strerror(errno));
+    msb_destroy(&path);
+}
+
+//
+// Like context_render_html, recording the conversion into `m` and capturing
+// it if given. `source` says where the input came from for the capture.
+static
+int
+metrics_convert(Metrics*_Nullable m, const Capture*_Nullable capture, DrMdContext* ctx, StringView source, StringView input, MStringBuilder* html){
+    if(!m && !capture)
+        return context_render_html(ctx, input, html);
+    size_t before = html->cursor;
+    uint64_t start = metrics_now();
+    NodeHandle root;
+    int err = context_parse(ctx, input, &root);
+    uint64_t parsed = metrics_now();
+    if(!err){
+        err = render_to_html(ctx, root, html);
+        if(!err && html->errored)
+            err = ERROR_OOM;
+    }
+    uint64_t rendered = metrics_now();
+    if(m)
+        metrics_record(m, ctx, input.length, html->cursor - before, start, parsed, rendered, err);
+    if(capture)
+        capture_conversion(capture, ctx, source, input, parsed - start, rendered - parsed);
+    return err;
+}
+
+static
+void
+metrics_add(Metrics* into, const Metrics* m){
+    into->conversions += m->conversions;
+    into->input_bytes += m->input_bytes;
+    into->output_bytes += m->output_bytes;
+    for(size_t i = 0; i < METRICS_ERRORS; i++)
+        into->errors[i] += m->errors[i];
+    if(m->arena_high_water > into->arena_high_water)
+        into->arena_high_water = m->arena_high_water;
+    for(size_t p = 0; p < METRICS_PHASES; p++){
+        for(size_t s = 0; s < METRICS_SIZE_CLASSES; s++){
+            Histogram* h = &into->latency[p][s];
+            const Histogram* from = &m->latency[p][s];
+            h->count += from->count;
+            h->sum += from->sum;
+            for(size_t i = 0; i < HIST_BUCKETS; i++)
+                h->buckets[i] += from->buckets[i];
+        }
+    }
+}
+
+static
+void
+msb_write_seconds(MStringBuilder* sb, uint64_t ns){
+    msb_write_uint(sb, ns / 1000000000u);
+    msb_write_char(sb, '.');
+    char digits[10];
+    snprintf(digits, sizeof digits, "%09u", (unsigned)(ns % 1000000000u));
+    msb_write_str(sb, digits, 9);
+}
+
+static
+void
+metrics_write_labels(MStringBuilder* sb, size_t phase, size_t size){
+    msb_write_literal(sb, "phase=\"");
+    msb_write_str(sb, metrics_phase_names[phase], strlen(metrics_phase_names[phase]));
+    msb_write_literal(sb, "\",size=\"");
+    msb_write_str(sb, metrics_size_names[size], strlen(metrics_size_names[size]));
+    msb_write_char(sb, '"');
+}
+
+//
+// Writes the metrics in the Prometheus text exposition format. The
+// histograms are exported with a bucket per power of 4 from 1us to 17s, and
+// quantiles from the full resolution ones.
+static
+void
+metrics_write(MStringBuilder* sb, const Metrics* m){
+    msb_write_literal(sb,
+        "# HELP drmd_conversions_total Documents converted.\n"
+        "# TYPE drmd_conversions_total counter\n"
+        "drmd_conversions_total ");
+    msb_write_uint(sb, m->conversions);
+    msb_write_literal(sb,
+        "\n# HELP drmd_input_bytes_total Bytes of markdown converted.\n"
+        "# TYPE drmd_input_bytes_total counter\n"
+        "drmd_input_bytes_total ");
+    msb_write_uint(sb, m->input_bytes);
+    msb_write_literal(sb,
+        "\n# HELP drmd_output_bytes_total Bytes of html produced.\n"
+        "# TYPE drmd_output_bytes_total counter\n"
+        "drmd_output_bytes_total ");
+    msb_write_uint(sb, m->output_bytes);
+    msb_write_literal(sb,
+        "\n# HELP drmd_errors_total Conversions that failed, by cause.\n"
+        "# TYPE drmd_errors_total counter\n");
+    for(size_t i = 0; i < METRICS_ERRORS; i++){
+        msb_write_literal(sb, "drmd_errors_total{code=\"");
+        msb_write_str(sb, metrics_error_names[i], strlen(metrics_error_names[i]));
+        msb_write_literal(sb, "\"} ");
+        msb_write_uint(sb, m->errors[i]);
+        msb_write_char(sb, '\n');
+    }
+    msb_write_literal(sb,
+        "# HELP drmd_arena_high_water_bytes Most memory held by a parser's arena.\n"
+        "# TYPE drmd_arena_high_water_bytes gauge\n"
+        "drmd_arena_high_water_bytes ");
+    msb_write_uint(sb, m->arena_high_water);
+    msb_write_literal(sb,
+        "\n# HELP drmd_latency_seconds Time spent per document, by phase and input size.\n"
+        "# TYPE drmd_latency_seconds histogram\n");
+    for(size_t p = 0; p < METRICS_PHASES; p++){
+        for(size_t s = 0; s < METRICS_SIZE_CLASSES; s++){
+            const Histogram* h = &m->latency[p][s];
+            uint64_t cumulative = 0;
+            size_t i = 0;
+            for(uint64_t le = 1024; le <= (uint64_t)1 << 34; le <<= 2){
+                for(; i < HIST_BUCKETS && histogram_bucket_min(i) < le; i++)
+                    cumulative += h->buckets[i];
+                msb_write_literal(sb, "drmd_latency_seconds_bucket{");
+                metrics_write_labels(sb, p, s);
+                msb_write_literal(sb, ",le=\"");
+                msb_write_seconds(sb, le);
+                msb_write_literal(sb, "\"} ");
+                msb_write_uint(sb, cumulative);
+                msb_write_char(sb, '\n');
+            }
+            msb_write_literal(sb, "drmd_latency_seconds_bucket{");
+            metrics_write_labels(sb, p, s);
+            msb_write_literal(sb, ",le=\"+Inf\"} ");
+            msb_write_uint(sb, h->count);
+            msb_write_literal(sb, "\ndrmd_latency_seconds_sum{");
+            metrics_write_labels(sb, p, s);
+            msb_write_literal(sb, "} ");
+            msb_write_seconds(sb, h->sum);
+            msb_write_literal(sb, "\ndrmd_latency_seconds_count{");
+            metrics_write_labels(sb, p, s);
+            msb_write_literal(sb, "} ");
+            msb_write_uint(sb, h->count);
+            msb_write_char(sb, '\n');
+        }
+    }
+    msb_write_literal(sb,
+        "# HELP drmd_latency_quantile_seconds Quantiles of drmd_latency_seconds, to within 1/8.\n"
+        "# TYPE drmd_latency_quantile_seconds gauge\n");
+    static const char*const quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+    for(size_t p = 0; p < METRICS_PHASES; p++){
+        for(size_t s = 0; s < METRICS_SIZE_CLASSES; s++){
+            for(size_t q = 0; q < arrlen(quantiles); q++){
+                msb_write_literal(sb, "drmd_latency_quantile_seconds{");
+                metrics_write_labels(sb, p, s);
+                msb_write_literal(sb, ",quantile=\"");
+                msb_write_str(sb, quantiles[q], strlen(quantiles[q]));
+                msb_write_literal(sb, "\"} ");
+                const Histogram* h = &m->latency[p][s];
+                if(h->count)
+                    msb_write_seconds(sb, histogram_quantile(h, strtod(quantiles[q], NULL)));
+                else
+                    msb_write_literal(sb, "NaN");
+                msb_write_char(sb, '\n');
+            }
+        }
+    }
+}
+
+//
+// Adds up the workers' metrics and replaces the file at `path` with them,
+// writing to a temporary file first so readers never see half of it.
+// Returns non-zero on an io error.
+static
+int
+metrics_save(const char* path, const Metrics*const* workers, size_t count){
+    Metrics* total = Allocator_zalloc(MALLOCATOR, sizeof *total);
+    if(!total){
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for(size_t i = 0; i < count; i++)
+        metrics_add(total, workers[i]);
+    MStringBuilder sb = {.allocator = MALLOCATOR};
+    metrics_write(&sb, total);
+    Allocator_free(MALLOCATOR, total, sizeof *total);
+    MStringBuilder tmp = {.allocator = MALLOCATOR};
+    msb_write_str(&tmp, path, strlen(path));
+    msb_write_literal(&tmp, ".tmp");
+    msb_write_char(&tmp, '\0');
+    int err = sb.errored || tmp.errored;
+    if(err)
+        fprintf(stderr, "Out of memory\n");
+    else {
+        FILE* fp = fopen(tmp.data, "wb");
+        _Bool failed = !fp;
+        if(fp){
+            failed = fwrite(sb.data, sb.cursor, 1, fp) != 1;
+            // Closed even if the write failed, and closing can fail too.
+            failed |= fclose(fp) != 0;
+        }
+        if(failed){
+            fprintf(stderr, "Unable to write '%s': %s\n", tmp.data, strerror(errno));
+            err = 1;
+        }
+        else {
+            #ifdef _WIN32
+            remove(path);
+            #endif
+            if(rename(tmp.data, path)){
+                fprintf(stderr, "Unable to write '%s': %s\n", path, strerror(errno));
+                err = 1;
+            }
+        }
+    }
+    msb_destroy(&tmp);
+    msb_destroy(&sb);
+    return err;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
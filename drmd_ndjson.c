@@ -0,0 +1,580 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+// Bulk conversion of json lines: every line is an object with a markdown
+// string field, and is converted to a line with its "id" and the "html".
+//
+// Included after drmd.c by drmd_cli.c.
+//
+#include <stdio.h>
+#include "thread_util.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+#ifdef HAVE_VEC
+force_inline
+Vec
+json_string_special(Vec data){
+    return vec_or(vec_eq(data, vec_splat('"')), vec_eq(data, vec_splat('\\')));
+}
+#endif
+
+//
+// Returns how many bytes at the start of the text are not '"' or '\'.
+static inline
+size_t
+json_string_run(const char* text, size_t length){
+    size_t i = 0;
+#ifdef HAVE_VEC
+    for(; length - i >= 64; i += 64){
+        const char* t = text+i;
+        uint64_t mask = vec_mask64(json_string_special(vec_load(t)),    json_string_special(vec_load(t+16)),
+                                   json_string_special(vec_load(t+32)), json_string_special(vec_load(t+48)));
+        if(mask)
+            return i + ctz_64(mask);
+    }
+    for(; length - i >= 16; i += 16){
+        uint64_t mask = vec_mask(json_string_special(vec_load(text+i)));
+        if(mask)
+            return i + ctz_64(mask)/VEC_MASK_BITS;
+    }
+#endif
+    for(; i < length; i++)
+        if(text[i] == '"' || text[i] == '\\')
+            break;
+    return i;
+}
+
+static inline
+const char*
+json_skip_whitespace(const char* p, const char* end){
+    while(p != end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+//
+// p is just after the opening quote. Returns just after the closing quote
+// or NULL if the string is unterminated.
+static inline
+const char*_Nullable
+json_skip_string(const char* p, const char* end){
+    for(;;){
+        p += json_string_run(p, end - p);
+        if(p == end)
+            return NULL;
+        if(*p == '"')
+            return p+1;
+        // backslash, skip the escaped character.
+        if(end - p < 2)
+            return NULL;
+        p += 2;
+    }
+}
+
+//
+// Returns just after the value starting at p, or NULL if it is malformed.
+// Only strings and nesting are checked; numbers and literals are anything up
+// to the next delimiter.
+static inline
+const char*_Nullable
+json_skip_value(const char* p, const char* end){
+    if(p == end)
+        return NULL;
+    if(*p == '"')
+        return json_skip_string(p+1, end);
+    if(*p == '{' || *p == '['){
+        int depth = 0;
+        while(p != end){
+            switch(*p){
+                case '"':
+                    p = json_skip_string(p+1, end);
+                    if(!p) return NULL;
+                    continue;
+                case '{': case '[':
+                    depth++;
+                    break;
+                case '}': case ']':
+                    if(!--depth)
+                        return p+1;
+                    break;
+                default:
+                    break;
+            }
+            p++;
+        }
+        return NULL;
+    }
+    const char* start = p;
+    while(p != end){
+        switch(*p){
+            case ',': case '}': case ']':
+            case ' ': case '\t': case '\r': case '\n':
+                goto done;
+            default:
+                p++;
+        }
+    }
+    done:
+    return p == start? NULL : p;
+}
+
+static inline
+int
+parse_hex4(const char* p, const char* end, uint32_t* out){
+    if(end - p < 4)
+        return 1;
+    uint32_t value = 0;
+    for(int i = 0; i < 4; i++){
+        char c = p[i];
+        value <<= 4;
+        if(c >= '0' && c <= '9') value |= c - '0';
+        else if(c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else return 1;
+    }
+    *out = value;
+    return 0;
+}
+
+static inline
+const char*
+json_skip_digits(const char* p, const char* end){
+    while(p != end && *p >= '0' && *p <= '9')
+        p++;
+    return p;
+}
+
+//
+// Whether the value is exactly one json string, number, true, false or null.
+// json_skip_value is looser than that, and the id is copied into the output
+// as is, so anything else would make the output line invalid.
+static
+_Bool
+json_valid_scalar(StringView value){
+    const char* p = value.text;
+    const char* end = p + value.length;
+    if(p == end)
+        return 0;
+    if(*p == '"'){
+        for(p++; p != end;){
+            unsigned char c = (unsigned char)*p;
+            if(c == '"')
+                return p + 1 == end;
+            if(c < 0x20)
+                return 0;
+            if(c >= 0x80){
+                size_t n = utf8_sequence_length(p, end - p);
+                if(!n) return 0;
+                p += n;
+                continue;
+            }
+            if(c != '\\'){
+                p++;
+                continue;
+            }
+            if(end - p < 2)
+                return 0;
+            uint32_t u;
+            switch(p[1]){
+                case '"': case '\\': case '/':
+                case 'b': case 'f': case 'n': case 'r': case 't':
+                    p += 2;
+                    break;
+                case 'u':
+                    if(parse_hex4(p+2, end, &u))
+                        return 0;
+                    p += 6;
+                    break;
+                default:
+                    return 0;
+            }
+        }
+        return 0;
+    }
+    if(sv_equals(value, SV("true")) || sv_equals(value, SV("false")) || sv_equals(value, SV("null")))
+        return 1;
+    if(*p == '-')
+        p++;
+    if(p == end)
+        return 0;
+    if(*p == '0')
+        p++;
+    else if(*p >= '1' && *p <= '9')
+        p = json_skip_digits(p, end);
+    else
+        return 0;
+    if(p != end && *p == '.'){
+        const char* digits = p+1;
+        p = json_skip_digits(digits, end);
+        if(p == digits) return 0;
+    }
+    if(p != end && (*p == 'e' || *p == 'E')){
+        p++;
+        if(p != end && (*p == '+' || *p == '-'))
+            p++;
+        const char* digits = p;
+        p = json_skip_digits(digits, end);
+        if(p == digits) return 0;
+    }
+    return p == end;
+}
+
+//
+// Finds the "id" and the markdown field of the object on the line.
+// The field is returned without its quotes, but still escaped. The id is
+// null unless the line has a valid one.
+// Returns an error message, or NULL on success.
+static
+const char*_Nullable
+ndjson_parse_line(const char* p, const char* end, StringView field_name, StringView* id, StringView* field){
+    *id = SV("null");
+    *field = (StringView){0};
+    _Bool have_field = 0;
+    p = json_skip_whitespace(p, end);
+    if(p == end || *p != '{')
+        return "line is not a json object";
+    p = json_skip_whitespace(p+1, end);
+    if(p != end && *p == '}')
+        goto finish;
+    for(;;){
+        if(p == end || *p != '"')
+            return "malformed json";
+        const char* key = p+1;
+        p = json_skip_string(key, end);
+        if(!p) return "malformed json";
+        StringView k = {p-1-key, key};
+        p = json_skip_whitespace(p, end);
+        if(p == end || *p != ':')
+            return "malformed json";
+        p = json_skip_whitespace(p+1, end);
+        const char* value = p;
+        p = json_skip_value(value, end);
+        if(!p) return "malformed json";
+        if(sv_equals(k, field_name)){
+            if(*value != '"')
+                return "field is not a string";
+            *field = (StringView){p-1-(value+1), value+1};
+            have_field = 1;
+        }
+        else if(sv_equals(k, SV("id"))){
+            StringView v = {p-value, value};
+            if(!json_valid_scalar(v))
+                return "id is not a json string, number or literal";
+            *id = v;
+        }
+        p = json_skip_whitespace(p, end);
+        if(p != end && *p == ','){
+            p = json_skip_whitespace(p+1, end);
+            continue;
+        }
+        if(p != end && *p == '}')
+            break;
+        return "malformed json";
+    }
+    finish:
+    if(!have_field)
+        return "missing field";
+    return NULL;
+}
+
+static inline
+void
+write_utf8(MStringBuilder* sb, uint32_t c){
+    if(c < 0x80)
+        msb_write_char(sb, (char)c);
+    else if(c < 0x800){
+        msb_write_char(sb, (char)(0xc0 | c >> 6));
+        msb_write_char(sb, (char)(0x80 | (c & 0x3f)));
+    }
+    else if(c < 0x10000){
+        msb_write_char(sb, (char)(0xe0 | c >> 12));
+        msb_write_char(sb, (char)(0x80 | ((c >> 6) & 0x3f)));
+        msb_write_char(sb, (char)(0x80 | (c & 0x3f)));
+    }
+    else {
+        msb_write_char(sb, (char)(0xf0 | c >> 18));
+        msb_write_char(sb, (char)(0x80 | ((c >> 12) & 0x3f)));
+        msb_write_char(sb, (char)(0x80 | ((c >> 6) & 0x3f)));
+        msb_write_char(sb, (char)(0x80 | (c & 0x3f)));
+    }
+}
+
+//
+// Unescapes the contents of a json string. Invalid escapes and unpaired
+// surrogates become U+FFFD.
+static
+void
+json_unescape(MStringBuilder* sb, const char* p, size_t length){
+    const char* end = p + length;
+    for(;;){
+        size_t n = json_string_run(p, end - p);
+        msb_write_str(sb, p, n);
+        p += n;
+        if(p == end)
+            return;
+        // Only backslashes are left as the string was already validated.
+        if(end - p < 2){
+            write_utf8(sb, 0xfffd);
+            return;
+        }
+        char c = p[1];
+        p += 2;
+        switch(c){
+            case '"':  msb_write_char(sb, '"');  break;
+            case '\\': msb_write_char(sb, '\\'); break;
+            case '/':  msb_write_char(sb, '/');  break;
+            case 'b':  msb_write_char(sb, '\b'); break;
+            case 'f':  msb_write_char(sb, '\f'); break;
+            case 'n':  msb_write_char(sb, '\n'); break;
+            case 'r':  msb_write_char(sb, '\r'); break;
+            case 't':  msb_write_char(sb, '\t'); break;
+            case 'u':{
+                uint32_t u;
+                if(parse_hex4(p, end, &u)){
+                    write_utf8(sb, 0xfffd);
+                    break;
+                }
+                p += 4;
+                if(u >= 0xd800 && u < 0xdc00){
+                    uint32_t lo;
+                    if(end - p >= 6 && p[0] == '\\' && p[1] == 'u' && !parse_hex4(p+2, end, &lo) && lo >= 0xdc00 && lo < 0xe000){
+                        p += 6;
+                        u = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+                    }
+                    else
+                        u = 0xfffd;
+                }
+                else if(u >= 0xdc00 && u < 0xe000)
+                    u = 0xfffd;
+                write_utf8(sb, u);
+            }break;
+            default:
+                write_utf8(sb, 0xfffd);
+                break;
+        }
+    }
+}
+
+typedef struct NdjsonWorker NdjsonWorker;
+struct NdjsonWorker {
+    Thread thread;
+    DrMdContext*_Nullable ctx;
+    StringView field_name;
+    // The complete lines this worker converts.
+    const char* begin;
+    const char* end;
+    // The unescaped markdown of the current line.
+    MStringBuilder markdown;
+    MStringBuilder html;
+    Metrics*_Nullable metrics;
+    const Capture*_Nullable capture;
+    // Converted lines, written out in worker order once all are done.
+    MStringBuilder out;
+    size_t errors;
+};
+
+static
+void
+ndjson_write_error(NdjsonWorker* w, StringView id, const char* message){
+    MStringBuilder* out = &w->out;
+    msb_write_literal(out, "{\"id\":");
+    msb_write_str(out, id.text, id.length);
+    msb_write_literal(out, ",\"error\":\"");
+    msb_write_str(out, message, strlen(message));
+    msb_write_literal(out, "\"}\n");
+    w->errors++;
+}
+
+static
+void
+ndjson_convert_line(NdjsonWorker* w, const char* line, const char* line_end){
+    if(json_skip_whitespace(line, line_end) == line_end)
+        return;
+    StringView id, field;
+    const char* message = ndjson_parse_line(line, line_end, w->field_name, &id, &field);
+    if(message){
+        if(w->metrics)
+            w->metrics->errors[METRICS_ERROR_INPUT]++;
+        ndjson_write_error(w, id, message);
+        return;
+    }
+    msb_reset(&w->markdown);
+    json_unescape(&w->markdown, field.text, field.length);
+    if(w->markdown.errored){
+        ndjson_write_error(w, id, "out of memory");
+        return;
+    }
+    msb_reset(&w->html);
+    int err = 1;
+    if(w->ctx)
+        err = metrics_convert(w->metrics, w->capture, w->ctx, id, (StringView){w->markdown.cursor, w->markdown.data?w->markdown.data:""}, &w->html);
+    if(err){
+        ndjson_write_error(w, id, "unable to convert");
+        return;
+    }
+    MStringBuilder* out = &w->out;
+    msb_write_literal(out, "{\"id\":");
+    msb_write_str(out, id.text, id.length);
+    msb_write_literal(out, ",\"html\":\"");
+    write_json_escaped_str(out, w->html.data, w->html.cursor);
+    msb_write_literal(out, "\"}\n");
+}
+
+static
+void
+ndjson_worker(void* p){
+    NdjsonWorker* w = p;
+    for(const char* line = w->begin; line != w->end;){
+        const char* nl = memchr(line, '\n', w->end - line);
+        const char* line_end = nl? nl : w->end;
+        ndjson_convert_line(w, line, line_end);
+        line = nl? nl+1 : w->end;
+    }
+}
+
+//
+// Reads json lines from `in` and writes a json line with the "id" and the
+// "html" of the `field_name` markdown for each to `out`, in the same order.
+// Input is read in chunks of whole lines, and each chunk is split between
+// `jobs` workers. If `metrics_path` is given, the metrics of the conversions
+// so far are written there after each chunk. With a `capture`, the
+// conversions over its thresholds are saved to its directory.
+// Returns the number of lines that failed to convert, or -1 on an io error.
+static
+long long
+drmd_ndjson(FILE* in, FILE* out, StringView field_name, int jobs, const char*_Nullable metrics_path, const Capture*_Nullable capture){
+    enum {CHUNK_SIZE = 8*1024*1024};
+    // Don't bother with threads for less than this much.
+    enum {MIN_PER_WORKER = 64*1024};
+    enum {MAX_WORKERS = 64};
+    if(jobs < 1) jobs = 1;
+    if(jobs > MAX_WORKERS) jobs = MAX_WORKERS;
+    NdjsonWorker workers[MAX_WORKERS];
+    const Metrics* metrics[MAX_WORKERS];
+    for(int i = 0; i < jobs; i++){
+        memcpy(&workers[i], &(NdjsonWorker){
+            .ctx = drmd_context_create(),
+            .field_name = field_name,
+            .markdown = {.allocator = MALLOCATOR},
+            .html = {.allocator = MALLOCATOR},
+            .out = {.allocator = MALLOCATOR},
+            .metrics = metrics_path? Allocator_zalloc(MALLOCATOR, sizeof(Metrics)) : NULL,
+            .capture = capture,
+        }, sizeof workers[i]);
+        metrics[i] = workers[i].metrics;
+    }
+    long long result = 0;
+    MStringBuilder buf = {.allocator = MALLOCATOR};
+    if(metrics_path){
+        for(int i = 0; i < jobs; i++){
+            if(!metrics[i]){
+                fprintf(stderr, "Out of memory\n");
+                result = -1;
+                goto cleanup;
+            }
+        }
+    }
+    size_t want = CHUNK_SIZE;
+    _Bool eof = 0;
+    for(;;){
+        while(!eof && buf.cursor < want){
+            if(msb_ensure_additional(&buf, want - buf.cursor)){
+                fprintf(stderr, "Out of memory\n");
+                result = -1;
+                goto cleanup;
+            }
+            size_t nread = fread(buf.data + buf.cursor, 1, want - buf.cursor, in);
+            buf.cursor += nread;
+            if(!nread){
+                if(ferror(in)){
+                    fprintf(stderr, "Error reading: %s\n", strerror(errno));
+                    result = -1;
+                    goto cleanup;
+                }
+                eof = 1;
+            }
+        }
+        size_t n = buf.cursor;
+        if(!eof){
+            while(n && buf.data[n-1] != '\n')
+                n--;
+            // A single line longer than the chunk.
+            if(!n){
+                want += CHUNK_SIZE;
+                continue;
+            }
+        }
+        // Split the lines between the workers at line boundaries.
+        int nworkers = (int)(n / MIN_PER_WORKER);
+        if(nworkers > jobs) nworkers = jobs;
+        if(nworkers < 1) nworkers = 1;
+        const char* chunk_end = buf.data + n;
+        const char* begin = buf.data;
+        for(int i = 0; i < nworkers; i++){
+            const char* end = chunk_end;
+            if(i != nworkers-1){
+                end = buf.data + n / nworkers * (i+1);
+                if(end < begin) end = begin;
+                const char* nl = memchr(end, '\n', chunk_end - end);
+                end = nl? nl+1 : chunk_end;
+            }
+            workers[i].begin = begin;
+            workers[i].end = end;
+            begin = end;
+        }
+        _Bool started[MAX_WORKERS] = {0};
+        for(int i = 1; i < nworkers; i++)
+            started[i] = !thread_create(&workers[i].thread, ndjson_worker, &workers[i]);
+        ndjson_worker(&workers[0]);
+        for(int i = 1; i < nworkers; i++){
+            if(started[i])
+                thread_join(&workers[i].thread);
+            else
+                ndjson_worker(&workers[i]);
+        }
+        for(int i = 0; i < nworkers; i++){
+            MStringBuilder* o = &workers[i].out;
+            if(o->errored){
+                fprintf(stderr, "Out of memory\n");
+                result = -1;
+                goto cleanup;
+            }
+            if(o->cursor && fwrite(o->data, o->cursor, 1, out) != 1){
+                fprintf(stderr, "Error writing: %s\n", strerror(errno));
+                result = -1;
+                goto cleanup;
+            }
+            msb_reset(o);
+        }
+        if(metrics_path && metrics_save(metrics_path, metrics, jobs)){
+            result = -1;
+            goto cleanup;
+        }
+        memmove(buf.data, buf.data+n, buf.cursor-n);
+        buf.cursor -= n;
+        want = CHUNK_SIZE;
+        if(eof && !buf.cursor)
+            break;
+    }
+    for(int i = 0; i < jobs; i++)
+        result += workers[i].errors;
+    cleanup:
+    msb_destroy(&buf);
+    for(int i = 0; i < jobs; i++){
+        if(workers[i].ctx)
+            drmd_context_destroy(workers[i].ctx);
+        msb_destroy(&workers[i].markdown);
+        msb_destroy(&workers[i].html);
+        msb_destroy(&workers[i].out);
+        if(workers[i].metrics)
+            Allocator_free(MALLOCATOR, workers[i].metrics, sizeof(Metrics));
+    }
+    return result;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
@@ -0,0 +1,195 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+// Replays the documents captured by --capture (see drmd_metrics.c) as a
+// benchmark: every .md file in the directory is converted several times and
+// the fastest parse, render and total time of each is printed, so a slow
+// document from production can be measured again as it is fixed.
+//
+// Included after drmd_metrics.c by drmd_cli.c.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+enum {REPLAY_RUNS = 5};
+
+static
+int
+replay_compare_names(const void* a, const void* b){
+    return strcmp(*(const char*const*)a, *(const char*const*)b);
+}
+
+//
+// Writes the name of every .md file in the directory to `names`, each
+// nul-terminated, and sets `count`. Returns non-zero if the directory can't
+// be read.
+static
+int
+replay_list(const char* dir, MStringBuilder* names, size_t* count){
+    *count = 0;
+#ifdef _WIN32
+    MStringBuilder pattern = {.allocator = MALLOCATOR};
+    msb_write_str(&pattern, dir, strlen(dir));
+    msb_write_literal(&pattern, "\\*.md");
+    msb_write_char(&pattern, '\0');
+    if(pattern.errored){
+        msb_destroy(&pattern);
+        return 1;
+    }
+    WIN32_FIND_DATAA found;
+    HANDLE h = FindFirstFileA(pattern.data, &found);
+    msb_destroy(&pattern);
+    if(h == INVALID_HANDLE_VALUE)
+        return GetLastError() != ERROR_FILE_NOT_FOUND;
+    do {
+        if(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+        msb_write_str(names, found.cFileName, strlen(found.cFileName));
+        msb_write_char(names, '\0');
+        ++*count;
+    }while(FindNextFileA(h, &found));
+    FindClose(h);
+#else
+    DIR* d = opendir(dir);
+    if(!d) return 1;
+    for(struct dirent* e; (e = readdir(d));){
+        size_t length = strlen(e->d_name);
+        if(length < 4 || memcmp(e->d_name + length - 3, ".md", 3) != 0)
+            continue;
+        msb_write_str(names, e->d_name, length);
+        msb_write_char(names, '\0');
+        ++*count;
+    }
+    closedir(d);
+#endif
+    return 0;
+}
+
+static
+int
+replay_read(const char* path, MStringBuilder* text){
+    FILE* fp = fopen(path, "rb");
+    if(!fp) return 1;
+    for(;;){
+        if(msb_ensure_additional(text, 64*1024)){
+            fclose(fp);
+            return 1;
+        }
+        size_t nread = fread(text->data + text->cursor, 1, 64*1024, fp);
+        text->cursor += nread;
+        if(nread != 64*1024)
+            break;
+    }
+    int err = ferror(fp);
+    fclose(fp);
+    return err;
+}
+
+//
+// Converts each captured document in `dir` REPLAY_RUNS times and writes a
+// line per document with the fastest times in milliseconds to `out`, sorted
+// by name, then the sum of them.
+// Returns 0 on success, or 1 if any document failed or on an io error.
+static
+int
+drmd_replay(const char* dir, FILE* out){
+    int result = 0;
+    MStringBuilder names = {.allocator = MALLOCATOR};
+    MStringBuilder path = {.allocator = MALLOCATOR};
+    MStringBuilder text = {.allocator = MALLOCATOR};
+    MStringBuilder html = {.allocator = MALLOCATOR};
+    const char** sorted = NULL;
+    size_t count = 0;
+    DrMdContext* ctx = drmd_context_create();
+    if(!ctx){
+        fprintf(stderr, "Out of memory\n");
+        result = 1;
+        goto cleanup;
+    }
+    if(replay_list(dir, &names, &count)){
+        fprintf(stderr, "Unable to read '%s': %s\n", dir, strerror(errno));
+        result = 1;
+        goto cleanup;
+    }
+    sorted = Allocator_alloc(MALLOCATOR, count * sizeof *sorted);
+    if(names.errored || (count && !sorted)){
+        fprintf(stderr, "Out of memory\n");
+        result = 1;
+        goto cleanup;
+    }
+    const char* name = names.data;
+    for(size_t i = 0; i < count; i++){
+        sorted[i] = name;
+        name += strlen(name) + 1;
+    }
+    if(count)
+        qsort(sorted, count, sizeof *sorted, replay_compare_names);
+    fprintf(out, "%10s %10s %10s %10s %10s  %s\n", "parse_ms", "render_ms", "total_ms", "nodes", "bytes", "file");
+    uint64_t sum[3] = {0};
+    for(size_t i = 0; i < count; i++){
+        msb_reset(&path);
+        msb_write_str(&path, dir, strlen(dir));
+        msb_write_char(&path, '/');
+        msb_write_str(&path, sorted[i], strlen(sorted[i]));
+        msb_write_char(&path, '\0');
+        msb_reset(&text);
+        if(path.errored || replay_read(path.data, &text)){
+            fprintf(stderr, "Unable to read '%s': %s\n", path.errored? sorted[i] : path.data, strerror(errno));
+            result = 1;
+            continue;
+        }
+        StringView input = {text.cursor, text.data? text.data : ""};
+        uint64_t best[3] = {UINT64_MAX, UINT64_MAX, UINT64_MAX};
+        int err = 0;
+        for(int run = 0; run < REPLAY_RUNS && !err; run++){
+            msb_reset(&html);
+            uint64_t start = metrics_now();
+            NodeHandle root;
+            err = context_parse(ctx, input, &root);
+            uint64_t parsed = metrics_now();
+            if(!err){
+                err = render_to_html(ctx, root, &html);
+                if(!err && html.errored)
+                    err = ERROR_OOM;
+            }
+            uint64_t rendered = metrics_now();
+            uint64_t times[3] = {parsed - start, rendered - parsed, rendered - start};
+            for(int t = 0; t < 3; t++)
+                if(times[t] < best[t])
+                    best[t] = times[t];
+        }
+        if(err){
+            fprintf(stderr, "Unable to convert '%s'\n", path.data);
+            result = 1;
+            continue;
+        }
+        for(int t = 0; t < 3; t++)
+            sum[t] += best[t];
+        fprintf(out, "%10.3f %10.3f %10.3f %10zu %10zu  %s\n",
+            (double)best[0] / 1e6, (double)best[1] / 1e6, (double)best[2] / 1e6,
+            ctx->nodes.count, input.length, sorted[i]);
+    }
+    fprintf(out, "%10.3f %10.3f %10.3f %10s %10s  %zu files\n",
+        (double)sum[0] / 1e6, (double)sum[1] / 1e6, (double)sum[2] / 1e6, "", "", count);
+    cleanup:
+    if(ctx)
+        drmd_context_destroy(ctx);
+    if(sorted)
+        Allocator_free(MALLOCATOR, sorted, count * sizeof *sorted);
+    msb_destroy(&names);
+    msb_destroy(&path);
+    msb_destroy(&text);
+    msb_destroy(&html);
+    return result;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
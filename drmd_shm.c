@@ -0,0 +1,243 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+// Serves conversions to a co-process over the shared memory rings described
+// in drmd_shm.h: `drmd --shm FD` converts each request as it arrives, in
+// order, until the client sends DRMD_SHM_CLOSE or exits. Every conversion
+// is recorded in the metrics (drmd_metrics.c), which a DRMD_SHM_STATS
+// request gets back, and which are written to --metrics on exit.
+//
+// Included after drmd.c and drmd_metrics.c by drmd_cli.c.
+//
+#include <stdio.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "drmd_shm.h"
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+#ifdef __linux__
+static
+int
+shm_send_error(const DrMdShmQueue* responses, uint64_t id, int err, int peer){
+    StringView message = err == ERROR_TOO_DEEP? SV("nested too deeply")
+                       : err == ERROR_OOM?      SV("out of memory")
+                       :                        SV("unable to convert");
+    size_t capacity;
+    char* slot = drmd_shm_reserve(responses, message.length, &capacity, 1, peer);
+    if(!slot) return 1;
+    memcpy(slot, message.text, message.length);
+    drmd_shm_commit(responses, DRMD_SHM_ERROR, id, message.length);
+    return 0;
+}
+
+//
+// Copies the payload into the response ring, in DRMD_SHM_HTML_PART records
+// followed by one of `kind` if it needs more than half the ring. Returns
+// non-zero if the client went away.
+static
+int
+shm_send(const DrMdShmQueue* responses, DrMdShmKind kind, uint64_t id, StringView payload, int peer){
+    size_t half = responses->size / 2;
+    size_t sent = 0;
+    do {
+        size_t remaining = payload.length - sent;
+        size_t capacity;
+        char* slot = drmd_shm_reserve(responses, remaining < half? remaining : half, &capacity, 1, peer);
+        if(!slot) return 1;
+        size_t n = remaining < capacity? remaining : capacity;
+        if(n) memcpy(slot, payload.text + sent, n);
+        sent += n;
+        drmd_shm_commit(responses, sent == payload.length? kind : DRMD_SHM_HTML_PART, id, n);
+    } while(sent < payload.length);
+    return 0;
+}
+
+//
+// Converts the markdown where it is in the request ring, `payload` as
+// returned by drmd_shm_next with the request. The html is
+// rendered straight into the free space of the response ring, or if it
+// doesn't fit there, into the context's buffer and copied over in parts.
+// Returns non-zero if the client went away.
+static
+int
+shm_convert(DrMdContext* ctx, Metrics* m, const DrMdShmQueue* responses, const DrMdShmRecord* request, const char* payload, int peer){
+    StringView input = {request->length, payload};
+    uint64_t start = metrics_now();
+    NodeHandle root;
+    int err = context_parse(ctx, input, &root);
+    uint64_t parsed = metrics_now();
+    if(err){
+        metrics_record(m, ctx, input.length, 0, start, parsed, parsed, err);
+        return shm_send_error(responses, request->id, err, peer);
+    }
+    // Html is up to a few times the size of its markdown. If it could be
+    // bigger than half the ring, don't bother rendering in place only to
+    // run out of room and render it again.
+    size_t want = input.length * 3 + 256;
+    size_t capacity;
+    char* slot;
+    if(want <= responses->size / 2){
+        slot = drmd_shm_reserve(responses, want, &capacity, 1, peer);
+        if(!slot) return 1;
+        MStringBuilder direct = {
+            .data = slot,
+            .capacity = capacity,
+            .allocator = NULLACATOR,
+        };
+        err = render_node(ctx, &direct, root, 0);
+        if(err || !direct.errored){
+            metrics_record(m, ctx, input.length, err? 0 : direct.cursor, start, parsed, metrics_now(), err);
+            if(err) return shm_send_error(responses, request->id, err, peer);
+            drmd_shm_commit(responses, DRMD_SHM_HTML, request->id, direct.cursor);
+            return 0;
+        }
+    }
+    MStringBuilder msb = {
+        .data = ctx->output,
+        .capacity = ctx->output_capacity,
+        .allocator = MALLOCATOR,
+    };
+    err = render_to_html(ctx, root, &msb);
+    ctx->output = msb.data;
+    ctx->output_capacity = msb.capacity;
+    if(!err && msb.errored) err = ERROR_OOM;
+    metrics_record(m, ctx, input.length, err? 0 : msb.cursor, start, parsed, metrics_now(), err);
+    if(err) return shm_send_error(responses, request->id, err, peer);
+    return shm_send(responses, DRMD_SHM_HTML, request->id, (StringView){msb.cursor, msb.data}, peer);
+}
+
+//
+// Answers a DRMD_SHM_STATS request with the metrics so far.
+static
+int
+shm_send_stats(DrMdContext* ctx, const Metrics* m, const DrMdShmQueue* responses, uint64_t id, int peer){
+    // The context's buffer is free between conversions.
+    MStringBuilder msb = {
+        .data = ctx->output,
+        .capacity = ctx->output_capacity,
+        .allocator = MALLOCATOR,
+    };
+    metrics_write(&msb, m);
+    ctx->output = msb.data;
+    ctx->output_capacity = msb.capacity;
+    if(msb.errored) return shm_send_error(responses, id, ERROR_OOM, peer);
+    return shm_send(responses, DRMD_SHM_STATS, id, (StringView){msb.cursor, msb.data}, peer);
+}
+
+//
+// Returns a pidfd of the client, or -1 if it can't be watched. Sets *gone
+// if it has already exited.
+static
+int
+shm_open_client(pid_t client, _Bool* gone){
+    pid_t parent = getppid();
+    if(!client || client == parent){
+        // The parent's pid can't be reused while it is still our parent,
+        // so if it is once the pidfd is open, the pidfd is of the client.
+        int peer = drmd_shm_peer_open(parent);
+        *gone = getppid() != parent || (peer < 0 && errno == ESRCH) || drmd_shm_peer_exited(peer);
+        return peer;
+    }
+    // Some other process set up the region. If it died and its pid was
+    // reused before this started there is no telling, but once the pidfd
+    // is open it can't be fooled.
+    int peer = drmd_shm_peer_open(client);
+    *gone = (peer < 0 && errno == ESRCH) || drmd_shm_peer_exited(peer);
+    return peer;
+}
+#endif
+
+static
+int
+drmd_shm_serve(int fd, const char*_Nullable metrics_path){
+#ifdef __linux__
+    struct stat st;
+    if(fstat(fd, &st) != 0){
+        fprintf(stderr, "Unable to stat --shm fd %d: %s\n", fd, strerror(errno));
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    void* map = size? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if(map == MAP_FAILED){
+        fprintf(stderr, "Unable to map --shm fd %d: %s\n", fd, size? strerror(errno) : "it is empty");
+        return 1;
+    }
+    DrMdShmHeader* shm = map;
+    // Only this copy of the rings' offsets and sizes is used from here on,
+    // as the client can write to the header.
+    DrMdShmQueue requests, responses;
+    if(drmd_shm_open(shm, size, &requests, &responses)){
+        fprintf(stderr, "--shm fd %d wasn't set up by drmd_shm_init\n", fd);
+        munmap(map, size);
+        return 1;
+    }
+    shm->server_pid = (int32_t)getpid();
+    _Bool gone;
+    int peer = shm_open_client(shm->client_pid, &gone);
+    DrMdContext* ctx = drmd_context_create();
+    Metrics* m = Allocator_zalloc(MALLOCATOR, sizeof *m);
+    int result = 1;
+    if(gone){
+        fprintf(stderr, "--shm: the client exited\n");
+        goto done;
+    }
+    if(!ctx || !m){
+        fprintf(stderr, "Out of memory\n");
+        goto done;
+    }
+    for(;;){
+        DrMdShmRecord request;
+        const char* payload = drmd_shm_next(&requests, &request, 1, peer);
+        if(!payload){
+            fprintf(stderr, "--shm: the client exited or sent a malformed request\n");
+            break;
+        }
+        if(request.kind == DRMD_SHM_CLOSE){
+            drmd_shm_consume(&requests, &request);
+            result = 0;
+            break;
+        }
+        int e;
+        if(request.kind == DRMD_SHM_CONVERT)
+            // The markdown is parsed in place, so it can only be freed
+            // once the html is out.
+            e = shm_convert(ctx, m, &responses, &request, payload, peer);
+        else if(request.kind == DRMD_SHM_STATS)
+            e = shm_send_stats(ctx, m, &responses, request.id, peer);
+        else {
+            fprintf(stderr, "--shm: unknown request kind %u\n", (unsigned)request.kind);
+            break;
+        }
+        if(e){
+            fprintf(stderr, "--shm: the client exited\n");
+            break;
+        }
+        drmd_shm_consume(&requests, &request);
+    }
+    if(m && metrics_path){
+        const Metrics* workers[] = {m};
+        if(metrics_save(metrics_path, workers, 1))
+            result = 1;
+    }
+    done:
+    if(m) Allocator_free(MALLOCATOR, m, sizeof *m);
+    if(ctx) drmd_context_destroy(ctx);
+    if(peer >= 0) close(peer);
+    munmap(map, size);
+    return result;
+#else
+    (void)fd;
+    (void)metrics_path;
+    fprintf(stderr, "--shm is only supported on linux\n");
+    return 1;
+#endif
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
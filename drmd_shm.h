@@ -0,0 +1,375 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+#ifndef DRMD_SHM_H
+#define DRMD_SHM_H
+//
+// Shared memory transport for running drmd as a co-process (linux only).
+//
+// The client creates a memfd, lays out a DrMdShmHeader at its start followed
+// by two rings, and starts `drmd --shm FD` with the fd inherited. Requests go
+// through one ring and responses come back through the other, in order. Each
+// ring has a single producer and a single consumer, so moving a record is
+// only a store of the head or tail, and a futex wakeup if the other side is
+// asleep.
+//
+// The markdown is parsed in place in the request ring and the html is
+// rendered straight into the response ring, so neither is copied. Html that
+// doesn't fit in the ring comes back in several DRMD_SHM_HTML_PART records
+// followed by a DRMD_SHM_HTML record.
+//
+// Each side notices the other has died (even if it was left a zombie) through
+// a pidfd, checked whenever it has been waiting for a while.
+//
+// See drmd_shm_client.c for a small client.
+//
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+enum {
+    DRMD_SHM_MAGIC = 0x646d7264, // "drmd"
+    DRMD_SHM_VERSION = 2,
+    // Records, and so the rings, are multiples of this.
+    DRMD_SHM_ALIGN = 16,
+};
+
+typedef enum DrMdShmKind DrMdShmKind;
+enum DrMdShmKind {
+    // Requests.
+    DRMD_SHM_CONVERT = 1, // The payload is markdown to convert.
+    DRMD_SHM_CLOSE   = 2, // No more requests, the server exits.
+    // Asks for the metrics of the conversions so far, and is also the kind
+    // of the response, whose payload is them in the Prometheus text format.
+    DRMD_SHM_STATS   = 7,
+    // Responses, with the id of their request.
+    DRMD_SHM_HTML      = 3, // The (rest of the) html.
+    DRMD_SHM_HTML_PART = 4, // Part of the html (or stats), more follows.
+    DRMD_SHM_ERROR     = 5, // The payload is a message.
+    // Skips the rest of the ring, the next record is at its start.
+    DRMD_SHM_WRAP = 6,
+};
+
+typedef struct DrMdShmRecord DrMdShmRecord;
+struct DrMdShmRecord {
+    uint32_t length; // Of the payload that follows.
+    uint32_t kind;
+    uint64_t id;     // Chosen by the client.
+};
+_Static_assert(sizeof(DrMdShmRecord) == DRMD_SHM_ALIGN, "");
+
+typedef struct DrMdShmRing DrMdShmRing;
+struct DrMdShmRing {
+    // Where the ring's bytes are, from the start of the region.
+    uint64_t offset;
+    uint64_t size;
+    char pad0[48];
+    // Bytes ever produced and consumed. Only the producer writes head and
+    // only the consumer writes tail, each on its own cache line with the
+    // futex word bumped after it moves. The waiters flags say whether the
+    // other side is asleep on that word and needs waking.
+    uint64_t head;
+    uint32_t head_seq;
+    uint32_t head_waiters;
+    char pad1[48];
+    uint64_t tail;
+    uint32_t tail_seq;
+    uint32_t tail_waiters;
+    char pad2[48];
+};
+_Static_assert(sizeof(DrMdShmRing) == 3*64, "");
+
+typedef struct DrMdShmHeader DrMdShmHeader;
+struct DrMdShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    // Of the whole region.
+    uint64_t size;
+    // For noticing the other side has exited while waiting on it. The server
+    // watches its parent if client_pid is 0.
+    int32_t client_pid;
+    int32_t server_pid;
+    char pad[40];
+    DrMdShmRing requests;
+    DrMdShmRing responses;
+};
+
+static inline
+size_t
+drmd_shm_record_size(size_t length){
+    return sizeof(DrMdShmRecord) + ((length + DRMD_SHM_ALIGN - 1) & ~(size_t)(DRMD_SHM_ALIGN - 1));
+}
+
+//
+// One side's view of a ring. The offset and size in the region could be
+// changed by the other side at any time, so each side copies them once they
+// have been checked (drmd_shm_open) and only uses its copy.
+typedef struct DrMdShmQueue DrMdShmQueue;
+struct DrMdShmQueue {
+    DrMdShmRing* ring; // For the head, tail and futex words.
+    char* data;
+    size_t size;
+};
+
+//
+// Returns a pidfd of the process for the `peer` arguments below, or -1 if
+// it doesn't exist (or the kernel is older than 5.3, when the peer can't be
+// watched). Unlike its pid, the pidfd can't come to mean another process
+// once this one is reaped. Close it when done.
+static inline
+int
+drmd_shm_peer_open(pid_t pid){
+    if(pid <= 0) return -1;
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+//
+// Whether the process has exited, including if it is a zombie nobody has
+// waited for yet. Never for a peer of -1.
+static inline
+_Bool
+drmd_shm_peer_exited(int peer){
+    if(peer < 0) return 0;
+    struct pollfd p = {.fd = peer, .events = POLLIN};
+    return poll(&p, 1, 0) == 1;
+}
+
+//
+// Waits for *seq to change from `seen`, unless *value isn't `unchanged`
+// anymore by the time the waiters flag is up. Returns non-zero if nothing
+// happened for a while and the peer has exited.
+static inline
+int
+drmd_shm_wait(uint32_t* seq, uint32_t* waiters, uint32_t seen, const uint64_t* value, uint64_t unchanged, int peer){
+    _Bool timed_out = 0;
+    __atomic_store_n(waiters, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(value, __ATOMIC_SEQ_CST) == unchanged){
+        struct timespec timeout = {.tv_sec = 1};
+        long r = syscall(SYS_futex, seq, FUTEX_WAIT, seen, &timeout, NULL, 0);
+        timed_out = r != 0 && errno == ETIMEDOUT;
+    }
+    __atomic_store_n(waiters, 0, __ATOMIC_SEQ_CST);
+    return timed_out && drmd_shm_peer_exited(peer);
+}
+
+static inline
+void
+drmd_shm_wake(uint32_t* seq, uint32_t* waiters){
+    __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static inline
+void
+drmd_shm_pause(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// How many times to check before going to sleep on a futex. Under load the
+// other side usually catches up within this, saving the syscalls.
+enum {DRMD_SHM_SPIN = 2000};
+
+//
+// Producer side.
+//
+// Returns space for a record with a payload of at least `min_length` bytes,
+// waiting for the consumer if there isn't enough yet, and sets `capacity` to
+// how much payload fits there. Doesn't wait if `wait` is 0, returning NULL
+// if there isn't room. Also returns NULL if the peer (a pidfd from
+// drmd_shm_peer_open, or -1) exited or min_length can never fit.
+static inline
+void*_Nullable
+drmd_shm_reserve(const DrMdShmQueue* q, size_t min_length, size_t* capacity, _Bool wait, int peer){
+    DrMdShmRing* ring = q->ring;
+    size_t need = drmd_shm_record_size(min_length);
+    if(need > q->size) return NULL;
+    uint64_t head = ring->head;
+    for(int spins = 0;;){
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        size_t index = head % q->size;
+        size_t contiguous = q->size - index;
+        size_t free = q->size - (size_t)(head - tail);
+        if(free > q->size) return NULL; // A tail the consumer couldn't have written.
+        if(contiguous < need && free >= contiguous){
+            // Skip to the start of the ring.
+            DrMdShmRecord* wrap = (DrMdShmRecord*)(q->data + index);
+            *wrap = (DrMdShmRecord){.length = (uint32_t)(contiguous - sizeof *wrap), .kind = DRMD_SHM_WRAP};
+            head += contiguous;
+            __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+            drmd_shm_wake(&ring->head_seq, &ring->head_waiters);
+            continue;
+        }
+        if(contiguous >= need && free >= need){
+            size_t room = free < contiguous? free : contiguous;
+            *capacity = room - sizeof(DrMdShmRecord);
+            return q->data + index + sizeof(DrMdShmRecord);
+        }
+        if(!wait) return NULL;
+        if(spins < DRMD_SHM_SPIN){
+            spins++;
+            drmd_shm_pause();
+            continue;
+        }
+        uint32_t seen = __atomic_load_n(&ring->tail_seq, __ATOMIC_SEQ_CST);
+        if(drmd_shm_wait(&ring->tail_seq, &ring->tail_waiters, seen, &ring->tail, tail, peer))
+            return NULL;
+    }
+}
+
+//
+// Publishes the record whose payload was written at what drmd_shm_reserve
+// returned.
+static inline
+void
+drmd_shm_commit(const DrMdShmQueue* q, DrMdShmKind kind, uint64_t id, size_t length){
+    DrMdShmRing* ring = q->ring;
+    uint64_t head = ring->head;
+    DrMdShmRecord* record = (DrMdShmRecord*)(q->data + head % q->size);
+    *record = (DrMdShmRecord){.length = (uint32_t)length, .kind = kind, .id = id};
+    __atomic_store_n(&ring->head, head + drmd_shm_record_size(length), __ATOMIC_SEQ_CST);
+    drmd_shm_wake(&ring->head_seq, &ring->head_waiters);
+}
+
+//
+// Consumer side.
+//
+// Copies the next record into *record and returns its payload, waiting for
+// one unless `wait` is 0. Returns NULL if there is none and not waiting, if
+// the peer exited or if the record is malformed. The payload stays valid
+// until drmd_shm_consume, but as the producer can still write to it, only
+// the copy's length says how long it is.
+static inline
+const char*_Nullable
+drmd_shm_next(const DrMdShmQueue* q, DrMdShmRecord* record, _Bool wait, int peer){
+    DrMdShmRing* ring = q->ring;
+    uint64_t tail = ring->tail;
+    for(int spins = 0;;){
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if(head != tail){
+            size_t index = tail % q->size;
+            if(head - tail < sizeof(DrMdShmRecord) || q->size - index < sizeof(DrMdShmRecord))
+                return NULL;
+            memcpy(record, q->data + index, sizeof *record);
+            size_t size = drmd_shm_record_size(record->length);
+            if(size > q->size - index || size > head - tail)
+                return NULL;
+            if(record->kind != DRMD_SHM_WRAP)
+                return q->data + index + sizeof *record;
+            tail += size;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+            drmd_shm_wake(&ring->tail_seq, &ring->tail_waiters);
+            continue;
+        }
+        if(!wait) return NULL;
+        if(spins < DRMD_SHM_SPIN){
+            spins++;
+            drmd_shm_pause();
+            continue;
+        }
+        uint32_t seen = __atomic_load_n(&ring->head_seq, __ATOMIC_SEQ_CST);
+        if(drmd_shm_wait(&ring->head_seq, &ring->head_waiters, seen, &ring->head, head, peer))
+            return NULL;
+    }
+}
+
+//
+// Frees the space of the record drmd_shm_next copied out.
+static inline
+void
+drmd_shm_consume(const DrMdShmQueue* q, const DrMdShmRecord* record){
+    DrMdShmRing* ring = q->ring;
+    uint64_t tail = ring->tail + drmd_shm_record_size(record->length);
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+    drmd_shm_wake(&ring->tail_seq, &ring->tail_waiters);
+}
+
+//
+// Sets up the header for a region of `size` bytes, splitting what is left
+// after it evenly between the two rings. Returns non-zero if it is too
+// small.
+static inline
+int
+drmd_shm_init(DrMdShmHeader* shm, size_t size){
+    size_t ring_size = (size - sizeof *shm) / 2 / 4096 * 4096;
+    if(size < sizeof *shm || ring_size < 4096) return 1;
+    memset(shm, 0, sizeof *shm);
+    shm->magic = DRMD_SHM_MAGIC;
+    shm->version = DRMD_SHM_VERSION;
+    shm->size = size;
+    shm->client_pid = (int32_t)getpid();
+    shm->requests.offset = 4096;
+    shm->requests.size = ring_size;
+    shm->responses.offset = 4096 + ring_size;
+    shm->responses.size = ring_size;
+    return 0;
+}
+
+//
+// Checks a region set up by the other side. Returns non-zero if it doesn't
+// look right.
+static inline
+int
+drmd_shm_validate(const DrMdShmHeader* shm, size_t size){
+    if(size < sizeof *shm) return 1;
+    if(shm->magic != DRMD_SHM_MAGIC || shm->version != DRMD_SHM_VERSION || shm->size != size)
+        return 1;
+    const DrMdShmRing* rings[] = {&shm->requests, &shm->responses};
+    for(size_t i = 0; i < 2; i++){
+        const DrMdShmRing* r = rings[i];
+        if(r->offset < sizeof *shm || r->offset % DRMD_SHM_ALIGN || r->size % DRMD_SHM_ALIGN || !r->size)
+            return 1;
+        if(r->offset > size || r->size > size - r->offset)
+            return 1;
+        if(r->size > UINT32_MAX)
+            return 1;
+    }
+    if(shm->requests.offset < shm->responses.offset + shm->responses.size
+    && shm->responses.offset < shm->requests.offset + shm->requests.size)
+        return 1;
+    return 0;
+}
+
+//
+// Checks the region like drmd_shm_validate and sets up this side's view of
+// its rings from a copy of the header, so what they use can't change after
+// the check. Returns non-zero if it doesn't look right.
+static inline
+int
+drmd_shm_open(DrMdShmHeader* shm, size_t size, DrMdShmQueue* requests, DrMdShmQueue* responses){
+    DrMdShmHeader copy;
+    if(size < sizeof copy) return 1;
+    memcpy(&copy, shm, sizeof copy);
+    if(drmd_shm_validate(&copy, size)) return 1;
+    *requests = (DrMdShmQueue){&shm->requests, (char*)shm + copy.requests.offset, (size_t)copy.requests.size};
+    *responses = (DrMdShmQueue){&shm->responses, (char*)shm + copy.responses.offset, (size_t)copy.responses.size};
+    return 0;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+// A small client for `drmd --shm` (see drmd_shm.h): starts drmd as a
+// co-process and converts each file through the shared memory rings,
+// writing the html to stdout.
+//
+//   drmd_shm_client [-n REPEAT] DRMD FILE...
+//
+// With -n, the files are converted that many times (only the last round is
+// output) and the throughput is printed to stderr.
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "drmd_shm.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+typedef struct File File;
+struct File {
+    const char* path;
+    char*_Nullable text;
+    size_t length;
+};
+
+static
+int
+read_file(File* f){
+    FILE* fp = fopen(f->path, "rb");
+    if(!fp){
+        fprintf(stderr, "Unable to open '%s': %s\n", f->path, strerror(errno));
+        return 1;
+    }
+    size_t capacity = 0;
+    for(;;){
+        if(f->length == capacity){
+            capacity = capacity? capacity * 2 : 4096;
+            char* text = realloc(f->text, capacity);
+            if(!text){
+                fclose(fp);
+                return 1;
+            }
+            f->text = text;
+        }
+        size_t n = fread(f->text + f->length, 1, capacity - f->length, fp);
+        f->length += n;
+        if(!n) break;
+    }
+    int err = ferror(fp);
+    if(err) fprintf(stderr, "Error reading '%s': %s\n", f->path, strerror(errno));
+    fclose(fp);
+    return err;
+}
+
+static
+double
+now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+int
+main(int argc, char** argv){
+    long repeat = 1;
+    int argi = 1;
+    if(argi + 1 < argc && strcmp(argv[argi], "-n") == 0){
+        repeat = strtol(argv[argi + 1], NULL, 10);
+        argi += 2;
+    }
+    if(argc - argi < 2 || repeat < 1){
+        fprintf(stderr, "Usage: %s [-n REPEAT] DRMD FILE...\n", argc? argv[0] : "drmd_shm_client");
+        return 1;
+    }
+    const char* drmd = argv[argi++];
+    size_t n_files = (size_t)(argc - argi);
+    File* files = calloc(n_files, sizeof *files);
+    if(!files) return 1;
+    size_t longest = 0, total_bytes = 0;
+    for(size_t i = 0; i < n_files; i++){
+        files[i].path = argv[argi + (int)i];
+        if(read_file(&files[i])) return 1;
+        if(files[i].length > longest) longest = files[i].length;
+        total_bytes += files[i].length;
+    }
+    if(longest > UINT32_MAX - 4096){
+        fprintf(stderr, "Files must be smaller than 4GiB\n");
+        return 1;
+    }
+    // Each ring needs to fit the biggest file, and several files in flight
+    // keep drmd busy.
+    size_t ring_size = 4 * 1024 * 1024;
+    while(ring_size < drmd_shm_record_size(longest))
+        ring_size *= 2;
+    size_t size = 4096 + 2 * ring_size;
+    int fd = memfd_create("drmd-shm", 0);
+    if(fd < 0 || ftruncate(fd, (off_t)size) != 0){
+        fprintf(stderr, "Unable to create shared memory: %s\n", strerror(errno));
+        return 1;
+    }
+    DrMdShmHeader* shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(shm == MAP_FAILED){
+        fprintf(stderr, "Unable to map shared memory: %s\n", strerror(errno));
+        return 1;
+    }
+    DrMdShmQueue requests, responses;
+    if(drmd_shm_init(shm, size) || drmd_shm_open(shm, size, &requests, &responses)) return 1;
+    char fd_arg[16];
+    snprintf(fd_arg, sizeof fd_arg, "%d", fd);
+    pid_t server = fork();
+    if(server < 0){
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        return 1;
+    }
+    if(!server){
+        execl(drmd, drmd, "--shm", fd_arg, (char*)NULL);
+        fprintf(stderr, "Unable to run '%s': %s\n", drmd, strerror(errno));
+        _exit(127);
+    }
+    close(fd);
+    // Notices drmd crashing even though it stays a zombie until waited for.
+    int peer = drmd_shm_peer_open(server);
+
+    int result = 0;
+    size_t total = (size_t)repeat * n_files;
+    size_t sent = 0, received = 0;
+    double start = now();
+    while(received < total){
+        // Keep the request ring as full as it will go, then take what
+        // responses there are. drmd frees a request only once its html is
+        // out, so with every response in there may still be no room, and
+        // then there is nothing to do but wait for it.
+        while(sent < total){
+            const File* f = &files[sent % n_files];
+            size_t capacity;
+            char* slot = drmd_shm_reserve(&requests, f->length, &capacity, sent == received, peer);
+            if(!slot) break;
+            if(f->length) memcpy(slot, f->text, f->length);
+            drmd_shm_commit(&requests, DRMD_SHM_CONVERT, sent, f->length);
+            sent++;
+        }
+        DrMdShmRecord response;
+        const char* payload = drmd_shm_next(&responses, &response, 1, peer);
+        if(!payload){
+            fprintf(stderr, "drmd exited\n");
+            result = 1;
+            break;
+        }
+        const File* f = &files[response.id % n_files];
+        _Bool last_round = response.id >= total - n_files;
+        switch(response.kind){
+            case DRMD_SHM_HTML:
+            case DRMD_SHM_HTML_PART:
+                if(last_round && response.length && fwrite(payload, response.length, 1, stdout) != 1){
+                    fprintf(stderr, "Error writing: %s\n", strerror(errno));
+                    result = 1;
+                }
+                break;
+            case DRMD_SHM_ERROR:
+                fprintf(stderr, "%s: %.*s\n", f->path, (int)response.length, payload);
+                result = 1;
+                break;
+            default:
+                fprintf(stderr, "Unexpected response kind %u\n", (unsigned)response.kind);
+                result = 1;
+                break;
+        }
+        if(response.kind != DRMD_SHM_HTML_PART)
+            received++;
+        drmd_shm_consume(&responses, &response);
+    }
+    double elapsed = now() - start;
+    size_t capacity;
+    if(drmd_shm_reserve(&requests, 0, &capacity, 1, peer))
+        drmd_shm_commit(&requests, DRMD_SHM_CLOSE, 0, 0);
+    int status;
+    if(waitpid(server, &status, 0) != server || !WIFEXITED(status) || WEXITSTATUS(status))
+        result = 1;
+    if(peer >= 0) close(peer);
+    if(repeat > 1)
+        fprintf(stderr, "%zu conversions, %.1f MB in %.3fs: %.0f MB/s, %.1fus each\n",
+            received, (double)total_bytes * (double)repeat / 1e6, elapsed,
+            (double)total_bytes * (double)repeat / 1e6 / elapsed,
+            elapsed * 1e6 / (double)received);
+    for(size_t i = 0; i < n_files; i++)
+        free(files[i].text);
+    free(files);
+    fflush(stdout);
+    return result;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
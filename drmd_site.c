@@ -0,0 +1,533 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+// The link graph of a batch of documents: which pages link to which, with
+// relative link targets resolved against the other inputs and the heading
+// ids of the page they point to.
+//
+// Workers scan each page as it is converted, recording its heading ids and
+// link targets. Once every page is scanned, the links are resolved on one
+// thread, reporting the ones that go nowhere and collecting the backlinks of
+// every page.
+//
+// When rendering, links to other inputs can be rewritten to go to their
+// outputs (see SiteLinks).
+//
+// Included after drmd.c by drmd_cli.c.
+//
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+typedef struct SiteLink SiteLink;
+struct SiteLink {
+    StringView target;
+    int lineno;
+};
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#define MARRAY_T SiteLink
+#include "Marray.h"
+
+#define MARRAY_T StringView
+#include "Marray.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+typedef struct SitePage SitePage;
+struct SitePage {
+    const char* input;
+    const char* output;
+    // Normalized, so they can be compared with resolved link targets.
+    StringView input_key;
+    StringView output_key;
+    // Set by the worker that scans the page, unless it failed to convert.
+    _Bool scanned;
+    // The text of the first heading, to title backlinks with.
+    StringView title;
+    // Sorted.
+    Marray(StringView) ids;
+    Marray(SiteLink) links;
+    // Set by site_resolve: the pages linking here, each once.
+    size_t*_Nullable backlinks;
+    size_t backlink_count;
+};
+
+typedef struct SiteKey SiteKey;
+struct SiteKey {
+    StringView path;
+    size_t page;
+};
+
+typedef struct Site Site;
+struct Site {
+    SitePage* pages;
+    size_t count;
+    // Open addressing from both paths of every page to the page.
+    SiteKey* keys;
+    // Power of 2.
+    size_t key_capacity;
+    ArenaAllocator arena;
+};
+
+//
+// Appends the components of path to sb, which has the normalized path so far
+// from `start`: "." and empty components are dropped and ".." removes the
+// previous component unless there isn't one. `fixed` is where the leading
+// ".." components that can't be removed end.
+static
+void
+site_normalize_append(MStringBuilder* sb, size_t start, size_t* fixed, StringView path){
+    const char* p = path.text;
+    const char* end = p + path.length;
+    while(p != end){
+        const char* slash = memchr(p, '/', end - p);
+        const char* next = slash? slash : end;
+        size_t length = next - p;
+        if(!length || (length == 1 && p[0] == '.')){
+            // skip
+        }
+        else if(length == 2 && p[0] == '.' && p[1] == '.' && sb->cursor != *fixed){
+            while(sb->cursor != *fixed && sb->data[sb->cursor-1] != '/')
+                sb->cursor--;
+            if(sb->cursor != *fixed)
+                sb->cursor--;
+        }
+        else {
+            if(sb->cursor != start && sb->data[sb->cursor-1] != '/')
+                msb_write_char(sb, '/');
+            msb_write_str(sb, p, length);
+            if(length == 2 && p[0] == '.' && p[1] == '.')
+                *fixed = sb->cursor;
+        }
+        p = slash? slash+1 : end;
+    }
+}
+
+//
+// Writes the normalized path of `path` relative to the directory `dir`
+// (which can be empty) to sb.
+static
+void
+site_normalize(MStringBuilder* sb, StringView dir, StringView path){
+    size_t start = sb->cursor;
+    StringView first = dir.length? dir : path;
+    if(first.length && first.text[0] == '/')
+        msb_write_char(sb, '/');
+    size_t fixed = sb->cursor;
+    site_normalize_append(sb, start, &fixed, dir);
+    site_normalize_append(sb, start, &fixed, path);
+}
+
+//
+// The directory part of path, including the trailing '/'.
+static inline
+StringView
+site_dirname(StringView path){
+    while(path.length && path.text[path.length-1] != '/')
+        path.length--;
+    return path;
+}
+
+static
+SiteKey*
+site_find_key(const Site* site, StringView path){
+    size_t mask = site->key_capacity - 1;
+    for(size_t i = hash_bytes(path.text, path.length) & mask;; i = (i + 1) & mask){
+        SiteKey* key = &site->keys[i];
+        if(!key->path.length || sv_equals(key->path, path))
+            return key;
+    }
+}
+
+static
+StringView
+site_normalize_key(Site* site, const char* path){
+    MStringBuilder msb = {.allocator = allocator_from_arena(&site->arena)};
+    site_normalize(&msb, (StringView){0}, (StringView){strlen(path), path});
+    if(!msb.cursor || msb.errored){
+        msb_destroy(&msb);
+        return (StringView){0};
+    }
+    return msb_detach_sv(&msb);
+}
+
+//
+// Makes room for `count` pages, which are then set up with site_add_page.
+// Returns non-zero if out of memory.
+static
+int
+site_init(Site* site, size_t count){
+    site->count = count;
+    site->pages = Allocator_zalloc(allocator_from_arena(&site->arena), (count? count : 1) * sizeof *site->pages);
+    if(!site->pages) return 1;
+    size_t capacity = 64;
+    while(capacity < count * 4)
+        capacity *= 2;
+    site->keys = Allocator_zalloc(allocator_from_arena(&site->arena), capacity * sizeof *site->keys);
+    if(!site->keys) return 1;
+    site->key_capacity = capacity;
+    return 0;
+}
+
+//
+// Returns non-zero if out of memory.
+static
+int
+site_add_page(Site* site, size_t index, const char* input, const char* output){
+    SitePage* page = &site->pages[index];
+    page->input = input;
+    page->output = output;
+    page->input_key = site_normalize_key(site, input);
+    page->output_key = site_normalize_key(site, output);
+    if(!page->input_key.length || !page->output_key.length)
+        return 1;
+    // If an input is listed twice, links go to the first.
+    SiteKey* key = site_find_key(site, page->input_key);
+    if(!key->path.length)
+        *key = (SiteKey){page->input_key, index};
+    key = site_find_key(site, page->output_key);
+    if(!key->path.length)
+        *key = (SiteKey){page->output_key, index};
+    return 0;
+}
+
+static
+void
+site_destroy(Site* site){
+    ArenaAllocator_free_all(&site->arena);
+}
+
+typedef struct SiteScan SiteScan;
+struct SiteScan {
+    SitePage* page;
+    Allocator allocator;
+    StringView text;
+    // Where the line count was last taken, as links come mostly in order.
+    size_t offset;
+    int lineno;
+};
+
+static
+int
+site_add_link(void*_Nullable p, StringView target, size_t offset){
+    SiteScan* scan = p;
+    if(offset < scan->offset){
+        scan->offset = 0;
+        scan->lineno = 1;
+    }
+    for(const char* t = scan->text.text + scan->offset, *end = scan->text.text + offset;;){
+        t = memchr(t, '\n', end - t);
+        if(!t) break;
+        scan->lineno++;
+        t++;
+    }
+    scan->offset = offset;
+    char* copy = Allocator_dupe(scan->allocator, target.text, target.length);
+    if(target.length && !copy) return ERROR_OOM;
+    int err = Marray_push(SiteLink)(&scan->page->links, scan->allocator, (SiteLink){
+        .target = {target.length, copy},
+        .lineno = scan->lineno,
+    });
+    return err? ERROR_OOM : 0;
+}
+
+static
+int
+site_compare_ids(const void* a, const void* b){
+    const StringView* x = a;
+    const StringView* y = b;
+    size_t n = x->length < y->length? x->length : y->length;
+    int c = memcmp(x->text, y->text, n);
+    if(c) return c;
+    return x->length < y->length? -1 : x->length > y->length;
+}
+
+//
+// Records the heading ids and link targets of the parsed page, copied into
+// memory from `a` as the context and text get reused. The context's headings
+// must already be collected (see collect_headings).
+// Call from one thread per page; different pages can be scanned at the same
+// time.
+static
+int
+site_scan_page(SitePage* page, Allocator a, DrMdContext* ctx, NodeHandle root, StringView text){
+    MARRAY_FOR_EACH(HeadingAnchor, anchor, ctx->anchors){
+        char* id = Allocator_dupe(a, anchor->id.text, anchor->id.length);
+        if(!id) return ERROR_OOM;
+        if(Marray_push(StringView)(&page->ids, a, (StringView){anchor->id.length, id}))
+            return ERROR_OOM;
+    }
+    if(page->ids.count)
+        qsort(page->ids.data, page->ids.count, sizeof *page->ids.data, site_compare_ids);
+    if(ctx->anchors.count){
+        StringView title = ctx->anchors.data[0].text;
+        char* copy = Allocator_dupe(a, title.text, title.length);
+        if(title.length && !copy) return ERROR_OOM;
+        page->title = (StringView){title.length, copy};
+    }
+    SiteScan scan = {
+        .page = page,
+        .allocator = a,
+        .text = text,
+        .lineno = 1,
+    };
+    int err = find_links(ctx, root, text.text, site_add_link, &scan, 0);
+    if(err) return err;
+    page->scanned = 1;
+    return 0;
+}
+
+static
+_Bool
+site_has_id(const SitePage* page, StringView id){
+    if(!page->ids.count) return 0;
+    return bsearch(&id, page->ids.data, page->ids.count, sizeof *page->ids.data, site_compare_ids) != NULL;
+}
+
+static inline
+_Bool
+site_ends_with(StringView path, StringView suffix){
+    return path.length >= suffix.length && memcmp(path.text + path.length - suffix.length, suffix.text, suffix.length) == 0;
+}
+
+//
+// Only links to other documents are checked, not to images and the like.
+static inline
+_Bool
+site_is_document(StringView path){
+    return site_ends_with(path, SV(".md")) || site_ends_with(path, SV(".html")) || site_ends_with(path, SV(".htm"));
+}
+
+enum SiteLinkKind {
+    // Has a scheme (http:, mailto:) or starts from the site root, so it
+    // can't be checked against the inputs.
+    SITE_LINK_EXTERNAL,
+    // Not an input, and not a document that should have been one.
+    SITE_LINK_UNKNOWN,
+    SITE_LINK_OK,
+    SITE_LINK_NO_PAGE,
+    SITE_LINK_NO_HEADING,
+};
+
+//
+// Finds the page a link target on page `from` goes to, without looking at
+// its fragment. `path` is a scratch buffer, left with the normalized path of
+// the target, or empty for a link within the page. Only reads what
+// site_add_page set, so it can be called while pages are being scanned.
+static
+enum SiteLinkKind
+site_find_link_page(const Site* site, size_t from, StringView target, MStringBuilder* path, size_t* to){
+    msb_reset(path);
+    if(!target.length || target.text[0] == '/')
+        return SITE_LINK_EXTERNAL;
+    for(size_t i = 0; i < target.length; i++){
+        char c = target.text[i];
+        if(c == ':') return SITE_LINK_EXTERNAL;
+        if(c == '/' || c == '?' || c == '#') break;
+    }
+    for(size_t i = 0; i < target.length; i++){
+        if(target.text[i] == '?' || target.text[i] == '#'){
+            target.length = i;
+            break;
+        }
+    }
+    if(!target.length){
+        *to = from;
+        return SITE_LINK_OK;
+    }
+    site_normalize(path, site_dirname(site->pages[from].input_key), target);
+    if(path->errored)
+        return SITE_LINK_UNKNOWN;
+    SiteKey* key = path->cursor? site_find_key(site, msb_borrow_sv(path)) : NULL;
+    if(!key || !key->path.length)
+        return site_is_document(target)? SITE_LINK_NO_PAGE : SITE_LINK_UNKNOWN;
+    *to = key->page;
+    return SITE_LINK_OK;
+}
+
+//
+// Resolves a link target on page `from`. `path` is a scratch buffer.
+static
+enum SiteLinkKind
+site_resolve_link(const Site* site, size_t from, StringView target, MStringBuilder* path, size_t* to){
+    enum SiteLinkKind kind = site_find_link_page(site, from, target, path, to);
+    if(kind != SITE_LINK_OK)
+        return kind;
+    const char* hash = memchr(target.text, '#', target.length);
+    if(!hash)
+        return SITE_LINK_OK;
+    StringView fragment = {target.text + target.length - hash - 1, hash + 1};
+    const SitePage* page = &site->pages[*to];
+    // Unscanned pages failed to convert and were already reported.
+    if(fragment.length && page->scanned && !site_has_id(page, fragment))
+        return SITE_LINK_NO_HEADING;
+    return SITE_LINK_OK;
+}
+
+//
+// Resolves every link of every scanned page. Broken ones are written to
+// `report` (if any) as "page:line: message", and the backlinks of each page
+// are collected.
+// Returns the number of broken links, or -1 if out of memory.
+static
+long long
+site_resolve(Site* site, FILE*_Nullable report){
+    long long broken = 0;
+    Allocator a = allocator_from_arena(&site->arena);
+    MStringBuilder path = {.allocator = MALLOCATOR};
+    // Edges as (from, to), first counted per target, then placed.
+    size_t* counts = Allocator_zalloc(MALLOCATOR, (site->count+1) * sizeof *counts);
+    if(!counts) return -1;
+    for(int pass = 0; pass < 2; pass++){
+        for(size_t from = 0; from < site->count; from++){
+            const SitePage* page = &site->pages[from];
+            MARRAY_FOR_EACH(SiteLink, link, page->links){
+                size_t to;
+                enum SiteLinkKind kind = site_resolve_link(site, from, link->target, &path, &to);
+                switch(kind){
+                    case SITE_LINK_EXTERNAL:
+                    case SITE_LINK_UNKNOWN:
+                        break;
+                    case SITE_LINK_NO_PAGE:
+                    case SITE_LINK_NO_HEADING:
+                        if(pass) break;
+                        broken++;
+                        if(report)
+                            fprintf(report, "%s:%d: %s '%.*s'\n", page->input, link->lineno,
+                                kind == SITE_LINK_NO_PAGE? "link to missing page" : "link to missing heading",
+                                (int)link->target.length, link->target.text);
+                        break;
+                    case SITE_LINK_OK:{
+                        if(to == from) break;
+                        SitePage* dst = &site->pages[to];
+                        if(!pass){
+                            counts[to]++;
+                            break;
+                        }
+                        // Pages are visited in order, so a repeat is last.
+                        if(dst->backlink_count && dst->backlinks[dst->backlink_count-1] == from)
+                            break;
+                        dst->backlinks[dst->backlink_count++] = from;
+                        break;
+                    }
+                }
+            }
+        }
+        if(pass) break;
+        for(size_t i = 0; i < site->count; i++){
+            if(!counts[i]) continue;
+            site->pages[i].backlinks = Allocator_alloc(a, counts[i] * sizeof(size_t));
+            if(!site->pages[i].backlinks){
+                broken = -1;
+                goto cleanup;
+            }
+        }
+    }
+    cleanup:
+    Allocator_free(MALLOCATOR, counts, (site->count+1) * sizeof *counts);
+    msb_destroy(&path);
+    return broken;
+}
+
+//
+// Writes the path of `to` relative to the directory of `from`.
+static
+void
+site_write_relative(MStringBuilder* sb, StringView from, StringView to){
+    // Skip the directories they have in common.
+    size_t common = 0;
+    for(size_t i = 0; i < from.length && i < to.length && from.text[i] == to.text[i]; i++)
+        if(from.text[i] == '/')
+            common = i+1;
+    for(size_t i = common; i < from.length; i++)
+        if(from.text[i] == '/')
+            msb_write_literal(sb, "../");
+    msb_write_str(sb, to.text + common, to.length - common);
+}
+
+//
+// Writes a list of links to the pages linking to `page`, or nothing if
+// there aren't any.
+static
+int
+site_write_backlinks(const Site* site, const SitePage* page, MStringBuilder* sb){
+    if(!page->backlink_count) return 0;
+    msb_write_literal(sb, "<section class=\"backlinks\">\n<h2>Linked from</h2>\n<ul>\n");
+    MStringBuilder href = {.allocator = MALLOCATOR};
+    for(size_t i = 0; i < page->backlink_count; i++){
+        const SitePage* from = &site->pages[page->backlinks[i]];
+        msb_reset(&href);
+        site_write_relative(&href, page->output_key, from->output_key);
+        msb_write_literal(sb, "<li><a href=\"");
+        write_attr_escaped_str(sb, href.data, href.cursor);
+        msb_write_literal(sb, "\">");
+        int err;
+        if(from->title.length)
+            err = write_link_escaped_str(sb, from->title.text, from->title.length, 0);
+        else
+            err = write_link_escaped_str(sb, from->input_key.text, from->input_key.length, 0);
+        if(err){
+            msb_destroy(&href);
+            return err;
+        }
+        msb_write_literal(sb, "</a></li>\n");
+    }
+    msb_write_literal(sb, "</ul>\n</section>\n");
+    int err = href.errored || sb->errored;
+    msb_destroy(&href);
+    return err? ERROR_OOM : 0;
+}
+
+//
+// Rewrites the links of a page being rendered that go to another input to
+// go to that input's output instead (b.md to b.html), keeping any query and
+// fragment. Links within the page or to anything else are left alone.
+typedef struct SiteLinks SiteLinks;
+struct SiteLinks {
+    const Site* site;
+    // The page being rendered.
+    size_t from;
+    // Kept between links.
+    MStringBuilder path;
+    MStringBuilder href;
+};
+
+static
+int
+site_rewrite_link(void* p, StringView target, StringView* out){
+    SiteLinks* links = p;
+    const Site* site = links->site;
+    *out = target;
+    size_t to;
+    enum SiteLinkKind kind = site_find_link_page(site, links->from, target, &links->path, &to);
+    if(links->path.errored)
+        return ERROR_OOM;
+    if(kind != SITE_LINK_OK)
+        return 0;
+    const SitePage* page = &site->pages[to];
+    if(!links->path.cursor || !sv_equals(msb_borrow_sv(&links->path), page->input_key))
+        return 0;
+    size_t rest = 0;
+    while(rest < target.length && target.text[rest] != '?' && target.text[rest] != '#')
+        rest++;
+    msb_reset(&links->href);
+    site_write_relative(&links->href, site->pages[links->from].output_key, page->output_key);
+    msb_write_str(&links->href, target.text + rest, target.length - rest);
+    if(links->href.errored)
+        return ERROR_OOM;
+    *out = msb_borrow_sv(&links->href);
+    return 0;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
@@ -0,0 +1,645 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+// Batch conversion of the markdown files in a tar archive into a tar
+// archive of their html, without extracting anything.
+//
+// The input archive is mapped into memory and its headers are parsed in
+// place, so each member is converted straight out of the mapping. Members
+// are taken a chunk at a time, split between the workers in order, and each
+// worker renders its members' headers and html into one buffer. Those are
+// then written out in order, so the output is a single sequential write.
+//
+// Included after drmd_batch.c by drmd_cli.c.
+//
+#include <stdio.h>
+#include "thread_util.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+enum {TAR_BLOCK = 512};
+
+typedef struct TarInput TarInput;
+struct TarInput {
+    StringView data;
+    // The mapping of the file that data points into, or NULL if it was read
+    // into `buffer`.
+    void*_Nullable map;
+    MStringBuilder buffer;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+//
+// Maps the archive, or reads it into memory if it can't be mapped (like a
+// pipe or "-" for stdin). Returns non-zero on failure, having reported it.
+static
+int
+tar_open(TarInput* input, const char* path){
+    memcpy(input, &(TarInput){.buffer = {.allocator = MALLOCATOR}}, sizeof *input);
+    if(strcmp(path, "-") != 0){
+#ifdef _WIN32
+        input->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if(input->file == INVALID_HANDLE_VALUE){
+            fprintf(stderr, "Unable to open '%s': error %lu\n", path, GetLastError());
+            return 1;
+        }
+        LARGE_INTEGER size;
+        if(GetFileSizeEx(input->file, &size) && size.QuadPart){
+            input->mapping = CreateFileMappingA(input->file, NULL, PAGE_READONLY, 0, 0, NULL);
+            void* view = input->mapping? MapViewOfFile(input->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+            if(view){
+                input->data = (StringView){(size_t)size.QuadPart, view};
+                input->map = view;
+                return 0;
+            }
+            if(input->mapping)
+                CloseHandle(input->mapping);
+        }
+        CloseHandle(input->file);
+#else
+        int fd = open(path, O_RDONLY);
+        if(fd < 0){
+            fprintf(stderr, "Unable to open '%s': %s\n", path, strerror(errno));
+            return 1;
+        }
+        struct stat st;
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size){
+            void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(map != MAP_FAILED){
+                close(fd);
+#ifdef MADV_SEQUENTIAL
+                madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+                input->data = (StringView){(size_t)st.st_size, map};
+                input->map = map;
+                return 0;
+            }
+        }
+        close(fd);
+#endif
+    }
+    FILE* fp = strcmp(path, "-") == 0? stdin : fopen(path, "rb");
+    if(!fp){
+        fprintf(stderr, "Unable to open '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    MStringBuilder* sb = &input->buffer;
+    int err = 0;
+    for(;;){
+        if(msb_ensure_additional(sb, 1024*1024)){
+            fprintf(stderr, "Out of memory\n");
+            err = 1;
+            break;
+        }
+        size_t nread = fread(sb->data + sb->cursor, 1, 1024*1024, fp);
+        sb->cursor += nread;
+        if(nread != 1024*1024){
+            if(ferror(fp)){
+                fprintf(stderr, "Error reading '%s': %s\n", path, strerror(errno));
+                err = 1;
+            }
+            break;
+        }
+    }
+    if(fp != stdin)
+        fclose(fp);
+    input->data = (StringView){sb->cursor, sb->data? sb->data : ""};
+    return err;
+}
+
+static
+void
+tar_close(TarInput* input){
+    if(input->map){
+#ifdef _WIN32
+        UnmapViewOfFile(input->map);
+        CloseHandle(input->mapping);
+        CloseHandle(input->file);
+#else
+        munmap(input->map, input->data.length);
+#endif
+    }
+    msb_destroy(&input->buffer);
+}
+
+//
+// Reads a numeric header field: octal digits padded with spaces or nuls, or
+// big-endian base-256 if the high bit of the first byte is set (for sizes of
+// 8GiB and up). Returns non-zero if it is neither.
+static
+int
+tar_number(const char* field, size_t width, uint64_t* value){
+    const unsigned char* f = (const unsigned char*)field;
+    uint64_t v = 0;
+    if(f[0] & 0x80){
+        if(f[0] != 0x80) return 1;
+        for(size_t i = 1; i < width; i++){
+            if(v >> 56) return 1;
+            v = v << 8 | f[i];
+        }
+        *value = v;
+        return 0;
+    }
+    size_t i = 0;
+    while(i < width && f[i] == ' ')
+        i++;
+    for(; i < width && f[i] >= '0' && f[i] <= '7'; i++){
+        if(v >> 61) return 1;
+        v = v << 3 | (f[i] - '0');
+    }
+    for(; i < width; i++)
+        if(f[i] != ' ' && f[i] != '\0')
+            return 1;
+    *value = v;
+    return 0;
+}
+
+//
+// The checksum is the sum of the header's bytes with its own field taken as
+// spaces. Some old tars summed them as signed chars.
+static
+_Bool
+tar_checksum_ok(const char* header){
+    uint64_t expected;
+    if(tar_number(header+148, 8, &expected))
+        return 0;
+    uint64_t sum = 0;
+    int64_t signed_sum = 0;
+    for(size_t i = 0; i < TAR_BLOCK; i++){
+        _Bool in_field = i >= 148 && i < 156;
+        sum += in_field? ' ' : (unsigned char)header[i];
+        signed_sum += in_field? ' ' : (signed char)header[i];
+    }
+    return sum == expected || (uint64_t)signed_sum == expected;
+}
+
+static inline
+StringView
+tar_field(const char* field, size_t width){
+    const char* nul = memchr(field, '\0', width);
+    return (StringView){nul? (size_t)(nul - field) : width, field};
+}
+
+//
+// Finds the path in a pax extended header's "length key=value\n" records.
+static
+StringView
+tar_pax_path(StringView data){
+    const char* p = data.text;
+    const char* end = data.text + data.length;
+    while(p != end){
+        size_t length = 0;
+        const char* q = p;
+        for(; q != end && *q >= '0' && *q <= '9'; q++)
+            length = length*10 + (*q - '0');
+        if(q == end || *q != ' ' || length < 2 || length > (size_t)(end - p))
+            break;
+        const char* record_end = p + length;
+        q++;
+        if(record_end - q > 5 && memcmp(q, "path=", 5) == 0)
+            return (StringView){record_end - 1 - (q+5), q+5};
+        p = record_end;
+    }
+    return (StringView){0};
+}
+
+typedef struct TarMember TarMember;
+struct TarMember {
+    // The path in the archive.
+    StringView name;
+    // The markdown, in the input.
+    StringView text;
+    // The modification time field of its header, kept for the html.
+    const char* mtime;
+};
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#define MARRAY_T TarMember
+#include "Marray.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+typedef struct TarReader TarReader;
+struct TarReader {
+    const char* cursor;
+    const char* end;
+    // Names joined from a ustar prefix and name.
+    ArenaAllocator names;
+};
+
+//
+// Finds the next regular file ending in .md. Returns 1 at the end of the
+// archive, -1 if it is malformed (having reported it) or 0 with the member.
+static
+int
+tar_next(TarReader* r, const char* base, TarMember* member){
+    // From a GNU 'L' or pax 'x' header, for the member after it.
+    StringView long_name = {0};
+    for(;;){
+        if(r->end - r->cursor < TAR_BLOCK){
+            if(r->cursor != r->end){
+                fprintf(stderr, "Truncated tar header at offset %zu\n", (size_t)(r->cursor - base));
+                return -1;
+            }
+            return 1;
+        }
+        const char* header = r->cursor;
+        // Two zero blocks end the archive, one is enough for us.
+        _Bool zero = 1;
+        for(size_t i = 0; i < TAR_BLOCK; i++){
+            if(header[i]){
+                zero = 0;
+                break;
+            }
+        }
+        if(zero)
+            return 1;
+        uint64_t size;
+        if(!tar_checksum_ok(header) || tar_number(header+124, 12, &size)){
+            fprintf(stderr, "Bad tar header at offset %zu\n", (size_t)(header - base));
+            return -1;
+        }
+        const char* data = header + TAR_BLOCK;
+        uint64_t padded = (size + TAR_BLOCK-1) / TAR_BLOCK * TAR_BLOCK;
+        if(size > (uint64_t)(r->end - data) || padded > (uint64_t)(r->end - data)){
+            if(size > (uint64_t)(r->end - data)){
+                fprintf(stderr, "Truncated tar member at offset %zu\n", (size_t)(header - base));
+                return -1;
+            }
+            // The padding of the last member can be missing.
+            padded = size;
+        }
+        r->cursor = data + padded;
+        StringView contents = {(size_t)size, data};
+        switch(header[156]){
+            case 'L':
+                long_name = tar_field(contents.text, contents.length);
+                continue;
+            case 'x':{
+                StringView path = tar_pax_path(contents);
+                if(path.length)
+                    long_name = path;
+                continue;
+            }
+            case 'g':
+            case 'K':
+                continue;
+            case '0':
+            case '\0':
+            case '7':
+                break;
+            default:
+                long_name = (StringView){0};
+                continue;
+        }
+        StringView name = long_name;
+        long_name = (StringView){0};
+        if(!name.length){
+            name = tar_field(header, 100);
+            StringView prefix = tar_field(header+345, 155);
+            // Only POSIX ustar has the prefix, old GNU tars put other
+            // things there.
+            if(prefix.length && memcmp(header+257, "ustar\0", 6) == 0){
+                char* joined = ArenaAllocator_alloc(&r->names, prefix.length + 1 + name.length);
+                if(!joined){
+                    fprintf(stderr, "Out of memory\n");
+                    return -1;
+                }
+                memcpy(joined, prefix.text, prefix.length);
+                joined[prefix.length] = '/';
+                memcpy(joined + prefix.length + 1, name.text, name.length);
+                name = (StringView){prefix.length + 1 + name.length, joined};
+            }
+        }
+        if(name.length <= 3 || memcmp(name.text + name.length - 3, ".md", 3) != 0)
+            continue;
+        *member = (TarMember){
+            .name = name,
+            .text = contents,
+            .mtime = header+136,
+        };
+        return 0;
+    }
+}
+
+static
+void
+tar_write_octal(char* field, size_t width, uint64_t value){
+    // width-1 digits and a nul.
+    field[width-1] = '\0';
+    for(size_t i = width-1; i--;){
+        field[i] = '0' + (value & 7);
+        value >>= 3;
+    }
+}
+
+static
+void
+tar_finish_header(char* header, uint64_t size){
+    if(size >> 33){
+        header[124] = (char)0x80;
+        for(size_t i = 11; i > 0; i--){
+            header[124+i] = (char)(size & 0xff);
+            size >>= 8;
+        }
+    }
+    else
+        tar_write_octal(header+124, 12, size);
+    memset(header+148, ' ', 8);
+    uint64_t sum = 0;
+    for(size_t i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char)header[i];
+    tar_write_octal(header+148, 7, sum);
+    header[155] = ' ';
+}
+
+static inline
+size_t
+tar_digits(size_t n){
+    size_t digits = 1;
+    for(; n >= 10; n /= 10)
+        digits++;
+    return digits;
+}
+
+static
+void
+tar_pad(MStringBuilder* out){
+    size_t rem = out->cursor % TAR_BLOCK;
+    if(rem)
+        msb_write_nchar(out, '\0', TAR_BLOCK - rem);
+}
+
+//
+// Writes a header for a file at `path` and returns its offset in `out`, for
+// tar_finish_header once the size is known. Paths too long for the header
+// get a pax extended header before it.
+static
+size_t
+tar_begin_member(MStringBuilder* out, StringView path, const char* mtime){
+    StringView prefix = {0};
+    StringView name = path;
+    if(path.length > 100){
+        // Split at a '/' into the 155 byte prefix and 100 byte name.
+        for(size_t i = path.length - 1; i > 0; i--){
+            if(path.text[i] != '/')
+                continue;
+            if(i > 155) continue;
+            if(path.length - i - 1 > 100 || path.length - i - 1 == 0) break;
+            prefix = (StringView){i, path.text};
+            name = (StringView){path.length - i - 1, path.text + i + 1};
+            break;
+        }
+        if(!prefix.length){
+            // "length path=...\n", where the length counts its own digits.
+            size_t record = sizeof(" path=")-1 + path.length + 1;
+            size_t digits = tar_digits(record);
+            if(tar_digits(record + digits) != digits)
+                digits++;
+            record += digits;
+            size_t at = out->cursor;
+            msb_write_nchar(out, '\0', TAR_BLOCK);
+            if(out->errored) return at;
+            char* h = out->data + at;
+            memcpy(h, "PaxHeader", 9);
+            memcpy(h+100, "0000644", 7);
+            memcpy(h+108, "0000000", 7);
+            memcpy(h+116, "0000000", 7);
+            memcpy(h+136, mtime, 12);
+            h[156] = 'x';
+            memcpy(h+257, "ustar\0" "00", 8);
+            tar_finish_header(h, record);
+            msb_write_uint(out, record);
+            msb_write_literal(out, " path=");
+            msb_write_str(out, path.text, path.length);
+            msb_write_char(out, '\n');
+            tar_pad(out);
+            // Something still has to go in the name.
+            name = (StringView){100, path.text + path.length - 100};
+        }
+    }
+    size_t at = out->cursor;
+    msb_write_nchar(out, '\0', TAR_BLOCK);
+    if(out->errored) return at;
+    char* h = out->data + at;
+    memcpy(h, name.text, name.length);
+    memcpy(h+100, "0000644", 7);
+    memcpy(h+108, "0000000", 7);
+    memcpy(h+116, "0000000", 7);
+    memcpy(h+136, mtime, 12);
+    h[156] = '0';
+    memcpy(h+257, "ustar\0" "00", 8);
+    if(prefix.length)
+        memcpy(h+345, prefix.text, prefix.length);
+    return at;
+}
+
+typedef struct TarWorker TarWorker;
+struct TarWorker {
+    Thread thread;
+    DrMdContext*_Nullable ctx;
+    const TarMember* begin;
+    const TarMember* end;
+    // Appended to every document (the stylesheet).
+    StringView suffix;
+    Metrics*_Nullable metrics;
+    const Capture*_Nullable capture;
+    // The output path of the current member.
+    MStringBuilder path;
+    // The members' headers and html, written out in worker order once all
+    // are done.
+    MStringBuilder out;
+    size_t errors;
+};
+
+static
+void
+tar_worker(void* p){
+    TarWorker* w = p;
+    MStringBuilder* out = &w->out;
+    for(const TarMember* m = w->begin; m != w->end; m++){
+        size_t before = out->cursor;
+        msb_reset(&w->path);
+        batch_output_path(&w->path, m->name);
+        // batch_output_path nul-terminates it.
+        StringView path = {w->path.cursor - 1, w->path.data};
+        int err = 1;
+        if(!w->path.errored && w->ctx){
+            size_t header = tar_begin_member(out, path, m->mtime);
+            size_t start = out->cursor;
+            err = metrics_convert(w->metrics, w->capture, w->ctx, m->name, m->text, out);
+            if(!err && w->suffix.length)
+                msb_write_str(out, w->suffix.text, w->suffix.length);
+            if(!err && out->errored)
+                err = ERROR_OOM;
+            if(!err){
+                tar_finish_header(out->data + header, out->cursor - start);
+                tar_pad(out);
+            }
+        }
+        if(err){
+            fprintf(stderr, "Unable to convert '%.*s'\n", (int)m->name.length, m->name.text);
+            w->errors++;
+            // Drop what was written of it. Running out of memory is
+            // reported once the output is written.
+            if(out->cursor > before)
+                out->cursor = before;
+        }
+    }
+}
+
+//
+// Converts each .md file in the tar archive at `path` ("-" for stdin) and
+// writes a tar archive of their html, with `suffix` appended, to `out`:
+// foo.md becomes foo.html, other members are left out. Members are read a
+// chunk at a time and each chunk is split between `jobs` workers. If
+// `metrics_path` is given, the metrics of the conversions so far are
+// written there after each chunk. With a `capture`, the conversions over
+// its thresholds are saved to its directory.
+// Returns the number of members that failed to convert, or -1 on an io
+// error or a malformed archive.
+static
+long long
+drmd_batch_tar(const char* path, FILE* out, StringView suffix, int jobs, const char*_Nullable metrics_path, const Capture*_Nullable capture){
+    enum {CHUNK_SIZE = 8*1024*1024};
+    enum {MAX_WORKERS = 64};
+    if(jobs < 1) jobs = 1;
+    if(jobs > MAX_WORKERS) jobs = MAX_WORKERS;
+    TarInput input;
+    if(tar_open(&input, path))
+        return -1;
+    TarWorker workers[MAX_WORKERS];
+    const Metrics* metrics[MAX_WORKERS];
+    for(int i = 0; i < jobs; i++){
+        memcpy(&workers[i], &(TarWorker){
+            .ctx = drmd_context_create(),
+            .suffix = suffix,
+            .metrics = metrics_path? Allocator_zalloc(MALLOCATOR, sizeof(Metrics)) : NULL,
+            .capture = capture,
+            .path = {.allocator = MALLOCATOR},
+            .out = {.allocator = MALLOCATOR},
+        }, sizeof workers[i]);
+        metrics[i] = workers[i].metrics;
+    }
+    long long result = 0;
+    TarReader reader = {
+        .cursor = input.data.text,
+        .end = input.data.text + input.data.length,
+    };
+    Marray(TarMember) members = {0};
+    if(metrics_path){
+        for(int i = 0; i < jobs; i++){
+            if(!metrics[i])
+                goto oom;
+        }
+    }
+    for(int done = 0; !done;){
+        // Take members until there's a chunk's worth of markdown.
+        members.count = 0;
+        size_t bytes = 0;
+        while(bytes < CHUNK_SIZE){
+            TarMember m;
+            int r = tar_next(&reader, input.data.text, &m);
+            if(r < 0){
+                result = -1;
+                goto cleanup;
+            }
+            if(r){
+                done = 1;
+                break;
+            }
+            if(Marray_push(TarMember)(&members, MALLOCATOR, m))
+                goto oom;
+            bytes += m.text.length;
+        }
+        // Split them between the workers by size, in order.
+        int nworkers = jobs;
+        if((size_t)nworkers > members.count) nworkers = (int)members.count;
+        if(nworkers < 1) nworkers = 1;
+        const TarMember* m = members.data;
+        const TarMember* members_end = members.data + members.count;
+        size_t taken = 0;
+        for(int i = 0; i < nworkers; i++){
+            workers[i].begin = m;
+            size_t share = bytes / nworkers * (i+1);
+            while(m != members_end && (taken < share || i == nworkers-1))
+                taken += (m++)->text.length;
+            workers[i].end = m;
+        }
+        _Bool started[MAX_WORKERS] = {0};
+        for(int i = 1; i < nworkers; i++)
+            started[i] = !thread_create(&workers[i].thread, tar_worker, &workers[i]);
+        tar_worker(&workers[0]);
+        for(int i = 1; i < nworkers; i++){
+            if(started[i])
+                thread_join(&workers[i].thread);
+            else
+                tar_worker(&workers[i]);
+        }
+        for(int i = 0; i < nworkers; i++){
+            MStringBuilder* o = &workers[i].out;
+            if(o->errored)
+                goto oom;
+            if(o->cursor && fwrite(o->data, o->cursor, 1, out) != 1){
+                fprintf(stderr, "Error writing: %s\n", strerror(errno));
+                result = -1;
+                goto cleanup;
+            }
+            msb_reset(o);
+        }
+        if(metrics_path && metrics_save(metrics_path, metrics, jobs)){
+            result = -1;
+            goto cleanup;
+        }
+        ArenaAllocator_free_all(&reader.names);
+    }
+    // The end of the archive.
+    {
+        static const char zeros[2*TAR_BLOCK];
+        if(fwrite(zeros, sizeof zeros, 1, out) != 1){
+            fprintf(stderr, "Error writing: %s\n", strerror(errno));
+            result = -1;
+            goto cleanup;
+        }
+    }
+    for(int i = 0; i < jobs; i++)
+        result += workers[i].errors;
+    goto cleanup;
+
+    oom:
+    fprintf(stderr, "Out of memory\n");
+    result = -1;
+    cleanup:
+    for(int i = 0; i < jobs; i++){
+        if(workers[i].ctx)
+            drmd_context_destroy(workers[i].ctx);
+        if(workers[i].metrics)
+            Allocator_free(MALLOCATOR, workers[i].metrics, sizeof(Metrics));
+        msb_destroy(&workers[i].path);
+        msb_destroy(&workers[i].out);
+    }
+    Marray_cleanup(TarMember)(&members, MALLOCATOR);
+    ArenaAllocator_free_all(&reader.names);
+    tar_close(&input);
+    return result;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
@@ -0,0 +1,92 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+#ifndef SIMD_STRING_H
+#define SIMD_STRING_H
+#include <stddef.h>
+#include <stdint.h>
+#include "simd_util.h"
+#include "bit_util.h"
+
+//
+// memchr, memcmp and strlen written against simd_util.h, for the wasm libc
+// shim (Wasm/allstd.h), which has no libc to get vectorized ones from. They
+// compile for every target, so TestDrMd.c checks them against the real ones.
+//
+
+#ifndef _Nullable
+#ifndef __clang__
+#define _Nullable
+#endif
+#endif
+
+static inline
+void*_Nullable
+simd_memchr(const void* pointer, int c, size_t nbytes){
+    const unsigned char* p = pointer;
+    unsigned char ch = (unsigned char)c;
+#ifdef HAVE_VEC
+    Vec needle = vec_splat(ch);
+    for(; nbytes >= 16; p += 16, nbytes -= 16){
+        uint64_t mask = vec_mask(vec_eq(vec_load(p), needle));
+        if(mask)
+            return (void*)(uintptr_t)(p + ctz_64(mask)/VEC_MASK_BITS);
+    }
+#endif
+    for(; nbytes; p++, nbytes--){
+        if(*p == ch)
+            return (void*)(uintptr_t)p;
+    }
+    return NULL;
+}
+
+static inline
+int
+simd_memcmp(const void* s1, const void* s2, size_t n){
+    const unsigned char* pa = s1;
+    const unsigned char* pb = s2;
+#ifdef HAVE_VEC
+    for(; n >= 16; pa += 16, pb += 16, n -= 16){
+        uint64_t same = vec_mask(vec_eq(vec_load(pa), vec_load(pb)));
+        if(same != VEC_MASK_ALL){
+            int i = ctz_64(~same)/VEC_MASK_BITS;
+            return pa[i] - pb[i];
+        }
+    }
+#endif
+    for(; n; pa++, pb++, n--){
+        int diff = *pa - *pb;
+        if(diff)
+            return diff;
+    }
+    return 0;
+}
+
+static inline
+size_t
+simd_strlen(const char* s){
+#ifdef HAVE_VEC
+    // Aligned 16 byte loads never cross a page (or the end of wasm's linear
+    // memory, a whole number of 64k pages), so reading past the terminator
+    // can't fault.
+    const char* block = (const char*)((uintptr_t)s & ~(uintptr_t)15);
+    Vec zero = vec_splat(0);
+    // Ignore the bytes before s.
+    uint64_t mask = vec_mask(vec_eq(vec_load(block), zero)) >> (s - block) * VEC_MASK_BITS;
+    if(mask)
+        return (size_t)ctz_64(mask)/VEC_MASK_BITS;
+    for(;;){
+        block += 16;
+        mask = vec_mask(vec_eq(vec_load(block), zero));
+        if(mask)
+            return (size_t)(block - s) + (size_t)ctz_64(mask)/VEC_MASK_BITS;
+    }
+#else
+    size_t i = 0;
+    while(s[i])
+        i++;
+    return i;
+#endif
+}
+
+#endif
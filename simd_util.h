@@ -0,0 +1,194 @@
+#ifndef SIMD_UTIL_H
+#define SIMD_UTIL_H
+#include <stdint.h>
+
+#ifndef force_inline
+#if defined(__GNUC__) || defined(__clang__)
+#define force_inline static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define force_inline static inline __forceinline
+#else
+#define force_inline static inline
+#endif
+#endif
+
+//
+// A minimal 16 byte vector abstraction over sse2, neon and wasm simd128, so
+// kernels can be written once instead of once per architecture.
+//
+// If HAVE_VEC is defined, the following are available:
+//
+//   Vec      vec_load(const void*)   unaligned load of 16 bytes
+//   void     vec_store(void*, Vec)   unaligned store of 16 bytes
+//   Vec      vec_splat(uint8_t)
+//   Vec      vec_eq(Vec, Vec)        0xff in each lane where equal
+//   Vec      vec_le(Vec, Vec)        0xff in each lane where a <= b (unsigned)
+//   Vec      vec_and(Vec, Vec)
+//   Vec      vec_or(Vec, Vec)
+//   _Bool    vec_any(Vec)            whether any lane is set
+//   uint64_t vec_mask(Vec)           VEC_MASK_BITS bits per lane, lane 0 lowest
+//   uint64_t vec_mask64(Vec, Vec, Vec, Vec)
+//                                    1 bit per lane for 64 bytes, first vector lowest
+//
+// vec_mask is like _mm_movemask_epi8, except on neon it is a "fat" mask with
+// 4 bits per lane, so divide bit positions and counts by VEC_MASK_BITS.
+// vec_mask64 is always 1 bit per lane, so prefer processing 64 byte blocks
+// with it and only use vec_mask for the tail.
+//
+// Define NO_SIMD to not use any of this.
+//
+
+#if !defined(NO_SIMD) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_VEC 1
+typedef __m128i Vec;
+enum {VEC_MASK_BITS = 1};
+
+force_inline Vec vec_load(const void* p){ return _mm_loadu_si128((const __m128i_u*)p); }
+force_inline void vec_store(void* p, Vec v){ _mm_storeu_si128((__m128i_u*)p, v); }
+force_inline Vec vec_splat(uint8_t c){ return _mm_set1_epi8((char)c); }
+force_inline Vec vec_eq(Vec a, Vec b){ return _mm_cmpeq_epi8(a, b); }
+force_inline Vec vec_le(Vec a, Vec b){ return _mm_cmpeq_epi8(_mm_min_epu8(a, b), a); }
+force_inline Vec vec_and(Vec a, Vec b){ return _mm_and_si128(a, b); }
+force_inline Vec vec_or(Vec a, Vec b){ return _mm_or_si128(a, b); }
+force_inline _Bool vec_any(Vec v){ return _mm_movemask_epi8(v) != 0; }
+force_inline uint64_t vec_mask(Vec v){ return (unsigned)_mm_movemask_epi8(v); }
+
+force_inline
+uint64_t
+vec_mask64(Vec a, Vec b, Vec c, Vec d){
+    uint64_t m0 = (unsigned)_mm_movemask_epi8(a);
+    uint64_t m1 = (unsigned)_mm_movemask_epi8(b);
+    uint64_t m2 = (unsigned)_mm_movemask_epi8(c);
+    uint64_t m3 = (unsigned)_mm_movemask_epi8(d);
+    return m0 | m1 << 16 | m2 << 32 | m3 << 48;
+}
+
+#elif !defined(NO_SIMD) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_VEC 1
+typedef uint8x16_t Vec;
+enum {VEC_MASK_BITS = 4};
+
+force_inline Vec vec_load(const void* p){ return vld1q_u8((const uint8_t*)p); }
+force_inline void vec_store(void* p, Vec v){ vst1q_u8((uint8_t*)p, v); }
+force_inline Vec vec_splat(uint8_t c){ return vdupq_n_u8(c); }
+force_inline Vec vec_eq(Vec a, Vec b){ return vceqq_u8(a, b); }
+force_inline Vec vec_le(Vec a, Vec b){ return vcleq_u8(a, b); }
+force_inline Vec vec_and(Vec a, Vec b){ return vandq_u8(a, b); }
+force_inline Vec vec_or(Vec a, Vec b){ return vorrq_u8(a, b); }
+
+// leaving this as reference, it is inefficient compared to the shrn trick
+#if 0
+// Copied from https://stackoverflow.com/a/68694558
+static inline
+uint32_t
+_mm_movemask_aarch64(uint8x16_t input){
+    _Alignas(16) const uint8_t ucShift[] = {-7,-6,-5,-4,-3,-2,-1,0,-7,-6,-5,-4,-3,-2,-1,0};
+    uint8x16_t vshift = vld1q_u8(ucShift);
+    // Mask to only the msb of each lane.
+    uint8x16_t vmask = vandq_u8(input, vdupq_n_u8(0x80));
+
+    // Shift the mask into place.
+    vmask = vshlq_u8(vmask, vshift);
+    uint32_t out = vaddv_u8(vget_low_u8(vmask));
+    // combine
+    out += vaddv_u8(vget_high_u8(vmask)) << 8;
+
+    return out;
+}
+#endif
+
+//  shrn trick from
+//  https://community.arm.com/arm-community-blogs/b/infrastructure-solutions-blog/posts/porting-x86-vector-bitmask-optimizations-to-arm-neon
+// Allows you to achieve a similar effect to _mm_movemask, but you get 4 bits set instead of 1 per 8 bit lane (thus it's a fat mask).
+// Usually need to divide by 4 when you count bits or whatever.
+force_inline
+uint64_t
+vector128_to_fatmask(uint8x16_t input){
+    uint8x8_t shifted = vshrn_n_u16(vreinterpretq_u16_u8(input), 4);
+    uint64_t fatmask = vget_lane_u64(vreinterpret_u64_u8(shifted), 0);
+    return fatmask;
+}
+
+force_inline _Bool vec_any(Vec v){ return vector128_to_fatmask(v) != 0; }
+force_inline uint64_t vec_mask(Vec v){ return vector128_to_fatmask(v); }
+
+#ifdef __aarch64__
+//
+// Keep a different bit of each lane, then pairwise add the four vectors
+// down to 8 bytes.
+force_inline
+uint64_t
+vec_mask64(Vec a, Vec b, Vec c, Vec d){
+    static const uint8_t bits[16] = {
+        0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+        0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+    };
+    uint8x16_t bit_mask = vld1q_u8(bits);
+    uint8x16_t sum0 = vpaddq_u8(vandq_u8(a, bit_mask), vandq_u8(b, bit_mask));
+    uint8x16_t sum1 = vpaddq_u8(vandq_u8(c, bit_mask), vandq_u8(d, bit_mask));
+    sum0 = vpaddq_u8(sum0, sum1);
+    sum0 = vpaddq_u8(sum0, sum0);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum0), 0);
+}
+#else
+//
+// No vpaddq on 32 bit arm, so squeeze the fat mask's nibbles down to bits.
+force_inline
+uint64_t
+fatmask_to_mask(uint64_t fat){
+    fat &= 0x1111111111111111ull;
+    fat = (fat | fat >> 3)  & 0x0303030303030303ull;
+    fat = (fat | fat >> 6)  & 0x000f000f000f000full;
+    fat = (fat | fat >> 12) & 0x000000ff000000ffull;
+    fat = (fat | fat >> 24) & 0xffffull;
+    return fat;
+}
+
+force_inline
+uint64_t
+vec_mask64(Vec a, Vec b, Vec c, Vec d){
+    uint64_t m0 = fatmask_to_mask(vector128_to_fatmask(a));
+    uint64_t m1 = fatmask_to_mask(vector128_to_fatmask(b));
+    uint64_t m2 = fatmask_to_mask(vector128_to_fatmask(c));
+    uint64_t m3 = fatmask_to_mask(vector128_to_fatmask(d));
+    return m0 | m1 << 16 | m2 << 32 | m3 << 48;
+}
+#endif
+
+#elif !defined(NO_SIMD) && defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define HAVE_VEC 1
+typedef v128_t Vec;
+enum {VEC_MASK_BITS = 1};
+
+force_inline Vec vec_load(const void* p){ return wasm_v128_load(p); }
+force_inline void vec_store(void* p, Vec v){ wasm_v128_store(p, v); }
+force_inline Vec vec_splat(uint8_t c){ return wasm_u8x16_splat(c); }
+force_inline Vec vec_eq(Vec a, Vec b){ return wasm_i8x16_eq(a, b); }
+force_inline Vec vec_le(Vec a, Vec b){ return wasm_u8x16_le(a, b); }
+force_inline Vec vec_and(Vec a, Vec b){ return wasm_v128_and(a, b); }
+force_inline Vec vec_or(Vec a, Vec b){ return wasm_v128_or(a, b); }
+force_inline _Bool vec_any(Vec v){ return wasm_v128_any_true(v); }
+force_inline uint64_t vec_mask(Vec v){ return (uint32_t)wasm_i8x16_bitmask(v); }
+
+force_inline
+uint64_t
+vec_mask64(Vec a, Vec b, Vec c, Vec d){
+    uint64_t m0 = (uint32_t)wasm_i8x16_bitmask(a);
+    uint64_t m1 = (uint32_t)wasm_i8x16_bitmask(b);
+    uint64_t m2 = (uint32_t)wasm_i8x16_bitmask(c);
+    uint64_t m3 = (uint32_t)wasm_i8x16_bitmask(d);
+    return m0 | m1 << 16 | m2 << 32 | m3 << 48;
+}
+#endif
+
+#ifdef HAVE_VEC
+// All of the bits vec_mask can set.
+#define VEC_MASK_ALL (VEC_MASK_BITS == 4? ~(uint64_t)0 : (uint64_t)0xffff)
+// The bits vec_mask sets for a single lane.
+#define VEC_MASK_LANE ((uint64_t)((1u << VEC_MASK_BITS) - 1))
+#endif
+
+#endif
@@ -0,0 +1,176 @@
+//
+// Copyright © 2024, David Priver <david@davidpriver.com>
+//
+#ifndef THREAD_UTIL_H
+#define THREAD_UTIL_H
+
+//
+// Just enough threading to fan work out to workers and wait for them.
+//
+
+typedef struct Thread Thread;
+typedef struct Mutex Mutex;
+typedef struct CondVar CondVar;
+typedef void (ThreadFunc)(void*);
+
+//
+// Starts running func(arg) on a new thread. Returns 0 on success.
+// The Thread must stay alive until it is joined.
+static inline int thread_create(Thread* thread, ThreadFunc* func, void* arg);
+
+//
+// Waits for the thread to finish.
+static inline void thread_join(Thread* thread);
+
+//
+// Returns the number of processors available, or 1 if that is unknown.
+static inline int processor_count(void);
+
+//
+// Neither can fail once initialized. Destroy them once nothing uses them.
+static inline void mutex_init(Mutex* mutex);
+static inline void mutex_lock(Mutex* mutex);
+static inline void mutex_unlock(Mutex* mutex);
+static inline void mutex_destroy(Mutex* mutex);
+
+static inline void cond_init(CondVar* cond);
+//
+// Unlocks the mutex while waiting and locks it again before returning. Can
+// wake up spuriously, so check what you were waiting for in a loop.
+static inline void cond_wait(CondVar* cond, Mutex* mutex);
+static inline void cond_broadcast(CondVar* cond);
+static inline void cond_destroy(CondVar* cond);
+
+#ifdef _WIN32
+
+#ifndef WINDOWSHEADER_H
+#define WINDOWSHEADER_H
+#define WIN32_LEAN_AND_MEAN
+#define WIN32_EXTRA_LEAN
+// Idk why, but this conflicts with builtin
+// so hacky #define
+#if !defined(_MSC_VER)
+#define _mm_prefetch _WINDOWS_MM_PREFETCH
+#include <Windows.h>
+#undef _mm_prefetch
+#else
+#pragma warning(disable: 5105)
+#include <Windows.h>
+#endif
+#endif
+
+struct Thread {
+    HANDLE handle;
+    ThreadFunc* func;
+    void* arg;
+};
+
+static
+DWORD WINAPI
+thread_trampoline_(LPVOID p){
+    Thread* thread = p;
+    thread->func(thread->arg);
+    return 0;
+}
+
+static inline
+int
+thread_create(Thread* thread, ThreadFunc* func, void* arg){
+    thread->func = func;
+    thread->arg = arg;
+    thread->handle = CreateThread(NULL, 0, thread_trampoline_, thread, 0, NULL);
+    return thread->handle? 0 : 1;
+}
+
+static inline
+void
+thread_join(Thread* thread){
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+}
+
+static inline
+int
+processor_count(void){
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors? (int)info.dwNumberOfProcessors : 1;
+}
+
+struct Mutex {
+    SRWLOCK lock;
+};
+
+static inline void mutex_init(Mutex* mutex){ InitializeSRWLock(&mutex->lock); }
+static inline void mutex_lock(Mutex* mutex){ AcquireSRWLockExclusive(&mutex->lock); }
+static inline void mutex_unlock(Mutex* mutex){ ReleaseSRWLockExclusive(&mutex->lock); }
+static inline void mutex_destroy(Mutex* mutex){ (void)mutex; }
+
+struct CondVar {
+    CONDITION_VARIABLE cv;
+};
+
+static inline void cond_init(CondVar* cond){ InitializeConditionVariable(&cond->cv); }
+static inline void cond_wait(CondVar* cond, Mutex* mutex){ SleepConditionVariableSRW(&cond->cv, &mutex->lock, INFINITE, 0); }
+static inline void cond_broadcast(CondVar* cond){ WakeAllConditionVariable(&cond->cv); }
+static inline void cond_destroy(CondVar* cond){ (void)cond; }
+
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+struct Thread {
+    pthread_t handle;
+    ThreadFunc* func;
+    void* arg;
+};
+
+static
+void*
+thread_trampoline_(void* p){
+    Thread* thread = p;
+    thread->func(thread->arg);
+    return NULL;
+}
+
+static inline
+int
+thread_create(Thread* thread, ThreadFunc* func, void* arg){
+    thread->func = func;
+    thread->arg = arg;
+    return pthread_create(&thread->handle, NULL, thread_trampoline_, thread);
+}
+
+static inline
+void
+thread_join(Thread* thread){
+    pthread_join(thread->handle, NULL);
+}
+
+static inline
+int
+processor_count(void){
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0? (int)n : 1;
+}
+
+struct Mutex {
+    pthread_mutex_t lock;
+};
+
+static inline void mutex_init(Mutex* mutex){ pthread_mutex_init(&mutex->lock, NULL); }
+static inline void mutex_lock(Mutex* mutex){ pthread_mutex_lock(&mutex->lock); }
+static inline void mutex_unlock(Mutex* mutex){ pthread_mutex_unlock(&mutex->lock); }
+static inline void mutex_destroy(Mutex* mutex){ pthread_mutex_destroy(&mutex->lock); }
+
+struct CondVar {
+    pthread_cond_t cv;
+};
+
+static inline void cond_init(CondVar* cond){ pthread_cond_init(&cond->cv, NULL); }
+static inline void cond_wait(CondVar* cond, Mutex* mutex){ pthread_cond_wait(&cond->cv, &mutex->lock); }
+static inline void cond_broadcast(CondVar* cond){ pthread_cond_broadcast(&cond->cv); }
+static inline void cond_destroy(CondVar* cond){ pthread_cond_destroy(&cond->cv); }
+#endif
+
+#endif